@@ -40,7 +40,13 @@ HEAPSIZE = 0x8000;  /* Size of heap buffer used by HeapMem */
 
 MEMORY
 {
-    MAIN       (RX) : origin = 0x00000000, length = 0x00040000
+    /*
+     * Code and constants stay in flash bank 0 (0x00000-0x1FFFF), so they keep
+     * running while the flash ring in the top 32 KB of bank 1 (0x38000-0x3FFFF)
+     * is erased or programmed, see flash_hal_msp432.c. The rest of bank 1 is
+     * left unused. Placement fails if they do not fit.
+     */
+    MAIN       (RX) : origin = 0x00000000, length = 0x00020000
     INFO       (RX) : origin = 0x00200000, length = 0x00004000
     ALIAS
     {
@@ -64,6 +70,9 @@ SECTIONS
     .bss    :   > SRAM_DATA
     .sysmem :   > SRAM_DATA
 
+    /* Samples retained across resets (see pending.h), never zero initialized */
+    .noinit :   > SRAM_DATA, type = NOINIT
+
     /* Heap buffer used by HeapMem */
     .priheap   : {
         __primary_heap_start__ = .;
@@ -72,6 +81,12 @@ SECTIONS
     } > SRAM_DATA align 8
 
     .stack  :   > SRAM_DATA (HIGH)
+
+    /*
+     * TRACE() format strings (see trace.h). Never loaded onto the device,
+     * their addresses are the trace format IDs.
+     */
+    .trace_fmt : > MAIN, type = COPY
 }
 
 /* Symbolic definition of the WDTCTL register for RTS */
@@ -28,6 +28,10 @@
 #include "ti_drivers_config.h"
 
 #include "cli.h"
+#include "config.h"
+#include "crc32.h"
+#include "cyclecount.h"
+#include "export.h"
 #include "radar.h"
 #include "storage.h"
 #include "transmission.h"
@@ -47,17 +51,28 @@ static int sensor_data_test(int argc, char *argv[]);
 static int mount_sd(int argc, char *argv[]);
 static int show_config(int argc, char *argv[]);
 static int load_config(int argc, char *argv[]);
+static int set_config(int argc, char *argv[]);
 static int search_sim(int argc, char *argv[]);
 static int force_timesync(int argc, char *argv[]);
 static int force_radar_sample(int argc, char *argv[]);
 static int system_reset(int argc, char *argv[]);
 static int cli_set_radar_offset(int argc, char *argv[]);
 static int set_radar_logging(int argc, char *argv[]);
+static int storage_bench(int argc, char *argv[]);
+static int crc_bench(int argc, char *argv[]);
+static int sd_stats(int argc, char *argv[]);
+static int query_data(int argc, char *argv[]);
+static bool print_query_record(DataRecord *record, void *arg);
+static int show_summary(int argc, char *argv[]);
+static bool print_rollup(RollupRecord *rollup, void *arg);
+static int export_data(int argc, char *argv[]);
+static void print_dir_entry(const char *name, uint32_t size, void *arg);
+static UART_Handle open_cli_uart(bool binary);
 
 /** CLI constants */
 #define CLI_COMMAND_MAX_LEN 20 /**< Max chars in CLI command */
 #define MAX_HELP_LEN 80        /**< Max length for CLI help string */
-#define CLI_MAX_ENTRIES 16     /**< Max number of CLI commands */
+#define CLI_MAX_ENTRIES 24     /**< Max number of CLI commands */
 #define CLI_PRINT_BUF_SIZE 128 /**< Max size of the CLI printf buffer */
 #define CLI_READ_BUF_SIZE 80   /**< Max input size for CLI */
 #define MAX_ARGC 8             /**< Max number of arguments for CLI */
@@ -73,6 +88,15 @@ typedef struct {
     int (*function)(int, char *[]); /**< function implementing CLI command */
 } CLI_COMMAND;
 
+/**
+ * Summary of the records printed by a query command
+ */
+typedef struct {
+    int count; /**< number of records printed */
+    float min; /**< smallest distance printed */
+    float max; /**< largest distance printed */
+} QuerySummary;
+
 // Array of CLI command entries
 static CLI_COMMAND commands[CLI_MAX_ENTRIES];
 // CLI UART handle
@@ -81,24 +105,14 @@ static UART_Handle cli_uart;
 // Tracks number of cli commands registered
 static int cli_command_entry_cnt = 0;
 static bool cli_init_done = false;
+// Set while the CLI UART carries export frames. Other output is dropped.
+static bool cli_binary_mode = false;
 
 /**
  * Performs required initialization for the CLI, including setting up the UART.
  */
 void cli_init() {
-    UART_Params params;
-    UART_Params_init(&params);
-    params.baudRate = CLI_BAUDRATE;
-    params.readDataMode = UART_DATA_TEXT;
-    params.writeDataMode = UART_DATA_TEXT;
-    params.readEcho = UART_ECHO_ON;
-    params.readReturnMode = UART_RETURN_NEWLINE;
-    params.readTimeout = CLI_UART_TIMEOUT;
-    params.writeTimeout = UART_WAIT_FOREVER;
-    cli_uart = UART_open(CONFIG_CLI_UART, &params);
-    if (cli_uart == NULL) {
-        System_abort("Error: could not open CLI UART, exiting\n");
-    }
+    cli_uart = open_cli_uart(false);
     // Register built in help function
     register_cli_function("help", "prints this help", cli_help);
     register_cli_function("unmount", "unmounts the SD card for removal",
@@ -110,6 +124,9 @@ void cli_init() {
     register_cli_function("showcfg", "shows configuration", show_config);
     register_cli_function("loadcfg", "load configuration from SD card",
                           load_config);
+    register_cli_function("setcfg",
+                          "sets and saves a config value: setcfg [key] [value]",
+                          set_config);
     register_cli_function("searchSIM", "searches for a connected SIM7000",
                           search_sim);
     register_cli_function("synctime", "forces an NTP time sync",
@@ -123,6 +140,27 @@ void cli_init() {
     register_cli_function("setradarlogging",
                           "enables or disables sample logging to cli",
                           set_radar_logging);
+    register_cli_function("storagebench",
+                          "times data file record encoding: storagebench "
+                          "[records]",
+                          storage_bench);
+    register_cli_function("crcbench",
+                          "times table and hardware CRC-32: crcbench [KB]",
+                          crc_bench);
+    register_cli_function("sdstats", "prints SD card latency and errors",
+                          sd_stats);
+    register_cli_function("query",
+                          "prints samples: query [start] [end] [gts], times "
+                          "as YYYY-MM-DD[THH:MM:SS]",
+                          query_data);
+    register_cli_function("summary",
+                          "prints min/max/mean: summary [minute|hour|day] "
+                          "[start] [end]",
+                          show_summary);
+    register_cli_function("export",
+                          "sends SD files to host: export list [dir], "
+                          "export get [file] [offset]",
+                          export_data);
     // Create Mutex to control multithreaded access to the UART.
     cliMutex = GateMutex_create(NULL, NULL);
     if (!cliMutex) {
@@ -333,8 +371,9 @@ void cli_log(const char *format, ...) {
     }
     // Print to CLI
     mutex_key = GateMutex_enter(cliMutex);
-    // Write formatted output to UART.
-    if (UART_write(cli_uart, temp_cli_buf, num_chars) != num_chars) {
+    // Write formatted output to UART, unless an export is using it
+    if (!cli_binary_mode &&
+        UART_write(cli_uart, temp_cli_buf, num_chars) != num_chars) {
         System_printf("Error while writing to CLI UART\n");
     }
     // Drop the mutex
@@ -358,8 +397,9 @@ void cli_write(const char *format, ...) {
     va_end(varargs);
     // Lock CLI Mutex.
     mutex_key = GateMutex_enter(cliMutex);
-    // Write formatted output to UART.
-    if (UART_write(cli_uart, temp_cli_buf, num_chars) != num_chars) {
+    // Write formatted output to UART, unless an export is using it
+    if (!cli_binary_mode &&
+        UART_write(cli_uart, temp_cli_buf, num_chars) != num_chars) {
         System_printf("Error while writing to CLI UART\n");
     }
     // Drop the mutex
@@ -395,24 +435,17 @@ static int mount_sd(int argc, char *argv[]) {
  * @return 0
  */
 static int show_config(int argc, char *argv[]) {
-    cli_write("Hardware ID: %s\n"
-              "Unique ID: %d\n"
-              "Radar: %s\n"
-              "Camera: %s\n"
-              "Network: %s\n"
-              "Server IP: %s\n",
-              program_config.hardware_id, program_config.synthetic_id,
-              program_config.radar_module_enabled ? "enabled" : "disabled",
-              program_config.camera_module_enabled ? "enabled" : "disabled",
-              program_config.network_enabled ? "enabled" : "disabled",
-              program_config.server_ip);
-    // Split into multiple CLI writes so we don't overflow buffer
-    cli_write("Radar Sample Interval: %i ms\n"
-              "Radar Sample Count: %i\n"
-              "Radar Sample offset: %.3f\n",
-              program_config.radar_sample_interval,
-              program_config.radar_sample_count,
-              program_config.radar_sample_offset);
+    char value[48];
+    int field;
+
+    // One write per field, so the CLI buffer never overflows
+    for (field = 0; field < CONFIG_FIELD_COUNT; field++) {
+        if (field == CONFIG_SERVER_AUTH) {
+            continue; // Keep the server key off the console
+        }
+        config_format_value((ConfigField)field, value, sizeof(value));
+        cli_write("%s: %s\n", config_key((ConfigField)field), value);
+    }
     return 0;
 }
 
@@ -423,11 +456,30 @@ static int show_config(int argc, char *argv[]) {
  * @return 0
  */
 static int load_config(int argc, char *argv[]) {
-    read_configuration();
+    // The user may have edited config.txt, so always parse it
+    read_configuration(false);
     show_config(argc, argv);
     return 0;
 }
 
+/**
+ * Sets a configuration value and saves it to config.txt
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on success, or -1 on error
+ */
+static int set_config(int argc, char *argv[]) {
+    if (argc != 3) {
+        cli_write("Incorrect number of arguments\n");
+        return -1;
+    }
+    if (set_config_value(argv[1], argv[2]) < 0) {
+        return -1;
+    }
+    cli_write("%s set to %s\n", argv[1], argv[2]);
+    return 0;
+}
+
 /**
  * Reloads the configuration values from the SD card.
  * @param argc: number of arguments
@@ -460,6 +512,327 @@ static int cli_set_radar_offset(int argc, char *argv[]) {
     return 0;
 }
 
+/**
+ * Benchmarks binary and CSV data file record encoding
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on sucesss, or negative value on error
+ */
+static int storage_bench(int argc, char *argv[]) {
+    int records = 1000;
+    if (argc > 2) {
+        cli_write("Incorrect number of arguments\n");
+        return -1;
+    }
+    if (argc == 2) {
+        records = atoi(argv[1]);
+        if (records <= 0) {
+            cli_write("Record count must be positive\n");
+            return -1;
+        }
+    }
+    storage_benchmark(records);
+    return 0;
+}
+
+/**
+ * Benchmarks the table driven and hardware CRC-32 implementations
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on sucesss, or negative value on error
+ */
+static int crc_bench(int argc, char *argv[]) {
+    static uint8_t buf[1024]; // Static, the CLI stack is small
+    uint32_t start, sw_cycles, hw_cycles, sw_crc = CRC32_INIT,
+                                          hw_crc = CRC32_INIT;
+    int kb = 16, i;
+
+    if (argc > 2) {
+        cli_write("Incorrect number of arguments\n");
+        return -1;
+    }
+    if (argc == 2) {
+        kb = atoi(argv[1]);
+        if (kb <= 0) {
+            cli_write("Size must be positive\n");
+            return -1;
+        }
+    }
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 37 + 11);
+    }
+    cyclecount_enable();
+    start = cyclecount_read();
+    for (i = 0; i < kb; i++) {
+        sw_crc = crc32_update_sw(sw_crc, buf, sizeof(buf));
+    }
+    sw_cycles = cyclecount_read() - start;
+    Watchdog_clear(watchdogHandle);
+    start = cyclecount_read();
+    for (i = 0; i < kb; i++) {
+        hw_crc = crc32_update_hw(hw_crc, buf, sizeof(buf));
+    }
+    hw_cycles = cyclecount_read() - start;
+    Watchdog_clear(watchdogHandle);
+    cli_write("CRC-32 of %d KB at %lu MHz\n", kb,
+              (unsigned long)(MAP_CS_getMCLK() / 1000000));
+    cli_write("Table: %lu cycles/KB\n", (unsigned long)(sw_cycles / kb));
+    cli_write("Hardware: %lu cycles/KB%s\n", (unsigned long)(hw_cycles / kb),
+              sw_crc != hw_crc ? ", wrong result" : "");
+    cli_write("In use: %s\n", crc32_hw_enabled() ? "hardware" : "table");
+    return 0;
+}
+
+/**
+ * Prints the SD card operation counters and latency histograms
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0
+ */
+static int sd_stats(int argc, char *argv[]) {
+    static const char *const op_names[SD_OP_COUNT] = {"open", "write",
+                                                       "sync", "close"};
+    StorageStats stats;
+    SdLatencyStats *op;
+    char line[CLI_PRINT_BUF_SIZE];
+    int i, j, pos;
+
+    storage_get_stats(&stats);
+    cli_write("SD card operations since boot, latency in ms:\n");
+    for (i = 0; i < SD_OP_COUNT; i++) {
+        op = &(stats.latency[i]);
+        cli_write("%s: %lu calls, %lu errors, p50 <%lu, p99 <%lu, max %lu\n",
+                  op_names[i], (unsigned long)op->count,
+                  (unsigned long)op->errors,
+                  (unsigned long)storage_latency_percentile(op, 50),
+                  (unsigned long)storage_latency_percentile(op, 99),
+                  (unsigned long)op->max_ms);
+        // Histogram, skipping empty buckets
+        pos = 0;
+        for (j = 0; j < SD_LATENCY_BUCKETS && pos < sizeof(line); j++) {
+            if (op->buckets[j] == 0) {
+                continue;
+            }
+            pos += snprintf(line + pos, sizeof(line) - pos, " %s%lu:%lu",
+                            j < SD_LATENCY_BUCKETS - 1 ? "<" : ">=",
+                            1UL << (j < SD_LATENCY_BUCKETS - 1 ? j : j - 1),
+                            (unsigned long)op->buckets[j]);
+        }
+        if (pos > 0) {
+            cli_write(" %s\n", line);
+        }
+    }
+    cli_write("Bytes written: %lu\n", (unsigned long)stats.bytes_written);
+    cli_write("Write p99 of last window: %lu ms, alarm at %d ms, %lu alarms\n",
+              (unsigned long)stats.window_p99_ms,
+              program_config.storage_latency_alarm,
+              (unsigned long)stats.latency_alarms);
+    return 0;
+}
+
+/**
+ * Prints the stored samples in a time range
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on sucesss, or negative value on error
+ */
+static int query_data(int argc, char *argv[]) {
+    QuerySummary summary = {0, 0.0, 0.0};
+    uint32_t start, end;
+    int ret;
+    if (argc != 3 && argc != 4) {
+        cli_write("Incorrect number of arguments\n");
+        return -1;
+    }
+    if (argc == 4 && strcmp(argv[3], "gts") != 0) {
+        cli_write("Unknown data source %s\n", argv[3]);
+        return -1;
+    }
+    if (storage_parse_time(argv[1], &start) < 0 ||
+        storage_parse_time(argv[2], &end) < 0) {
+        cli_write("Times must be formatted as YYYY-MM-DD or "
+                  "YYYY-MM-DDTHH:MM:SS\n");
+        return -1;
+    }
+    if (argc == 4) {
+        // Read the compressed block files instead of the raw data files
+        ret = storage_query_blocks(start, end, print_query_record, &summary);
+    } else {
+        ret = storage_query(start, end, print_query_record, &summary);
+    }
+    if (ret < 0) {
+        cli_write("Could not read data files\n");
+        return -1;
+    }
+    if (summary.count) {
+        cli_write("%d samples, min %.3f m, max %.3f m\n", summary.count,
+                  summary.min, summary.max);
+    } else {
+        cli_write("No samples in range\n");
+    }
+    return 0;
+}
+
+/**
+ * Query callback printing each record to the CLI
+ * @param record: record in the queried range
+ * @param arg: QuerySummary to update
+ * @return true, to continue the query
+ */
+static bool print_query_record(DataRecord *record, void *arg) {
+    QuerySummary *summary = arg;
+    char timestr[24];
+    storage_format_time(record->timestamp, timestr, sizeof(timestr));
+    cli_write("%s, %.3f\n", timestr, record->distance);
+    if (summary->count == 0 || record->distance < summary->min) {
+        summary->min = record->distance;
+    }
+    if (summary->count == 0 || record->distance > summary->max) {
+        summary->max = record->distance;
+    }
+    summary->count++;
+    return true;
+}
+
+/**
+ * Prints the stored rollups of a tier in a time range
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on sucesss, or negative value on error
+ */
+static int show_summary(int argc, char *argv[]) {
+    static const char *tiers[ROLLUP_TIERS] = {"minute", "hour", "day"};
+    uint32_t start, end;
+    int tier, ret;
+    if (argc != 4) {
+        cli_write("Incorrect number of arguments\n");
+        return -1;
+    }
+    for (tier = 0; tier < ROLLUP_TIERS; tier++) {
+        if (strcmp(argv[1], tiers[tier]) == 0) {
+            break;
+        }
+    }
+    if (tier == ROLLUP_TIERS) {
+        cli_write("Period must be minute, hour or day\n");
+        return -1;
+    }
+    if (storage_parse_time(argv[2], &start) < 0 ||
+        storage_parse_time(argv[3], &end) < 0) {
+        cli_write("Times must be formatted as YYYY-MM-DD or "
+                  "YYYY-MM-DDTHH:MM:SS\n");
+        return -1;
+    }
+    ret = storage_rollup_query((RollupTier)tier, start, end, print_rollup,
+                               NULL);
+    if (ret < 0) {
+        cli_write("Could not read rollup files\n");
+        return -1;
+    } else if (ret == 0) {
+        cli_write("No samples in range\n");
+    }
+    return 0;
+}
+
+/**
+ * Rollup query callback printing each rollup to the CLI
+ * @param rollup: rollup in the queried range
+ * @param arg: unused
+ * @return true, to continue the query
+ */
+static bool print_rollup(RollupRecord *rollup, void *arg) {
+    char timestr[24];
+    storage_format_time(rollup->start, timestr, sizeof(timestr));
+    cli_write("%s, %lu samples, min %.3f, max %.3f, mean %.3f\n", timestr,
+              (unsigned long)rollup->count, rollup->min, rollup->max,
+              rollup->mean);
+    return true;
+}
+
+/**
+ * Lists SD card files, or sends one to the host with the export protocol.
+ * While a file is sent, the CLI UART is switched to binary mode and output
+ * from other tasks only goes to the log file.
+ * @param argc: number of arguments
+ * @param argv: argument array
+ * @return 0 on sucesss, or negative value on error
+ */
+static int export_data(int argc, char *argv[]) {
+    IArg mutex_key;
+    uint32_t offset = 0;
+    int ret;
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "list") == 0) {
+        ret = storage_list_dir(argc == 3 ? argv[2] : "", print_dir_entry,
+                               NULL);
+        if (ret < 0) {
+            cli_write("Could not read directory\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (argc < 3 || argc > 4 || strcmp(argv[1], "get") != 0) {
+        cli_write("Incorrect arguments\n");
+        return -1;
+    }
+    if (argc == 4) {
+        offset = strtoul(argv[3], NULL, 10);
+    }
+    mutex_key = GateMutex_enter(cliMutex);
+    cli_binary_mode = true;
+    UART_close(cli_uart);
+    cli_uart = open_cli_uart(true);
+    GateMutex_leave(cliMutex, mutex_key);
+    ret = export_file(cli_uart, argv[2], offset);
+    mutex_key = GateMutex_enter(cliMutex);
+    UART_close(cli_uart);
+    cli_uart = open_cli_uart(false);
+    cli_binary_mode = false;
+    GateMutex_leave(cliMutex, mutex_key);
+    return ret;
+}
+
+/**
+ * Directory listing callback printing each file to the CLI
+ * @param name: file name
+ * @param size: file size in bytes
+ * @param arg: unused
+ */
+static void print_dir_entry(const char *name, uint32_t size, void *arg) {
+    cli_write("%s %lu\n", name, (unsigned long)size);
+}
+
+/**
+ * Opens the CLI UART
+ * @param binary: open for export frames instead of text, with no echo or
+ *  newline translation
+ * @return UART handle
+ */
+static UART_Handle open_cli_uart(bool binary) {
+    UART_Params params;
+    UART_Handle uart;
+    UART_Params_init(&params);
+    params.baudRate = CLI_BAUDRATE;
+    if (binary) {
+        params.readDataMode = UART_DATA_BINARY;
+        params.writeDataMode = UART_DATA_BINARY;
+        params.readEcho = UART_ECHO_OFF;
+        params.readReturnMode = UART_RETURN_FULL;
+        params.readTimeout = EXPORT_READ_TIMEOUT;
+    } else {
+        params.readDataMode = UART_DATA_TEXT;
+        params.writeDataMode = UART_DATA_TEXT;
+        params.readEcho = UART_ECHO_ON;
+        params.readReturnMode = UART_RETURN_NEWLINE;
+        params.readTimeout = CLI_UART_TIMEOUT;
+    }
+    params.writeTimeout = UART_WAIT_FOREVER;
+    uart = UART_open(CONFIG_CLI_UART, &params);
+    if (uart == NULL) {
+        System_abort("Error: could not open CLI UART, exiting\n");
+    }
+    return uart;
+}
+
 /**
  * Custom system exit handler. Writes output code to CLI.
  */
@@ -48,6 +48,14 @@ typedef struct {
     int lidar_sample_interval;
     int lidar_sample_count;
     float lidar_sample_offset;
+    int lidar_sample_spacing; /**< ms between samples averaged together */
+    bool lidar_burst_mode;    /**< should the sensor measure on its own */
+
+    float report_deadband; /**< min change in meters before a sample is sent */
+    int report_heartbeat;  /**< max ms between uploaded samples */
+    bool modem_staging_enabled; /**< stage backlog on SIM file system */
+    int storage_flush_age; /**< max ms data is buffered before SD write */
+    int storage_latency_alarm; /**< p99 SD write ms that warns, 0 for off */
 } ProgramConfiguration;
 
 /** Global program configuration structure, implemented in main.c */
@@ -0,0 +1,297 @@
+/**
+ * @file config.c
+ * Configuration parsing, printing and serialization, generated from the
+ * schema in config.h.
+ *
+ * Keys are looked up through a perfect hash: config_init() searches for a
+ * hash seed that gives every key its own slot of a small table, so a lookup
+ * is one hash and one string compare, however many keys there are.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+/* xdc module headers */
+#include <xdc/runtime/System.h>
+#include <xdc/std.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "config.h"
+#include "crc32.h"
+
+/** Slots in the key hash table, a power of 2 well above the key count */
+#define CONFIG_HASH_SLOTS 64
+/** Seeds tried before giving up on a perfect hash */
+#define CONFIG_HASH_MAX_SEEDS 4096
+
+/** Schema entry, as used by the generated code */
+typedef struct {
+    const char *key;  /**< config.txt key */
+    ConfigType type;  /**< value type */
+    uint16_t offset;  /**< offset of field in ProgramConfiguration */
+    uint16_t size;    /**< size of field */
+    int32_t min;      /**< smallest INT or FLOAT value */
+    int32_t max;      /**< largest INT or FLOAT value */
+} ConfigFieldInfo;
+
+static int find_field(const char *key);
+static uint32_t hash_key(const char *key, uint32_t seed);
+static int check_value(const ConfigFieldInfo *info, const uint8_t *value);
+
+/** Schema entry X macro expanding to a ConfigFieldInfo */
+#define CONFIG_INFO_X(id, key, type, field, min, max, def)                     \
+    {key,                                                                      \
+     CONFIG_TYPE_##type,                                                       \
+     offsetof(ProgramConfiguration, field),                                    \
+     sizeof(((ProgramConfiguration *)0)->field),                               \
+     min,                                                                      \
+     max},
+
+/** Schema, indexed by ConfigField */
+static const ConfigFieldInfo fields[CONFIG_FIELD_COUNT] = {
+    CONFIG_SCHEMA(CONFIG_INFO_X)};
+
+/** Key hash table, holding ConfigField + 1 for each key, or 0 */
+static uint8_t hash_table[CONFIG_HASH_SLOTS];
+/** Hash seed that places every key in its own slot */
+static uint32_t hash_seed;
+
+/**
+ * Builds the key lookup table. Must be called before any other config
+ * function.
+ */
+void config_init() {
+    uint32_t seed;
+    unsigned int slot;
+    int i;
+
+    for (seed = 0; seed < CONFIG_HASH_MAX_SEEDS; seed++) {
+        memset(hash_table, 0, sizeof(hash_table));
+        for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+            slot = hash_key(fields[i].key, seed) % CONFIG_HASH_SLOTS;
+            if (hash_table[slot]) {
+                break; // Collision, try the next seed
+            }
+            hash_table[slot] = i + 1;
+        }
+        if (i == CONFIG_FIELD_COUNT) {
+            hash_seed = seed;
+            return;
+        }
+    }
+    System_abort("No perfect hash for configuration keys\n");
+}
+
+/**
+ * Gets the config.txt key of a field
+ * @param field: configuration field
+ * @return key string
+ */
+const char *config_key(ConfigField field) { return fields[field].key; }
+
+/**
+ * Parses a config.txt value into its program_config field. The field is
+ * left unchanged if the value is invalid.
+ * @param key: configuration key, matched exactly
+ * @param value: value string
+ * @return 0 on success, -1 if the key is unknown, or -2 if the value is not
+ *  valid for the field's type and range
+ */
+int config_parse_entry(const char *key, const char *value) {
+    const ConfigFieldInfo *info;
+    uint8_t *dest;
+    char *end;
+    long int_value;
+    float float_value;
+    int index = find_field(key);
+
+    if (index < 0) {
+        return -1;
+    }
+    info = &fields[index];
+    dest = (uint8_t *)&program_config + info->offset;
+    switch (info->type) {
+    case CONFIG_TYPE_BOOL:
+        if (strcmp(value, "true") == 0) {
+            *(bool *)dest = true;
+        } else if (strcmp(value, "false") == 0) {
+            *(bool *)dest = false;
+        } else {
+            return -2;
+        }
+        break;
+    case CONFIG_TYPE_INT:
+        int_value = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || int_value < info->min ||
+            int_value > info->max) {
+            return -2;
+        }
+        *(int *)dest = (int)int_value;
+        break;
+    case CONFIG_TYPE_FLOAT:
+        float_value = strtof(value, &end);
+        // Written so NaN fails the range check
+        if (end == value || *end != '\0' ||
+            !(float_value >= info->min && float_value <= info->max)) {
+            return -2;
+        }
+        *(float *)dest = float_value;
+        break;
+    case CONFIG_TYPE_STRING:
+        if (strlen(value) >= info->size) {
+            return -2;
+        }
+        strcpy((char *)dest, value);
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Formats the value of a program_config field the way config.txt holds it
+ * @param field: configuration field
+ * @param output: buffer to write the value into
+ * @param len: length of output buffer
+ * @return number of characters written, as snprintf
+ */
+int config_format_value(ConfigField field, char *output, int len) {
+    const uint8_t *src = (const uint8_t *)&program_config + fields[field].offset;
+
+    switch (fields[field].type) {
+    case CONFIG_TYPE_BOOL:
+        return snprintf(output, len, "%s", *(bool *)src ? "true" : "false");
+    case CONFIG_TYPE_INT:
+        return snprintf(output, len, "%d", *(int *)src);
+    case CONFIG_TYPE_FLOAT:
+        return snprintf(output, len, "%.3f", *(float *)src);
+    case CONFIG_TYPE_STRING:
+        return snprintf(output, len, "%s", (const char *)src);
+    }
+    return 0;
+}
+
+/**
+ * Packs a configuration into CONFIG_SERIALIZED_SIZE bytes, field by field in
+ * schema order, without padding
+ * @param config: configuration to pack
+ * @param output: buffer of CONFIG_SERIALIZED_SIZE bytes
+ */
+void config_serialize(const ProgramConfiguration *config, uint8_t *output) {
+    int i;
+
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        memcpy(output, (const uint8_t *)config + fields[i].offset,
+               fields[i].size);
+        output += fields[i].size;
+    }
+}
+
+/**
+ * Unpacks a configuration packed by config_serialize(). Values outside their
+ * field's range are rejected.
+ * @param config: configuration to fill
+ * @param input: buffer of CONFIG_SERIALIZED_SIZE bytes
+ * @return 0 on success, or negative value if a value is invalid, in which
+ *  case config is unchanged
+ */
+int config_deserialize(ProgramConfiguration *config, const uint8_t *input) {
+    const uint8_t *pos = input;
+    int i;
+
+    // Check every value before changing anything
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        if (check_value(&fields[i], pos) < 0) {
+            return -1;
+        }
+        pos += fields[i].size;
+    }
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        memcpy((uint8_t *)config + fields[i].offset, input, fields[i].size);
+        input += fields[i].size;
+    }
+    return 0;
+}
+
+/**
+ * Gets a checksum of the schema's keys and types. Serialized configurations
+ * can only be unpacked by firmware with the same schema ID.
+ * @return schema ID
+ */
+uint32_t config_schema_id() {
+    uint32_t crc = CRC32_INIT;
+    uint8_t layout[2];
+    int i;
+
+    for (i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        layout[0] = (uint8_t)fields[i].type;
+        layout[1] = (uint8_t)fields[i].size;
+        // Include the terminator, so key boundaries count
+        crc = crc32_update(crc, fields[i].key, strlen(fields[i].key) + 1);
+        crc = crc32_update(crc, layout, sizeof(layout));
+    }
+    return crc;
+}
+
+/**
+ * Finds a field by its key
+ * @param key: configuration key
+ * @return index of the field, or -1 if the key is unknown
+ */
+static int find_field(const char *key) {
+    uint8_t entry = hash_table[hash_key(key, hash_seed) % CONFIG_HASH_SLOTS];
+
+    // A slot only holds one key, which may not be the one asked for
+    if (entry == 0 || strcmp(fields[entry - 1].key, key) != 0) {
+        return -1;
+    }
+    return entry - 1;
+}
+
+/**
+ * Hashes a key, with FNV-1a
+ * @param key: null terminated key
+ * @param seed: hash seed
+ * @return hash of key
+ */
+static uint32_t hash_key(const char *key, uint32_t seed) {
+    uint32_t hash = 2166136261UL ^ seed;
+
+    while (*key) {
+        hash ^= (uint8_t)*key++;
+        hash *= 16777619UL;
+    }
+    // Fold the high bits in, the table only uses the low ones
+    return hash ^ (hash >> 16);
+}
+
+/**
+ * Checks a serialized field value
+ * @param info: field to check
+ * @param value: serialized value
+ * @return 0 if the value is valid, or -1 if not
+ */
+static int check_value(const ConfigFieldInfo *info, const uint8_t *value) {
+    int int_value;
+    float float_value;
+
+    switch (info->type) {
+    case CONFIG_TYPE_BOOL:
+        return value[0] <= 1 ? 0 : -1;
+    case CONFIG_TYPE_INT:
+        memcpy(&int_value, value, sizeof(int_value));
+        return (int_value >= info->min && int_value <= info->max) ? 0 : -1;
+    case CONFIG_TYPE_FLOAT:
+        memcpy(&float_value, value, sizeof(float_value));
+        return (float_value >= info->min && float_value <= info->max) ? 0
+                                                                      : -1;
+    case CONFIG_TYPE_STRING:
+        return memchr(value, '\0', info->size) ? 0 : -1;
+    }
+    return -1;
+}
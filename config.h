@@ -0,0 +1,159 @@
+/**
+ * @file config.h
+ * Configuration schema. Every ProgramConfiguration field is described once,
+ * in CONFIG_SCHEMA, with its config.txt key, type, accepted range and built
+ * in default. The config.txt parser, the CLI printer, the binary serializer
+ * used for the configuration snapshot and the default program_config are
+ * all generated from it, so adding a field only takes a schema line.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/**
+ * Configuration schema, one X(id, key, type, field, min, max, default) entry
+ * per field:
+ *  - id: name of the field's ConfigField value, after CONFIG_
+ *  - key: key of the field in config.txt
+ *  - type: BOOL ("true" or "false"), INT, FLOAT or STRING
+ *  - field: ProgramConfiguration member
+ *  - min, max: accepted range of INT and FLOAT values. STRING values must
+ *    fit in the member, with a null terminator.
+ *  - default: value built into the firmware
+ */
+#define CONFIG_SCHEMA(X)                                                       \
+    X(HARDWARE_ID, "HardwareIdentifier", STRING, hardware_id, 0, 0, "HW_ID")   \
+    X(SYNTHETIC_ID, "UniqueIdentifier", INT, synthetic_id, 0, 65535, 1)        \
+    X(LIDAR_ENABLED, "LidarModuleEnabled", BOOL, lidar_module_enabled, 0, 1,   \
+      true)                                                                    \
+    X(RADAR_ENABLED, "RadarModuleEnabled", BOOL, radar_module_enabled, 0, 1,   \
+      false)                                                                   \
+    X(CAMERA_ENABLED, "CameraModuleEnabled", BOOL, camera_module_enabled, 0,   \
+      1, false)                                                                \
+    X(NETWORK_ENABLED, "NetworkModuleEnabled", BOOL, network_enabled, 0, 1,    \
+      false)                                                                   \
+    X(SERVER_IP, "RemoteServerIP", STRING, server_ip, 0, 0, "3.21.41.182")     \
+    X(SERVER_AUTH, "ServerAuthenticationKey", STRING, server_token, 0, 0,      \
+      "f94ed0427c1d5d54b4308fe8c1aa7e03703d4bbd")                              \
+    X(RADAR_SAMPLE_INTERVAL, "RadarSampleInterval", INT,                       \
+      radar_sample_interval, 100, 86400000, 15000)                             \
+    X(RADAR_SAMPLE_COUNT, "RadarSampleCount", INT, radar_sample_count, 1,      \
+      1000, 55)                                                                \
+    X(RADAR_SAMPLE_OFFSET, "RadarSampleOffset", FLOAT, radar_sample_offset,    \
+      -100, 100, 0.0f)                                                         \
+    X(LIDAR_SAMPLE_INTERVAL, "LidarSampleInterval", INT,                       \
+      lidar_sample_interval, 100, 86400000, 15000)                             \
+    X(LIDAR_SAMPLE_COUNT, "LidarSampleCount", INT, lidar_sample_count, 1,      \
+      1000, 2)                                                                 \
+    X(LIDAR_SAMPLE_OFFSET, "LidarSampleOffset", FLOAT, lidar_sample_offset,    \
+      -100, 100, 0.0f)                                                         \
+    X(LIDAR_SAMPLE_SPACING, "LidarSampleSpacing", INT, lidar_sample_spacing,   \
+      10, 60000, 500)                                                          \
+    X(LIDAR_BURST_MODE, "LidarBurstMode", BOOL, lidar_burst_mode, 0, 1,        \
+      false)                                                                   \
+    X(REPORT_DEADBAND, "ReportDeadband", FLOAT, report_deadband, 0, 100,       \
+      0.02f)                                                                   \
+    X(REPORT_HEARTBEAT, "ReportHeartbeat", INT, report_heartbeat, 0,           \
+      604800000, 3600000)                                                      \
+    X(MODEM_STAGING_ENABLED, "ModemStagingEnabled", BOOL,                      \
+      modem_staging_enabled, 0, 1, false)                                      \
+    X(STORAGE_FLUSH_AGE, "StorageFlushAge", INT, storage_flush_age, 0,         \
+      3600000, 60000)                                                          \
+    X(STORAGE_LATENCY_ALARM, "StorageLatencyAlarm", INT,                       \
+      storage_latency_alarm, 0, 60000, 250)
+
+/** Configuration value types */
+typedef enum {
+    CONFIG_TYPE_BOOL,   /**< bool, "true" or "false" */
+    CONFIG_TYPE_INT,    /**< int */
+    CONFIG_TYPE_FLOAT,  /**< float */
+    CONFIG_TYPE_STRING, /**< null terminated char array */
+} ConfigType;
+
+/** Schema entry X macro expanding to the field's ConfigField value */
+#define CONFIG_ENUM_X(id, key, type, field, min, max, def) CONFIG_##id,
+
+/** Configuration fields, in schema order */
+typedef enum {
+    CONFIG_SCHEMA(CONFIG_ENUM_X) CONFIG_FIELD_COUNT /**< number of fields */
+} ConfigField;
+
+/** Schema entry X macro expanding to a designated initializer */
+#define CONFIG_DEFAULT_X(id, key, type, field, min, max, def) .field = def,
+
+/** Initializer for a ProgramConfiguration holding the built in defaults */
+#define CONFIG_DEFAULTS                                                        \
+    { CONFIG_SCHEMA(CONFIG_DEFAULT_X) }
+
+/** Schema entry X macro expanding to the field's serialized size */
+#define CONFIG_SERIAL_SIZE_X(id, key, type, field, min, max, def)              \
+    +sizeof(((ProgramConfiguration *)0)->field)
+
+/** Size of a serialized configuration */
+#define CONFIG_SERIALIZED_SIZE (0 CONFIG_SCHEMA(CONFIG_SERIAL_SIZE_X))
+
+/**
+ * Builds the key lookup table. Must be called before any other config
+ * function.
+ */
+void config_init();
+
+/**
+ * Gets the config.txt key of a field
+ * @param field: configuration field
+ * @return key string
+ */
+const char *config_key(ConfigField field);
+
+/**
+ * Parses a config.txt value into its program_config field. The field is
+ * left unchanged if the value is invalid.
+ * @param key: configuration key, matched exactly
+ * @param value: value string
+ * @return 0 on success, -1 if the key is unknown, or -2 if the value is not
+ *  valid for the field's type and range
+ */
+int config_parse_entry(const char *key, const char *value);
+
+/**
+ * Formats the value of a program_config field the way config.txt holds it
+ * @param field: configuration field
+ * @param output: buffer to write the value into
+ * @param len: length of output buffer
+ * @return number of characters written, as snprintf
+ */
+int config_format_value(ConfigField field, char *output, int len);
+
+/**
+ * Packs a configuration into CONFIG_SERIALIZED_SIZE bytes, field by field in
+ * schema order, without padding
+ * @param config: configuration to pack
+ * @param output: buffer of CONFIG_SERIALIZED_SIZE bytes
+ */
+void config_serialize(const ProgramConfiguration *config, uint8_t *output);
+
+/**
+ * Unpacks a configuration packed by config_serialize(). Values outside their
+ * field's range are rejected.
+ * @param config: configuration to fill
+ * @param input: buffer of CONFIG_SERIALIZED_SIZE bytes
+ * @return 0 on success, or negative value if a value is invalid, in which
+ *  case config is unchanged
+ */
+int config_deserialize(ProgramConfiguration *config, const uint8_t *input);
+
+/**
+ * Gets a checksum of the schema's keys and types. Serialized configurations
+ * can only be unpacked by firmware with the same schema ID.
+ * @return schema ID
+ */
+uint32_t config_schema_id();
+
+#endif /* CONFIG_H_ */
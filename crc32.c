@@ -0,0 +1,155 @@
+/**
+ * @file crc32.c
+ * CRC-32 checksums. The software path works four bits at a time with a 16
+ * entry table to keep flash use small. On the MSP432 the CRC32 hardware
+ * module takes a word per write instead.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifdef __MSP432P401R__
+/* DriverLib Includes */
+#include <ti/devices/msp432p4xx/driverlib/driverlib.h>
+
+/* BIOS module headers */
+#include <ti/sysbios/knl/Task.h>
+#endif
+
+#include <stddef.h>
+
+#include "crc32.h"
+
+/** CRC-32 of each nibble value, reflected polynomial 0xEDB88320 */
+static const uint32_t crc_nibble_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+    0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+/** CRC-32 of "123456789", the standard check value */
+#define CRC32_CHECK_VALUE 0xCBF43926
+
+/** Set once the hardware module has passed its self test */
+static bool hw_enabled;
+
+/**
+ * Selects the CRC implementation. Uses the hardware CRC32 module if it is
+ * present and gives the same results as the table, including over unaligned
+ * and continued buffers.
+ */
+void crc32_init() {
+#ifdef __MSP432P401R__
+    uint32_t pattern[17]; // Word aligned, so offsets below cover alignments
+    const uint8_t *bytes = (const uint8_t *)pattern;
+    uint32_t expected;
+    unsigned int i;
+
+    hw_enabled = false;
+    if (crc32_update_hw(CRC32_INIT, "123456789", 9) != CRC32_CHECK_VALUE) {
+        return;
+    }
+    for (i = 0; i < sizeof(pattern); i++) {
+        ((uint8_t *)pattern)[i] = (uint8_t)(i * 37 + 11);
+    }
+    for (i = 0; i < 4; i++) {
+        expected = crc32_update_sw(CRC32_INIT, bytes + i, 61);
+        if (crc32_update_hw(CRC32_INIT, bytes + i, 61) != expected ||
+            crc32_update_hw(crc32_update_hw(CRC32_INIT, bytes + i, 7),
+                            bytes + i + 7, 54) != expected) {
+            return;
+        }
+    }
+    hw_enabled = true;
+#endif
+}
+
+/**
+ * Checks whether crc32_update() uses the hardware CRC32 module
+ * @return true if the hardware module is in use
+ */
+bool crc32_hw_enabled() { return hw_enabled; }
+
+/**
+ * Continues a CRC-32 over more data. Start with CRC32_INIT; the value
+ * returned after the last call is the checksum of all data passed.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, unsigned int len) {
+    if (hw_enabled) {
+        return crc32_update_hw(crc, data, len);
+    }
+    return crc32_update_sw(crc, data, len);
+}
+
+/**
+ * Continues a CRC-32 with the table driven implementation. Same results as
+ * crc32_update(); exposed for benchmarking.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update_sw(uint32_t crc, const void *data, unsigned int len) {
+    const uint8_t *bytes = data;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *bytes++;
+        crc = (crc >> 4) ^ crc_nibble_table[crc & 0xF];
+        crc = (crc >> 4) ^ crc_nibble_table[crc & 0xF];
+    }
+    return ~crc;
+}
+
+/**
+ * Continues a CRC-32 with the hardware CRC32 module. Falls back to the table
+ * on builds without the module; exposed for benchmarking.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update_hw(uint32_t crc, const void *data, unsigned int len) {
+#ifdef __MSP432P401R__
+    const uint8_t *bytes = data;
+    UInt key;
+
+    /*
+     * The module shifts data in least significant bit first, and keeps its
+     * state bit reversed from the zlib register, so the seed is reversed on
+     * the way in and the reversed result register read on the way out.
+     * Other tasks must not use the module part way through a buffer.
+     */
+    key = Task_disable();
+    MAP_CRC32_setSeed(__RBIT(~crc), CRC32_MODE);
+    while (len && ((uintptr_t)bytes & 0x3)) {
+        MAP_CRC32_set8BitData(*bytes++, CRC32_MODE);
+        len--;
+    }
+    while (len >= 4) {
+        MAP_CRC32_set32BitData(*(const uint32_t *)bytes);
+        bytes += 4;
+        len -= 4;
+    }
+    while (len--) {
+        MAP_CRC32_set8BitData(*bytes++, CRC32_MODE);
+    }
+    crc = ~MAP_CRC32_getResultReversed(CRC32_MODE);
+    Task_restore(key);
+    return crc;
+#else
+    return crc32_update_sw(crc, data, len);
+#endif
+}
+
+/**
+ * Computes the CRC-32 of a buffer
+ * @param data: data to checksum
+ * @param len: length of data
+ * @return CRC-32 of data
+ */
+uint32_t crc32(const void *data, unsigned int len) {
+    return crc32_update(CRC32_INIT, data, len);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file crc32.h
+ * CRC-32 checksums, using the polynomial and bit order of zlib and Ethernet,
+ * so results can be checked with zlib.crc32() in Python.
+ *
+ * On the MSP432 the CRC32 hardware module is used once crc32_init() has
+ * checked it against the table driven implementation. Host builds, and
+ * firmware before crc32_init(), use the table.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Initial value to pass to crc32_update() */
+#define CRC32_INIT 0x00000000
+
+/**
+ * Selects the CRC implementation. Uses the hardware CRC32 module if it is
+ * present and gives the same results as the table, including over unaligned
+ * and continued buffers.
+ */
+void crc32_init();
+
+/**
+ * Checks whether crc32_update() uses the hardware CRC32 module
+ * @return true if the hardware module is in use
+ */
+bool crc32_hw_enabled();
+
+/**
+ * Continues a CRC-32 over more data. Start with CRC32_INIT; the value
+ * returned after the last call is the checksum of all data passed.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, unsigned int len);
+
+/**
+ * Continues a CRC-32 with the table driven implementation. Same results as
+ * crc32_update(); exposed for benchmarking.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update_sw(uint32_t crc, const void *data, unsigned int len);
+
+/**
+ * Continues a CRC-32 with the hardware CRC32 module. Falls back to the table
+ * on builds without the module; exposed for benchmarking.
+ * @param crc: CRC of the data so far
+ * @param data: data to add
+ * @param len: length of data
+ * @return CRC of the data so far, including data
+ */
+uint32_t crc32_update_hw(uint32_t crc, const void *data, unsigned int len);
+
+/**
+ * Computes the CRC-32 of a buffer
+ * @param data: data to checksum
+ * @param len: length of data
+ * @return CRC-32 of data
+ */
+uint32_t crc32(const void *data, unsigned int len);
+
+#endif /* CRC32_H_ */
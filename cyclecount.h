@@ -0,0 +1,32 @@
+/**
+ * @file cyclecount.h
+ * Cycle counter helpers used for benchmarking. Uses the DWT cycle counter
+ * of the Cortex-M4 core, which counts MCLK cycles.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef CYCLECOUNT_H_
+#define CYCLECOUNT_H_
+
+#include <stdint.h>
+
+/* DriverLib Includes */
+#include <ti/devices/msp432p4xx/driverlib/driverlib.h>
+
+/**
+ * Enables the DWT cycle counter. Safe to call more than once.
+ */
+static inline void cyclecount_enable() {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * Reads the current cycle count. The counter wraps every 2^32 cycles, so
+ * unsigned subtraction of two reads gives the elapsed cycles.
+ * @return current value of the cycle counter
+ */
+static inline uint32_t cyclecount_read() { return DWT->CYCCNT; }
+
+#endif /* CYCLECOUNT_H_ */
@@ -0,0 +1,266 @@
+/**
+ * @file export.c
+ * Streams files from the SD card to a host over the CLI UART. See export.h
+ * for the protocol.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+/* xdc module headers */
+#include <xdc/std.h>
+
+/* Standard libs */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Ti BIOS Headers */
+#include <ti/sysbios/knl/Clock.h>
+
+/* TI Drivers */
+#include <ti/drivers/UART.h>
+
+#include "common.h"
+#include "crc32.h"
+#include "export.h"
+#include "storage.h"
+
+/** Bytes in a frame before the payload */
+#define FRAME_HEADER_LEN 9
+/** Bytes in a frame after the payload */
+#define FRAME_TRAILER_LEN 4
+/** Length of a frame from the host, which never has a payload */
+#define HOST_FRAME_LEN (FRAME_HEADER_LEN + FRAME_TRAILER_LEN)
+/** Bytes that may be sent ahead of the last acknowledgement */
+#define WINDOW_BYTES (EXPORT_WINDOW * EXPORT_PAYLOAD_MAX)
+
+/** Receive state for frames from the host */
+typedef struct {
+    uint8_t buf[HOST_FRAME_LEN]; /**< bytes of the frame so far */
+    unsigned int len;            /**< number of bytes in buf */
+} ExportRx;
+
+static int send_frame(UART_Handle uart, uint8_t type, uint32_t offset,
+                      const void *payload, unsigned int len);
+static bool receive_byte(ExportRx *rx, uint8_t byte, uint8_t *type,
+                         uint32_t *offset);
+static bool poll_host(UART_Handle uart, ExportRx *rx, uint32_t timeout,
+                      uint8_t *type, uint32_t *offset);
+static void put_le16(uint8_t *buf, uint16_t value);
+static void put_le32(uint8_t *buf, uint32_t value);
+static uint32_t get_le32(const uint8_t *buf);
+
+/** Frame being sent. Static, since it is too large for the CLI stack */
+static uint8_t tx_frame[FRAME_HEADER_LEN + EXPORT_PAYLOAD_MAX +
+                        FRAME_TRAILER_LEN];
+
+/**
+ * Sends a file to the host. The UART must be open in binary mode without
+ * echo, with a read timeout of EXPORT_READ_TIMEOUT, and no other task may
+ * write to it during the transfer.
+ * @param uart: UART to send the file over
+ * @param filename: name of the file on the SD card
+ * @param offset: offset to start sending from, to resume a transfer
+ * @return 0 once the host acknowledged the whole file, or negative value on
+ *  error
+ */
+int export_file(UART_Handle uart, const char *filename, uint32_t offset) {
+    ExportRx rx = {{0}, 0};
+    uint32_t size, acked, next, ack_offset;
+    unsigned int name_len, retries = 0;
+    uint8_t type;
+    int len, ret = -1;
+    bool ended = false, window_open;
+
+    if (storage_export_open(filename, &size) < 0) {
+        send_frame(uart, EXPORT_FRAME_ERROR, 0, "cannot open file", 16);
+        return -1;
+    }
+    if (offset > size) {
+        send_frame(uart, EXPORT_FRAME_ERROR, offset, "offset past end", 15);
+        storage_export_close();
+        return -1;
+    }
+    // Header payload is the file size, then the file name
+    name_len = strlen(filename);
+    if (name_len > EXPORT_PAYLOAD_MAX - 4) {
+        name_len = EXPORT_PAYLOAD_MAX - 4;
+    }
+    put_le32(tx_frame + FRAME_HEADER_LEN, size);
+    memcpy(tx_frame + FRAME_HEADER_LEN + 4, filename, name_len);
+    send_frame(uart, EXPORT_FRAME_HEADER, offset, NULL, 4 + name_len);
+    acked = next = offset;
+    while (retries <= EXPORT_MAX_RETRIES) {
+        Watchdog_clear(watchdogHandle);
+        window_open = next < size && next - acked < WINDOW_BYTES;
+        if (window_open) {
+            len = storage_export_read(next, tx_frame + FRAME_HEADER_LEN,
+                                      EXPORT_PAYLOAD_MAX);
+            if (len <= 0) {
+                send_frame(uart, EXPORT_FRAME_ERROR, next, "read error", 10);
+                break;
+            }
+            send_frame(uart, EXPORT_FRAME_DATA, next, NULL, len);
+            next += len;
+        } else if (acked == size && !ended) {
+            send_frame(uart, EXPORT_FRAME_END, size, NULL, 0);
+            ended = true;
+        }
+        // Only wait for the host once the window is full or the file is sent
+        window_open = next < size && next - acked < WINDOW_BYTES;
+        if (!poll_host(uart, &rx, window_open ? 0 : EXPORT_ACK_TIMEOUT, &type,
+                       &ack_offset)) {
+            if (!window_open) {
+                // Timed out, resend everything not acknowledged
+                retries++;
+                next = acked;
+                ended = false;
+            }
+            continue;
+        }
+        if (type == EXPORT_FRAME_CANCEL) {
+            break;
+        } else if (type != EXPORT_FRAME_ACK) {
+            continue;
+        }
+        if (ended && ack_offset == size) {
+            ret = 0; // Host has the whole file
+            break;
+        } else if (ack_offset > acked && ack_offset <= next) {
+            acked = ack_offset;
+            retries = 0;
+        } else if (ack_offset == acked && next > acked) {
+            // Host saw a gap, go back to the first missing byte
+            retries++;
+            next = acked;
+        }
+    }
+    storage_export_close();
+    return ret;
+}
+
+/**
+ * Builds and sends a frame. A NULL payload means the payload was already
+ * placed in tx_frame.
+ * @param uart: UART to send the frame over
+ * @param type: frame type
+ * @param offset: file offset of the frame
+ * @param payload: frame payload, or NULL
+ * @param len: length of payload
+ * @return 0 on success, or negative value on write error
+ */
+static int send_frame(UART_Handle uart, uint8_t type, uint32_t offset,
+                      const void *payload, unsigned int len) {
+    unsigned int frame_len = FRAME_HEADER_LEN + len + FRAME_TRAILER_LEN;
+
+    tx_frame[0] = EXPORT_SYNC0;
+    tx_frame[1] = EXPORT_SYNC1;
+    tx_frame[2] = type;
+    put_le16(tx_frame + 3, len);
+    put_le32(tx_frame + 5, offset);
+    if (payload) {
+        memcpy(tx_frame + FRAME_HEADER_LEN, payload, len);
+    }
+    put_le32(tx_frame + FRAME_HEADER_LEN + len,
+             crc32(tx_frame + 2, FRAME_HEADER_LEN - 2 + len));
+    if (UART_write(uart, tx_frame, frame_len) != frame_len) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads frames from the host
+ * @param uart: UART to read from
+ * @param rx: receive state, kept between calls
+ * @param timeout: ms to wait for a frame, or 0 to only read bytes already
+ *  received
+ * @param type: set to the frame type
+ * @param offset: set to the frame offset
+ * @return true if a valid frame was received
+ */
+static bool poll_host(UART_Handle uart, ExportRx *rx, uint32_t timeout,
+                      uint8_t *type, uint32_t *offset) {
+    uint32_t start = Clock_getTicks();
+    int available;
+    uint8_t byte;
+
+    while (1) {
+        if (timeout == 0) {
+            if (UART_control(uart, UART_CMD_GETRXCOUNT, &available) !=
+                    UART_STATUS_SUCCESS ||
+                available == 0) {
+                return false;
+            }
+        } else if (Clock_getTicks() - start >= timeout) {
+            return false;
+        }
+        // Blocks for at most EXPORT_READ_TIMEOUT
+        if (UART_read(uart, &byte, 1) == 1 &&
+            receive_byte(rx, byte, type, offset)) {
+            return true;
+        }
+    }
+}
+
+/**
+ * Adds a received byte to the frame being received
+ * @param rx: receive state
+ * @param byte: received byte
+ * @param type: set to the frame type when a frame completes
+ * @param offset: set to the frame offset when a frame completes
+ * @return true if byte completed a valid frame
+ */
+static bool receive_byte(ExportRx *rx, uint8_t byte, uint8_t *type,
+                         uint32_t *offset) {
+    if ((rx->len == 0 && byte != EXPORT_SYNC0) ||
+        (rx->len == 1 && byte != EXPORT_SYNC1)) {
+        // Not a frame start, resynchronize
+        rx->len = (byte == EXPORT_SYNC0) ? 1 : 0;
+        rx->buf[0] = byte;
+        return false;
+    }
+    rx->buf[rx->len++] = byte;
+    if (rx->len < HOST_FRAME_LEN) {
+        return false;
+    }
+    rx->len = 0;
+    if (rx->buf[3] != 0 || rx->buf[4] != 0 ||
+        get_le32(rx->buf + FRAME_HEADER_LEN) !=
+            crc32(rx->buf + 2, FRAME_HEADER_LEN - 2)) {
+        return false;
+    }
+    *type = rx->buf[2];
+    *offset = get_le32(rx->buf + 5);
+    return true;
+}
+
+/**
+ * Stores a 16 bit value little endian
+ * @param buf: output buffer
+ * @param value: value to store
+ */
+static void put_le16(uint8_t *buf, uint16_t value) {
+    buf[0] = value & 0xFF;
+    buf[1] = value >> 8;
+}
+
+/**
+ * Stores a 32 bit value little endian
+ * @param buf: output buffer
+ * @param value: value to store
+ */
+static void put_le32(uint8_t *buf, uint32_t value) {
+    put_le16(buf, value & 0xFFFF);
+    put_le16(buf + 2, value >> 16);
+}
+
+/**
+ * Reads a little endian 32 bit value
+ * @param buf: input buffer
+ * @return value read
+ */
+static uint32_t get_le32(const uint8_t *buf) {
+    return buf[0] | (buf[1] << 8) | ((uint32_t)buf[2] << 16) |
+           ((uint32_t)buf[3] << 24);
+}
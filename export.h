@@ -0,0 +1,63 @@
+/**
+ * @file export.h
+ * Streams files from the SD card to a host over the CLI UART, with a framed,
+ * CRC checked protocol that can resume a partial transfer.
+ *
+ * Every frame, in both directions, is:
+ *  - sync bytes 0x7E 0xA5
+ *  - type (1 byte, one of ExportFrameType)
+ *  - payload length (2 bytes)
+ *  - file offset (4 bytes)
+ *  - payload
+ *  - CRC-32 of type through payload (4 bytes)
+ * Multi byte fields are little endian. Bytes outside of a valid frame are
+ * skipped, so the host can resynchronize after noise or CLI text.
+ *
+ * The device sends a header frame giving the file size, then keeps up to
+ * EXPORT_WINDOW data frames in flight. The host acknowledges with the offset
+ * of the next byte it expects. Repeating an acknowledgement, or sending none
+ * for EXPORT_ACK_TIMEOUT, makes the device resend from that offset. An end
+ * frame closes the transfer. tools/export_receive.py is the host side.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef EXPORT_H_
+#define EXPORT_H_
+
+#include <stdint.h>
+
+/* TI Drivers */
+#include <ti/drivers/UART.h>
+
+#define EXPORT_SYNC0 0x7E          /**< first sync byte of a frame */
+#define EXPORT_SYNC1 0xA5          /**< second sync byte of a frame */
+#define EXPORT_PAYLOAD_MAX 256     /**< max payload bytes in a frame */
+#define EXPORT_WINDOW 8            /**< data frames sent ahead of the ack */
+#define EXPORT_ACK_TIMEOUT 1000    /**< ms to wait for an ack before resend */
+#define EXPORT_MAX_RETRIES 8       /**< resends without progress, then abort */
+#define EXPORT_READ_TIMEOUT 20     /**< UART read timeout in binary mode, ms */
+
+/** Frame types */
+typedef enum {
+    EXPORT_FRAME_HEADER = 'H', /**< device: file size and name */
+    EXPORT_FRAME_DATA = 'D',   /**< device: file data at offset */
+    EXPORT_FRAME_END = 'E',    /**< device: transfer complete */
+    EXPORT_FRAME_ERROR = 'X',  /**< device: transfer failed, text payload */
+    EXPORT_FRAME_ACK = 'A',    /**< host: next offset expected */
+    EXPORT_FRAME_CANCEL = 'C', /**< host: stop the transfer */
+} ExportFrameType;
+
+/**
+ * Sends a file to the host. The UART must be open in binary mode without
+ * echo, with a read timeout of EXPORT_READ_TIMEOUT, and no other task may
+ * write to it during the transfer.
+ * @param uart: UART to send the file over
+ * @param filename: name of the file on the SD card
+ * @param offset: offset to start sending from, to resume a transfer
+ * @return 0 once the host acknowledged the whole file, or negative value on
+ *  error
+ */
+int export_file(UART_Handle uart, const char *filename, uint32_t offset);
+
+#endif /* EXPORT_H_ */
@@ -0,0 +1,44 @@
+/**
+ * @file flash_hal.h
+ * Access to the flash area reserved for the sample flash ring. The area is
+ * made of FLASHRING_SECTORS erasable sectors of FLASHRING_SECTOR_SIZE bytes.
+ * Like NOR flash, erasing sets every byte of a sector to 0xFF, and
+ * programming can only clear bits.
+ *
+ * flash_hal_msp432.c implements this for the MSP432 main flash. The host
+ * build in gcc-build/host uses a RAM image instead.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef FLASH_HAL_H_
+#define FLASH_HAL_H_
+
+#include <stdint.h>
+
+#define FLASHRING_SECTOR_SIZE 4096 /**< size of an erasable flash sector */
+#define FLASHRING_SECTORS 8        /**< sectors reserved for the ring */
+
+/**
+ * Gets the memory mapped start of the ring area, for reading
+ * @return pointer to the first byte of the ring area
+ */
+const uint8_t *flash_hal_base();
+
+/**
+ * Erases one sector of the ring area
+ * @param sector: sector index, 0 to FLASHRING_SECTORS - 1
+ * @return 0 on success, or negative value on error
+ */
+int flash_hal_erase(unsigned int sector);
+
+/**
+ * Programs data into the ring area
+ * @param offset: offset from the start of the ring area, 16 byte aligned
+ * @param data: data to program
+ * @param len: length of data, a multiple of 4
+ * @return 0 on success, or negative value on error
+ */
+int flash_hal_program(uint32_t offset, const void *data, unsigned int len);
+
+#endif /* FLASH_HAL_H_ */
@@ -0,0 +1,84 @@
+/**
+ * @file flash_hal_msp432.c
+ * Flash ring storage in the top FLASHRING_SECTORS sectors of MSP432 main
+ * flash bank 1. The linker scripts limit code and constants to bank 0, and
+ * fail the link if they do not fit, so the firmware keeps executing while
+ * bank 1 is erased or programmed.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdint.h>
+
+/* DriverLib Includes */
+#include <ti/devices/msp432p4xx/driverlib/driverlib.h>
+
+#include "flash_hal.h"
+
+/** Start of the ring area, must match the linker scripts */
+#define FLASHRING_BASE 0x00038000
+/** Start of main flash bank 1 */
+#define FLASH_BANK1_BASE 0x00020000
+
+static uint32_t sector_mask(unsigned int sector);
+
+/**
+ * Gets the memory mapped start of the ring area, for reading
+ * @return pointer to the first byte of the ring area
+ */
+const uint8_t *flash_hal_base() { return (const uint8_t *)FLASHRING_BASE; }
+
+/**
+ * Erases one sector of the ring area
+ * @param sector: sector index, 0 to FLASHRING_SECTORS - 1
+ * @return 0 on success, or negative value on error
+ */
+int flash_hal_erase(unsigned int sector) {
+    bool ok;
+
+    if (sector >= FLASHRING_SECTORS) {
+        return -1;
+    }
+    MAP_FlashCtl_unprotectSector(FLASH_MAIN_MEMORY_SPACE_BANK1,
+                                 sector_mask(sector));
+    ok = MAP_FlashCtl_eraseSector(FLASHRING_BASE +
+                                  sector * FLASHRING_SECTOR_SIZE);
+    MAP_FlashCtl_protectSector(FLASH_MAIN_MEMORY_SPACE_BANK1,
+                               sector_mask(sector));
+    return ok ? 0 : -1;
+}
+
+/**
+ * Programs data into the ring area
+ * @param offset: offset from the start of the ring area, 16 byte aligned
+ * @param data: data to program
+ * @param len: length of data, a multiple of 4
+ * @return 0 on success, or negative value on error
+ */
+int flash_hal_program(uint32_t offset, const void *data, unsigned int len) {
+    unsigned int sector = offset / FLASHRING_SECTOR_SIZE;
+    bool ok;
+
+    if (offset + len > FLASHRING_SECTORS * FLASHRING_SECTOR_SIZE ||
+        (offset + len - 1) / FLASHRING_SECTOR_SIZE != sector) {
+        return -1;
+    }
+    MAP_FlashCtl_unprotectSector(FLASH_MAIN_MEMORY_SPACE_BANK1,
+                                 sector_mask(sector));
+    ok = MAP_FlashCtl_programMemory(
+        (void *)data, (void *)(uintptr_t)(FLASHRING_BASE + offset), len);
+    MAP_FlashCtl_protectSector(FLASH_MAIN_MEMORY_SPACE_BANK1,
+                               sector_mask(sector));
+    return ok ? 0 : -1;
+}
+
+/**
+ * Gets the DriverLib protection mask of a ring sector. FLASH_SECTORn of a
+ * bank is bit n of the mask.
+ * @param sector: ring sector index
+ * @return sector mask for the FlashCtl protection functions
+ */
+static uint32_t sector_mask(unsigned int sector) {
+    return 1UL << ((FLASHRING_BASE - FLASH_BANK1_BASE) / FLASHRING_SECTOR_SIZE +
+                   sector);
+}
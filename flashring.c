@@ -0,0 +1,316 @@
+/**
+ * @file flashring.c
+ * Ring buffer of fixed size records in internal flash.
+ *
+ * Every ring sector in use starts with a SectorHeader holding a sequence
+ * number one higher than the sector before it, followed by 16 byte slots.
+ * A slot holds one record and the CRC-32 of the record, so a slot torn by a
+ * reset is skipped. Slots are filled in order, so the first erased slot of
+ * the newest sector is where the next record goes. At least one sector
+ * always has a header, which keeps the ring position across resets.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "flash_hal.h"
+#include "flashring.h"
+
+/** Magic value at the start of every sector in use ("FRNG") */
+#define RING_MAGIC 0x474E5246
+/** Size of a record slot */
+#define SLOT_SIZE 16
+/** Record slots in a sector */
+#define SLOTS_PER_SECTOR                                                       \
+    ((FLASHRING_SECTOR_SIZE - sizeof(SectorHeader)) / SLOT_SIZE)
+
+/** Header at the start of each ring sector in use */
+typedef struct {
+    uint32_t magic;    /**< RING_MAGIC */
+    uint32_t seq;      /**< sequence number of sector */
+    uint32_t seq_inv;  /**< ~seq, catches a header torn by a reset */
+    uint32_t reserved; /**< pads header to a slot, left erased */
+} SectorHeader;
+
+/** Record slot */
+typedef struct {
+    uint8_t record[FLASHRING_RECORD_SIZE]; /**< stored record */
+    uint32_t crc;                          /**< CRC-32 of record */
+} Slot;
+
+static const SectorHeader *sector_header(unsigned int sector);
+static const Slot *sector_slot(unsigned int sector, unsigned int slot);
+static bool is_erased(const void *data, unsigned int len);
+static bool slot_valid(const Slot *slot);
+static bool header_valid(unsigned int sector);
+static unsigned int count_records(unsigned int sector, unsigned int slots);
+static int open_sector(unsigned int sector, uint32_t seq);
+
+/** Sector records are appended to */
+static unsigned int head;
+/** Sequence number of head sector */
+static uint32_t head_seq;
+/** Next free slot in head sector */
+static unsigned int head_slot;
+/** Sector holding the oldest records */
+static unsigned int tail;
+/** Number of valid records in the ring */
+static uint32_t record_count;
+/** Records dropped because the ring was full */
+static uint32_t dropped_count;
+
+/**
+ * Finds the ring's oldest and newest records after a reset. Must be called
+ * before any other ring function.
+ * @return 0 on success, or negative value on flash error
+ */
+int flashring_init() {
+    unsigned int sector, prev, i;
+    bool found = false;
+
+    for (sector = 0; sector < FLASHRING_SECTORS; sector++) {
+        if (header_valid(sector) &&
+            (!found || sector_header(sector)->seq > head_seq)) {
+            head = sector;
+            head_seq = sector_header(sector)->seq;
+            found = true;
+        }
+    }
+    record_count = 0;
+    if (!found) {
+        // Blank or unreadable ring, start over
+        tail = head = 0;
+        head_seq = 1;
+        head_slot = 0;
+        return open_sector(head, head_seq);
+    }
+    // The oldest sector ends the run of consecutive sequence numbers
+    tail = head;
+    while (1) {
+        prev = (tail + FLASHRING_SECTORS - 1) % FLASHRING_SECTORS;
+        if (prev == head || !header_valid(prev) ||
+            sector_header(prev)->seq != sector_header(tail)->seq - 1) {
+            break;
+        }
+        tail = prev;
+    }
+    head_slot = 0;
+    for (i = SLOTS_PER_SECTOR; i > 0; i--) {
+        if (!is_erased(sector_slot(head, i - 1), SLOT_SIZE)) {
+            head_slot = i;
+            break;
+        }
+    }
+    for (sector = tail; sector != head;
+         sector = (sector + 1) % FLASHRING_SECTORS) {
+        record_count += count_records(sector, SLOTS_PER_SECTOR);
+    }
+    record_count += count_records(head, head_slot);
+    return 0;
+}
+
+/**
+ * Appends a record to the ring. If the ring is full, the sector holding the
+ * oldest records is dropped to make room.
+ * @param record: FLASHRING_RECORD_SIZE byte record to store
+ * @return 0 on success, or negative value on flash error
+ */
+int flashring_append(const void *record) {
+    unsigned int next, dropped;
+    Slot slot;
+
+    if (head_slot == SLOTS_PER_SECTOR) {
+        next = (head + 1) % FLASHRING_SECTORS;
+        if (next == tail) {
+            // Ring is full, give up the oldest sector
+            dropped = count_records(tail, SLOTS_PER_SECTOR);
+            record_count -= dropped;
+            dropped_count += dropped;
+            tail = (tail + 1) % FLASHRING_SECTORS;
+        }
+        if (open_sector(next, head_seq + 1) < 0) {
+            return -1;
+        }
+        head = next;
+        head_seq++;
+        head_slot = 0;
+    }
+    memcpy(slot.record, record, FLASHRING_RECORD_SIZE);
+    slot.crc = crc32(slot.record, FLASHRING_RECORD_SIZE);
+    // A failed slot is left behind, its CRC will not match
+    head_slot++;
+    if (flash_hal_program(head * FLASHRING_SECTOR_SIZE + sizeof(SectorHeader) +
+                              (head_slot - 1) * SLOT_SIZE,
+                          &slot, SLOT_SIZE) < 0) {
+        return -1;
+    }
+    record_count++;
+    return 0;
+}
+
+/**
+ * Removes all records from the ring, oldest first. After all records of a
+ * sector were passed to store, sync is called, and the sector is erased only
+ * if sync succeeds. Records of a sector may be stored again if an error or
+ * reset interrupts the drain before the sector is erased.
+ * @param store: called with each record, returns negative value on error
+ * @param sync: called to make the stored records durable, returns negative
+ *  value on error
+ * @param arg: passed to store and sync
+ * @return number of records drained, or negative value on error
+ */
+int flashring_drain(int (*store)(const void *record, void *arg),
+                    int (*sync)(void *arg), void *arg) {
+    unsigned int sector, slots, i, next;
+    const Slot *slot;
+    int count = 0;
+
+    if (tail == head && head_slot == 0) {
+        return 0; // Nothing stored
+    }
+    while (1) {
+        sector = tail;
+        slots = (sector == head) ? head_slot : SLOTS_PER_SECTOR;
+        for (i = 0; i < slots; i++) {
+            slot = sector_slot(sector, i);
+            if (slot_valid(slot)) {
+                if (store(slot->record, arg) < 0) {
+                    return -1;
+                }
+                count++;
+            }
+        }
+        if (sync(arg) < 0) {
+            return -1;
+        }
+        if (sector == head) {
+            // Move on to a fresh sector before erasing the last one
+            next = (head + 1) % FLASHRING_SECTORS;
+            if (open_sector(next, head_seq + 1) < 0 ||
+                flash_hal_erase(head) < 0) {
+                return -1;
+            }
+            head = tail = next;
+            head_seq++;
+            head_slot = 0;
+            record_count = 0;
+            return count;
+        }
+        record_count -= count_records(sector, SLOTS_PER_SECTOR);
+        if (flash_hal_erase(sector) < 0) {
+            return -1;
+        }
+        tail = (tail + 1) % FLASHRING_SECTORS;
+    }
+}
+
+/**
+ * Gets the number of records in the ring
+ * @return number of records waiting to be drained
+ */
+uint32_t flashring_count() { return record_count; }
+
+/**
+ * Gets the number of records dropped because the ring was full, since boot
+ * @return number of dropped records
+ */
+uint32_t flashring_dropped() { return dropped_count; }
+
+/**
+ * Gets the header of a ring sector
+ * @param sector: sector index
+ * @return pointer to the sector header in flash
+ */
+static const SectorHeader *sector_header(unsigned int sector) {
+    return (const SectorHeader *)(flash_hal_base() +
+                                  sector * FLASHRING_SECTOR_SIZE);
+}
+
+/**
+ * Gets a record slot of a ring sector
+ * @param sector: sector index
+ * @param slot: slot index in sector
+ * @return pointer to the slot in flash
+ */
+static const Slot *sector_slot(unsigned int sector, unsigned int slot) {
+    return (const Slot *)(flash_hal_base() + sector * FLASHRING_SECTOR_SIZE +
+                          sizeof(SectorHeader) + slot * SLOT_SIZE);
+}
+
+/**
+ * Checks if flash is erased
+ * @param data: flash to check
+ * @param len: number of bytes to check
+ * @return true if every byte is 0xFF
+ */
+static bool is_erased(const void *data, unsigned int len) {
+    const uint8_t *bytes = data;
+    while (len--) {
+        if (*bytes++ != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Checks if a slot holds a complete record
+ * @param slot: slot to check
+ * @return true if the slot's CRC matches its record
+ */
+static bool slot_valid(const Slot *slot) {
+    return !is_erased(slot, SLOT_SIZE) &&
+           crc32(slot->record, FLASHRING_RECORD_SIZE) == slot->crc;
+}
+
+/**
+ * Checks if a sector is in use by the ring
+ * @param sector: sector index
+ * @return true if the sector has a valid header
+ */
+static bool header_valid(unsigned int sector) {
+    const SectorHeader *header = sector_header(sector);
+    return header->magic == RING_MAGIC && header->seq_inv == ~header->seq;
+}
+
+/**
+ * Counts the valid records in the first slots of a sector
+ * @param sector: sector index
+ * @param slots: number of slots to check
+ * @return number of valid records
+ */
+static unsigned int count_records(unsigned int sector, unsigned int slots) {
+    unsigned int i, count = 0;
+    for (i = 0; i < slots; i++) {
+        if (slot_valid(sector_slot(sector, i))) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Prepares a sector to receive records, erasing it if needed and writing its
+ * header
+ * @param sector: sector index
+ * @param seq: sequence number of sector
+ * @return 0 on success, or negative value on flash error
+ */
+static int open_sector(unsigned int sector, uint32_t seq) {
+    SectorHeader header;
+
+    if (!is_erased(sector_header(sector), FLASHRING_SECTOR_SIZE) &&
+        flash_hal_erase(sector) < 0) {
+        return -1;
+    }
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = RING_MAGIC;
+    header.seq = seq;
+    header.seq_inv = ~seq;
+    return flash_hal_program(sector * FLASHRING_SECTOR_SIZE, &header,
+                             sizeof(header));
+}
@@ -0,0 +1,61 @@
+/**
+ * @file flashring.h
+ * Ring buffer of fixed size records in internal flash, used to keep sensor
+ * samples while the SD card is missing or failing. Records are appended to
+ * one sector at a time, moving around all ring sectors so they wear evenly.
+ * Once the card is back, the ring is drained oldest first and each sector
+ * is erased only after its records are safely on the card.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef FLASHRING_H_
+#define FLASHRING_H_
+
+#include <stdint.h>
+
+/** Size of a record stored in the ring */
+#define FLASHRING_RECORD_SIZE 12
+
+/**
+ * Finds the ring's oldest and newest records after a reset. Must be called
+ * before any other ring function.
+ * @return 0 on success, or negative value on flash error
+ */
+int flashring_init();
+
+/**
+ * Appends a record to the ring. If the ring is full, the sector holding the
+ * oldest records is dropped to make room.
+ * @param record: FLASHRING_RECORD_SIZE byte record to store
+ * @return 0 on success, or negative value on flash error
+ */
+int flashring_append(const void *record);
+
+/**
+ * Removes all records from the ring, oldest first. After all records of a
+ * sector were passed to store, sync is called, and the sector is erased only
+ * if sync succeeds. Records of a sector may be stored again if an error or
+ * reset interrupts the drain before the sector is erased.
+ * @param store: called with each record, returns negative value on error
+ * @param sync: called to make the stored records durable, returns negative
+ *  value on error
+ * @param arg: passed to store and sync
+ * @return number of records drained, or negative value on error
+ */
+int flashring_drain(int (*store)(const void *record, void *arg),
+                    int (*sync)(void *arg), void *arg);
+
+/**
+ * Gets the number of records in the ring
+ * @return number of records waiting to be drained
+ */
+uint32_t flashring_count();
+
+/**
+ * Gets the number of records dropped because the ring was full, since boot
+ * @return number of dropped records
+ */
+uint32_t flashring_dropped();
+
+#endif /* FLASHRING_H_ */
@@ -0,0 +1,60 @@
+/*
+ * FatFs configuration for host builds of storage.c. The makefile copies the
+ * FatFs sources from FATFS_DIR next to this file, so it is used in place of
+ * the SDK's ffconf.h. Options match what the firmware relies on: long names
+ * off (all names are 8.3), f_expand() on, no locking (storage.c serializes
+ * FatFs calls with its SD card mutex). Works with FatFs R0.13 to R0.15.
+ */
+
+/* Accept any FatFs revision */
+#define FFCONF_DEF FF_DEFINED
+
+/* Function configuration */
+#define FF_FS_READONLY 0
+#define FF_FS_MINIMIZE 0
+#define FF_USE_FIND 0
+#define FF_USE_MKFS 0
+#define FF_USE_FASTSEEK 0
+#define FF_USE_EXPAND 1
+#define FF_USE_CHMOD 0
+#define FF_USE_LABEL 0
+#define FF_USE_FORWARD 0
+#define FF_USE_STRFUNC 0
+#define FF_PRINT_LLI 0
+#define FF_PRINT_FLOAT 0
+#define FF_STRF_ENCODE 0
+
+/* Locale and namespace configuration */
+#define FF_CODE_PAGE 437
+#define FF_USE_LFN 0
+#define FF_MAX_LFN 255
+#define FF_LFN_UNICODE 0
+#define FF_LFN_BUF 255
+#define FF_SFN_BUF 12
+#define FF_FS_RPATH 0
+#define FF_PATH_DEPTH 10
+
+/* Drive/volume configuration */
+#define FF_VOLUMES 1
+#define FF_STR_VOLUME_ID 0
+#define FF_VOLUME_STRS "SD"
+#define FF_MULTI_PARTITION 0
+#define FF_MIN_SS 512
+#define FF_MAX_SS 512
+#define FF_LBA64 0
+#define FF_MIN_GPT 0x10000000
+#define FF_USE_TRIM 0
+
+/* System configuration */
+#define FF_FS_TINY 0
+#define FF_FS_EXFAT 0
+#define FF_FS_NORTC 0
+#define FF_NORTC_MON 1
+#define FF_NORTC_MDAY 1
+#define FF_NORTC_YEAR 2026
+#define FF_FS_CRTIME 0
+#define FF_FS_NOFSINFO 0
+#define FF_FS_LOCK 0
+#define FF_FS_REENTRANT 0
+#define FF_FS_TIMEOUT 1000
+#define FF_SYNC_t void *
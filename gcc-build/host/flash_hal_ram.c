@@ -0,0 +1,100 @@
+/**
+ * @file flash_hal_ram.c
+ * Host implementation of flash_hal.h on a RAM image. Like NOR flash,
+ * programming can only clear bits, so a bad write shows up the same way it
+ * would on the MSP432.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "flash_hal.h"
+#include "flash_hal_ram.h"
+
+static int power_fail();
+
+/** Flash image, starts erased */
+static uint8_t image[FLASHRING_SECTORS * FLASHRING_SECTOR_SIZE];
+static int image_ready;
+/** Erase count of each sector */
+static uint32_t erase_counts[FLASHRING_SECTORS];
+/** Operations left before a power cut, negative for none */
+static long ops_left = -1;
+/** Set once power is cut */
+static int powered_off;
+
+const uint8_t *flash_hal_base() {
+    if (!image_ready) {
+        memset(image, 0xFF, sizeof(image));
+        image_ready = 1;
+    }
+    return image;
+}
+
+int flash_hal_erase(unsigned int sector) {
+    uint8_t *start = (uint8_t *)flash_hal_base() + sector * FLASHRING_SECTOR_SIZE;
+
+    if (sector >= FLASHRING_SECTORS || powered_off) {
+        return -1;
+    }
+    if (power_fail()) {
+        // Erase stopped halfway
+        memset(start, 0xFF, FLASHRING_SECTOR_SIZE / 2);
+        return -1;
+    }
+    memset(start, 0xFF, FLASHRING_SECTOR_SIZE);
+    erase_counts[sector]++;
+    return 0;
+}
+
+int flash_hal_program(uint32_t offset, const void *data, unsigned int len) {
+    uint8_t *dest = (uint8_t *)flash_hal_base() + offset;
+    const uint8_t *src = data;
+    unsigned int i;
+
+    if (offset + len > sizeof(image) || offset % 16 || len % 4 ||
+        powered_off) {
+        return -1;
+    }
+    if (power_fail()) {
+        // Program stopped halfway
+        len /= 2;
+        for (i = 0; i < len; i++) {
+            dest[i] &= src[i];
+        }
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        dest[i] &= src[i];
+    }
+    return 0;
+}
+
+void flash_hal_ram_power_cut(long ops) {
+    ops_left = ops;
+    powered_off = 0;
+}
+
+int flash_hal_ram_powered_off() { return powered_off; }
+
+uint32_t flash_hal_ram_erase_count(unsigned int sector) {
+    return erase_counts[sector];
+}
+
+/**
+ * Counts down to a power cut
+ * @return nonzero if power is cut during this operation
+ */
+static int power_fail() {
+    if (ops_left == 0) {
+        powered_off = 1;
+        ops_left = -1;
+        return 1;
+    }
+    if (ops_left > 0) {
+        ops_left--;
+    }
+    return 0;
+}
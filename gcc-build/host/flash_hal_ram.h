@@ -0,0 +1,35 @@
+/**
+ * @file flash_hal_ram.h
+ * Host implementation of flash_hal.h on a RAM image, with the hooks the
+ * simulator uses to inspect wear and cut power.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef FLASH_HAL_RAM_H_
+#define FLASH_HAL_RAM_H_
+
+#include <stdint.h>
+
+/**
+ * Simulates a power cut: after ops more successful erase or program
+ * operations, the next one stops halfway and fails, as do all later ones
+ * until flash_hal_ram_power_cut is called again.
+ * @param ops: operations before the cut, or negative value for no cut
+ */
+void flash_hal_ram_power_cut(long ops);
+
+/**
+ * Checks if the simulated power is off
+ * @return nonzero if a power cut happened
+ */
+int flash_hal_ram_powered_off();
+
+/**
+ * Gets the number of times a sector was erased
+ * @param sector: sector index
+ * @return erase count of sector
+ */
+uint32_t flash_hal_ram_erase_count(unsigned int sector);
+
+#endif /* FLASH_HAL_RAM_H_ */
@@ -0,0 +1,184 @@
+/**
+ * @file flashring_sim.c
+ * Host simulation of the flash ring (flashring.c) on a RAM flash image.
+ * Runs rounds of SD card outages, during which samples go to the ring, each
+ * followed by a drain to a simulated card. Power is cut at random points,
+ * both while filling and while draining, and the ring is reinitialized as
+ * after a reset.
+ *
+ * Checks that the card receives every sample that was not dropped for lack
+ * of space, in order, and that no sample is stored twice outside of drains
+ * cut by a reset. Prints erase counts to show wear levelling.
+ *
+ * Usage: flashring_sim [rounds [seed]]
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flash_hal.h"
+#include "flash_hal_ram.h"
+#include "flashring.h"
+
+/** Sample stored in the ring, same size as a storage DataRecord */
+typedef struct {
+    uint32_t seq;   /**< sample number, increasing */
+    uint32_t time;  /**< timestamp of sample */
+    float distance; /**< sample value */
+} Sample;
+
+/** Simulated SD card */
+typedef struct {
+    uint32_t last_seq;   /**< last sample number stored */
+    uint32_t stored;     /**< samples stored, without duplicates */
+    uint32_t duplicates; /**< samples stored again after a cut drain */
+    uint32_t errors;     /**< samples out of order */
+} Card;
+
+static void reboot();
+static int card_store(const void *record, void *arg);
+static int card_sync(void *arg);
+
+int main(int argc, char **argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 1000;
+    unsigned int seed = argc > 2 ? (unsigned int)atol(argv[2]) : 1;
+    uint32_t appended = 0, failed = 0, next_seq = 1, min_erase, max_erase;
+    uint32_t lost_to_cuts = 0, prev_count;
+    Card card;
+    Sample sample;
+    long round, outage, i;
+    unsigned int sector;
+    int drained;
+
+    srand(seed);
+    memset(&card, 0, sizeof(card));
+    if (flashring_init() < 0) {
+        printf("init failed\n");
+        return 1;
+    }
+    for (round = 0; round < rounds; round++) {
+        // Card is out for up to a bit more than the ring holds
+        outage = rand() % 2500;
+        if (rand() % 5 == 0) {
+            flash_hal_ram_power_cut(rand() % (outage / 200 + 2));
+        }
+        for (i = 0; i < outage; i++) {
+            sample.seq = next_seq++;
+            sample.time = sample.seq * 60;
+            sample.distance = (float)(rand() % 4000) / 10.0f;
+            if (flashring_append(&sample) == 0) {
+                appended++;
+            } else {
+                failed++;
+            }
+            if (flash_hal_ram_powered_off()) {
+                reboot();
+            }
+        }
+        // Card is back, drain it, possibly cut by a reset
+        if (rand() % 5 == 0) {
+            flash_hal_ram_power_cut(rand() % 4);
+        }
+        while (1) {
+            prev_count = flashring_count();
+            drained = flashring_drain(card_store, card_sync, &card);
+            if (drained >= 0) {
+                break;
+            }
+            if (!flash_hal_ram_powered_off()) {
+                printf("drain failed without a power cut\n");
+                return 1;
+            }
+            reboot();
+            // A cut drain may leave fewer records, never more
+            if (flashring_count() > prev_count) {
+                printf("ring grew across a reset\n");
+                return 1;
+            }
+        }
+        flash_hal_ram_power_cut(-1);
+        if (flashring_count() != 0) {
+            printf("ring not empty after drain\n");
+            return 1;
+        }
+    }
+    // Only a reset while erasing the oldest sector of a full ring loses samples
+    lost_to_cuts = appended - card.stored - flashring_dropped();
+
+    min_erase = max_erase = flash_hal_ram_erase_count(0);
+    printf("erase counts:");
+    for (sector = 0; sector < FLASHRING_SECTORS; sector++) {
+        uint32_t count = flash_hal_ram_erase_count(sector);
+        printf(" %u", (unsigned int)count);
+        if (count < min_erase) {
+            min_erase = count;
+        }
+        if (count > max_erase) {
+            max_erase = count;
+        }
+    }
+    printf("\n");
+    printf("rounds %ld, appended %u, failed appends %u\n", rounds,
+           (unsigned int)appended, (unsigned int)failed);
+    printf("stored %u, dropped when full %u, lost to resets %u, "
+           "duplicates %u, out of order %u\n",
+           (unsigned int)card.stored, (unsigned int)flashring_dropped(),
+           (unsigned int)lost_to_cuts, (unsigned int)card.duplicates,
+           (unsigned int)card.errors);
+    // Wear should stay within about 5% across sectors
+    if (card.errors || card.stored + flashring_dropped() > appended ||
+        max_erase - min_erase > min_erase / 20 + 2) {
+        printf("FAIL\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
+
+/**
+ * Simulates a reset: power comes back and the ring is found again
+ */
+static void reboot() {
+    flash_hal_ram_power_cut(-1);
+    if (flashring_init() < 0) {
+        printf("init after reset failed\n");
+        exit(1);
+    }
+}
+
+/**
+ * Stores a drained sample on the simulated card
+ * @param record: sample to store
+ * @param arg: card
+ * @return 0
+ */
+static int card_store(const void *record, void *arg) {
+    Card *card = arg;
+    Sample sample;
+
+    memcpy(&sample, record, sizeof(sample));
+    if (sample.seq <= card->last_seq) {
+        card->duplicates++;
+    } else {
+        card->last_seq = sample.seq;
+        card->stored++;
+    }
+    if (sample.time != sample.seq * 60) {
+        card->errors++;
+    }
+    return 0;
+}
+
+/**
+ * Syncs the simulated card
+ * @param arg: card
+ * @return 0
+ */
+static int card_sync(void *arg) {
+    (void)arg;
+    return 0;
+}
@@ -0,0 +1,299 @@
+/**
+ * @file garmin_sim.c
+ * Simulated Garmin LIDAR-Lite behind the TI I2C driver calls, see
+ * garmin_sim.h.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "garmin_sim.h"
+#include "tirtos_host.h"
+
+///@{
+/** Registers of the sensor that are modeled */
+#define REG_ACQ_COMMANDS 0x00
+#define REG_STATUS 0x01
+#define REG_FULL_DELAY_LOW 0x10
+#define REG_FULL_DELAY_HIGH 0x11
+#define REG_MEASUREMENT_INTERVAL 0xE3
+///@}
+/** ACQ_COMMANDS value that starts a measurement */
+#define ACQ_START 0x04
+/** STATUS bit set while a measurement runs */
+#define STATUS_BUSY 0x01
+/** Bits on the bus per byte, including the ACK */
+#define BITS_PER_BYTE 9
+
+/** I2C driver instance */
+struct I2C_Config {
+    I2C_Params params;     /**< parameters the bus was opened with */
+    I2C_Transaction *hung; /**< transfer waiting for I2C_cancel() */
+};
+
+static bool run_transfer(I2C_Transaction *transaction);
+static void update_measurements(uint64_t now);
+static void set_result(uint64_t started);
+static uint8_t read_register(uint8_t reg);
+static void write_register(uint8_t reg, uint8_t value);
+
+static struct I2C_Config bus;
+static bool bus_open;
+/** Register file */
+static uint8_t registers[256];
+/** Register the next read starts at */
+static uint8_t reg_pointer;
+/** Measurement time in us */
+static uint32_t measure_us = 5000;
+/** Distance returned by measurements, in cm */
+static uint16_t distance_cm = 250;
+/** Amplitude of the simulated waves in cm, and their period in us */
+static double wave_amplitude_cm;
+static uint64_t wave_period_us;
+/** Virtual time the running or first burst measurement started at */
+static uint64_t measure_start;
+/** Virtual time the running single measurement ends at */
+static uint64_t measure_end;
+/** A single measurement is running */
+static bool measuring;
+/** Time between burst measurements, 0 when not bursting */
+static uint64_t auto_interval_us;
+/** Burst measurements finished so far */
+static uint64_t auto_done;
+/** Virtual time the measurement in the result registers started at */
+static uint64_t result_start;
+/** The result registers hold a distance that has not been read yet */
+static bool result_fresh;
+/** Transfers numbered fail_after + 1 to fail_after + fail_count fail */
+static uint32_t fail_after, fail_count;
+/** Transfer number that hangs, 0 for none */
+static uint32_t hang_at;
+static GarminSimStats stats;
+
+void garmin_sim_set_measure_time(uint32_t us) { measure_us = us; }
+
+void garmin_sim_set_distance(uint16_t cm) { distance_cm = cm; }
+
+void garmin_sim_set_waves(uint16_t amplitude_cm, uint32_t period_ms) {
+    wave_amplitude_cm = amplitude_cm;
+    wave_period_us = period_ms * 1000ULL;
+}
+
+void garmin_sim_fail_transfers(uint32_t after, uint32_t count) {
+    fail_after = after;
+    fail_count = count;
+}
+
+void garmin_sim_hang_transfer(uint32_t after) {
+    hang_at = after ? after + 1 : 0;
+}
+
+void garmin_sim_get_stats(GarminSimStats *out) { *out = stats; }
+
+void I2C_Params_init(I2C_Params *params) {
+    memset(params, 0, sizeof(*params));
+    params->transferMode = I2C_MODE_BLOCKING;
+    params->bitRate = I2C_100kHz;
+}
+
+I2C_Handle I2C_open(uint_least8_t index, I2C_Params *params) {
+    (void)index;
+    if (bus_open) {
+        return NULL; // Already open, as with the TI driver
+    }
+    bus.params = *params;
+    bus.hung = NULL;
+    bus_open = true;
+    return &bus;
+}
+
+bool I2C_transfer(I2C_Handle handle, I2C_Transaction *transaction) {
+    bool status;
+
+    if (handle->hung) {
+        return false; // A transfer is still in progress
+    }
+    stats.transfers++;
+    if (stats.transfers == hang_at) {
+        stats.hangs++;
+        if (handle->params.transferMode == I2C_MODE_BLOCKING) {
+            // A blocking transfer on a hung bus never returns
+            System_abort("I2C transfer hung in blocking mode\n");
+        }
+        handle->hung = transaction;
+        return true;
+    }
+    status = run_transfer(transaction);
+    if (handle->params.transferMode == I2C_MODE_CALLBACK) {
+        handle->params.transferCallbackFxn(handle, transaction, status);
+        return true;
+    }
+    return status;
+}
+
+void I2C_cancel(I2C_Handle handle) {
+    I2C_Transaction *transaction = handle->hung;
+
+    if (transaction) {
+        stats.cancels++;
+        handle->hung = NULL;
+        handle->params.transferCallbackFxn(handle, transaction, false);
+    }
+}
+
+/**
+ * Moves a transaction over the simulated bus
+ * @param transaction: transaction to run
+ * @return true if the sensor acknowledged it
+ */
+static bool run_transfer(I2C_Transaction *transaction) {
+    uint32_t bytes = 1 + transaction->writeCount + transaction->readCount;
+    uint32_t bit_rate = bus.params.bitRate == I2C_400kHz ? 400000 : 100000;
+    const uint8_t *tx = transaction->writeBuf;
+    uint8_t *rx = transaction->readBuf;
+    uint64_t bus_us;
+    size_t i;
+
+    if (transaction->readCount) {
+        bytes++; // Repeated start with the address again
+    }
+    bus_us = (uint64_t)bytes * BITS_PER_BYTE * 1000000 / bit_rate;
+    stats.bus_us += bus_us;
+    tirtos_host_advance_us(bus_us);
+    if (transaction->slaveAddress != GARMIN_SIM_ADDRESS ||
+        (stats.transfers > fail_after &&
+         stats.transfers <= fail_after + fail_count)) {
+        stats.nacks++;
+        return false;
+    }
+    if (transaction->writeCount) {
+        reg_pointer = tx[0];
+        for (i = 1; i < transaction->writeCount; i++) {
+            write_register(reg_pointer++, tx[i]);
+        }
+    }
+    for (i = 0; i < transaction->readCount; i++) {
+        rx[i] = read_register(reg_pointer++);
+    }
+    return true;
+}
+
+/**
+ * Finishes the measurements due by now, putting the newest distance in the
+ * result registers
+ * @param now: virtual time in us
+ */
+static void update_measurements(uint64_t now) {
+    uint64_t done, started;
+
+    if (auto_interval_us) {
+        if (now < measure_start + measure_us) {
+            return;
+        }
+        done = (now - measure_start - measure_us) / auto_interval_us + 1;
+        if (done == auto_done) {
+            return;
+        }
+        stats.measurements += done - auto_done;
+        auto_done = done;
+        started = measure_start + (done - 1) * auto_interval_us;
+    } else {
+        if (!measuring || now < measure_end) {
+            return;
+        }
+        measuring = false;
+        started = measure_start;
+    }
+    set_result(started);
+}
+
+/**
+ * Puts the distance of a finished measurement in the result registers
+ * @param started: virtual time the measurement started at, in us
+ */
+static void set_result(uint64_t started) {
+    uint64_t ended = started + measure_us;
+    double cm = distance_cm;
+
+    if (wave_period_us) {
+        cm += wave_amplitude_cm *
+              sin(2 * M_PI * (double)(ended % wave_period_us) / wave_period_us);
+    }
+    cm = cm < 0 ? 0 : cm > 0xFFFF ? 0xFFFF : cm;
+    registers[REG_FULL_DELAY_LOW] = (uint16_t)cm & 0xFF;
+    registers[REG_FULL_DELAY_HIGH] = (uint16_t)cm >> 8;
+    result_start = started;
+    result_fresh = true;
+}
+
+/**
+ * Reads a register, updating the measurement state first. Until a
+ * measurement ends, the previous distance is read; while a triggered
+ * measurement runs, such reads are not counted, as the busy flag read with
+ * them tells the driver to ignore them.
+ * @param reg: register address
+ * @return register value
+ */
+static uint8_t read_register(uint8_t reg) {
+    uint64_t now = tirtos_host_time_us();
+
+    update_measurements(now);
+    if (reg == REG_STATUS) {
+        stats.status_reads++;
+        if (auto_interval_us) {
+            return (now - measure_start) % auto_interval_us < measure_us
+                       ? STATUS_BUSY
+                       : 0;
+        }
+        return measuring ? STATUS_BUSY : 0;
+    }
+    if (reg == REG_FULL_DELAY_HIGH && !measuring) {
+        if (result_fresh) {
+            result_fresh = false;
+            stats.results++;
+            stats.result_us += now - result_start;
+        } else {
+            stats.stale_reads++;
+        }
+    }
+    return registers[reg];
+}
+
+/**
+ * Writes a register. ACQ_START starts one measurement, or measurements
+ * every MEASUREMENT_INTERVAL ms (back to back if a measurement takes
+ * longer) if that is not 0. Setting MEASUREMENT_INTERVAL to 0 stops them.
+ * @param reg: register address
+ * @param value: value written
+ */
+static void write_register(uint8_t reg, uint8_t value) {
+    uint64_t now = tirtos_host_time_us();
+
+    update_measurements(now);
+    registers[reg] = value;
+    if (reg == REG_ACQ_COMMANDS && value == ACQ_START) {
+        measure_start = now;
+        if (registers[REG_MEASUREMENT_INTERVAL]) {
+            // The sensor cannot start a measurement before the last ended
+            auto_interval_us = registers[REG_MEASUREMENT_INTERVAL] * 1000ULL;
+            if (auto_interval_us < measure_us) {
+                auto_interval_us = measure_us;
+            }
+            auto_done = 0;
+            measuring = false;
+        } else {
+            stats.measurements++;
+            measure_end = now + measure_us;
+            measuring = true;
+        }
+    } else if (reg == REG_MEASUREMENT_INTERVAL && value == 0) {
+        auto_interval_us = 0;
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file garmin_sim.h
+ * Simulated Garmin LIDAR-Lite on the I2C bus, for host builds of lidar.c.
+ * Implements the TI I2C driver calls of tirtos_host.h against a register
+ * model of the sensor: writing 0x04 to ACQ_COMMANDS starts a measurement,
+ * the STATUS busy bit stays set for the measurement time, then FULL_DELAY
+ * holds the distance in cm. If MEASUREMENT_INTERVAL is not 0, the start
+ * command instead starts a burst: a measurement every MEASUREMENT_INTERVAL
+ * ms, or back to back if a measurement takes longer, until
+ * MEASUREMENT_INTERVAL is set to 0. The distance can follow
+ * simulated waves. Bus time moves the virtual clock forward, and
+ * transfers can be made to fail (NACK) or hang until canceled, to exercise
+ * error and timeout paths.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef GARMIN_SIM_H_
+#define GARMIN_SIM_H_
+
+#include <stdint.h>
+
+/** I2C address the simulated sensor answers on */
+#define GARMIN_SIM_ADDRESS 0x62
+
+/** Counters of bus activity */
+typedef struct {
+    uint32_t transfers;    /**< I2C_transfer() calls */
+    uint32_t status_reads; /**< reads of the STATUS register */
+    uint32_t measurements; /**< measurements started */
+    uint32_t results;      /**< new distances read after a measurement */
+    uint32_t stale_reads;  /**< distances read a second time, when idle */
+    uint32_t nacks;        /**< transfers failed on purpose */
+    uint32_t hangs;        /**< transfers hung on purpose */
+    uint32_t cancels;      /**< hung transfers ended by I2C_cancel() */
+    uint64_t bus_us;       /**< simulated time spent on the bus */
+    uint64_t result_us;    /**< total time from start to distance read */
+} GarminSimStats;
+
+/**
+ * Sets the time a measurement takes
+ * @param us: time from the start command until STATUS is no longer busy
+ */
+void garmin_sim_set_measure_time(uint32_t us);
+
+/**
+ * Sets the distance measurements return
+ * @param cm: distance in cm
+ */
+void garmin_sim_set_distance(uint16_t cm);
+
+/**
+ * Makes the distance rise and fall around the one set with
+ * garmin_sim_set_distance()
+ * @param amplitude_cm: height of the waves above and below it
+ * @param period_ms: wave period, 0 for a still surface
+ */
+void garmin_sim_set_waves(uint16_t amplitude_cm, uint32_t period_ms);
+
+/**
+ * Makes transfers fail with a NACK
+ * @param after: number of transfers that succeed first
+ * @param count: number of transfers that then fail
+ */
+void garmin_sim_fail_transfers(uint32_t after, uint32_t count);
+
+/**
+ * Makes one transfer hang: its callback is only called, with a failed
+ * status, when the transfer is canceled
+ * @param after: number of transfers that succeed first, 0 for none
+ */
+void garmin_sim_hang_transfer(uint32_t after);
+
+/**
+ * Reads the bus counters
+ * @param stats: set to the counters since the simulation started
+ */
+void garmin_sim_get_stats(GarminSimStats *stats);
+
+#endif /* GARMIN_SIM_H_ */
@@ -0,0 +1,173 @@
+/**
+ * @file lidar_sim.c
+ * Host run of the lidar task (lidar.c) against a simulated Garmin lidar on
+ * the I2C bus. Requests samples as the main task does, and prints the
+ * samples stored, then the bus activity they took, see garmin_sim.h.
+ *
+ * Usage: lidar_sim [options] SAMPLES
+ * Options:
+ *  - -m US: measurement time of the sensor (default 5000)
+ *  - -d CM: distance the sensor measures (default 250)
+ *  - -e AFTER,COUNT: fail COUNT transfers after AFTER transfers
+ *  - -h AFTER: hang the transfer after AFTER transfers
+ *  - -b: use the sensor's burst mode (LidarBurstMode)
+ *  - -s MS: time between samples averaged together (LidarSampleSpacing)
+ *  - -n COUNT: samples averaged together (LidarSampleCount)
+ *  - -w AMP,PERIOD: waves of AMP cm every PERIOD ms on the surface
+ *  - -v: print lidar task output
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "config.h"
+#include "garmin_sim.h"
+#include "lidar.h"
+#include "tirtos_host.h"
+
+static void usage();
+
+/** Configuration used by lidar.c */
+ProgramConfiguration program_config = CONFIG_DEFAULTS;
+/** Watchdog handle, unused on the host */
+Watchdog_Handle watchdogHandle;
+/** Samples passed to store_sensor_data() */
+static long stored;
+
+int main(int argc, char *argv[]) {
+    unsigned long fail_after = 0, fail_count = 0, hang_after = 0;
+    unsigned long wave_amplitude, wave_period;
+    GarminSimStats stats;
+    Task_Params params;
+    uint64_t start;
+    long samples, i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:d:e:h:bs:n:w:v")) != -1) {
+        switch (opt) {
+        case 'm':
+            garmin_sim_set_measure_time(strtoul(optarg, NULL, 10));
+            break;
+        case 'd':
+            garmin_sim_set_distance(strtoul(optarg, NULL, 10));
+            break;
+        case 'e':
+            if (sscanf(optarg, "%lu,%lu", &fail_after, &fail_count) != 2) {
+                usage();
+            }
+            break;
+        case 'h':
+            hang_after = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            program_config.lidar_burst_mode = true;
+            break;
+        case 's':
+            program_config.lidar_sample_spacing = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            program_config.lidar_sample_count = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            if (sscanf(optarg, "%lu,%lu", &wave_amplitude, &wave_period) !=
+                2) {
+                usage();
+            }
+            garmin_sim_set_waves(wave_amplitude, wave_period);
+            break;
+        case 'v':
+            tirtos_host_verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1) {
+        usage();
+    }
+    samples = strtol(argv[optind], NULL, 10);
+    garmin_sim_fail_transfers(fail_after, fail_count);
+    garmin_sim_hang_transfer(hang_after);
+    // A zero offset means the lidar is not calibrated, and nothing is stored
+    program_config.lidar_sample_offset = 1.0f;
+    lidar_init();
+    Task_Params_init(&params);
+    if (Task_create(lidar_run, &params, NULL) == NULL) {
+        System_abort("Lidar task creation failed\n");
+    }
+    tirtos_host_run();
+    start = tirtos_host_time_us();
+    for (i = 0; i < samples; i++) {
+        sample_lidar();
+        tirtos_host_run();
+    }
+    garmin_sim_get_stats(&stats);
+    printf("%ld of %ld samples stored in %.1f ms\n", stored, samples,
+           (tirtos_host_time_us() - start) / 1000.0);
+    printf("%lu transfers (%lu failed, %lu hung, %lu canceled), "
+           "%.1f ms on the bus\n",
+           (unsigned long)stats.transfers, (unsigned long)stats.nacks,
+           (unsigned long)stats.hangs, (unsigned long)stats.cancels,
+           stats.bus_us / 1000.0);
+    printf("%.2f transfers and %.3f ms of bus time per distance\n",
+           stats.results ? (double)stats.transfers / stats.results : 0.0,
+           stats.results ? stats.bus_us / 1000.0 / stats.results : 0.0);
+    printf("%lu measurements, %lu distances read (%lu stale), %.2f status "
+           "reads and %.2f ms per distance\n",
+           (unsigned long)stats.measurements, (unsigned long)stats.results,
+           (unsigned long)stats.stale_reads,
+           stats.results ? (double)stats.status_reads / stats.results : 0.0,
+           stats.results ? stats.result_us / 1000.0 / stats.results : 0.0);
+    return 0;
+}
+
+/**
+ * Stands in for the storage task, counting and printing samples
+ */
+void store_sensor_data(SensorDataPacket *packet) {
+    stored++;
+    printf("%ld, %.3f\n", (long)packet->timestamp, packet->distance);
+}
+
+/**
+ * Stands in for the transmission task, which ignores samples when the
+ * network is disabled
+ */
+void transmit_sensor_data(SensorDataPacket *packet) { (void)packet; }
+
+/**
+ * Stands in for the CLI's log function
+ */
+void cli_log(const char *format, ...) {
+    va_list args;
+
+    if (tirtos_host_verbose) {
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+    }
+}
+
+/**
+ * Stands in for the storage task's trace log, which is not simulated
+ */
+void log_trace(uint32_t fmt_id, const uint32_t *args, unsigned int nargs) {
+    (void)fmt_id;
+    (void)args;
+    (void)nargs;
+}
+
+/**
+ * Prints usage and exits
+ */
+static void usage() {
+    fprintf(stderr, "Usage: lidar_sim [-m US] [-d CM] [-e AFTER,COUNT] "
+                    "[-h AFTER] [-b] [-s MS] [-n COUNT] [-w AMP,PERIOD] "
+                    "[-v] SAMPLES\n");
+    exit(2);
+}
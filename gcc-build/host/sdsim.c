@@ -0,0 +1,459 @@
+/**
+ * @file sdsim.c
+ * Simulated SD card on a disk image file. See sdsim.h.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "diskio.h"
+#include "ff.h"
+
+#include "sdsim.h"
+#include "tirtos_host.h"
+
+/** Prefix of stdio names on the card, as used with TI's ffcio layer */
+#define FFCIO_PREFIX "fat:"
+/** FAT16 root directory entries */
+#define ROOT_ENTRIES 512
+/** Sectors used by the FAT16 root directory */
+#define ROOT_SECTORS (ROOT_ENTRIES * 32 / SDSIM_SECTOR_SIZE)
+/** Most clusters of a FAT16 volume, as counted by FatFs */
+#define FAT16_MAX_CLUSTERS 65525
+/** Fewest clusters of a FAT16 volume */
+#define FAT16_MIN_CLUSTERS 4086
+
+int32_t fatfs_getFatTime(void);
+static void find_fat();
+static uint32_t get_le(const uint8_t *data, int len);
+static void put_le(uint8_t *data, uint32_t value, int len);
+static void add_latency(uint64_t us);
+static ssize_t cookie_read(void *cookie, char *buf, size_t size);
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size);
+static int cookie_seek(void *cookie, off64_t *offset, int whence);
+static int cookie_close(void *cookie);
+
+/** FatFs work area of the mounted card */
+static FATFS fatfs;
+/** Drive the card is mounted as */
+static char mount_path[8];
+/** Open disk image, or NULL if no card is present */
+static FILE *image;
+/** Size of the image in sectors */
+static uint32_t image_sectors;
+/** First sector of the FATs */
+static uint32_t fat_start;
+/** Sector after the last FAT */
+static uint32_t fat_end;
+/** Guards the counters and fault settings */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static SdsimStats stats;
+static uint32_t read_latency, write_latency, sync_latency;
+/** Writes to let through before failing fail_count of them */
+static uint32_t fail_after, fail_count;
+/** Sector writes left before the power is cut, negative for none */
+static int64_t cut_after = -1;
+
+int sdsim_open(const char *path) {
+    sdsim_close();
+    image = fopen(path, "r+b");
+    if (!image || fseeko(image, 0, SEEK_END) != 0) {
+        sdsim_close();
+        return -1;
+    }
+    image_sectors = (uint32_t)(ftello(image) / SDSIM_SECTOR_SIZE);
+    find_fat();
+    return 0;
+}
+
+int sdsim_format(const char *path, uint32_t megabytes) {
+    uint8_t sector[SDSIM_SECTOR_SIZE];
+    uint32_t sectors = megabytes * (1024 * 1024 / SDSIM_SECTOR_SIZE);
+    uint32_t cluster_size, fat_size = 0, clusters = 0;
+    FILE *file;
+    int i, ok;
+
+    if (megabytes < 16 || megabytes > 2048) {
+        return -1;
+    }
+    // Smallest clusters that keep the cluster count within FAT16 limits
+    for (cluster_size = 1; cluster_size <= 64; cluster_size *= 2) {
+        clusters = (sectors - 1 - ROOT_SECTORS) / cluster_size;
+        fat_size = ((clusters + 2) * 2 + SDSIM_SECTOR_SIZE - 1) /
+                   SDSIM_SECTOR_SIZE;
+        clusters = (sectors - 1 - ROOT_SECTORS - 2 * fat_size) / cluster_size;
+        if (clusters <= FAT16_MAX_CLUSTERS) {
+            break;
+        }
+    }
+    if (clusters < FAT16_MIN_CLUSTERS || clusters > FAT16_MAX_CLUSTERS) {
+        return -1;
+    }
+    // Boot sector, without partition table, as FatFs writes with FM_SFD
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, "\xEB\x3C\x90MSWIN4.1", 11);
+    put_le(sector + 11, SDSIM_SECTOR_SIZE, 2);
+    sector[13] = (uint8_t)cluster_size;
+    put_le(sector + 14, 1, 2); // Reserved sectors, the boot sector
+    sector[16] = 2;            // FATs
+    put_le(sector + 17, ROOT_ENTRIES, 2);
+    if (sectors < 0x10000) {
+        put_le(sector + 19, sectors, 2);
+    } else {
+        put_le(sector + 32, sectors, 4);
+    }
+    sector[21] = 0xF8; // Fixed disk
+    put_le(sector + 22, fat_size, 2);
+    put_le(sector + 24, 63, 2);  // Sectors per track
+    put_le(sector + 26, 255, 2); // Heads
+    sector[36] = 0x80;           // Drive number
+    sector[38] = 0x29;           // Extended boot signature
+    put_le(sector + 39, 0x5D5D0000 | megabytes, 4);
+    memcpy(sector + 43, "NO NAME    FAT16   ", 19);
+    put_le(sector + 510, 0xAA55, 2);
+    file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+    ok = fwrite(sector, sizeof(sector), 1, file) == 1;
+    // Each FAT starts with the media byte and the end of chain marker
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, "\xF8\xFF\xFF\xFF", 4);
+    for (i = 0; i < 2 && ok; i++) {
+        ok = fseeko(file, (off_t)(1 + i * fat_size) * SDSIM_SECTOR_SIZE,
+                    SEEK_SET) == 0 &&
+             fwrite(sector, sizeof(sector), 1, file) == 1;
+    }
+    // The rest reads back as zeros
+    ok = ok && fflush(file) == 0 &&
+         ftruncate(fileno(file), (off_t)sectors * SDSIM_SECTOR_SIZE) == 0;
+    return (fclose(file) == 0 && ok) ? 0 : -1;
+}
+
+void sdsim_close() {
+    if (image) {
+        fclose(image);
+        image = NULL;
+    }
+}
+
+void sdsim_set_latency(uint32_t read_us, uint32_t write_us, uint32_t sync_us) {
+    pthread_mutex_lock(&lock);
+    read_latency = read_us;
+    write_latency = write_us;
+    sync_latency = sync_us;
+    pthread_mutex_unlock(&lock);
+}
+
+void sdsim_fail_writes(uint32_t after, uint32_t count) {
+    pthread_mutex_lock(&lock);
+    fail_after = after;
+    fail_count = count;
+    pthread_mutex_unlock(&lock);
+}
+
+void sdsim_cut_power(uint32_t after) {
+    pthread_mutex_lock(&lock);
+    cut_after = after;
+    pthread_mutex_unlock(&lock);
+}
+
+void sdsim_get_stats(SdsimStats *out) {
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+void sdsim_reset_stats() {
+    pthread_mutex_lock(&lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
+
+DSTATUS disk_status(BYTE pdrv) {
+    return (pdrv == 0 && image) ? 0 : STA_NOINIT | STA_NODISK;
+}
+
+DSTATUS disk_initialize(BYTE pdrv) { return disk_status(pdrv); }
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
+    if (disk_status(pdrv) != 0) {
+        return RES_NOTRDY;
+    }
+    if (sector + count > image_sectors ||
+        fseeko(image, (off_t)sector * SDSIM_SECTOR_SIZE, SEEK_SET) != 0 ||
+        fread(buff, SDSIM_SECTOR_SIZE, count, image) != count) {
+        return RES_ERROR;
+    }
+    pthread_mutex_lock(&lock);
+    stats.read_cmds++;
+    stats.sectors_read += count;
+    add_latency((uint64_t)read_latency * count);
+    pthread_mutex_unlock(&lock);
+    return RES_OK;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+    UINT i, written = count;
+    bool cut = false;
+
+    if (disk_status(pdrv) != 0) {
+        return RES_NOTRDY;
+    }
+    if (sector + count > image_sectors) {
+        return RES_ERROR;
+    }
+    pthread_mutex_lock(&lock);
+    if (fail_after > 0) {
+        fail_after--;
+    } else if (fail_count > 0) {
+        fail_count--;
+        stats.write_errors++;
+        pthread_mutex_unlock(&lock);
+        return RES_ERROR;
+    }
+    if (cut_after >= 0 && cut_after < count) {
+        written = (UINT)cut_after; // Sectors after the cut never arrive
+        cut = true;
+    } else if (cut_after >= 0) {
+        cut_after -= count;
+    }
+    stats.write_cmds++;
+    stats.sectors_written += written;
+    for (i = 0; i < written; i++) {
+        if (sector + i >= fat_start && sector + i < fat_end) {
+            stats.fat_writes++;
+        }
+    }
+    add_latency((uint64_t)write_latency * written);
+    pthread_mutex_unlock(&lock);
+    if (fseeko(image, (off_t)sector * SDSIM_SECTOR_SIZE, SEEK_SET) != 0 ||
+        fwrite(buff, SDSIM_SECTOR_SIZE, written, image) != written) {
+        return RES_ERROR;
+    }
+    if (cut) {
+        fflush(image);
+        fflush(stdout);
+        fprintf(stderr, "Power cut during write of sector %lu\n",
+                (unsigned long)(sector + written));
+        _exit(2);
+    }
+    if (sector <= fat_start) {
+        find_fat(); // Boot sector may have changed
+    }
+    return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
+    if (disk_status(pdrv) != 0) {
+        return RES_NOTRDY;
+    }
+    switch (cmd) {
+    case CTRL_SYNC:
+        if (fflush(image) != 0) {
+            return RES_ERROR;
+        }
+        pthread_mutex_lock(&lock);
+        stats.syncs++;
+        add_latency(sync_latency);
+        pthread_mutex_unlock(&lock);
+        return RES_OK;
+    case GET_SECTOR_COUNT:
+        *(DWORD *)buff = image_sectors;
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD *)buff = SDSIM_SECTOR_SIZE;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD *)buff = 1;
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+DWORD get_fattime(void) { return (DWORD)fatfs_getFatTime(); }
+
+SDFatFS_Handle SDFatFS_open(uint_least8_t index, uint_least8_t drive) {
+    snprintf(mount_path, sizeof(mount_path), "%u:", (unsigned int)drive);
+    // Lazy mount, the card is first read on the first file access
+    if (f_mount(&fatfs, mount_path, 0) != FR_OK) {
+        return NULL;
+    }
+    return (SDFatFS_Handle)&fatfs;
+}
+
+void SDFatFS_close(SDFatFS_Handle handle) { f_mount(NULL, mount_path, 0); }
+
+FILE *sdsim_fopen(const char *path, const char *mode) {
+    cookie_io_functions_t io = {cookie_read, cookie_write, cookie_seek,
+                                cookie_close};
+    const char *name;
+    FIL *file;
+    BYTE flags;
+    FILE *stream;
+
+    if (strncmp(path, FFCIO_PREFIX, strlen(FFCIO_PREFIX)) != 0) {
+        return fopen(path, mode);
+    }
+    // Skip "fat:N:", FatFs uses the default drive
+    name = strchr(path + strlen(FFCIO_PREFIX), ':');
+    name = name ? name + 1 : path + strlen(FFCIO_PREFIX);
+    switch (mode[0]) {
+    case 'r':
+        flags = FA_READ | FA_OPEN_EXISTING;
+        break;
+    case 'w':
+        flags = FA_WRITE | FA_CREATE_ALWAYS;
+        break;
+    case 'a':
+        flags = FA_WRITE | FA_OPEN_APPEND;
+        break;
+    default:
+        return NULL;
+    }
+    if (strchr(mode, '+')) {
+        flags |= FA_READ | FA_WRITE;
+    }
+    file = malloc(sizeof(*file));
+    if (!file) {
+        return NULL;
+    }
+    if (f_open(file, name, flags) != FR_OK) {
+        free(file);
+        return NULL;
+    }
+    stream = fopencookie(file, mode, io);
+    if (!stream) {
+        f_close(file);
+        free(file);
+    }
+    return stream;
+}
+
+/**
+ * Finds the sectors holding the FATs, from the boot sector of the volume.
+ * Images of real cards have a partition table; the first partition is used.
+ */
+static void find_fat() {
+    uint8_t sector[SDSIM_SECTOR_SIZE];
+    uint32_t base = 0, fat_size;
+
+    fat_start = fat_end = 0;
+    if (fseeko(image, 0, SEEK_SET) != 0 ||
+        fread(sector, sizeof(sector), 1, image) != 1) {
+        return;
+    }
+    if (sector[0] != 0xEB && sector[0] != 0xE9) {
+        base = get_le(sector + 0x1C6, 4);
+        if (fseeko(image, (off_t)base * SDSIM_SECTOR_SIZE, SEEK_SET) != 0 ||
+            fread(sector, sizeof(sector), 1, image) != 1) {
+            return;
+        }
+    }
+    fat_size = get_le(sector + 22, 2);
+    if (fat_size == 0) {
+        fat_size = get_le(sector + 36, 4); // FAT32
+    }
+    fat_start = base + get_le(sector + 14, 2);
+    fat_end = fat_start + sector[16] * fat_size;
+}
+
+/**
+ * Reads a little endian value
+ * @param data: bytes to read
+ * @param len: number of bytes, up to 4
+ * @return value
+ */
+static uint32_t get_le(const uint8_t *data, int len) {
+    uint32_t value = 0;
+
+    while (len--) {
+        value = (value << 8) | data[len];
+    }
+    return value;
+}
+
+/**
+ * Writes a little endian value
+ * @param data: buffer to write to
+ * @param value: value to write
+ * @param len: number of bytes, up to 4
+ */
+static void put_le(uint8_t *data, uint32_t value, int len) {
+    while (len--) {
+        *data++ = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+/**
+ * Records time spent on an operation, and moves the virtual clock forward.
+ * Must be called with the lock held.
+ * @param us: time spent
+ */
+static void add_latency(uint64_t us) {
+    stats.busy_us += us;
+    tirtos_host_advance_us(us);
+}
+
+/**
+ * stdio read function of sdsim_fopen() streams
+ */
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+    UINT bytes_read;
+
+    if (f_read(cookie, buf, (UINT)size, &bytes_read) != FR_OK) {
+        return -1;
+    }
+    return bytes_read;
+}
+
+/**
+ * stdio write function of sdsim_fopen() streams
+ */
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size) {
+    UINT bytes_written;
+
+    if (f_write(cookie, buf, (UINT)size, &bytes_written) != FR_OK) {
+        return 0; // stdio treats a short write as an error
+    }
+    return bytes_written;
+}
+
+/**
+ * stdio seek function of sdsim_fopen() streams
+ */
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+    FIL *file = cookie;
+    off64_t target = *offset;
+
+    if (whence == SEEK_CUR) {
+        target += f_tell(file);
+    } else if (whence == SEEK_END) {
+        target += f_size(file);
+    }
+    if (target < 0 || f_lseek(file, (FSIZE_t)target) != FR_OK) {
+        return -1;
+    }
+    *offset = target;
+    return 0;
+}
+
+/**
+ * stdio close function of sdsim_fopen() streams
+ */
+static int cookie_close(void *cookie) {
+    FRESULT fr = f_close(cookie);
+
+    free(cookie);
+    return fr == FR_OK ? 0 : -1;
+}
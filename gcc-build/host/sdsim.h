@@ -0,0 +1,87 @@
+/**
+ * @file sdsim.h
+ * Simulated SD card for host builds of storage.c. Implements the FatFs
+ * disk I/O layer (diskio.h) on a disk image file, and counts what FatFs asks
+ * of the card: sector reads and writes, writes to the FAT and syncs. Read,
+ * write and sync latency can be simulated, moving the virtual clock of
+ * tirtos_host.h forward, and writes can be made to fail or the power cut at
+ * a chosen point, to exercise error and recovery paths.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef SDSIM_H_
+#define SDSIM_H_
+
+#include <stdint.h>
+
+/** Sector size of the simulated card */
+#define SDSIM_SECTOR_SIZE 512
+
+/** Counters of card operations */
+typedef struct {
+    uint32_t read_cmds;       /**< disk_read() calls */
+    uint32_t sectors_read;    /**< sectors read */
+    uint32_t write_cmds;      /**< disk_write() calls */
+    uint32_t sectors_written; /**< sectors written */
+    uint32_t fat_writes;      /**< sectors written in a FAT */
+    uint32_t syncs;           /**< CTRL_SYNC requests */
+    uint32_t write_errors;    /**< writes failed on purpose */
+    uint64_t busy_us;         /**< simulated time spent on operations */
+} SdsimStats;
+
+/**
+ * Opens a disk image. The image stays open until sdsim_close().
+ * @param path: image file
+ * @return 0 on success, or negative value on error
+ */
+int sdsim_open(const char *path);
+
+/**
+ * Creates a disk image holding an empty FAT16 volume, replacing any file at
+ * path. The image is not opened.
+ * @param path: image file
+ * @param megabytes: size of the volume, 16 to 2048 MB
+ * @return 0 on success, or negative value on error
+ */
+int sdsim_format(const char *path, uint32_t megabytes);
+
+/**
+ * Closes the disk image. Later card accesses fail as if no card is present.
+ */
+void sdsim_close();
+
+/**
+ * Sets the simulated latency of card operations
+ * @param read_us: time per sector read
+ * @param write_us: time per sector written
+ * @param sync_us: time per sync
+ */
+void sdsim_set_latency(uint32_t read_us, uint32_t write_us, uint32_t sync_us);
+
+/**
+ * Makes writes fail
+ * @param after: writes that succeed first
+ * @param count: writes that fail after those
+ */
+void sdsim_fail_writes(uint32_t after, uint32_t count);
+
+/**
+ * Cuts the power: after a number of sector writes, the process exits as if
+ * power was lost, leaving the image as the card would be
+ * @param after: sector writes that complete first
+ */
+void sdsim_cut_power(uint32_t after);
+
+/**
+ * Reads the operation counters
+ * @param stats: structure to copy the counters into
+ */
+void sdsim_get_stats(SdsimStats *stats);
+
+/**
+ * Clears the operation counters
+ */
+void sdsim_reset_stats();
+
+#endif /* SDSIM_H_ */
@@ -0,0 +1,275 @@
+/**
+ * @file storage_sim.c
+ * Host benchmark of the storage task (storage.c) on a simulated SD card.
+ * Each run boots the storage task against a disk image, as a station would
+ * power up with that card, so runs can be chained: format an image, append
+ * samples, cut the power part way through, then boot again to time the
+ * recovery. Prints the card operations of each phase, see sdsim.h.
+ *
+ * Usage: storage_sim [options] IMAGE COMMAND [ARGS]
+ * Commands:
+ *  - format [MB]: create an empty FAT16 image (default 64 MB)
+ *  - boot: mount the card and read the configuration
+ *  - append SAMPLES [SECONDS]: boot, then store SAMPLES samples taken
+ *    SECONDS apart (default 15)
+ *  - get SDPATH HOSTPATH: copy a file out of the image
+ * Options:
+ *  - -l READ,WRITE,SYNC: latency in us per sector read, per sector written
+ *    and per sync
+ *  - -e AFTER,COUNT: fail COUNT writes after AFTER writes
+ *  - -c SECTORS: cut the power after SECTORS sector writes
+ *  - -t TIMESTAMP: time of the first sample, in seconds since 1970
+ *  - -u: unmount the card at the end
+ *  - -v: print storage task output
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ff.h"
+
+#include "common.h"
+#include "config.h"
+#include "pending.h"
+#include "sdsim.h"
+#include "storage.h"
+#include "tirtos_host.h"
+
+/** Default first sample time, 2026-10-18 00:00:00 UTC */
+#define DEFAULT_START_TIME 1792281600
+/** Largest log line, as in cli.c */
+#define LOG_LINE_MAX 128
+
+static void print_phase(const char *name, uint64_t start_us, uint32_t samples);
+static int copy_file(const char *sd_path, const char *host_path);
+static void usage();
+
+/** Configuration used by storage.c, defaults until config.txt is read */
+ProgramConfiguration program_config = CONFIG_DEFAULTS;
+/** Watchdog handle, unused on the host */
+Watchdog_Handle watchdogHandle;
+
+int main(int argc, char *argv[]) {
+    unsigned long read_us = 0, write_us = 0, sync_us = 0;
+    unsigned long fail_after = 0, fail_count = 0;
+    long samples, interval = 15;
+    time_t start_time = DEFAULT_START_TIME;
+    bool unmount = false;
+    SensorDataPacket packet;
+    Task_Params params;
+    uint64_t start;
+    const char *image, *command;
+    int opt;
+    long i;
+
+    while ((opt = getopt(argc, argv, "l:e:c:t:uv")) != -1) {
+        switch (opt) {
+        case 'l':
+            if (sscanf(optarg, "%lu,%lu,%lu", &read_us, &write_us,
+                       &sync_us) != 3) {
+                usage();
+            }
+            break;
+        case 'e':
+            if (sscanf(optarg, "%lu,%lu", &fail_after, &fail_count) != 2) {
+                usage();
+            }
+            break;
+        case 'c':
+            sdsim_cut_power(strtoul(optarg, NULL, 10));
+            break;
+        case 't':
+            start_time = strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            unmount = true;
+            break;
+        case 'v':
+            tirtos_host_verbose = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+    }
+    image = argv[optind];
+    command = argv[optind + 1];
+    if (strcmp(command, "format") == 0) {
+        if (sdsim_format(image, argc - optind > 2
+                                    ? strtoul(argv[optind + 2], NULL, 10)
+                                    : 64) < 0) {
+            fprintf(stderr, "Could not format %s\n", image);
+            return 1;
+        }
+        return 0;
+    }
+    if (sdsim_open(image) < 0) {
+        fprintf(stderr, "Could not open %s\n", image);
+        return 1;
+    }
+    sdsim_set_latency(read_us, write_us, sync_us);
+    sdsim_fail_writes(fail_after, fail_count);
+    if (strcmp(command, "get") == 0) {
+        // Mount without booting, so the image is not changed
+        if (argc - optind < 4 || SDFatFS_open(CONFIG_SD_0, 0) == NULL) {
+            usage();
+        }
+        return copy_file(argv[optind + 2], argv[optind + 3]) < 0 ? 1 : 0;
+    }
+    // Boot as main_task() does
+    start = tirtos_host_time_us();
+    pending_init();
+    storage_init();
+    read_configuration(true);
+    Task_Params_init(&params);
+    if (Task_create(storage_run, &params, NULL) == NULL) {
+        System_abort("Storage task creation failed\n");
+    }
+    tirtos_host_wait_idle();
+    print_phase("boot", start, 0);
+    if (strcmp(command, "append") == 0) {
+        if (argc - optind < 3) {
+            usage();
+        }
+        samples = strtol(argv[optind + 2], NULL, 10);
+        if (argc - optind > 3) {
+            interval = strtol(argv[optind + 3], NULL, 10);
+        }
+        sdsim_reset_stats();
+        start = tirtos_host_time_us();
+        packet.timestamp = start_time;
+        packet.distance = 1.5f;
+        for (i = 0; i < samples; i++) {
+            store_sensor_data(&packet);
+            tirtos_host_wait_idle();
+            // Main task loop: wait for the next sample, then flush old data
+            tirtos_host_advance_us(interval * 1000000ULL);
+            sync_to_disk();
+            packet.timestamp += interval;
+            packet.distance += (i % 16 < 8) ? 0.001f : -0.001f;
+        }
+        print_phase("append", start, (uint32_t)samples);
+    } else if (strcmp(command, "boot") != 0) {
+        usage();
+    }
+    if (unmount) {
+        sdsim_reset_stats();
+        start = tirtos_host_time_us();
+        unmount_sdcard();
+        tirtos_host_wait_idle();
+        print_phase("unmount", start, 0);
+    }
+    sdsim_close();
+    return 0;
+}
+
+/**
+ * Stands in for the CLI's log function: logs to the card like the firmware,
+ * and prints when verbose
+ */
+void cli_log(const char *format, ...) {
+    char line[LOG_LINE_MAX];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    log_sdcard(line);
+    System_printf("%s", line);
+}
+
+/**
+ * Stands in for the CLI's print function
+ */
+void cli_write(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/**
+ * Prints the card operations of a phase, then clears the counters
+ * @param name: phase name
+ * @param start_us: virtual time the phase started
+ * @param samples: samples stored in the phase, for per sample figures
+ */
+static void print_phase(const char *name, uint64_t start_us,
+                        uint32_t samples) {
+    SdsimStats stats;
+
+    sdsim_get_stats(&stats);
+    printf("%s: %.1f ms simulated I/O, %lu reads (%lu sectors), %lu writes "
+           "(%lu sectors, %lu FAT), %lu syncs, %lu write errors\n",
+           name, stats.busy_us / 1000.0, (unsigned long)stats.read_cmds,
+           (unsigned long)stats.sectors_read, (unsigned long)stats.write_cmds,
+           (unsigned long)stats.sectors_written,
+           (unsigned long)stats.fat_writes, (unsigned long)stats.syncs,
+           (unsigned long)stats.write_errors);
+    if (samples) {
+        printf("%s: per sample %.3f sectors read, %.3f written, %.3f FAT, "
+               "%.3f syncs, %.1f us I/O, over %.1f h\n",
+               name, (double)stats.sectors_read / samples,
+               (double)stats.sectors_written / samples,
+               (double)stats.fat_writes / samples,
+               (double)stats.syncs / samples, (double)stats.busy_us / samples,
+               (tirtos_host_time_us() - start_us) / 3.6e9);
+    }
+    sdsim_reset_stats();
+}
+
+/**
+ * Copies a file out of the image
+ * @param sd_path: FatFs path of the file
+ * @param host_path: file to write
+ * @return 0 on success, or negative value on error
+ */
+static int copy_file(const char *sd_path, const char *host_path) {
+    uint8_t buf[SDSIM_SECTOR_SIZE];
+    FIL file;
+    FILE *out;
+    UINT bytes_read;
+    int ret = 0;
+
+    if (f_open(&file, sd_path, FA_READ) != FR_OK) {
+        fprintf(stderr, "Could not open %s in image\n", sd_path);
+        return -1;
+    }
+    out = fopen(host_path, "wb");
+    if (!out) {
+        f_close(&file);
+        return -1;
+    }
+    do {
+        if (f_read(&file, buf, sizeof(buf), &bytes_read) != FR_OK ||
+            fwrite(buf, 1, bytes_read, out) != bytes_read) {
+            ret = -1;
+            break;
+        }
+    } while (bytes_read == sizeof(buf));
+    f_close(&file);
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * Prints usage and exits
+ */
+static void usage() {
+    fprintf(stderr,
+            "Usage: storage_sim [-l READ,WRITE,SYNC] [-e AFTER,COUNT] "
+            "[-c SECTORS] [-t TIMESTAMP] [-u] [-v] IMAGE COMMAND [ARGS]\n"
+            "Commands: format [MB] | boot | append SAMPLES [SECONDS] | "
+            "get SDPATH HOSTPATH\n");
+    exit(2);
+}
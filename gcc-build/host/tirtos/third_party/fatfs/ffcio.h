@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for TI's FatFs stdio binding. stdio calls on "fat:N:" names
+ * go to the simulated card, see sdsim.h.
+ */
+#ifndef FFCIO_HOST_H_
+#define FFCIO_HOST_H_
+
+#include <stdio.h>
+
+#include "ff.h"
+
+/**
+ * Opens a "fat:N:path" file on the simulated card as a stdio stream
+ * @param path: file name, with the "fat:N:" prefix
+ * @param mode: fopen() mode
+ * @return stream, or NULL on error
+ */
+FILE *sdsim_fopen(const char *path, const char *mode);
+
+#define fopen sdsim_fopen
+
+#endif /* FFCIO_HOST_H_ */
@@ -0,0 +1,2 @@
+/* Host stand-in for the TI header of the same name, see tirtos_host.h */
+#include "tirtos_host.h"
@@ -0,0 +1,223 @@
+/**
+ * @file tirtos_host.h
+ * Host stand-ins for the TI-RTOS kernel, driver and driverlib calls made by
+ * storage.c and lidar.c, so the storage task can run on a PC against a
+ * simulated SD card (see sdsim.h), and the lidar task against a simulated
+ * Garmin lidar (see garmin_sim.h). The headers under tirtos/ mirror the TI
+ * include paths and all forward here.
+ *
+ * Tasks are POSIX threads. Hwi_disable() takes a global lock instead of
+ * masking interrupts. Clock ticks are virtual milliseconds, moved forward by
+ * the simulation and by simulated SD card latency, so flush ages and I/O
+ * times do not depend on the speed of the PC.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef TIRTOS_HOST_H_
+#define TIRTOS_HOST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* xdc/std.h */
+typedef intptr_t IArg;
+typedef uintptr_t UArg;
+typedef unsigned int UInt;
+typedef int Int;
+typedef bool Bool;
+typedef uint32_t UInt32;
+typedef void *Ptr;
+typedef struct Error_Block Error_Block;
+
+/* xdc/runtime/System.h */
+/**
+ * Prints to stderr when tirtos_host_verbose is set
+ * @param format: printf format string
+ * @return number of characters printed
+ */
+int System_printf(const char *format, ...);
+/**
+ * Prints a message and ends the simulation with a failure
+ * @param str: message to print
+ */
+void System_abort(const char *str);
+/**
+ * Flushes System_printf() output
+ */
+void System_flush();
+
+/* ti/sysbios/BIOS.h */
+#define BIOS_WAIT_FOREVER (~(UInt32)0) /**< block until posted */
+#define BIOS_NO_WAIT 0                 /**< do not block */
+
+/* ti/sysbios/gates/GateMutex.h */
+typedef struct GateMutex *GateMutex_Handle;
+GateMutex_Handle GateMutex_create(const void *params, Error_Block *eb);
+IArg GateMutex_enter(GateMutex_Handle handle);
+void GateMutex_leave(GateMutex_Handle handle, IArg key);
+
+/* ti/sysbios/hal/Hwi.h */
+UInt Hwi_disable();
+void Hwi_restore(UInt key);
+
+/* ti/sysbios/knl/Clock.h */
+UInt32 Clock_getTicks();
+
+/* ti/sysbios/knl/Event.h */
+#define Event_Id_NONE 0
+#define Event_Id_00 (1u << 0)
+#define Event_Id_01 (1u << 1)
+#define Event_Id_02 (1u << 2)
+#define Event_Id_03 (1u << 3)
+#define Event_Id_04 (1u << 4)
+#define Event_Id_05 (1u << 5)
+#define Event_Id_06 (1u << 6)
+#define Event_Id_07 (1u << 7)
+typedef struct Event *Event_Handle;
+Event_Handle Event_create(const void *params, Error_Block *eb);
+void Event_post(Event_Handle handle, UInt events);
+/**
+ * Waits for any of orMask to be posted. andMask is not supported. Timeouts
+ * are in virtual milliseconds, so a pend only times out once other code
+ * advances the clock.
+ */
+UInt Event_pend(Event_Handle handle, UInt andMask, UInt orMask,
+                UInt32 timeout);
+
+/* ti/sysbios/knl/Queue.h */
+/** Queue link, embedded in queued structures */
+typedef struct Queue_Elem {
+    struct Queue_Elem *volatile next; /**< next element */
+    struct Queue_Elem *volatile prev; /**< previous element */
+} Queue_Elem;
+typedef struct Queue_Elem *Queue_Handle;
+Queue_Handle Queue_create(const void *params, Error_Block *eb);
+void Queue_enqueue(Queue_Handle queue, Queue_Elem *elem);
+Ptr Queue_dequeue(Queue_Handle queue);
+Bool Queue_empty(Queue_Handle queue);
+
+/* ti/sysbios/knl/Task.h */
+typedef void (*Task_FuncPtr)(UArg arg0, UArg arg1);
+/** Task parameters; only the arguments are used */
+typedef struct {
+    UArg arg0;    /**< first task argument */
+    UArg arg1;    /**< second task argument */
+    Int priority; /**< ignored */
+    size_t stackSize; /**< ignored */
+} Task_Params;
+typedef struct Task *Task_Handle;
+void Task_Params_init(Task_Params *params);
+Task_Handle Task_create(Task_FuncPtr fxn, const Task_Params *params,
+                        Error_Block *eb);
+/** Moves the virtual clock forward instead of sleeping */
+void Task_sleep(UInt32 ticks);
+
+/* ti/drivers/GPIO.h, pins are not simulated */
+void GPIO_setConfig(uint_least8_t index, uint32_t config);
+void GPIO_write(uint_least8_t index, unsigned int value);
+#define GPIO_CFG_OUTPUT 0x1
+#define GPIO_CFG_OUT_LOW 0x0
+#define GPIO_CFG_OUT_HIGH 0x2
+
+/* ti/drivers/I2C.h, implemented by the simulated lidar in garmin_sim.c */
+typedef struct I2C_Config *I2C_Handle;
+/** I2C transaction, as in the TI driver */
+typedef struct {
+    void *writeBuf;               /**< bytes to write */
+    size_t writeCount;            /**< number of bytes to write */
+    void *readBuf;                /**< buffer for bytes read */
+    size_t readCount;             /**< number of bytes to read */
+    uint_least8_t slaveAddress;   /**< 7 bit target address */
+    void *arg;                    /**< unused */
+    void *nextPtr;                /**< unused */
+} I2C_Transaction;
+typedef void (*I2C_CallbackFxn)(I2C_Handle handle,
+                                I2C_Transaction *transaction, bool status);
+typedef enum { I2C_MODE_BLOCKING, I2C_MODE_CALLBACK } I2C_TransferMode;
+typedef enum { I2C_100kHz, I2C_400kHz } I2C_BitRate;
+/** I2C parameters; the bit rate sets the simulated bus time */
+typedef struct {
+    I2C_TransferMode transferMode;       /**< blocking or callback */
+    I2C_CallbackFxn transferCallbackFxn; /**< callback in callback mode */
+    I2C_BitRate bitRate;                 /**< bus speed */
+    void *custom;                        /**< unused */
+} I2C_Params;
+void I2C_Params_init(I2C_Params *params);
+I2C_Handle I2C_open(uint_least8_t index, I2C_Params *params);
+/**
+ * Runs a transaction. In callback mode the callback is called before this
+ * returns, unless the transfer is made to hang (see garmin_sim.h).
+ */
+bool I2C_transfer(I2C_Handle handle, I2C_Transaction *transaction);
+/** Ends a hung transfer, calling its callback with a failed status */
+void I2C_cancel(I2C_Handle handle);
+
+/* ti/drivers/Watchdog.h */
+typedef struct Watchdog_Config *Watchdog_Handle;
+void Watchdog_clear(Watchdog_Handle handle);
+
+/* ti/drivers/SDFatFS.h */
+typedef struct SDFatFS_Config *SDFatFS_Handle;
+/**
+ * Mounts the simulated card as FatFs drive. Like the TI driver, the mount
+ * is lazy, so a missing card shows up as FR_NOT_READY on first access.
+ */
+SDFatFS_Handle SDFatFS_open(uint_least8_t index, uint_least8_t drive);
+void SDFatFS_close(SDFatFS_Handle handle);
+
+/* ti_drivers_config.h */
+#define CONFIG_SD_0 0
+#define CONFIG_I2C_0 0
+#define CONFIG_D1_LED 0
+#define CONFIG_GPIO_RADAR_PMIC_EN 1
+
+/* ti/devices/msp432p4xx/driverlib/driverlib.h, as used by cyclecount.h */
+/** Cycle counter registers; the host counter does not run */
+typedef struct {
+    volatile uint32_t CTRL;   /**< control */
+    volatile uint32_t CYCCNT; /**< cycle count */
+} DWT_Type;
+/** Debug registers */
+typedef struct {
+    volatile uint32_t DEMCR; /**< exception and monitor control */
+} CoreDebug_Type;
+extern DWT_Type tirtos_host_dwt;
+extern CoreDebug_Type tirtos_host_core_debug;
+#define DWT (&tirtos_host_dwt)
+#define CoreDebug (&tirtos_host_core_debug)
+#define DWT_CTRL_CYCCNTENA_Msk (1u << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1u << 24)
+uint32_t MAP_CS_getMCLK();
+
+/* Simulation control */
+/** Set to print System_printf() output */
+extern bool tirtos_host_verbose;
+
+/**
+ * Moves the virtual clock forward
+ * @param us: microseconds to add
+ */
+void tirtos_host_advance_us(uint64_t us);
+
+/**
+ * Reads the virtual clock
+ * @return microseconds since the simulation started
+ */
+uint64_t tirtos_host_time_us();
+
+/**
+ * Waits until every task pending on an event has handled all events posted
+ * to it, and is blocked again
+ */
+void tirtos_host_wait_idle();
+
+/**
+ * Waits until every task pending on an event is blocked without a timeout.
+ * While tasks only wait on timeouts, the virtual clock is moved to the
+ * earliest one.
+ */
+void tirtos_host_run();
+
+#endif /* TIRTOS_HOST_H_ */
@@ -0,0 +1,306 @@
+/**
+ * @file tirtos_host.c
+ * Host stand-ins for the TI-RTOS calls made by storage.c and lidar.c, on
+ * POSIX threads.
+ * See tirtos_host.h.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tirtos_host.h"
+
+/** Most events that can be created */
+#define MAX_EVENTS 8
+
+/** Event object */
+struct Event {
+    UInt posted;  /**< events posted and not yet taken */
+    UInt pending; /**< events the blocked task waits for, 0 if running */
+    uint64_t deadline; /**< virtual time the pend times out, in us */
+};
+
+/** GateMutex object */
+struct GateMutex {
+    pthread_mutex_t mutex; /**< lock */
+};
+
+/** Task object */
+struct Task {
+    pthread_t thread; /**< thread running the task */
+    Task_FuncPtr fxn; /**< task function */
+    UArg arg0;        /**< first task argument */
+    UArg arg1;        /**< second task argument */
+};
+
+static void *task_main(void *arg);
+static bool idle();
+static uint64_t next_deadline();
+
+bool tirtos_host_verbose;
+DWT_Type tirtos_host_dwt;
+CoreDebug_Type tirtos_host_core_debug;
+
+/** Stands in for interrupt masking */
+static pthread_mutex_t hwi_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+/** Guards all events */
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled on every event post and every pend that blocks */
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static struct Event events[MAX_EVENTS];
+static int event_count;
+/** Virtual clock */
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t clock_us;
+
+int System_printf(const char *format, ...) {
+    va_list args;
+    int ret = 0;
+
+    if (tirtos_host_verbose) {
+        va_start(args, format);
+        ret = vfprintf(stderr, format, args);
+        va_end(args);
+    }
+    return ret;
+}
+
+void System_abort(const char *str) {
+    fprintf(stderr, "abort: %s", str);
+    exit(1);
+}
+
+void System_flush() { fflush(stderr); }
+
+GateMutex_Handle GateMutex_create(const void *params, Error_Block *eb) {
+    GateMutex_Handle gate = calloc(1, sizeof(*gate));
+
+    if (gate) {
+        pthread_mutex_init(&gate->mutex, NULL);
+    }
+    return gate;
+}
+
+IArg GateMutex_enter(GateMutex_Handle handle) {
+    // Not recursive, like the TI gate
+    pthread_mutex_lock(&handle->mutex);
+    return 0;
+}
+
+void GateMutex_leave(GateMutex_Handle handle, IArg key) {
+    pthread_mutex_unlock(&handle->mutex);
+}
+
+UInt Hwi_disable() {
+    pthread_mutex_lock(&hwi_lock);
+    return 0;
+}
+
+void Hwi_restore(UInt key) { pthread_mutex_unlock(&hwi_lock); }
+
+UInt32 Clock_getTicks() { return (UInt32)(tirtos_host_time_us() / 1000); }
+
+Event_Handle Event_create(const void *params, Error_Block *eb) {
+    Event_Handle event = NULL;
+
+    pthread_mutex_lock(&event_lock);
+    if (event_count < MAX_EVENTS) {
+        event = &events[event_count++];
+    }
+    pthread_mutex_unlock(&event_lock);
+    return event;
+}
+
+void Event_post(Event_Handle handle, UInt posted) {
+    pthread_mutex_lock(&event_lock);
+    handle->posted |= posted;
+    pthread_cond_broadcast(&event_cond);
+    pthread_mutex_unlock(&event_lock);
+}
+
+UInt Event_pend(Event_Handle handle, UInt andMask, UInt orMask,
+                UInt32 timeout) {
+    UInt taken;
+
+    pthread_mutex_lock(&event_lock);
+    handle->deadline = timeout == BIOS_WAIT_FOREVER
+                           ? UINT64_MAX
+                           : tirtos_host_time_us() + timeout * 1000ULL;
+    while (!(handle->posted & orMask) &&
+           tirtos_host_time_us() < handle->deadline) {
+        handle->pending = orMask;
+        pthread_cond_broadcast(&event_cond); // May now be idle
+        pthread_cond_wait(&event_cond, &event_lock);
+    }
+    handle->pending = 0;
+    taken = handle->posted & orMask;
+    handle->posted &= ~taken;
+    pthread_mutex_unlock(&event_lock);
+    return taken;
+}
+
+Queue_Handle Queue_create(const void *params, Error_Block *eb) {
+    Queue_Handle queue = malloc(sizeof(*queue));
+
+    if (queue) {
+        queue->next = queue;
+        queue->prev = queue;
+    }
+    return queue;
+}
+
+void Queue_enqueue(Queue_Handle queue, Queue_Elem *elem) {
+    UInt key = Hwi_disable();
+
+    elem->next = queue;
+    elem->prev = queue->prev;
+    queue->prev->next = elem;
+    queue->prev = elem;
+    Hwi_restore(key);
+}
+
+Ptr Queue_dequeue(Queue_Handle queue) {
+    UInt key = Hwi_disable();
+    Queue_Elem *elem = queue->next;
+
+    // An empty queue returns the queue itself, as on TI-RTOS
+    queue->next = elem->next;
+    elem->next->prev = queue;
+    Hwi_restore(key);
+    return elem;
+}
+
+Bool Queue_empty(Queue_Handle queue) { return queue->next == queue; }
+
+void Task_Params_init(Task_Params *params) {
+    params->arg0 = 0;
+    params->arg1 = 0;
+    params->priority = 1;
+    params->stackSize = 0;
+}
+
+Task_Handle Task_create(Task_FuncPtr fxn, const Task_Params *params,
+                        Error_Block *eb) {
+    Task_Handle task = calloc(1, sizeof(*task));
+
+    if (!task) {
+        return NULL;
+    }
+    task->fxn = fxn;
+    if (params) {
+        task->arg0 = params->arg0;
+        task->arg1 = params->arg1;
+    }
+    if (pthread_create(&task->thread, NULL, task_main, task) != 0) {
+        free(task);
+        return NULL;
+    }
+    pthread_detach(task->thread);
+    return task;
+}
+
+void Task_sleep(UInt32 ticks) { tirtos_host_advance_us(ticks * 1000ULL); }
+
+void Watchdog_clear(Watchdog_Handle handle) {}
+
+void GPIO_setConfig(uint_least8_t index, uint32_t config) {}
+
+void GPIO_write(uint_least8_t index, unsigned int value) {}
+
+uint32_t MAP_CS_getMCLK() { return 48000000; }
+
+void tirtos_host_advance_us(uint64_t us) {
+    pthread_mutex_lock(&clock_lock);
+    clock_us += us;
+    pthread_mutex_unlock(&clock_lock);
+    // Wakes tasks whose pend timed out
+    pthread_mutex_lock(&event_lock);
+    pthread_cond_broadcast(&event_cond);
+    pthread_mutex_unlock(&event_lock);
+}
+
+uint64_t tirtos_host_time_us() {
+    uint64_t now;
+
+    pthread_mutex_lock(&clock_lock);
+    now = clock_us;
+    pthread_mutex_unlock(&clock_lock);
+    return now;
+}
+
+void tirtos_host_wait_idle() {
+    pthread_mutex_lock(&event_lock);
+    while (!idle()) {
+        pthread_cond_wait(&event_cond, &event_lock);
+    }
+    pthread_mutex_unlock(&event_lock);
+}
+
+void tirtos_host_run() {
+    uint64_t deadline, now;
+
+    while (1) {
+        tirtos_host_wait_idle();
+        pthread_mutex_lock(&event_lock);
+        deadline = next_deadline();
+        pthread_mutex_unlock(&event_lock);
+        if (deadline == UINT64_MAX) {
+            return;
+        }
+        now = tirtos_host_time_us();
+        tirtos_host_advance_us(deadline > now ? deadline - now : 0);
+    }
+}
+
+/**
+ * Runs a task function on its thread
+ * @param arg: task
+ * @return NULL
+ */
+static void *task_main(void *arg) {
+    Task_Handle task = arg;
+
+    task->fxn(task->arg0, task->arg1);
+    return NULL;
+}
+
+/**
+ * Checks that every event has a task blocked on it that does not wait for its
+ * posts, and whose pend has not timed out. Must be called with the event lock
+ * held.
+ * @return true if no task has work left
+ */
+static bool idle() {
+    int i;
+
+    for (i = 0; i < event_count; i++) {
+        if (events[i].pending == 0 || (events[i].posted & events[i].pending) ||
+            tirtos_host_time_us() >= events[i].deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Finds the earliest timeout of the tasks blocked on events. Must be called
+ * with the event lock held.
+ * @return virtual time of the timeout in us, or UINT64_MAX if there is none
+ */
+static uint64_t next_deadline() {
+    uint64_t deadline = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < event_count; i++) {
+        if (events[i].pending && events[i].deadline < deadline) {
+            deadline = events[i].deadline;
+        }
+    }
+    return deadline;
+}
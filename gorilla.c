@@ -0,0 +1,393 @@
+/**
+ * @file gorilla.c
+ * Block compression for sensor samples, based on the Gorilla time series
+ * encoding.
+ *
+ * Timestamps: the delta-of-delta D between consecutive timestamps is stored
+ * as
+ *  - '0' if D is 0
+ *  - '10' followed by 7 bits if D is in [-64, 63]
+ *  - '110' followed by 9 bits if D is in [-256, 255]
+ *  - '1110' followed by 12 bits if D is in [-2048, 2047]
+ *  - '1111' followed by 32 bits otherwise
+ * The delta before the second sample is taken as 0.
+ *
+ * Values: the XOR X of a value's bits with the previous value's is stored as
+ *  - '0' if X is 0
+ *  - '10' followed by the meaningful bits of X, if they fit in the window of
+ *    leading and trailing zeros used by the previous stored XOR
+ *  - '11' followed by 5 bits of leading zero count, 5 bits of meaningful bit
+ *    count minus one, then the meaningful bits
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <string.h>
+
+#include "crc32.h"
+#include "gorilla.h"
+
+static void put_bits(GorillaEncoder *enc, uint32_t value, int bits);
+static uint32_t get_bits(GorillaDecoder *dec, int bits);
+static int dod_bits(int32_t dod);
+static int xor_bits(GorillaEncoder *enc, uint32_t xor, int *leading,
+                    int *trailing, bool *reuse);
+static int count_leading_zeros(uint32_t value);
+static int count_trailing_zeros(uint32_t value);
+static uint32_t float_bits(float value);
+static float bits_float(uint32_t bits);
+
+/** Bit stream of a block, after the header */
+#define PAYLOAD(block) ((block) + sizeof(GorillaBlockHeader))
+/** Offset of the CRC at the end of a block */
+#define CRC_OFFSET (GORILLA_BLOCK_SIZE - GORILLA_CRC_SIZE)
+
+/**
+ * Starts a new, empty block
+ * @param enc: encoder to initialize
+ * @param sensor_id: sensor ID to record in the block header
+ */
+void gorilla_init(GorillaEncoder *enc, uint16_t sensor_id) {
+    GorillaBlockHeader *header = (GorillaBlockHeader *)enc->block;
+
+    memset(enc->block, 0, sizeof(enc->block));
+    header->magic = GORILLA_BLOCK_MAGIC;
+    header->sensor_id = sensor_id;
+    enc->bit_pos = 0;
+    enc->prev_delta = 0;
+    enc->prev_leading = 0;
+    enc->prev_trailing = 0;
+}
+
+/**
+ * Adds a sample to the block being built
+ * @param enc: encoder to add sample to
+ * @param timestamp: timestamp of sample, in seconds
+ * @param value: sample value
+ * @return true if the sample was added, or false if the block is full. When
+ *  full, write out the block, start a new one and add the sample again.
+ */
+bool gorilla_append(GorillaEncoder *enc, uint32_t timestamp, float value) {
+    GorillaBlockHeader *header = (GorillaBlockHeader *)enc->block;
+    uint32_t bits = float_bits(value), xor;
+    int32_t delta, dod;
+    int dbits, xbits, leading, trailing;
+    bool reuse;
+
+    if (header->count == UINT16_MAX) {
+        return false;
+    }
+    if (header->count == 0) {
+        // First sample is stored raw
+        header->start_time = timestamp;
+        header->end_time = timestamp;
+        put_bits(enc, timestamp, 32);
+        put_bits(enc, bits, 32);
+    } else {
+        delta = (int32_t)(timestamp - enc->prev_time);
+        dod = delta - enc->prev_delta;
+        xor = bits ^ enc->prev_value;
+        // Check the whole sample fits before writing any of it
+        dbits = dod_bits(dod);
+        xbits = xor_bits(enc, xor, &leading, &trailing, &reuse);
+        if (enc->bit_pos + dbits + xbits > GORILLA_PAYLOAD_SIZE * 8) {
+            return false;
+        }
+        if (dod == 0) {
+            put_bits(enc, 0x0, 1);
+        } else if (dbits == 2 + 7) {
+            put_bits(enc, 0x2, 2);
+            put_bits(enc, (uint32_t)dod & 0x7F, 7);
+        } else if (dbits == 3 + 9) {
+            put_bits(enc, 0x6, 3);
+            put_bits(enc, (uint32_t)dod & 0x1FF, 9);
+        } else if (dbits == 4 + 12) {
+            put_bits(enc, 0xE, 4);
+            put_bits(enc, (uint32_t)dod & 0xFFF, 12);
+        } else {
+            put_bits(enc, 0xF, 4);
+            put_bits(enc, (uint32_t)dod, 32);
+        }
+        if (xor == 0) {
+            put_bits(enc, 0x0, 1);
+        } else if (reuse) {
+            put_bits(enc, 0x2, 2);
+            put_bits(enc, xor >> trailing, 32 - leading - trailing);
+        } else {
+            put_bits(enc, 0x3, 2);
+            put_bits(enc, leading, 5);
+            put_bits(enc, 32 - leading - trailing - 1, 5);
+            put_bits(enc, xor >> trailing, 32 - leading - trailing);
+            enc->prev_leading = leading;
+            enc->prev_trailing = trailing;
+        }
+        enc->prev_delta = delta;
+    }
+    // Timestamps step backwards if the RTC is set, so track the range
+    if (timestamp < header->start_time) {
+        header->start_time = timestamp;
+    }
+    if (timestamp > header->end_time) {
+        header->end_time = timestamp;
+    }
+    enc->prev_time = timestamp;
+    enc->prev_value = bits;
+    header->count++;
+    header->payload_bits = enc->bit_pos;
+    return true;
+}
+
+/**
+ * Reads the number of samples in the block being built
+ * @param enc: encoder to check
+ * @return number of samples in the block
+ */
+uint16_t gorilla_count(GorillaEncoder *enc) {
+    return ((GorillaBlockHeader *)enc->block)->count;
+}
+
+/**
+ * Sets the CRC at the end of a block. Call before writing a block out; the
+ * encoder's block can keep taking samples afterwards.
+ * @param block: GORILLA_BLOCK_SIZE byte block
+ */
+void gorilla_seal(uint8_t *block) {
+    uint32_t crc = crc32(block, CRC_OFFSET);
+
+    memcpy(block + CRC_OFFSET, &crc, sizeof(crc));
+}
+
+/**
+ * Starts decoding a block
+ * @param dec: decoder to initialize
+ * @param block: GORILLA_BLOCK_SIZE byte block to decode
+ * @return 0 on success, or negative value if the block header or CRC is
+ *  invalid
+ */
+int gorilla_decoder_init(GorillaDecoder *dec, const uint8_t *block) {
+    const GorillaBlockHeader *header = (const GorillaBlockHeader *)block;
+    uint32_t crc;
+
+    if (header->magic == GORILLA_BLOCK_MAGIC) {
+        memcpy(&crc, block + CRC_OFFSET, sizeof(crc));
+        if (header->payload_bits > GORILLA_PAYLOAD_SIZE * 8 ||
+            crc != crc32(block, CRC_OFFSET)) {
+            return -1;
+        }
+    } else if (header->magic != GORILLA_BLOCK_MAGIC_V1 ||
+               header->payload_bits >
+                   (GORILLA_BLOCK_SIZE - sizeof(GorillaBlockHeader)) * 8) {
+        return -1;
+    }
+    dec->block = block;
+    dec->payload_bits = header->payload_bits;
+    dec->bit_pos = 0;
+    dec->count = header->count;
+    dec->remaining = header->count;
+    dec->prev_time = 0;
+    dec->prev_delta = 0;
+    dec->prev_leading = 0;
+    dec->prev_trailing = 0;
+    return 0;
+}
+
+/**
+ * Reads the next sample from a block
+ * @param dec: decoder to read from
+ * @param timestamp: set to timestamp of sample
+ * @param value: set to sample value
+ * @return true if a sample was read, false at the end of the block
+ */
+bool gorilla_next(GorillaDecoder *dec, uint32_t *timestamp, float *value) {
+    uint32_t prefix, meaningful;
+    int32_t dod = 0;
+    int leading, length;
+
+    if (dec->remaining == 0) {
+        return false;
+    }
+    if (dec->remaining == dec->count) {
+        dec->prev_time = get_bits(dec, 32);
+        dec->prev_value = get_bits(dec, 32);
+    } else {
+        // Timestamp delta-of-delta
+        prefix = 0;
+        while (prefix < 4 && get_bits(dec, 1)) {
+            prefix++;
+        }
+        switch (prefix) {
+        case 0:
+            dod = 0;
+            break;
+        case 1: // Sign extend from 7 bits
+            dod = (int32_t)(get_bits(dec, 7) << 25) >> 25;
+            break;
+        case 2:
+            dod = (int32_t)(get_bits(dec, 9) << 23) >> 23;
+            break;
+        case 3:
+            dod = (int32_t)(get_bits(dec, 12) << 20) >> 20;
+            break;
+        default:
+            dod = (int32_t)get_bits(dec, 32);
+            break;
+        }
+        dec->prev_delta += dod;
+        dec->prev_time += dec->prev_delta;
+        // Value XOR
+        if (get_bits(dec, 1)) {
+            if (get_bits(dec, 1)) {
+                dec->prev_leading = get_bits(dec, 5);
+                dec->prev_trailing =
+                    32 - dec->prev_leading - (get_bits(dec, 5) + 1);
+            }
+            leading = dec->prev_leading;
+            length = 32 - leading - dec->prev_trailing;
+            meaningful = get_bits(dec, length);
+            dec->prev_value ^= meaningful << dec->prev_trailing;
+        }
+    }
+    dec->remaining--;
+    *timestamp = dec->prev_time;
+    *value = bits_float(dec->prev_value);
+    return true;
+}
+
+/**
+ * Finds the number of bits needed to store a timestamp delta-of-delta
+ * @param dod: delta-of-delta to store
+ * @return number of bits, including the prefix
+ */
+static int dod_bits(int32_t dod) {
+    if (dod == 0) {
+        return 1;
+    } else if (dod >= -64 && dod <= 63) {
+        return 2 + 7;
+    } else if (dod >= -256 && dod <= 255) {
+        return 3 + 9;
+    } else if (dod >= -2048 && dod <= 2047) {
+        return 4 + 12;
+    }
+    return 4 + 32;
+}
+
+/**
+ * Finds the number of bits needed to store a value XOR
+ * @param enc: encoder, holding the previous XOR window
+ * @param xor: XOR of value with the previous value
+ * @param leading: set to leading zeros of xor
+ * @param trailing: set to trailing zeros of xor
+ * @param reuse: set to true if xor is stored in the previous window
+ * @return number of bits, including the prefix
+ */
+static int xor_bits(GorillaEncoder *enc, uint32_t xor, int *leading,
+                    int *trailing, bool *reuse) {
+    *reuse = false;
+    if (xor == 0) {
+        *leading = *trailing = 0;
+        return 1;
+    }
+    *leading = count_leading_zeros(xor);
+    *trailing = count_trailing_zeros(xor);
+    // A block's first XOR has no previous window (both counts are 0)
+    if ((enc->prev_leading || enc->prev_trailing) &&
+        *leading >= enc->prev_leading && *trailing >= enc->prev_trailing) {
+        *reuse = true;
+        *leading = enc->prev_leading;
+        *trailing = enc->prev_trailing;
+        return 2 + 32 - *leading - *trailing;
+    }
+    return 2 + 10 + 32 - *leading - *trailing;
+}
+
+/**
+ * Writes bits to the block's bit stream, most significant bit first.
+ * The caller must check the bits fit.
+ * @param enc: encoder to write to
+ * @param value: bits to write, in the low bits of value
+ * @param bits: number of bits to write, 1-32
+ */
+static void put_bits(GorillaEncoder *enc, uint32_t value, int bits) {
+    uint8_t *payload = PAYLOAD(enc->block);
+    int i;
+
+    for (i = bits - 1; i >= 0; i--) {
+        if ((value >> i) & 0x1) {
+            payload[enc->bit_pos / 8] |= 0x80 >> (enc->bit_pos % 8);
+        }
+        enc->bit_pos++;
+    }
+}
+
+/**
+ * Reads bits from the block's bit stream, most significant bit first.
+ * Reads past the bits used return zeros.
+ * @param dec: decoder to read from
+ * @param bits: number of bits to read, 1-32
+ * @return bits read, in the low bits of the return value
+ */
+static uint32_t get_bits(GorillaDecoder *dec, int bits) {
+    const uint8_t *payload = PAYLOAD(dec->block);
+    uint32_t value = 0;
+    int i;
+
+    for (i = 0; i < bits; i++) {
+        value <<= 1;
+        if (dec->bit_pos < dec->payload_bits &&
+            (payload[dec->bit_pos / 8] & (0x80 >> (dec->bit_pos % 8)))) {
+            value |= 0x1;
+        }
+        dec->bit_pos++;
+    }
+    return value;
+}
+
+/**
+ * Counts the leading zero bits of a nonzero word
+ * @param value: word to check
+ * @return number of leading zeros, capped at 31 so it fits in 5 bits
+ */
+static int count_leading_zeros(uint32_t value) {
+    int count = 0;
+    while (count < 31 && !(value & 0x80000000)) {
+        value <<= 1;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Counts the trailing zero bits of a nonzero word
+ * @param value: word to check
+ * @return number of trailing zeros
+ */
+static int count_trailing_zeros(uint32_t value) {
+    int count = 0;
+    while (count < 31 && !(value & 0x1)) {
+        value >>= 1;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Reinterprets a float as a 32 bit word
+ * @param value: float to convert
+ * @return bits of value
+ */
+static uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+/**
+ * Reinterprets a 32 bit word as a float
+ * @param bits: word to convert
+ * @return float with the given bits
+ */
+static float bits_float(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
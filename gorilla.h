@@ -0,0 +1,126 @@
+/**
+ * @file gorilla.h
+ * Block compression for sensor samples, based on the Gorilla time series
+ * encoding: timestamps are stored as delta-of-deltas, and distances as the
+ * XOR of each value with the previous one. Samples are packed into fixed
+ * size blocks, each starting with a header giving the block's time range and
+ * sample count, so blocks can be decoded (or skipped) independently.
+ *
+ * Block layout, all header fields little endian:
+ *  - GorillaBlockHeader (16 bytes)
+ *  - bit stream, most significant bit first: the first timestamp and value
+ *    as 32 raw bits each, then for every later sample a timestamp
+ *    delta-of-delta followed by a value XOR, encoded as described in
+ *    gorilla.c.
+ *  - CRC-32 of everything above (4 bytes), set by gorilla_seal(). Blocks
+ *    with the older GORILLA_BLOCK_MAGIC_V1 have no CRC, and a longer bit
+ *    stream instead.
+ * tools/decode_gts.py decodes blocks on a PC.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef GORILLA_H_
+#define GORILLA_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Size of a compressed block, one SD card sector */
+#define GORILLA_BLOCK_SIZE 512
+/** Magic value at the start of every block ("GC") */
+#define GORILLA_BLOCK_MAGIC 0x4347
+/** Magic value of blocks written without a CRC ("GB") */
+#define GORILLA_BLOCK_MAGIC_V1 0x4247
+/** Size of the CRC at the end of a block */
+#define GORILLA_CRC_SIZE 4
+/** Size of the bit stream following the block header */
+#define GORILLA_PAYLOAD_SIZE                                                   \
+    (GORILLA_BLOCK_SIZE - sizeof(GorillaBlockHeader) - GORILLA_CRC_SIZE)
+
+/** Header at the start of every compressed block */
+typedef struct {
+    uint16_t magic;        /**< GORILLA_BLOCK_MAGIC */
+    uint16_t count;        /**< number of samples in block */
+    uint32_t start_time;   /**< earliest timestamp in block */
+    uint32_t end_time;     /**< latest timestamp in block */
+    uint16_t sensor_id;    /**< synthetic ID of the device */
+    uint16_t payload_bits; /**< number of bits used in the bit stream */
+} GorillaBlockHeader;
+
+/** State of a block being compressed */
+typedef struct {
+    uint8_t block[GORILLA_BLOCK_SIZE]; /**< block being built */
+    uint32_t bit_pos;       /**< next bit to write in the bit stream */
+    uint32_t prev_time;     /**< timestamp of previous sample */
+    int32_t prev_delta;     /**< previous timestamp delta */
+    uint32_t prev_value;    /**< bits of previous value */
+    uint8_t prev_leading;   /**< leading zeros of previous stored XOR */
+    uint8_t prev_trailing;  /**< trailing zeros of previous stored XOR */
+} GorillaEncoder;
+
+/** State of a block being decompressed */
+typedef struct {
+    const uint8_t *block;   /**< block being read */
+    uint32_t bit_pos;       /**< next bit to read in the bit stream */
+    uint16_t remaining;     /**< samples left to read */
+    uint16_t count;         /**< samples in block */
+    uint16_t payload_bits;  /**< bits used in the bit stream */
+    uint32_t prev_time;     /**< timestamp of previous sample */
+    int32_t prev_delta;     /**< previous timestamp delta */
+    uint32_t prev_value;    /**< bits of previous value */
+    uint8_t prev_leading;   /**< leading zeros of previous stored XOR */
+    uint8_t prev_trailing;  /**< trailing zeros of previous stored XOR */
+} GorillaDecoder;
+
+/**
+ * Starts a new, empty block
+ * @param enc: encoder to initialize
+ * @param sensor_id: sensor ID to record in the block header
+ */
+void gorilla_init(GorillaEncoder *enc, uint16_t sensor_id);
+
+/**
+ * Adds a sample to the block being built
+ * @param enc: encoder to add sample to
+ * @param timestamp: timestamp of sample, in seconds
+ * @param value: sample value
+ * @return true if the sample was added, or false if the block is full. When
+ *  full, write out the block, start a new one and add the sample again.
+ */
+bool gorilla_append(GorillaEncoder *enc, uint32_t timestamp, float value);
+
+/**
+ * Reads the number of samples in the block being built
+ * @param enc: encoder to check
+ * @return number of samples in the block
+ */
+uint16_t gorilla_count(GorillaEncoder *enc);
+
+/**
+ * Sets the CRC at the end of a block. Call before writing a block out; the
+ * encoder's block can keep taking samples afterwards.
+ * @param block: GORILLA_BLOCK_SIZE byte block
+ */
+void gorilla_seal(uint8_t *block);
+
+/**
+ * Starts decoding a block
+ * @param dec: decoder to initialize
+ * @param block: GORILLA_BLOCK_SIZE byte block to decode
+ * @return 0 on success, or negative value if the block header or CRC is
+ *  invalid
+ */
+int gorilla_decoder_init(GorillaDecoder *dec, const uint8_t *block);
+
+/**
+ * Reads the next sample from a block
+ * @param dec: decoder to read from
+ * @param timestamp: set to timestamp of sample
+ * @param value: set to sample value
+ * @return true if a sample was read, false at the end of the block
+ */
+bool gorilla_next(GorillaDecoder *dec, uint32_t *timestamp, float *value);
+
+#endif /* GORILLA_H_ */
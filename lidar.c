@@ -15,13 +15,14 @@
 
 /* BIOS Module headers */
 #include <ti/sysbios/BIOS.h>
+#include <ti/sysbios/gates/GateMutex.h>
+#include <ti/sysbios/knl/Clock.h>
 #include <ti/sysbios/knl/Event.h>
 #include <ti/sysbios/knl/Task.h>
 
 /* Ti Driver Headers */
 #include "ti_drivers_config.h"
 #include <ti/drivers/GPIO.h>
-#include <ti/drivers/UART.h>
 #include <ti/drivers/I2C.h>
 
 /* Standard libraries */
@@ -34,6 +35,7 @@
 #include "cli.h"
 #include "common.h"
 #include "storage.h"
+#include "trace.h"
 #include "transmission.h"
 #include "lidar.h"
 
@@ -48,7 +50,6 @@
                                  */
 #define LIDAR_READ_TIMEOUT 100  /**< how many ms to wait for data from system  \
                                  */
-#define LIDAR_SAMPLE_DELAY 500  /**< how many ms to wait for radar sample */
 #define LIDAR_BOARD_CMD_DELAY 2 /**< how many ms to wait between commands */
 #define RANGE_DELTA_MIN                                                        \
     0.8 /**< how many meters below offset to allow samples */
@@ -59,6 +60,7 @@
  * radar fail to return a sample
  */
 #define LIDAR_MIN_SAMPLES 1
+#define LIDAR_READ_TIMEDOUT -3 /**< Lidar did not finish a measurement */
 #define LIDAR_READ_NODATA -2   /**< Radar did not return any data */
 #define LIDAR_READ_NOPACKET -1 /**< Radar did not return a valid packet */
 #define LIDAR_SUCCESS 0        /**< Radar returned data */
@@ -73,6 +75,70 @@
 
 #define EVT_LIDAR_SAMPLE Event_Id_00    /**< Radar sample event ID */
 #define EVT_LIDAR_CALIBRATE Event_Id_01 /**< Radar calibration event ID */
+#define EVT_LIDAR_I2C_DONE Event_Id_02  /**< I2C transfer finished */
+
+///@{
+/**
+ * Measurement timing, in ms. A measurement takes a few ms on the Garmin, so
+ * the busy flag is first checked after LIDAR_MEASURE_DELAY, then every
+ * LIDAR_POLL_INTERVAL until the whole measurement has taken
+ * LIDAR_ACQ_TIMEOUT. Each I2C transfer gets LIDAR_I2C_TIMEOUT to complete.
+ */
+#define LIDAR_MEASURE_DELAY 2
+#define LIDAR_POLL_INTERVAL 1
+#define LIDAR_ACQ_TIMEOUT 100
+#define LIDAR_I2C_TIMEOUT 10
+///@}
+/**
+ * Longest MEASUREMENT_INTERVAL, in ms, the sensor takes in burst mode. With
+ * a longer sample spacing the sensor measures more often than it is read.
+ */
+#define LIDAR_BURST_MAX_INTERVAL 255
+/**
+ * Time in ms that burst reads are spaced beyond the sensor's measurement
+ * interval, so a new measurement always finishes between two reads: 2 ms
+ * for clock tick rounding, and about 3% for the sensor's clock running slow
+ */
+#define LIDAR_BURST_MARGIN(interval) (2 + (interval) / 32)
+/** Value written to ACQ_COMMANDS to start a measurement */
+#define LIDAR_ACQ_START 0x04
+/** STATUS bit set while a measurement is running */
+#define LIDAR_STATUS_BUSY 0x01
+
+/**
+ * Registers read by a busy flag poll expected to find the measurement done:
+ * STATUS through FULL_DELAY_HIGH, so the distance comes with it
+ */
+#define LIDAR_POLL_READ_COUNT (FULL_DELAY_HIGH - STATUS + 1)
+
+/** Steps of one lidar measurement */
+typedef enum {
+    LIDAR_STEP_TRIGGER, /**< start a measurement */
+    LIDAR_STEP_POLL,    /**< wait for the busy flag to clear */
+    LIDAR_STEP_READ,    /**< read the distance registers */
+    LIDAR_STEP_DONE,    /**< distance has been read */
+} LidarStep;
+
+/** Timing of the burst being read, see start_burst() */
+typedef struct {
+    uint32_t interval;  /**< ms between the sensor's measurements */
+    uint32_t period;    /**< ms between reads */
+    uint32_t next_read; /**< clock tick the next read is due at */
+    uint32_t last_read; /**< clock tick of the previous read */
+    float first;        /**< distance of the triggered first measurement */
+    bool first_ready;   /**< first has not been returned yet */
+} LidarBurst;
+
+/**
+ * One I2C transfer with the lidar. Each register access has its own, on the
+ * caller's stack, and it stays in use until the driver's callback ran.
+ */
+typedef struct {
+    I2C_Transaction transaction; /**< driver transaction, arg points here */
+    uint8_t tx[2];               /**< register address, then value written */
+    volatile bool done;          /**< set by the callback when it ends */
+    volatile bool status;        /**< true if the transfer succeeded */
+} GarminTransfer;
 
 /**
  * Lidar data packet. Only holds distance. Note the use of struct packing
@@ -86,18 +152,36 @@ typedef struct __attribute((__packed__)) LidarPacket {
 static I2C_Params garminParams;
 static I2C_Handle garmin_i2c;
 static Event_Handle lidarEventHandle;
-static I2C_Transaction garminTransaction = {0};
+/**
+ * Held while a transfer is on the bus, so EVT_LIDAR_I2C_DONE always belongs
+ * to the transfer being waited for
+ */
+static GateMutex_Handle garminMutex;
+/**
+ * Ticks the last measurement took to clear its busy flag. Earlier polls
+ * read STATUS alone, as the distance read with them would be discarded.
+ */
+static uint32_t last_measure_ticks;
+/** Burst being read, while LidarBurstMode is set */
+static LidarBurst burst_state;
 
-// Should the wait for GPIO0 to be pressed during calibration be bypassed
-static bool button_press_bypassed = false;
 // Should each lidar sample be logged to the CLI
 static bool log_lidar_samples = true;
 
 /* Static functions */
 
 static int read_lidar_distance(float *distance);
-static int turn_on(uint8_t accuracy);
-static int turn_off(void);
+static int read_distance_registers(float *distance, uint32_t start);
+static int start_burst(int spacing);
+static int read_burst_distance(float *distance);
+static int stop_burst(void);
+static float garmin_distance(const uint8_t *regs);
+static int garmin_read(uint8_t reg, uint8_t *buf, size_t count,
+                       uint32_t start);
+static int garmin_write(uint8_t reg, uint8_t value, uint32_t start);
+static int garmin_transfer(GarminTransfer *xfer, uint32_t start);
+static void lidar_i2c_callback(I2C_Handle handle,
+                               I2C_Transaction *transaction, bool status);
 /*
 static int configure_lidar();
 static int wait_data(const char *expected, int len);
@@ -118,12 +202,21 @@ void lidar_init() {
     // Set up the I2C to read data from the sensor
     I2C_Params_init(&garminParams);
     garminParams.bitRate = I2C_400kHz;
-    garminParams.transferMode = I2C_MODE_BLOCKING;
+    /*
+     * Transfers complete in the background, and the lidar task sleeps on an
+     * event until they do, so a hung bus cannot hold the task forever.
+     */
+    garminParams.transferMode = I2C_MODE_CALLBACK;
+    garminParams.transferCallbackFxn = lidar_i2c_callback;
 
     lidarEventHandle = Event_create(NULL, NULL);
     if (!lidarEventHandle) {
         System_abort("Could not create lidar event\n");
     }
+    garminMutex = GateMutex_create(NULL, NULL);
+    if (!garminMutex) {
+        System_abort("Could not create lidar I2C mutex\n");
+    }
 
     /** FIX ME **/
     // I think the following lines are about controlling the power pins on the sensor to minimize power
@@ -155,11 +248,14 @@ void lidar_init() {
 }
 
 void lidar_run(UArg arg0, UArg arg1) {
-    int num_samples;
+    int num_samples, ret;
     UInt events;
     float num_samples_avg;
     float sum;
     SensorDataPacket packet;
+
+    (void)arg0;
+    (void)arg1;
     System_printf("sensor task starting\n");
     Watchdog_clear(watchdogHandle);
     cli_log("Lidar task starting with distance offset of %.2f\n",
@@ -218,21 +314,43 @@ void lidar_run(UArg arg0, UArg arg1) {
             */
             struct timespec ts;
             float distance;
+            bool burst = false;
             num_samples = program_config.lidar_sample_count;
             num_samples_avg = 0;
             sum = 0;
+            if (program_config.lidar_burst_mode) {
+                // Let the sensor measure on its own, and just read results
+                burst = start_burst(program_config.lidar_sample_spacing) ==
+                        LIDAR_SUCCESS;
+                if (!burst) {
+                    cli_log("Could not start lidar burst, triggering each "
+                            "sample\n");
+                }
+            }
             while (num_samples--) {
-                Task_sleep(LIDAR_SAMPLE_DELAY);
-                num_samples_avg = num_samples_avg + 1.0;
-                if (read_lidar_distance(&distance) != LIDAR_SUCCESS) {
+                if (burst) {
+                    // Paced to the sensor, see read_burst_distance()
+                    ret = read_burst_distance(&distance);
+                } else {
+                    Task_sleep(program_config.lidar_sample_spacing);
+                    ret = read_lidar_distance(&distance);
+                }
+                if (ret != LIDAR_SUCCESS) {
                     Watchdog_clear(watchdogHandle);
                     System_printf("Failed to get sample from lidar board\n");
                     System_flush();
-                    cli_log("Did not get sample from lidar board\n");
+                    cli_log(ret == LIDAR_READ_TIMEDOUT
+                                ? "Timed out waiting for lidar sample\n"
+                                : "Did not get sample from lidar board\n");
                     break; // Exit loop
                 }
+                // Only average the samples that were read
+                num_samples_avg = num_samples_avg + 1.0;
                 sum = sum + distance;
             }
+            if (burst && stop_burst() != LIDAR_SUCCESS) {
+                cli_log("Could not stop lidar burst\n");
+            }
             if (sum != 0 && num_samples_avg > LIDAR_MIN_SAMPLES) {
                 if (program_config.lidar_sample_offset == 0.0) {
                     // This would also be used for calibrating the lidar sample offset
@@ -250,7 +368,8 @@ void lidar_run(UArg arg0, UArg arg1) {
                     packet.timestamp = ts.tv_sec;
                     if (log_lidar_samples) {
                         System_printf("printf: %.03f\n", packet.distance);
-                        cli_log("cli_log: %.03f\n", packet.distance);
+                        TRACE("Lidar distance: %.03f\n",
+                              TRACE_FLOAT(packet.distance));
                         System_flush();
                     }
                     store_sensor_data(&packet);
@@ -270,46 +389,69 @@ void sample_lidar(void) {
     Event_post(lidarEventHandle, EVT_LIDAR_SAMPLE);
 }
 
+/**
+ * Takes one measurement. The measurement runs as a series of steps: start a
+ * measurement, poll the busy flag until it clears, then read the distance.
+ * Once the measurement has run as long as the last one did, each poll reads
+ * the distance registers along with STATUS, so the poll that finds the
+ * measurement done usually saves the separate read. The task sleeps between
+ * polls and while each I2C transfer runs.
+ * @param distance: set to the measured distance
+ * @return LIDAR_SUCCESS, LIDAR_READ_NODATA if a transfer failed, or
+ *  LIDAR_READ_TIMEDOUT if the measurement did not finish in time
+ */
 static int read_lidar_distance(float *distance) {
-
-    uint8_t writeData[2] = {ACQ_COMMANDS, 0x04};
-    uint8_t readData[2];
-
-    garminTransaction.slaveAddress = garmin_ADDRESS;      // Where we send to
-    garminTransaction.writeBuf = writeData;                // What we send
-    garminTransaction.writeCount = 2;                      // How many bytes to send
-    if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-        return LIDAR_READ_NODATA;
-    }
-
-    System_printf("Before data is ready\n");
-    System_flush();
-    do {
-        writeData[0] = STATUS;
-        garminTransaction.slaveAddress = garmin_ADDRESS;      // Where we send to
-        garminTransaction.writeBuf = writeData;                // What we send
-        garminTransaction.writeCount = 1;                      // How many bytes to send
-        garminTransaction.readBuf = readData;                  // Where to store data
-        garminTransaction.readCount = 1;                       // How many bytes to read
-        if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
+    LidarStep step = LIDAR_STEP_TRIGGER;
+    uint32_t start = Clock_getTicks();
+    uint8_t regs[LIDAR_POLL_READ_COUNT];
+    uint32_t elapsed;
+    size_t count;
+    int ret;
+
+    while (step != LIDAR_STEP_DONE) {
+        switch (step) {
+        case LIDAR_STEP_TRIGGER:
+            ret = garmin_write(ACQ_COMMANDS, LIDAR_ACQ_START, start);
+            if (ret < 0) {
+                return ret;
+            }
+            Task_sleep(LIDAR_MEASURE_DELAY);
+            step = LIDAR_STEP_POLL;
+            break;
+        case LIDAR_STEP_POLL:
+            elapsed = Clock_getTicks() - start;
+            count = elapsed >= last_measure_ticks ? LIDAR_POLL_READ_COUNT : 1;
+            ret = garmin_read(STATUS, regs, count, start);
+            if (ret < 0) {
+                return ret;
+            }
+            if (!(regs[0] & LIDAR_STATUS_BUSY)) {
+                last_measure_ticks = elapsed;
+                if (count == LIDAR_POLL_READ_COUNT) {
+                    *distance =
+                        garmin_distance(regs + (FULL_DELAY_LOW - STATUS));
+                    step = LIDAR_STEP_DONE;
+                } else {
+                    step = LIDAR_STEP_READ;
+                }
+            } else if (Clock_getTicks() - start >= LIDAR_ACQ_TIMEOUT) {
+                return LIDAR_READ_TIMEDOUT;
+            } else {
+                Task_sleep(LIDAR_POLL_INTERVAL);
+            }
+            break;
+        case LIDAR_STEP_READ:
+            ret = read_distance_registers(distance, start);
+            if (ret < 0) {
+                return ret;
+            }
+            step = LIDAR_STEP_DONE;
+            break;
+        default:
             return LIDAR_READ_NODATA;
         }
-    } while(readData[0] & 0x1 == 1);
-
-    System_printf("After data is ready\n");
-    System_flush();
-    writeData[0] = 0x10;
-    garminTransaction.slaveAddress = garmin_ADDRESS;      // Where we send to
-    garminTransaction.writeBuf = writeData;                // What we send
-    garminTransaction.writeCount = 1;                      // How many bytes to send
-    garminTransaction.readBuf = readData;                  // Where to store data
-    garminTransaction.readCount = 2;                       // How many bytes to read
-    if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-        return LIDAR_READ_NODATA;
     }
 
-    *distance = (readData[1] << 8) | readData[0];
-
     /*
     if (*distance < LIDAR_THRESHOLD ||
         *distance > LIDAR_UPPER_THRESHOLD) {
@@ -320,44 +462,234 @@ static int read_lidar_distance(float *distance) {
     return LIDAR_SUCCESS;
 }
 
-static int turn_on (uint8_t accuracy) {
-	// turns on always on mode and turns on high accuracy mode
-	uint8_t writeData0[2] = {POWER_MODE, 0xFF};
-	garminTransaction.slaveAddress = garmin_ADDRESS;
-	garminTransaction.writeBuf = writeData0;
-	garminTransaction.writeCount = 2;
-    if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-        return LIDAR_READ_NODATA;
+/**
+ * Reads the distance of the last finished measurement
+ * @param distance: set to the distance
+ * @param start: clock tick the measurement started at
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int read_distance_registers(float *distance, uint32_t start) {
+    uint8_t regs[2];
+    int ret;
+
+    ret = garmin_read(FULL_DELAY_LOW, regs, sizeof(regs), start);
+    if (ret < 0) {
+        return ret;
+    }
+    *distance = garmin_distance(regs);
+    return LIDAR_SUCCESS;
+}
+
+/**
+ * Starts burst mode: the sensor measures on its own, and keeps the newest
+ * distance in its result registers. A sample is then a single register
+ * read, rather than a trigger, status polls and a read.
+ * The first measurement is triggered, which times a measurement with the
+ * sensor's current settings. The sensor cannot measure faster than that, so
+ * shorter spacings are raised to it. The sensor then measures slightly
+ * faster than the samples are read (at most every LIDAR_BURST_MAX_INTERVAL
+ * ms), so every read finds a new distance.
+ * @param spacing: ms between the samples that will be read
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int start_burst(int spacing) {
+    uint32_t start, interval;
+    int ret;
+
+    ret = read_lidar_distance(&burst_state.first);
+    if (ret < 0) {
+        return ret;
+    }
+    interval = spacing - LIDAR_BURST_MARGIN(spacing);
+    if (interval > LIDAR_BURST_MAX_INTERVAL) {
+        interval = LIDAR_BURST_MAX_INTERVAL;
     }
+    // last_measure_ticks is rounded to clock ticks, so may be 1 ms short
+    if (interval < last_measure_ticks + 1) {
+        interval = last_measure_ticks + 1;
+    }
+    burst_state.interval = interval;
+    burst_state.period = interval + LIDAR_BURST_MARGIN(interval);
+    if (burst_state.period < (uint32_t)spacing) {
+        burst_state.period = spacing;
+    }
+    start = Clock_getTicks();
+    ret = garmin_write(MEASUREMENT_INTERVAL, interval, start);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = garmin_write(ACQ_COMMANDS, LIDAR_ACQ_START, start);
+    if (ret < 0) {
+        // Triggered measurements must not start a burst
+        stop_burst();
+        return ret;
+    }
+    burst_state.last_read = start;
+    burst_state.next_read = start + burst_state.period;
+    burst_state.first_ready = true;
+    return LIDAR_SUCCESS;
+}
+
+/**
+ * Reads the next distance of a burst. The first one comes from the
+ * measurement start_burst() triggered. The others are read on a fixed
+ * schedule, one period apart, so the time a read takes does not add to the
+ * window. A read less than a sensor interval (plus margin) after the
+ * previous one could find the same distance again, so after a late read
+ * the next one waits for a new measurement.
+ * @param distance: set to the distance
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int read_burst_distance(float *distance) {
+    uint32_t now, fresh;
+    int ret;
+
+    if (burst_state.first_ready) {
+        *distance = burst_state.first;
+        burst_state.first_ready = false;
+        return LIDAR_SUCCESS;
+    }
+    fresh = burst_state.last_read + burst_state.interval +
+            LIDAR_BURST_MARGIN(burst_state.interval);
+    if ((int32_t)(fresh - burst_state.next_read) > 0) {
+        burst_state.next_read = fresh;
+    }
+    now = Clock_getTicks();
+    if ((int32_t)(burst_state.next_read - now) > 0) {
+        Task_sleep(burst_state.next_read - now);
+        now = Clock_getTicks();
+    }
+    ret = read_distance_registers(distance, now);
+    if (ret < 0) {
+        return ret;
+    }
+    burst_state.last_read = now;
+    burst_state.next_read += burst_state.period;
+    return LIDAR_SUCCESS;
+}
+
+/**
+ * Stops burst mode, so the sensor only measures when triggered
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int stop_burst(void) {
+    return garmin_write(MEASUREMENT_INTERVAL, 0, Clock_getTicks());
+}
+
+/**
+ * Gets the distance held in the result registers
+ * @param regs: FULL_DELAY_LOW and FULL_DELAY_HIGH, in that order
+ * @return distance in cm
+ */
+static float garmin_distance(const uint8_t *regs) {
+    return (regs[1] << 8) | regs[0];
+}
 
-	uint8_t writeData1[2] = {HIGH_ACCURACY_MODE, accuracy};
-	garminTransaction.slaveAddress = garmin_ADDRESS;
-	garminTransaction.writeBuf = writeData1;
-	garminTransaction.writeCount = 2;
-	if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-	    return LIDAR_READ_NODATA;
-	}
+/**
+ * Reads consecutive lidar registers in one transfer: the first register's
+ * address is written, then a repeated start reads count bytes while the
+ * sensor increments the register address.
+ * @param reg: first register to read
+ * @param buf: set to the register values
+ * @param count: number of registers to read
+ * @param start: clock tick the measurement started at
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int garmin_read(uint8_t reg, uint8_t *buf, size_t count,
+                       uint32_t start) {
+    GarminTransfer xfer = {0};
+
+    xfer.tx[0] = reg;
+    xfer.transaction.writeBuf = xfer.tx;
+    xfer.transaction.writeCount = 1;
+    xfer.transaction.readBuf = buf;
+    xfer.transaction.readCount = count;
+    return garmin_transfer(&xfer, start);
+}
 
-	return LIDAR_SUCCESS;
+/**
+ * Writes one lidar register
+ * @param reg: register to write
+ * @param value: value to write
+ * @param start: clock tick the measurement started at
+ * @return LIDAR_SUCCESS, or negative value on error
+ */
+static int garmin_write(uint8_t reg, uint8_t value, uint32_t start) {
+    GarminTransfer xfer = {0};
+
+    xfer.tx[0] = reg;
+    xfer.tx[1] = value;
+    xfer.transaction.writeBuf = xfer.tx;
+    xfer.transaction.writeCount = 2;
+    return garmin_transfer(&xfer, start);
 }
 
-static int turn_off (void) {
-	// turn off high accuracy mode and turns on asynchronous mode
-	uint8_t writeData0[2] = {HIGH_ACCURACY_MODE, 0x00};
-	garminTransaction.slaveAddress = garmin_ADDRESS;
-	garminTransaction.writeBuf = writeData0;
-	garminTransaction.writeCount = 2;
-	if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-	    return LIDAR_READ_NODATA;
-	}
-
-	uint8_t writeData1[2] = {POWER_MODE, 0x00};
-	garminTransaction.slaveAddress = garmin_ADDRESS;
-	garminTransaction.writeBuf = writeData1;
-	garminTransaction.writeCount = 2;
-	if (!I2C_transfer(garmin_i2c, &garminTransaction)) {
-	    return LIDAR_READ_NODATA;
-	}
-
-	return LIDAR_SUCCESS;
+/**
+ * Runs one I2C transfer with the lidar and sleeps until it completes. A
+ * transfer that does not complete within LIDAR_I2C_TIMEOUT, or before the
+ * measurement's LIDAR_ACQ_TIMEOUT, is canceled. Either way, this only
+ * returns once the driver is done with the transfer, so its buffers can
+ * live on the caller's stack.
+ * @param xfer: transfer, with the buffers and counts of its transaction set
+ * @param start: clock tick the measurement started at
+ * @return LIDAR_SUCCESS, LIDAR_READ_NODATA if the transfer failed, or
+ *  LIDAR_READ_TIMEDOUT if it did not complete in time
+ */
+static int garmin_transfer(GarminTransfer *xfer, uint32_t start) {
+    uint32_t elapsed;
+    UInt32 timeout;
+    IArg key;
+    int ret;
+
+    xfer->transaction.slaveAddress = garmin_ADDRESS;
+    xfer->transaction.arg = xfer;
+    xfer->done = false;
+    xfer->status = false;
+    key = GateMutex_enter(garminMutex);
+    elapsed = Clock_getTicks() - start;
+    if (elapsed >= LIDAR_ACQ_TIMEOUT) {
+        GateMutex_leave(garminMutex, key);
+        return LIDAR_READ_TIMEDOUT;
+    }
+    timeout = LIDAR_ACQ_TIMEOUT - elapsed;
+    if (timeout > LIDAR_I2C_TIMEOUT) {
+        timeout = LIDAR_I2C_TIMEOUT;
+    }
+    if (!I2C_transfer(garmin_i2c, &xfer->transaction)) {
+        GateMutex_leave(garminMutex, key);
+        return LIDAR_READ_NODATA; // Transfer could not be started
+    }
+    ret = LIDAR_SUCCESS;
+    while (!xfer->done) {
+        if (!(Event_pend(lidarEventHandle, Event_Id_NONE, EVT_LIDAR_I2C_DONE,
+                         timeout) &
+              EVT_LIDAR_I2C_DONE)) {
+            // The driver calls the callback of the canceled transfer
+            I2C_cancel(garmin_i2c);
+            timeout = LIDAR_I2C_TIMEOUT;
+            ret = LIDAR_READ_TIMEDOUT;
+        }
+    }
+    GateMutex_leave(garminMutex, key);
+    if (ret == LIDAR_SUCCESS && !xfer->status) {
+        ret = LIDAR_READ_NODATA;
+    }
+    return ret;
+}
+
+/**
+ * I2C transfer callback, marks the transfer done and wakes the task waiting
+ * for it. Runs in interrupt context.
+ * @param handle: I2C handle
+ * @param transaction: finished transaction, part of a GarminTransfer
+ * @param status: true if the transfer succeeded
+ */
+static void lidar_i2c_callback(I2C_Handle handle,
+                               I2C_Transaction *transaction, bool status) {
+    GarminTransfer *xfer = transaction->arg;
+
+    (void)handle;
+    xfer->status = status;
+    xfer->done = true;
+    Event_post(lidarEventHandle, EVT_LIDAR_I2C_DONE);
 }
@@ -61,6 +61,9 @@
 
 #include "cli.h"
 #include "common.h"
+#include "config.h"
+#include "crc32.h"
+#include "pending.h"
 #include "radar.h"
 #include "storage.h"
 #include "transmission.h"
@@ -71,26 +74,11 @@
 
 /*
  * Global configuration structure
- * These are the default values
+ * Default values come from the schema in config.h
  * If an SD card is inserted, the config.txt file can override them.
  */
 
-ProgramConfiguration program_config = {
-    "HW_ID",       // Device hardware ID
-    1,             // Device synthetic ID
-    true,           // Lidar module enabled?
-    false,          // Radar module enabled?
-    false,          // Camera module enabled?
-    false,         // network module enabled?
-    "3.21.41.182", // remote server for network module to talk to
-    "f94ed0427c1d5d54b4308fe8c1aa7e03703d4bbd", // Auth token for server
-    15000,                                      // radar sample interval in ms
-    55, // number of radar samples to take every time the interval fires
-    0.0, // Distance to offset radar samples by (subtracts)
-    15000,                                      // lidar sample interval in ms
-    2,                                         // number of lidar samples to take every time the interval fires
-    0.0                                         // Distance to offset lidar samples by (subtracts)
-};
+ProgramConfiguration program_config = CONFIG_DEFAULTS;
 // Watchdog handle implemenation, used across code for watchdog timer
 Watchdog_Handle watchdogHandle;
 // Interval counting system ticks since last clock update
@@ -177,13 +165,17 @@ static void main_task(UArg arg0, UArg arg1) {
     Clock_Params clockParams;
     Clock_Handle clock;
     /* Call task init functions */
+    // Before any checksums are taken, so they all use the same path
+    crc32_init();
+    // Before any sample is taken, so samples retained across a reset are kept
+    pending_init();
     cli_init();
     storage_init();
 
     // Read configuration file
     /** FIX ME **/
     // Maybe need to check what this does
-    read_configuration();
+    read_configuration(true);
 
     /*
     if (program_config.radar_module_enabled) {
@@ -207,6 +199,8 @@ static void main_task(UArg arg0, UArg arg1) {
         // Ensure transmission module will remain off
         GPIO_setConfig(CONFIG_GPIO_SIM_PWRKEY,
                        GPIO_CFG_OUTPUT | GPIO_CFG_OUT_HIGH);
+        // Samples retained for upload will never be sent
+        pending_done_through(UINT32_MAX, PENDING_UPLOAD);
     }
     /*
      * Start all required tasks
@@ -289,9 +283,10 @@ static void main_task(UArg arg0, UArg arg1) {
         clockupdate_interal += program_config.lidar_sample_interval;
         if (clockupdate_interal >= NETWORK_TIME_DELAY) {
             clockupdate_interal = 0;
-            request_rtc_update();
+            // Runs in the next modem window, alongside the next upload
+            schedule_rtc_update();
         }
-        // Force log files to flush to disk
+        // Write out file data buffered longer than the flush age
         sync_to_disk();
     }
 }
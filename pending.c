@@ -0,0 +1,294 @@
+/**
+ * @file pending.c
+ * Ring of samples not yet stored or uploaded, in RAM kept across resets.
+ *
+ * The ring lives in the .noinit section, which the linker scripts place in
+ * SRAM outside .bss, so the C startup code neither zeroes nor loads it. A
+ * header with a magic value and an inverted copy of the next sequence number
+ * tells a warm reset from a power up, where SRAM holds random data. Sample
+ * seq always goes in slot seq % PENDING_SLOTS, so a full ring overwrites its
+ * oldest sample, and every slot carries the CRC-32 of its contents, so a slot
+ * torn by a reset part way through an update is dropped.
+ *
+ * Slots are only touched with interrupts disabled, which keeps every update
+ * to a few dozen instructions and lets any task add and release samples.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ti/sysbios/hal/Hwi.h>
+
+#include "crc32.h"
+#include "pending.h"
+
+/** Magic value at the start of the retained region ("PEND") */
+#define PENDING_MAGIC 0x444E4550
+
+/** Retained sample */
+typedef struct {
+    uint32_t seq;       /**< sequence number, 0 if the slot is free */
+    uint32_t timestamp; /**< sample timestamp */
+    float distance;     /**< sample distance */
+    uint16_t pending;   /**< consumers still needing the sample */
+    uint16_t reserved;  /**< pads slot, always 0 */
+    uint32_t crc;       /**< CRC-32 of the fields above */
+} Slot;
+
+/** Retained region */
+typedef struct {
+    uint32_t magic;        /**< PENDING_MAGIC */
+    uint32_t next_seq;     /**< sequence number of the next sample added */
+    uint32_t next_seq_inv; /**< ~next_seq, catches random SRAM at power up */
+    Slot slots[PENDING_SLOTS];
+} PendingRegion;
+
+static void write_slot(Slot *slot);
+static bool slot_valid(const Slot *slot, unsigned int index);
+static void release(Slot *slot, uint16_t flags);
+static unsigned int replay_before(uint32_t end, uint16_t flag,
+                                  void (*callback)(SensorDataPacket *packet,
+                                                   uint32_t seq, void *arg),
+                                  void *arg);
+
+/** Retained ring, left alone by the C startup code */
+static PendingRegion region __attribute__((section(".noinit")));
+/** Sequence number of the first sample added since the reset */
+static uint32_t boot_seq;
+/** Samples dropped because the ring was full */
+static uint32_t dropped_count;
+
+/**
+ * Checks the retained ring after a reset. Samples with a bad checksum are
+ * dropped, and a ring that was never set up, or lost power, is cleared.
+ * Must be called before any other pending function, after crc32_init().
+ * @return number of retained samples
+ */
+unsigned int pending_init() {
+    unsigned int i, count = 0;
+
+    if (region.magic != PENDING_MAGIC ||
+        region.next_seq != ~region.next_seq_inv || region.next_seq == 0) {
+        memset(&region, 0, sizeof(region));
+        region.magic = PENDING_MAGIC;
+        region.next_seq = 1;
+        region.next_seq_inv = ~region.next_seq;
+        boot_seq = region.next_seq;
+        return 0;
+    }
+    boot_seq = region.next_seq;
+    for (i = 0; i < PENDING_SLOTS; i++) {
+        if (region.slots[i].seq == 0) {
+            continue;
+        }
+        if (slot_valid(&region.slots[i], i)) {
+            count++;
+        } else {
+            memset(&region.slots[i], 0, sizeof(Slot));
+        }
+    }
+    return count;
+}
+
+/**
+ * Retains a sample until every consumer in flags releases it. If the ring
+ * is full, the oldest sample is dropped from it to make room.
+ * @param packet: sample to retain
+ * @param flags: PENDING_STORE and/or PENDING_UPLOAD
+ * @return sequence number of the sample, never 0
+ */
+uint32_t pending_add(const SensorDataPacket *packet, uint16_t flags) {
+    uint32_t seq;
+    Slot *slot;
+    UInt key;
+
+    key = Hwi_disable();
+    seq = region.next_seq;
+    region.next_seq = seq + 1 ? seq + 1 : 1;
+    region.next_seq_inv = ~region.next_seq;
+    slot = &region.slots[seq % PENDING_SLOTS];
+    if (slot->seq != 0) {
+        dropped_count++;
+    }
+    slot->seq = seq;
+    slot->timestamp = (uint32_t)packet->timestamp;
+    slot->distance = packet->distance;
+    slot->pending = flags;
+    slot->reserved = 0;
+    write_slot(slot);
+    Hwi_restore(key);
+    return seq;
+}
+
+/**
+ * Releases one sample for the given consumers
+ * @param seq: sequence number from pending_add(), ignored if 0
+ * @param flags: consumers that are done with the sample
+ */
+void pending_done(uint32_t seq, uint16_t flags) {
+    Slot *slot;
+    UInt key;
+
+    if (seq == 0) {
+        return;
+    }
+    key = Hwi_disable();
+    slot = &region.slots[seq % PENDING_SLOTS];
+    if (slot->seq == seq) {
+        release(slot, flags);
+    }
+    Hwi_restore(key);
+}
+
+/**
+ * Releases every sample up to a sequence number for the given consumers
+ * @param seq: newest sequence number to release
+ * @param flags: consumers that are done with the samples
+ */
+void pending_done_through(uint32_t seq, uint16_t flags) {
+    unsigned int i;
+    UInt key;
+
+    for (i = 0; i < PENDING_SLOTS; i++) {
+        key = Hwi_disable();
+        if (region.slots[i].seq != 0 && region.slots[i].seq <= seq) {
+            release(&region.slots[i], flags);
+        }
+        Hwi_restore(key);
+    }
+}
+
+/**
+ * Passes every sample retained from before the reset that is pending for a
+ * consumer to a callback, oldest first. Samples added since pending_init()
+ * are left out, as they are still queued. The samples stay retained until
+ * the consumer releases them.
+ * @param flag: consumer to replay samples for
+ * @param callback: called with each sample and its sequence number
+ * @param arg: passed to callback
+ * @return number of samples replayed
+ */
+unsigned int pending_replay(uint16_t flag,
+                            void (*callback)(SensorDataPacket *packet,
+                                             uint32_t seq, void *arg),
+                            void *arg) {
+    return replay_before(boot_seq, flag, callback, arg);
+}
+
+/**
+ * Passes every retained sample up to a sequence number that is pending for a
+ * consumer to a callback, oldest first, including samples added since
+ * pending_init(). Used by a consumer that lost samples it had taken but not
+ * yet released. The samples stay retained until the consumer releases them.
+ * @param seq: newest sequence number to replay
+ * @param flag: consumer to replay samples for
+ * @param callback: called with each sample and its sequence number
+ * @param arg: passed to callback
+ * @return number of samples replayed
+ */
+unsigned int pending_replay_through(uint32_t seq, uint16_t flag,
+                                    void (*callback)(SensorDataPacket *packet,
+                                                     uint32_t seq, void *arg),
+                                    void *arg) {
+    if (seq == 0) {
+        return 0;
+    }
+    return replay_before(seq + 1, flag, callback, arg);
+}
+
+/**
+ * Gets the number of samples dropped from the ring because it was full,
+ * since boot
+ * @return number of dropped samples
+ */
+uint32_t pending_dropped() {
+    return dropped_count;
+}
+
+/**
+ * Sets the CRC of a slot after its fields were changed
+ * @param slot: slot to update
+ */
+static void write_slot(Slot *slot) {
+    slot->crc = crc32(slot, offsetof(Slot, crc));
+}
+
+/**
+ * Checks a retained slot found at startup
+ * @param slot: slot to check
+ * @param index: position of slot in the ring
+ * @return true if the slot holds a sample still pending for a consumer
+ */
+static bool slot_valid(const Slot *slot, unsigned int index) {
+    return slot->crc == crc32(slot, offsetof(Slot, crc)) &&
+           slot->seq % PENDING_SLOTS == index &&
+           slot->seq < region.next_seq && slot->pending != 0 &&
+           slot->reserved == 0;
+}
+
+/**
+ * Clears consumers from a slot, freeing it once none are left. Call with
+ * interrupts disabled.
+ * @param slot: slot holding a sample
+ * @param flags: consumers that are done with the sample
+ */
+static void release(Slot *slot, uint16_t flags) {
+    if (!(slot->pending & flags)) {
+        return;
+    }
+    slot->pending &= ~flags;
+    if (slot->pending == 0) {
+        memset(slot, 0, sizeof(Slot));
+    } else {
+        write_slot(slot);
+    }
+}
+
+/**
+ * Passes every retained sample older than a sequence number that is pending
+ * for a consumer to a callback, oldest first
+ * @param end: sequence number after the newest sample to replay
+ * @param flag: consumer to replay samples for
+ * @param callback: called with each sample and its sequence number
+ * @param arg: passed to callback
+ * @return number of samples replayed
+ */
+static unsigned int replay_before(uint32_t end, uint16_t flag,
+                                  void (*callback)(SensorDataPacket *packet,
+                                                   uint32_t seq, void *arg),
+                                  void *arg) {
+    SensorDataPacket packet;
+    uint32_t last = 0, seq;
+    unsigned int i, count = 0;
+    UInt key;
+
+    /*
+     * Samples are copied out one at a time with interrupts disabled, and
+     * the callback runs with them enabled.
+     */
+    for (;;) {
+        seq = 0;
+        key = Hwi_disable();
+        for (i = 0; i < PENDING_SLOTS; i++) {
+            const Slot *slot = &region.slots[i];
+            if (slot->seq > last && slot->seq < end &&
+                (slot->pending & flag) &&
+                (seq == 0 || slot->seq < seq)) {
+                seq = slot->seq;
+                packet.timestamp = slot->timestamp;
+                packet.distance = slot->distance;
+            }
+        }
+        Hwi_restore(key);
+        if (seq == 0) {
+            return count;
+        }
+        callback(&packet, seq, arg);
+        last = seq;
+        count++;
+    }
+}
@@ -0,0 +1,104 @@
+/**
+ * @file pending.h
+ * Ring of samples that were taken but not yet stored or uploaded, kept in
+ * RAM that is not cleared at startup. SRAM keeps its contents through
+ * watchdog resets, System_abort and the reset CLI command, so samples still
+ * queued when one of these happens are replayed into storage and
+ * transmission at the next boot instead of being lost. A power loss clears
+ * the ring.
+ *
+ * Each sample is added once per consumer that still needs it, and is
+ * identified by a sequence number that keeps increasing across resets. A
+ * consumer releases a sample once it no longer needs the retained copy.
+ * Replay can deliver a sample that was handled just before the reset a
+ * second time, but never drops one the ring still holds.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef PENDING_H_
+#define PENDING_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/** Samples the ring can hold */
+#define PENDING_SLOTS 128
+
+///@{
+/** Consumers a retained sample is pending for */
+#define PENDING_STORE 0x01  /**< not yet on the SD card or in flash */
+#define PENDING_UPLOAD 0x02 /**< not yet accepted by the backend */
+///@}
+
+/**
+ * Checks the retained ring after a reset. Samples with a bad checksum are
+ * dropped, and a ring that was never set up, or lost power, is cleared.
+ * Must be called before any other pending function, after crc32_init().
+ * @return number of retained samples
+ */
+unsigned int pending_init();
+
+/**
+ * Retains a sample until every consumer in flags releases it. If the ring
+ * is full, the oldest sample is dropped from it to make room.
+ * @param packet: sample to retain
+ * @param flags: PENDING_STORE and/or PENDING_UPLOAD
+ * @return sequence number of the sample, never 0
+ */
+uint32_t pending_add(const SensorDataPacket *packet, uint16_t flags);
+
+/**
+ * Releases one sample for the given consumers
+ * @param seq: sequence number from pending_add(), ignored if 0
+ * @param flags: consumers that are done with the sample
+ */
+void pending_done(uint32_t seq, uint16_t flags);
+
+/**
+ * Releases every sample up to a sequence number for the given consumers
+ * @param seq: newest sequence number to release
+ * @param flags: consumers that are done with the samples
+ */
+void pending_done_through(uint32_t seq, uint16_t flags);
+
+/**
+ * Passes every sample retained from before the reset that is pending for a
+ * consumer to a callback, oldest first. Samples added since pending_init()
+ * are left out, as they are still queued. The samples stay retained until
+ * the consumer releases them.
+ * @param flag: consumer to replay samples for
+ * @param callback: called with each sample and its sequence number
+ * @param arg: passed to callback
+ * @return number of samples replayed
+ */
+unsigned int pending_replay(uint16_t flag,
+                            void (*callback)(SensorDataPacket *packet,
+                                             uint32_t seq, void *arg),
+                            void *arg);
+
+/**
+ * Passes every retained sample up to a sequence number that is pending for a
+ * consumer to a callback, oldest first, including samples added since
+ * pending_init(). Used by a consumer that lost samples it had taken but not
+ * yet released. The samples stay retained until the consumer releases them.
+ * @param seq: newest sequence number to replay
+ * @param flag: consumer to replay samples for
+ * @param callback: called with each sample and its sequence number
+ * @param arg: passed to callback
+ * @return number of samples replayed
+ */
+unsigned int pending_replay_through(uint32_t seq, uint16_t flag,
+                                    void (*callback)(SensorDataPacket *packet,
+                                                     uint32_t seq, void *arg),
+                                    void *arg);
+
+/**
+ * Gets the number of samples dropped from the ring because it was full,
+ * since boot
+ * @return number of dropped samples
+ */
+uint32_t pending_dropped();
+
+#endif /* PENDING_H_ */
@@ -32,6 +32,7 @@
 #include "cli.h"
 #include "common.h"
 #include "storage.h"
+#include "trace.h"
 #include "transmission.h"
 
 /** Constant values board should reply with */
@@ -328,7 +329,7 @@ void radar_run(UArg arg0, UArg arg1) {
                     clock_gettime(CLOCK_REALTIME, &ts);
                     packet.timestamp = ts.tv_sec;
                     if (log_radar_samples) {
-                        cli_log("%.03f\n", packet.distance);
+                        TRACE("%.03f\n", TRACE_FLOAT(packet.distance));
                     }
                     store_sensor_data(&packet);
                     transmit_sensor_data(&packet);
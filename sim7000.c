@@ -74,6 +74,11 @@
 /** number of times to "ping" SIM with AT command */
 #define SIM7000_BOOT_ATTEMPTS 2
 
+/** File system directory index for "/customer/" (see AT+CFSWFILE) */
+#define SIM_FS_CUSTOMER_DIR 3
+/** ms the SIM waits for file data after prompting with DOWNLOAD */
+#define SIM_FS_INPUT_TIME 10000
+
 /** SIM7000 phone full functionality mode */
 #define SIM_FULL_FUNCTIONALITY 1
 
@@ -101,6 +106,7 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
                         int method);
 static int enable_app_network(SIM7000_Config *config);
 static void disable_app_network(SIM7000_Config *config);
+static void release_app_network(SIM7000_Config *config);
 static int connect_http(SIM7000_Config *config, HTTPConnectionRequest *request);
 static void disconnect_http(SIM7000_Config *config);
 static int set_http_headers(SIM7000_Config *config,
@@ -114,7 +120,9 @@ static int parse_time(char *str, struct timespec *time);
 static bool set_sim_functionality(SIM7000_Config *config, int code);
 static bool enable_network(SIM7000_Config *config);
 static bool enable_bearer(SIM7000_Config *config);
+static int ntp_request(SIM7000_Config *config, struct timespec *time);
 static bool disable_result_codes(SIM7000_Config *config);
+static int fs_file_size(SIM7000_Config *config, const char *filename);
 
 // Supported baud rates for the SIM
 static const uint32_t sim7000_baudrates[] = {
@@ -132,6 +140,7 @@ void SIM7000_init_params(SIM7000_Config *config) {
     config->reset_pin = UINT8_MAX;
     config->UART_index = UINT8_MAX;
     config->sim_running = false;
+    config->session_active = false;
 }
 
 /**
@@ -231,9 +240,11 @@ bool SIM7000_poweroff(SIM7000_Config *config) {
             System_flush();
             config->sim_running =
                 false; // Assume that SIM timed out because it's off
+            config->session_active = false;
             return false;
         } else {
             config->sim_running = false;
+            config->session_active = false;
             // Wait for the board to actually power down
             delay_ms(SIM7000_POWERDOWN_DELAY);
             return true;
@@ -492,18 +503,195 @@ int SIM7000_http_head(SIM7000_Config *config, HTTPConnectionRequest *request) {
     return http_generic(config, request, HTTP_HEAD_CODE);
 }
 
+/**
+ * Opens a data session. The network is registered and the app network PDP
+ * context is activated once, then shared by every HTTP request and NTP sync
+ * made until SIM7000_session_close() is called.
+ * @param config: SIM7000 Config structure
+ * @return true on success, false otherwise
+ */
+bool SIM7000_session_open(SIM7000_Config *config) {
+    if (config->session_active) {
+        return true;
+    }
+    // Start from a clean IP and app network state
+    set_ip_initial(config);
+    disconnect_http(config);
+    disable_app_network(config);
+    if (!enable_network(config)) {
+        System_printf("Failed to enable SIM network\n");
+        return false;
+    }
+    if (enable_app_network(config) < 0) {
+        System_printf("Failed to enable app network\n");
+        return false;
+    }
+    config->session_active = true;
+    return true;
+}
+
+/**
+ * Closes a data session opened with SIM7000_session_open()
+ * @param config: SIM7000 Config structure
+ */
+void SIM7000_session_close(SIM7000_Config *config) {
+    if (!config->session_active) {
+        return;
+    }
+    config->session_active = false;
+    disconnect_http(config);
+    disable_app_network(config);
+}
+
+/**
+ * Writes data to a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file (8.3 format) in the customer directory
+ * @param data: data to write
+ * @param len: length of data, at most SIM7000_FS_MAX_WRITE bytes
+ * @param append: append to the file if true, otherwise overwrite it
+ * @return 0 on success, or negative value on error
+ */
+int SIM7000_fs_write(SIM7000_Config *config, const char *filename,
+                     const uint8_t *data, uint16_t len, bool append) {
+    char cmd[80];
+    int ret = 0;
+    if (len == 0 || len > SIM7000_FS_MAX_WRITE) {
+        return -1;
+    }
+    // Allocate the SIM's file system buffer
+    if (!send_verified_reply(config, "AT+CFSINIT", OK_REPLY, SIM7000_TIMEOUT)) {
+        System_printf("Could not start SIM file system\n");
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "AT+CFSWFILE=%d,\"%s\",%d,%d,%d",
+             SIM_FS_CUSTOMER_DIR, filename, append ? 1 : 0, len,
+             SIM_FS_INPUT_TIME);
+    // SIM prompts for the file data with "DOWNLOAD"
+    if (!send_verified_reply(config, cmd, "DOWNLOAD", SIM7000_TIMEOUT)) {
+        System_printf("SIM did not prompt for file data\n");
+        ret = -1;
+    } else {
+        if (UART_write(config->uart, data, len) < 0) {
+            System_abort("Could not write to SIM UART\n");
+        }
+        if (!verified_readline(config, OK_REPLY, SIM7000_LONG_TIMEOUT)) {
+            System_printf("SIM file write failed\n");
+            ret = -1;
+        }
+    }
+    // Free the file system buffer
+    send_verified_reply(config, "AT+CFSTERM", OK_REPLY, SIM7000_TIMEOUT);
+    return ret;
+}
+
+/**
+ * Reads data from a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @param output: buffer to read data into
+ * @param len: length of the output buffer
+ * @return number of bytes read, SIM7000_FS_NOFILE if the file does not
+ *  exist, or other negative value on error
+ */
+int SIM7000_fs_read(SIM7000_Config *config, const char *filename,
+                    uint8_t *output, uint16_t len) {
+    char cmd[80];
+    int file_len, ret;
+    if (!send_verified_reply(config, "AT+CFSINIT", OK_REPLY, SIM7000_TIMEOUT)) {
+        System_printf("Could not start SIM file system\n");
+        return -1;
+    }
+    file_len = fs_file_size(config, filename);
+    if (file_len < 0) {
+        send_verified_reply(config, "AT+CFSTERM", OK_REPLY, SIM7000_TIMEOUT);
+        return file_len;
+    }
+    if (file_len > len) {
+        file_len = len;
+    }
+    /*
+     * Read the file from position 0. Reply is "+CFSRFILE: <len>", followed by
+     * the raw file data and "OK".
+     */
+    snprintf(cmd, sizeof(cmd), "AT+CFSRFILE=%d,\"%s\",0,%d,0",
+             SIM_FS_CUSTOMER_DIR, filename, file_len);
+    if (!send_verified_reply(config, cmd, "+CFSRFILE: ", SIM7000_TIMEOUT)) {
+        System_printf("SIM file read failed\n");
+        ret = -1;
+    } else {
+        ret = read_to_buffer(config, output, file_len);
+        if (ret < file_len ||
+            !verified_readline(config, OK_REPLY, SIM7000_TIMEOUT)) {
+            System_printf("SIM file read was incomplete\n");
+            ret = -1;
+        }
+    }
+    send_verified_reply(config, "AT+CFSTERM", OK_REPLY, SIM7000_TIMEOUT);
+    return ret;
+}
+
+/**
+ * Gets the size of a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @return size of the file, SIM7000_FS_NOFILE if it does not exist, or other
+ *  negative value on error
+ */
+int SIM7000_fs_size(SIM7000_Config *config, const char *filename) {
+    int ret;
+    if (!send_verified_reply(config, "AT+CFSINIT", OK_REPLY, SIM7000_TIMEOUT)) {
+        System_printf("Could not start SIM file system\n");
+        return -1;
+    }
+    ret = fs_file_size(config, filename);
+    send_verified_reply(config, "AT+CFSTERM", OK_REPLY, SIM7000_TIMEOUT);
+    return ret;
+}
+
+/**
+ * Deletes a file from the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @return true on success, false otherwise
+ */
+bool SIM7000_fs_delete(SIM7000_Config *config, const char *filename) {
+    char cmd[80];
+    bool ret;
+    if (!send_verified_reply(config, "AT+CFSINIT", OK_REPLY, SIM7000_TIMEOUT)) {
+        System_printf("Could not start SIM file system\n");
+        return false;
+    }
+    snprintf(cmd, sizeof(cmd), "AT+CFSDFILE=%d,\"%s\"", SIM_FS_CUSTOMER_DIR,
+             filename);
+    ret = send_verified_reply(config, cmd, OK_REPLY, SIM7000_TIMEOUT);
+    send_verified_reply(config, "AT+CFSTERM", OK_REPLY, SIM7000_TIMEOUT);
+    return ret;
+}
+
 /**
  * Synchronizes the SIM7000 Clock with a network time server, and updates the
- * supplied timespec struct with the current time
+ * supplied timespec struct with the current time.
+ * If a data session is open, the sync runs over the session's app network
+ * context. Otherwise (or if the module firmware does not support NTP over the
+ * app network) a separate SAPBR bearer is opened for the sync.
  * @param config: SIM7000 Config structure
  * @param time: timespec struct, populated with the current time to second
  *  accuracy
  * @return 0 on success, or negative value on error
  */
 int SIM7000_ntp_time(SIM7000_Config *config, struct timespec *time) {
-    int response_len;
     char cmd[80];
-    if (!enable_network(config)) {
+    if (config->session_active) {
+        // Context ID 0 selects the app network PDP context (AT+CNACT)
+        snprintf(cmd, sizeof(cmd), "AT+CNTP=\"%s\",%d,0", NTP_TIMESERVER,
+                 TIMEZONE);
+        if (send_verified_reply(config, cmd, OK_REPLY, SIM7000_TIMEOUT) &&
+            ntp_request(config, time) == 0) {
+            return 0;
+        }
+        System_printf("NTP over app network failed, using bearer\n");
+    } else if (!enable_network(config)) {
         System_printf("Failed to enable SIM network\n");
         return -1;
     }
@@ -518,11 +706,33 @@ int SIM7000_ntp_time(SIM7000_Config *config, struct timespec *time) {
         send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
         return -1;
     }
+    if (ntp_request(config, time) < 0) {
+        // Close bearer
+        send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
+        return -1;
+    }
+    // Close the bearer (closes network connection)
+    if (!send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY,
+                             SIM7000_TIMEOUT)) {
+        System_printf("Could not close bearer\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs an NTP sync with the timeserver set by AT+CNTP, and reads back the
+ * synchronized time. Does not open or close any network context.
+ * @param config: SIM7000 Config structure
+ * @param time: timespec struct, populated with the current time
+ * @return 0 on success, or negative value on error
+ */
+static int ntp_request(SIM7000_Config *config, struct timespec *time) {
+    int response_len;
+    char cmd[80];
     // Make NTP synchronization request
     if (!send_verified_reply(config, "AT+CNTP", OK_REPLY, SIM7000_TIMEOUT)) {
         System_printf("Failed to make NTP sync request\n");
-        // Close bearer
-        send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
         return -1;
     }
     /*
@@ -532,31 +742,19 @@ int SIM7000_ntp_time(SIM7000_Config *config, struct timespec *time) {
      */
     if (sim_readline(config, SIM7000_NETWORK_TIMEOUT) == 0) {
         System_printf("Did not get new NTP time\n");
-        // Close bearer
-        send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
         return -1;
     }
     // Now, query the time and parse it.
     response_len = get_reply(config, "AT+CCLK?", SIM7000_TIMEOUT);
     if (response_len == 0) {
         System_printf("NTP time query did not get response");
-        // Close bearer
-        send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
         return -1;
     }
-    // Copy the time out here, so we can parse after closing the bearer
+    // Copy the time out here, so the reply buffer can be reused
     strncpy(cmd, config->replybuffer, sizeof(cmd));
     // Verify that command status is "OK"
     if (!verified_readline(config, OK_REPLY, SIM7000_TIMEOUT)) {
         System_printf("NTP time query did not respond OK\n");
-        // Close bearer
-        send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY, SIM7000_TIMEOUT);
-        return -1;
-    }
-    // Close the bearer (closes network connection)
-    if (!send_verified_reply(config, "AT+SAPBR=0,1", OK_REPLY,
-                             SIM7000_TIMEOUT)) {
-        System_printf("Could not close bearer\n");
         return -1;
     }
     /*
@@ -1014,18 +1212,23 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
                         int method) {
     int data_len;
     char cmd[80];
-    // Verify that IP State is initial
-    set_ip_initial(config);
-    disconnect_http(config);
-    disable_app_network(config);
-    if (!enable_network(config)) {
-        System_printf("Failed to enable SIM network\n");
-        return -1;
-    }
-    // Set up the APN
-    if (enable_app_network(config) < 0) {
-        System_printf("Failed to enable app network\n");
-        return -1;
+    if (config->session_active) {
+        // Reuse the session's app network, just drop any old connection
+        disconnect_http(config);
+    } else {
+        // Verify that IP State is initial
+        set_ip_initial(config);
+        disconnect_http(config);
+        disable_app_network(config);
+        if (!enable_network(config)) {
+            System_printf("Failed to enable SIM network\n");
+            return -1;
+        }
+        // Set up the APN
+        if (enable_app_network(config) < 0) {
+            System_printf("Failed to enable app network\n");
+            return -1;
+        }
     }
 
     // Connect to the HTTP server
@@ -1039,7 +1242,7 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
         System_printf("Failed to set headers\n");
         // Drop http connection
         disconnect_http(config);
-        disable_app_network(config);
+        release_app_network(config);
         return -1;
     }
 
@@ -1051,7 +1254,7 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
          method == HTTP_PATCH_CODE)) {
         if (add_http_body(config, request) < 0) {
             disconnect_http(config);
-            disable_app_network(config);
+            release_app_network(config);
             return -1;
         }
     }
@@ -1061,7 +1264,7 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
     if (!send_verified_reply(config, cmd, OK_REPLY, SIM7000_NETWORK_TIMEOUT)) {
         System_printf("HTTP request failed\n");
         disconnect_http(config);
-        disable_app_network(config);
+        release_app_network(config);
         return -1;
     }
 
@@ -1070,13 +1273,13 @@ static int http_generic(SIM7000_Config *config, HTTPConnectionRequest *request,
     if (data_len < 0) {
         System_printf("Failed to read HTTP response\n");
         disconnect_http(config);
-        disable_app_network(config);
+        release_app_network(config);
         return -1;
     }
 
     // Data has been read. Close HTTP connection.
     disconnect_http(config);
-    disable_app_network(config);
+    release_app_network(config);
     return data_len;
 }
 
@@ -1125,8 +1328,12 @@ static int read_http_response(SIM7000_Config *config,
         return -1;
     }
     if (data_len > request->response_len) {
-        System_printf("Error: output buffer too small to hold returned data\n");
-        return -1;
+        /*
+         * Only read what fits. The request itself succeeded, and callers
+         * that only need the response code can pass a small buffer.
+         */
+        System_printf("Warning: HTTP response truncated to output buffer\n");
+        data_len = request->response_len;
     }
     snprintf(cmd, sizeof(cmd), "AT+SHREAD=0,%d", data_len);
     if (!send_verified_reply(config, cmd, OK_REPLY, SIM7000_TIMEOUT)) {
@@ -1399,6 +1606,17 @@ static void disable_app_network(SIM7000_Config *config) {
     }
 }
 
+/**
+ * Disables the SIM7000 App network after a one-shot request. If a data
+ * session is open the app network is left up for the next request.
+ * @param config: SIM7000 Config structure
+ */
+static void release_app_network(SIM7000_Config *config) {
+    if (!config->session_active) {
+        disable_app_network(config);
+    }
+}
+
 /**
  * Enables the SIM7000 App network
  * @param config: SIM7000 Config structure
@@ -1540,3 +1758,41 @@ static bool disable_result_codes(SIM7000_Config *config) {
     }
     return true;
 }
+
+/**
+ * Gets the size of a file on the SIM's file system. The file system must
+ * have been started with AT+CFSINIT. The SIM answers ERROR both for a
+ * missing file and when its file system cannot be used, so after an ERROR
+ * the file system is checked by asking for its free space: the file is only
+ * reported missing if that query succeeds.
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @return size of the file, SIM7000_FS_NOFILE if it does not exist, or other
+ *  negative value on error
+ */
+static int fs_file_size(SIM7000_Config *config, const char *filename) {
+    char cmd[80];
+    int file_len;
+    // Reply is formatted as "+CFSGFIS: <size>", or ERROR for a missing file
+    snprintf(cmd, sizeof(cmd), "AT+CFSGFIS=%d,\"%s\"", SIM_FS_CUSTOMER_DIR,
+             filename);
+    if (!send_verified_reply(config, cmd, "+CFSGFIS: ", SIM7000_TIMEOUT)) {
+        if (strncmp(config->replybuffer, "ERROR", 5) != 0) {
+            System_printf("SIM did not report file size\n");
+            return -1; // No reply at all
+        }
+        // Reply is formatted as "+CFSGFRS: <free bytes>"
+        if (!send_verified_reply(config, "AT+CFSGFRS?", "+CFSGFRS: ",
+                                 SIM7000_TIMEOUT)) {
+            System_printf("SIM file system is not available\n");
+            return -1;
+        }
+        // Eat the "OK" after the free space
+        sim_readline(config, SIM7000_TIMEOUT);
+        return SIM7000_FS_NOFILE;
+    }
+    file_len = atoi(config->replybuffer + 10);
+    // Eat the "OK" after the size
+    sim_readline(config, SIM7000_TIMEOUT);
+    return file_len;
+}
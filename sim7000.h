@@ -16,6 +16,8 @@
 
 #define REPLYBUF_LEN 256 /**< Length of buffer to store data read from SIM */
 #define APN_LEN 16;      /**< Length of buffer to store GPRS APN within */
+#define SIM7000_FS_MAX_WRITE 10240 /**< Max bytes in one file system write */
+#define SIM7000_FS_NOFILE -2 /**< SIM reported that the file does not exist */
 
 /**
  * Configuration structure for an instance of the SIM7000 driver
@@ -29,6 +31,7 @@ typedef struct SIM7000_Config_ {
     char
         replybuffer[REPLYBUF_LEN]; /*!< reply buffer for sim, used internally */
     bool sim_running;              /*!< software tracker for if sim is booted */
+    bool session_active; /*!< app network held open by a data session */
 } SIM7000_Config;
 
 /**
@@ -150,6 +153,62 @@ int SIM7000_http_path(SIM7000_Config *config, HTTPConnectionRequest *request);
  */
 int SIM7000_http_head(SIM7000_Config *config, HTTPConnectionRequest *request);
 
+/**
+ * Opens a data session. The network is registered and the app network PDP
+ * context is activated once, then shared by every HTTP request and NTP sync
+ * made until SIM7000_session_close() is called.
+ * @param config: SIM7000 Config structure
+ * @return true on success, false otherwise
+ */
+bool SIM7000_session_open(SIM7000_Config *config);
+
+/**
+ * Closes a data session opened with SIM7000_session_open()
+ * @param config: SIM7000 Config structure
+ */
+void SIM7000_session_close(SIM7000_Config *config);
+
+/**
+ * Writes data to a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file (8.3 format) in the customer directory
+ * @param data: data to write
+ * @param len: length of data, at most SIM7000_FS_MAX_WRITE bytes
+ * @param append: append to the file if true, otherwise overwrite it
+ * @return 0 on success, or negative value on error
+ */
+int SIM7000_fs_write(SIM7000_Config *config, const char *filename,
+                     const uint8_t *data, uint16_t len, bool append);
+
+/**
+ * Reads data from a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @param output: buffer to read data into
+ * @param len: length of the output buffer
+ * @return number of bytes read, SIM7000_FS_NOFILE if the file does not
+ *  exist, or other negative value on error
+ */
+int SIM7000_fs_read(SIM7000_Config *config, const char *filename,
+                    uint8_t *output, uint16_t len);
+
+/**
+ * Gets the size of a file on the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @return size of the file, SIM7000_FS_NOFILE if it does not exist, or other
+ *  negative value on error
+ */
+int SIM7000_fs_size(SIM7000_Config *config, const char *filename);
+
+/**
+ * Deletes a file from the SIM7000's flash file system
+ * @param config: SIM7000 Config structure
+ * @param filename: name of the file in the customer directory
+ * @return true on success, false otherwise
+ */
+bool SIM7000_fs_delete(SIM7000_Config *config, const char *filename);
+
 /**
  * Synchronizes the SIM7000 Clock with a network time server, and updates the
  * supplied timespec struct with the current time
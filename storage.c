@@ -17,6 +17,7 @@
 #include <file.h>
 #endif
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -28,6 +29,8 @@
 /* Ti BIOS Headers */
 #include <ti/sysbios/BIOS.h>
 #include <ti/sysbios/gates/GateMutex.h>
+#include <ti/sysbios/hal/Hwi.h>
+#include <ti/sysbios/knl/Clock.h>
 #include <ti/sysbios/knl/Event.h>
 #include <ti/sysbios/knl/Queue.h>
 
@@ -38,25 +41,15 @@
 
 #include "cli.h"
 #include "common.h"
+#include "config.h"
+#include "crc32.h"
+#include "cyclecount.h"
+#include "flashring.h"
+#include "gorilla.h"
+#include "pending.h"
+#include "storage.h"
 #include "ti_drivers_config.h"
 
-///@{
-/**
- * Configuration file keys. These values are included in a configuration file,
- * and parsed to load into a program_config structure
- */
-#define HARDWARE_ID_CONFIG_KEY "HardwareIdentifier"
-#define SYNTHETIC_ID_CONFIG_KEY "UniqueIdentifier"
-#define RADAR_ENABLED_KEY "RadarModuleEnabled"
-#define CAMERA_ENABLED_KEY "CameraModuleEnabled"
-#define NETWORK_ENABLED_KEY "NetworkModuleEnabled"
-#define SERVER_IP_KEY "RemoteServerIP"
-#define SERVER_AUTH_KEY "ServerAuthenticationKey"
-#define RADAR_SAMPLE_INTERVAL_KEY "RadarSampleInterval"
-#define RADAR_SAMPLE_COUNT_KEY "RadarSampleCount"
-#define RADAR_SAMPLE_OFFSET_KEY "RadarSampleOffset"
-///@}
-
 /** String conversion macro */
 #define STR_(n) #n
 /** Second part of string conversion macro */
@@ -66,14 +59,96 @@
 #define EVT_SENSOR_DATA_AVAIL Event_Id_00 /**< new sensor data is available */
 #define EVT_SDCARD_UNMOUNT Event_Id_01 /**< the SD card should be unmounted */
 #define EVT_SDCARD_MOUNT Event_Id_02   /**< the SD card should be mounted */
+#define EVT_LOG_DATA_AVAIL Event_Id_03 /**< new log data is available */
 
 void storage_init();
 void storage_run(UArg arg0, UArg arg1);
 void store_sensor_data(SensorDataPacket *packet);
-void mount_sdcard();
+int mount_sdcard();
 void request_sd_mount();
-void read_configuration();
-void parse_config_entry(char *key, char *value);
+static void release_sdcard();
+static void schedule_mount_retry();
+static void retry_mount();
+static bool note_write_failure();
+static void handle_record(DataRecord *record, uint32_t seq);
+static void replay_record(SensorDataPacket *packet, uint32_t seq, void *arg);
+static void hold_record(DataRecord *record, uint32_t seq);
+static void spill_held_records();
+static int drain_backlog();
+static void restore_lost_record(SensorDataPacket *packet, uint32_t seq,
+                                void *arg);
+void read_configuration(bool use_snapshot);
+int set_config_value(const char *key, const char *value);
+static int rewrite_config_file(const char *key, const char *value);
+static int replace_config_file();
+static void recover_config_file();
+static int load_config_snapshot(const FILINFO *text_info);
+static int save_config_snapshot();
+void storage_benchmark(int records);
+void storage_get_stats(StorageStats *stats);
+static void encode_record(SensorDataPacket *packet, DataRecord *record);
+static int format_csv_record(SensorDataPacket *packet, char *output, int len);
+static int data_file_open(const char *filename);
+static int read_data_header(FIL *file, uint32_t *data_end);
+static int data_day_open(uint32_t day);
+static int data_day_close(bool compact);
+static int data_writer_close();
+static int store_record(DataRecord *record);
+static int journal_write(DataRecord *record);
+static int journal_read(uint32_t skip, bool encode, uint32_t *count);
+static int journal_restore(uint32_t day);
+static uint16_t record_crc(const void *record);
+static bool record_valid(const DataRecord *record);
+static int recover_data_end(FIL *file, uint32_t *data_end);
+static void day_filename(uint32_t day, const char *ext, char *output);
+static void civil_from_days(uint32_t day, int *year, int *month, int *mday);
+static uint32_t days_from_civil(int year, int month, int mday);
+static uint32_t index_lookup(uint32_t day, uint32_t start, uint32_t data_end);
+static int query_day_raw(uint32_t day, uint32_t start, uint32_t end,
+                         bool (*callback)(DataRecord *record, void *arg),
+                         void *arg, bool *done);
+static int query_day_blocks(uint32_t day, uint32_t start, uint32_t end,
+                            bool (*callback)(DataRecord *record, void *arg),
+                            void *arg, bool *done);
+static int block_file_open_day(uint32_t day);
+static int block_file_close();
+static int block_store(DataRecord *record);
+static int block_write();
+static int rollup_add(DataRecord *record, bool emit);
+static int rollup_emit(RollupTier tier);
+static void rollup_rebuild(uint32_t day);
+static uint32_t newest_data_day();
+static uint32_t data_file_day(const char *name);
+static void compact_stale_days(uint32_t newest);
+static void rollup_filename(RollupTier tier, uint32_t day, char *output);
+static int append_file(const char *filename, const void *data,
+                       unsigned int len);
+static void save_to_flash(DataRecord *record, uint32_t seq);
+static int drain_flash_ring();
+static int flash_ring_store(const void *record, void *arg);
+static int flash_ring_sync(void *arg);
+int storage_export_open(const char *filename, uint32_t *size);
+int storage_export_read(uint32_t offset, void *buf, unsigned int len);
+void storage_export_close();
+int storage_list_dir(const char *dirname,
+                     void (*callback)(const char *name, uint32_t size,
+                                      void *arg),
+                     void *arg);
+int storage_rollup_query(RollupTier tier, uint32_t start, uint32_t end,
+                         bool (*callback)(RollupRecord *rollup, void *arg),
+                         void *arg);
+int storage_query_blocks(uint32_t start, uint32_t end,
+                         bool (*callback)(DataRecord *record, void *arg),
+                         void *arg);
+int storage_parse_time(const char *str, uint32_t *timestamp);
+void storage_format_time(uint32_t timestamp, char *output, int len);
+int storage_query(uint32_t start, uint32_t end,
+                  bool (*callback)(DataRecord *record, void *arg), void *arg);
+static void drain_log_ring();
+static void drain_trace_ring();
+uint32_t log_overflow_count();
+void log_trace(uint32_t fmt_id, const uint32_t *args, unsigned int nargs);
+static FRESULT create_data_file(const char *filename);
 
 /** Drive number used for FatFs */
 #define DRIVE_NUM 0
@@ -81,6 +156,66 @@ void parse_config_entry(char *key, char *value);
 #define MAX_QUEUE_ELEM 32
 /** maximum length of logging line to write to SD card */
 #define LOG_LINE_MAX 128
+/** must be power of 2, size of the RAM ring holding log lines for the SD card */
+#define LOG_RING_SIZE 2048
+/** bytes before the text of each log ring record: timestamp, then length */
+#define LOG_RECORD_HEADER 5
+/** must be power of 2, size of the RAM ring holding trace records */
+#define TRACE_RING_SIZE 1024
+/** bytes before the arguments of each trace record: timestamp, ID, count */
+#define TRACE_RECORD_HEADER 9
+/** SD card sector size, and size of the file write buffers */
+#define SECTOR_SIZE 512
+/**
+ * Size of the contiguous extent reserved for a data file when it is created,
+ * and of each extension once it fills (about 10900 records, or 45 hours of
+ * samples at a 15 second interval). Building with 0 writes data files in
+ * append mode, growing them a cluster at a time, which the host storage
+ * benchmark uses to compare FAT writes.
+ */
+#ifndef DATA_FILE_EXTENT
+#define DATA_FILE_EXTENT (128UL * 1024UL)
+#endif
+/** Seconds in a day, data files are rolled over at UTC midnight */
+#define SECONDS_PER_DAY 86400UL
+/** Number of data file records between entries in the day's index file */
+#define INDEX_STRIDE 64
+/** Length of a data directory file name, "data/YYMMDD.ext" */
+#define DAY_FILENAME_LEN 16
+/** Max length of a config.txt line, including the newline */
+#define CONFIG_LINE_MAX 80
+/** Magic bytes at the start of the configuration snapshot */
+#define CONFIG_SNAPSHOT_MAGIC "FCFG"
+/** Configuration snapshot format version, bump when its layout changes */
+#define CONFIG_SNAPSHOT_VERSION 2
+/** Modification time of a file as one word, FAT date in the high half */
+#define FAT_TIMESTAMP(info) (((uint32_t)(info)->fdate << 16) | (info)->ftime)
+/** Value of open_day when no data file is open */
+#define NO_DAY UINT32_MAX
+/**
+ * Records read back from a data file's end to find its last CommitRecord,
+ * which bounds recovery time whatever the size of the file
+ */
+#define RECOVERY_SCAN_RECORDS (4 * SECTOR_SIZE / sizeof(DataRecord))
+/** Days before the newest data file checked at mount for left over files */
+#define STALE_SCAN_DAYS 7
+/** Records read from the SD card at once while querying */
+#define QUERY_CHUNK_RECORDS (SECTOR_SIZE / sizeof(DataRecord))
+/** Rollup records read from the SD card at once while querying */
+#define ROLLUP_CHUNK_RECORDS (SECTOR_SIZE / sizeof(RollupRecord))
+/** f_write calls per window checked against StorageLatencyAlarm */
+#define LATENCY_WINDOW_WRITES 128
+/** Delay before the first attempt to remount a missing SD card, in ms */
+#define MOUNT_RETRY_MIN 1000UL
+/** Longest delay between attempts to remount a missing SD card, in ms */
+#define MOUNT_RETRY_MAX 300000UL
+/** Sample writes failing in a row before the SD card is remounted */
+#define SD_FAILURE_LIMIT 3
+/**
+ * Samples held in RAM while a missing SD card is being remounted (16 minutes
+ * at a 15 second interval)
+ */
+#define HELD_RECORDS 64
 
 /**
  * Queue element to be placed into the sensor data queue. These elements will
@@ -89,39 +224,240 @@ void parse_config_entry(char *key, char *value);
 typedef struct SensorDataQueueElem {
     Queue_Elem elem;         /**< Queue element, used to track queue */
     SensorDataPacket packet; /**< Sensor data packet to write to SD card */
+    uint32_t seq;            /**< sequence number in the pending ring */
 } SensorDataQueueElem;
 
-/** Definition for the sensor data file name (cannot be longer than 8
- * characters) */
-static const char sensor_data_filename[] = "distdata.csv";
+/** Sample held in RAM while the SD card is unavailable */
+typedef struct {
+    DataRecord record; /**< sample to store */
+    uint32_t seq;      /**< sequence number in the pending ring, or 0 */
+} HeldRecord;
+
+/**
+ * Entry of a day's sparse index file. One entry is written for every
+ * INDEX_STRIDE records in the day's data file.
+ */
+typedef struct {
+    uint32_t timestamp; /**< timestamp of the indexed record */
+    uint32_t offset;    /**< offset of the indexed record in the data file */
+} IndexEntry;
+
+/**
+ * Running summary of one rollup tier. Only the period being accumulated is
+ * kept in RAM; it is written to the tier's file when a sample from another
+ * period arrives.
+ */
+typedef struct {
+    uint32_t period;      /**< length of a period in seconds */
+    const char *ext;      /**< extension of the tier's per day files */
+    RollupRecord current; /**< period being accumulated */
+    double sum;           /**< sum of the distances in the current period */
+} RollupState;
+
+/**
+ * Buffered append-only file writer. Data is collected in a sector sized
+ * buffer and written with FatFs f_write one whole, sector aligned chunk at a
+ * time. Partial sectors are only written when the oldest unsynced data is
+ * older than the configured flush age, or the file is closed.
+ * Writers with a nonzero extent write to a preallocated file starting with a
+ * DataFileHeader, and keep its data_end field current on every flush.
+ */
+typedef struct {
+    FIL file;                 /**< FatFs file object */
+    bool open;                /**< is the file open */
+    bool dirty;               /**< does the file have unsynced data */
+    uint32_t oldest;          /**< clock tick oldest unsynced data was added */
+    unsigned int len;         /**< number of bytes in buf */
+    unsigned int capacity;    /**< bytes until next sector boundary of file */
+    uint32_t extent;          /**< bytes to reserve when file fills, or 0 */
+    bool commit;              /**< end each flush with a CommitRecord */
+    uint8_t buf[SECTOR_SIZE]; /**< data waiting to be written */
+} SectorWriter;
+
+/**
+ * Binary snapshot of program_config, saved in config.bin each time config.txt
+ * is parsed or written, so later boots can skip parsing the text file
+ */
+typedef struct {
+    char magic[4];         /**< CONFIG_SNAPSHOT_MAGIC, not null terminated */
+    uint16_t version;      /**< CONFIG_SNAPSHOT_VERSION */
+    uint16_t config_size;  /**< CONFIG_SERIALIZED_SIZE */
+    uint32_t schema_id;    /**< config_schema_id() */
+    uint32_t text_size;    /**< size of config.txt the snapshot matches */
+    uint32_t text_time;    /**< FAT_TIMESTAMP of config.txt */
+    uint32_t defaults_crc; /**< CRC-32 of the serialized built in defaults */
+    uint8_t config[CONFIG_SERIALIZED_SIZE]; /**< serialized configuration */
+    uint32_t crc;          /**< CRC-32 of all fields above */
+} ConfigSnapshot;
+
+/**
+ * Byte ring used to pass log records to the storage task. Any task may add
+ * records, only the storage task removes them. Head and tail are free running
+ * indexes, so the ring holds head - tail bytes.
+ */
+typedef struct {
+    uint8_t *buf;                /**< ring storage */
+    uint32_t size;               /**< size of buf, must be a power of 2 */
+    volatile uint32_t head;      /**< index of next byte to write */
+    volatile uint32_t tail;      /**< index of next byte to read */
+    volatile uint32_t overflows; /**< records dropped as the ring was full */
+} ByteRing;
+
+static bool ring_put(ByteRing *ring, const void *header,
+                     unsigned int header_len, const void *data,
+                     unsigned int len);
+static void ring_copy_in(ByteRing *ring, uint32_t pos, const void *data,
+                         unsigned int len);
+static void ring_copy_out(ByteRing *ring, uint32_t pos, void *data,
+                          unsigned int len);
+static FRESULT writer_open(SectorWriter *writer, const char *filename);
+static int writer_write(SectorWriter *writer, const void *data,
+                        unsigned int len);
+static int writer_write_buffer(SectorWriter *writer);
+static FRESULT sd_open(FIL *file, const TCHAR *path, BYTE mode);
+static FRESULT sd_write(FIL *file, const void *data, UINT len, UINT *written);
+static FRESULT sd_sync(FIL *file);
+static FRESULT sd_close(FIL *file);
+static FILE *sd_fopen(const char *path, const char *mode);
+static int sd_fputs(const char *str, FILE *file);
+static int sd_fprintf(FILE *file, const char *format, ...);
+static int sd_fclose(FILE *file);
+static void sd_record(SdOp op, uint32_t start, bool ok);
+static int writer_flush(SectorWriter *writer);
+static int writer_close(SectorWriter *writer);
+static int writer_reserve(SectorWriter *writer);
+static int writer_update_end(SectorWriter *writer);
+static int writer_commit(SectorWriter *writer);
+
+/**
+ * Directory holding sensor data. Each UTC day has a compressed block file
+ * "YYMMDD.gts". The open day also has a data file "YYMMDD.bin" and a sparse
+ * index file "YYMMDD.idx", deleted when the day is closed.
+ */
+static const char data_dirname[] = "data";
 /** Configuration filename */
 static const char configuration_filename[] =
     "fat:" STR(DRIVE_NUM) ":config.txt";
+/** Configuration file being written by set_config_value() */
+static const char new_configuration_filename[] =
+    "fat:" STR(DRIVE_NUM) ":config.new";
+///@{
+/** Configuration file names, for FatFs calls */
+static const char config_path[] = "config.txt";
+static const char config_new_path[] = "config.new";
+static const char config_old_path[] = "config.old";
+static const char config_snapshot_path[] = "config.bin";
+///@}
 /** log filename */
-static const char log_filename[] = "fat:" STR(DRIVE_NUM) ":log.txt";
+static const char log_filename[] = "log.txt";
+/** binary trace log filename */
+static const char trace_filename[] = "trace.bin";
+/** Name of the day rollup file */
+static const char day_rollup_filename[] = "data/days.r1d";
+
+/** Header written to new trace files */
+static const TraceFileHeader TRACE_HEADER = {TRACE_FILE_MAGIC,
+                                             TRACE_FILE_VERSION, 0};
 
 #ifdef __TI_ARM__
 /** File name prefix for this filesystem for use with TI C RTS */
 static char fatfsPrefix[] = "fat";
 #endif
 
-/** Data file CSV header */
-static const char FILE_HEADER[] = "Timestamp,Distance\n";
+/** Header written to new data files */
+static const DataFileHeader FILE_HEADER = {
+    DATA_FILE_MAGIC, DATA_FILE_VERSION, sizeof(DataRecord),
+    sizeof(DataFileHeader), 0};
 
 static SDFatFS_Handle sdfatfsHandle = NULL;
-static FILE *data_file;
-static FILE *log_file = NULL;
+static SectorWriter data_writer;
+static SectorWriter index_writer;
+static SectorWriter log_writer;
+static SectorWriter trace_writer;
+static StorageStats storage_stats;
+/** f_write latency histogram of the current alarm window */
+static SdLatencyStats latency_window;
+/** Day of the open data file, in days since the unix epoch */
+static uint32_t open_day = NO_DAY;
+/** CRC-32 of program_config as built into the firmware */
+static uint32_t config_defaults_crc;
+/** Timestamp of the last sample stored in the open data file */
+static uint32_t last_sample_time;
+/** Samples stored in the open data file since its last CommitRecord */
+static uint16_t uncommitted_records;
+/**
+ * Compressed block file of the open day. Only open while it holds every
+ * sample of the data file, up to the block being built.
+ */
+static FIL block_file;
+static bool block_file_is_open = false;
+/** Block of compressed samples being built for the open day */
+static GorillaEncoder block_encoder;
+/**
+ * Minute rollups are frequent enough to buffer, so they go through a sector
+ * writer. Hour and day rollups are appended directly.
+ */
+static SectorWriter rollup_writer;
+/** Day of the minute rollup file open in rollup_writer */
+static uint32_t rollup_day = NO_DAY;
+static RollupState rollups[ROLLUP_TIERS] = {
+    {60, "r1m"}, {60 * 60, "r1h"}, {SECONDS_PER_DAY, "r1d"}};
+/** Every sector writer, for flushing them all */
+static SectorWriter *const all_writers[] = {&data_writer,   &index_writer,
+                                            &rollup_writer, &log_writer,
+                                            &trace_writer};
+/** File being sent by the export command */
+static FIL export_fil;
+static bool export_is_open = false;
+/**
+ * Log ring. Each record is a 4 byte timestamp, a 1 byte text length, then
+ * the text.
+ */
+static uint8_t log_ring_buf[LOG_RING_SIZE];
+static ByteRing log_ring = {log_ring_buf, LOG_RING_SIZE, 0, 0, 0};
+/**
+ * Trace ring. Each record is a 4 byte timestamp, a 4 byte format ID, a 1 byte
+ * argument count, then the 4 byte argument words. Records are written to the
+ * trace file as they are.
+ */
+static uint8_t trace_ring_buf[TRACE_RING_SIZE];
+static ByteRing trace_ring = {trace_ring_buf, TRACE_RING_SIZE, 0, 0, 0};
 static Event_Handle storageEventHandle;
 static Queue_Handle sensorDataQueue;
 static GateMutex_Handle queueMutex;
 static GateMutex_Handle sdMutex;
 static SensorDataQueueElem queue_elements[MAX_QUEUE_ELEM];
+/** Samples held in RAM while the SD card is unavailable, oldest first */
+static HeldRecord held_records[HELD_RECORDS];
+static unsigned int held_count = 0;
+/**
+ * Newest sample stored in the data file's write buffer, released from the
+ * pending ring once the buffer is flushed, or 0 if there is none
+ */
+static uint32_t sd_uncommitted_seq = 0;
+/**
+ * Newest sample lost from the data file when it was closed with a failed
+ * flush, or 0 if there is none. The file is cut back to its last commit when
+ * it is opened again, so the samples up to this one that are still pending
+ * are stored again before anything newer.
+ */
+static uint32_t sd_lost_seq = 0;
+/** Should the user be updated about the sd card status */
+static bool storage_notification = true;
+/** Delay before the next mount attempt in ms, or 0 if none is scheduled */
+static uint32_t mount_retry_delay = 0;
+/** Clock tick of the next mount attempt */
+static uint32_t mount_retry_tick;
+/** Sample writes to the SD card that failed in a row */
+static unsigned int write_failures = 0;
 
 /**
  * This function should perform any initialization required for the storage
  * module to function, including initializing peripherals like SPI.
  */
 void storage_init() {
+    uint8_t defaults[CONFIG_SERIALIZED_SIZE];
+
 #ifdef __TI_ARM__
     // only required for TI compiler
     /* add_device() should be called once and is used for all media types */
@@ -145,8 +481,26 @@ void storage_init() {
     if (!sdMutex) {
         System_abort("Failed to create sd mutex\n");
     }
+    config_init();
+    // Snapshots saved by firmware with other defaults are not used
+    config_serialize(&program_config, defaults);
+    config_defaults_crc = crc32(defaults, sizeof(defaults));
+    if (sizeof(DataRecord) != FLASHRING_RECORD_SIZE) {
+        System_abort("Data records do not fit the flash ring\n");
+    }
+    // Samples kept in flash are moved to the SD card once the task starts
+    if (flashring_init() < 0) {
+        System_printf("Warning: could not initialize flash ring\n");
+    } else if (flashring_count() > 0) {
+        System_printf("%lu samples waiting in flash\n",
+                      (unsigned long)flashring_count());
+    }
     // Mount the SD card before finishing initialization.
-    mount_sdcard();
+    if (mount_sdcard() < 0) {
+        // The storage task keeps trying, and holds samples until then
+        schedule_mount_retry();
+        System_printf("Warning: SD card not available, retrying\n");
+    }
     System_printf("Storage init done\n");
 }
 
@@ -159,16 +513,30 @@ void storage_init() {
 void storage_run(UArg arg0, UArg arg1) {
     IArg sd_mutex_key;
     SensorDataQueueElem *elem;
-    struct tm *timeinfo;
+    DataRecord record;
     UInt events;
-    int num_printed;
-    char temp_linebuf[128];
-    // Should the user be updated about the sd card status
-    bool storage_notification = true;
+    UInt32 timeout;
+    int32_t retry_in;
+    uint32_t seq;
+    unsigned int replayed;
     IArg mutex_key;
     System_printf("Storage task starting\n");
     Watchdog_clear(watchdogHandle);
+    if (sdfatfsHandle) {
+        drain_backlog();
+    }
+    // Store samples that were still queued when the device last reset
+    replayed = pending_replay(PENDING_STORE, replay_record, NULL);
+    if (replayed) {
+        cli_log("Recovered %u samples queued before reset\n", replayed);
+    }
     while (1) {
+        // Wake up for the next mount attempt while the SD card is missing
+        timeout = BIOS_WAIT_FOREVER;
+        if (mount_retry_delay) {
+            retry_in = (int32_t)(mount_retry_tick - Clock_getTicks());
+            timeout = retry_in > 0 ? (UInt32)retry_in : BIOS_NO_WAIT;
+        }
         /*
          * Wait for an event. The call will return if any of the events
          * passed in occur, and "events" will be a bitwise OR of all events
@@ -176,233 +544,612 @@ void storage_run(UArg arg0, UArg arg1) {
          */
         events = Event_pend(storageEventHandle, Event_Id_NONE,
                             EVT_SENSOR_DATA_AVAIL | EVT_SDCARD_UNMOUNT |
-                                EVT_SDCARD_MOUNT,
-                            BIOS_WAIT_FOREVER);
+                                EVT_SDCARD_MOUNT | EVT_LOG_DATA_AVAIL,
+                            timeout);
+        if ((events & EVT_SENSOR_DATA_AVAIL) && sdfatfsHandle &&
+            (flashring_count() > 0 || held_count > 0 || sd_lost_seq) &&
+            drain_backlog() < 0 && note_write_failure()) {
+            // Retrying samples held back by a write error failed again
+            storage_notification = true;
+        }
         if (events & EVT_SENSOR_DATA_AVAIL) {
-            // While the queue of sensor data isn't empty, read from it.
-            // Get the queue mutex
-            mutex_key = GateMutex_enter(queueMutex);
-            while (!Queue_empty(sensorDataQueue)) {
-                // pop an element from the queue.
-                elem = Queue_dequeue(sensorDataQueue);
-                /*
-                 * Format the element data into a buffer
-                 * so we can write it to the SD card
-                 */
-                /*
-                 * Convert the timestamp to a human readable value.
-                 * We are using ISO 8601 timestamps,
-                 * and the timezone is UTC (+00)
-                 */
-                timeinfo = localtime(&(elem->packet.timestamp));
-                num_printed = snprintf(temp_linebuf, sizeof(temp_linebuf),
-                                       "20%d-%02d-%02dT%02d:%02d:%02d, %f\n",
-                                       timeinfo->tm_year - 100,
-                                       timeinfo->tm_mon, timeinfo->tm_mday,
-                                       timeinfo->tm_hour, timeinfo->tm_min,
-                                       timeinfo->tm_sec, elem->packet.distance);
-                if (!sdfatfsHandle) {
-                    // SD card is unmounted. Warn user data may be missed.
-                    if (storage_notification) {
-                        cli_log(
-                            "WARNING: SD card is unmounted but data is still "
-                            "being received\n");
-                        storage_notification = false;
-                    }
-                    // Print the data to the cli.
-                    cli_log("%s", temp_linebuf);
-                } else {
-                    // Enter SD card mutex
-                    sd_mutex_key = GateMutex_enter(sdMutex);
-                    if (fwrite(temp_linebuf, num_printed, 1, data_file) != 1) {
-                        cli_log("SD card write error\n");
-                    }
-                    GateMutex_leave(sdMutex, sd_mutex_key);
-                    if (storage_notification) {
-                        cli_log(
-                            "SD card is mounted and data is being written\n");
-                        storage_notification = false;
-                    }
+            /*
+             * Take samples off the queue one at a time, so the sensor task
+             * never waits on the queue mutex while the SD card is written.
+             */
+            while (1) {
+                mutex_key = GateMutex_enter(queueMutex);
+                elem = NULL;
+                if (!Queue_empty(sensorDataQueue)) {
+                    elem = Queue_dequeue(sensorDataQueue);
+                    // Pack the element data into a fixed size record
+                    encode_record(&(elem->packet), &record);
+                    seq = elem->seq;
+                }
+                GateMutex_leave(queueMutex, mutex_key);
+                if (elem == NULL) {
+                    break;
                 }
+                handle_record(&record, seq);
             }
-            GateMutex_leave(queueMutex, mutex_key);
+        }
+        if ((events & (EVT_LOG_DATA_AVAIL | EVT_SDCARD_UNMOUNT)) &&
+            sdfatfsHandle) {
+            // Write out queued log lines, including before an unmount
+            sd_mutex_key = GateMutex_enter(sdMutex);
+            drain_log_ring();
+            drain_trace_ring();
+            GateMutex_leave(sdMutex, sd_mutex_key);
         }
         if (events & EVT_SDCARD_MOUNT) {
             if (sdfatfsHandle != NULL) {
                 cli_log("Cannot mount sd card, already mounted\n");
             } else {
-                mount_sdcard();
-                cli_log("SD Card mounted\n");
+                // Start again from the shortest retry delay if this fails
+                mount_retry_delay = 0;
+                retry_mount();
                 // reset storage notification
                 storage_notification = true;
             }
+        } else if (mount_retry_delay &&
+                   (int32_t)(Clock_getTicks() - mount_retry_tick) >= 0) {
+            retry_mount();
+            if (sdfatfsHandle) {
+                storage_notification = true;
+            }
         }
         if (events & EVT_SDCARD_UNMOUNT) {
+            // The card is being removed on purpose, stop remounting it
+            mount_retry_delay = 0;
             if (sdfatfsHandle == NULL) {
                 cli_log("SD card already unmounted\n");
             } else {
-                // Close the open file handle we have, and unmount the SD card
-                fclose(data_file);
-                fclose(log_file);
-                SDFatFS_close(sdfatfsHandle);
-                sdfatfsHandle = NULL;
+                release_sdcard();
                 cli_log("SD Card unmounted\n");
                 // reset storage notification
                 storage_notification = true;
             }
+            // Power may be cut next, move samples held in RAM to flash
+            spill_held_records();
         }
     }
 }
 
 /**
- * Sets the radar offset into the configuration file.
- * The strategy used here is to copy the current configuration file to
- * a new file line by line, and splice in the new offset when required. Once
- * the new config file is created, copy it over the old one.
- * This method would also work to set other configuration values.
- * @param offset: float specifying new offset
+ * Stores one sample on the SD card, or keeps it until the card can take it.
+ * @param record: sample to store
+ * @param seq: sequence number of the sample in the pending ring
  */
-void set_radar_offset(float offset) {
-    FRESULT ret;
-    FILE *input_config_file, *output_config_file;
+static void handle_record(DataRecord *record, uint32_t seq) {
     IArg sd_mutex_key;
-    char file_buffer[80], *config_key, *config_value, output_buffer[80];
-    const char temp_config_file[] = "fat:" STR(DRIVE_NUM) ":tmp.txt";
-    // Save the new offset into the program_config structure
-    program_config.radar_sample_offset = offset;
+    int ret;
+
     if (!sdfatfsHandle) {
-        // Warn user
-        System_printf(
-            "Warning: SD card not available, cannot read configuration\n");
-        return;
+        // SD card is unmounted. Keep data until it is mounted.
+        if (storage_notification) {
+            cli_log("WARNING: SD card is unmounted, data is being "
+                    "kept until it is mounted\n");
+            storage_notification = false;
+        }
+        hold_record(record, seq);
+    } else if (flashring_count() > 0 || held_count > 0 || sd_lost_seq) {
+        // Older samples are still held, keep files in order
+        hold_record(record, seq);
+    } else {
+        // Enter SD card mutex
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        ret = store_record(record);
+        if (ret == 0) {
+            sd_uncommitted_seq = seq;
+        }
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        if (ret < 0) {
+            cli_log("SD card write error\n");
+            hold_record(record, seq);
+            if (note_write_failure()) {
+                storage_notification = true;
+            }
+        } else {
+            write_failures = 0;
+            if (storage_notification) {
+                cli_log("SD card is mounted and data is being written\n");
+                storage_notification = false;
+            }
+        }
     }
-    // Get SD mutex
+}
+
+/**
+ * pending_replay callback, stores a sample retained across a reset
+ * @param packet: retained sample
+ * @param seq: sequence number of the sample in the pending ring
+ * @param arg: unused
+ */
+static void replay_record(SensorDataPacket *packet, uint32_t seq, void *arg) {
+    DataRecord record;
+
+    encode_record(packet, &record);
+    handle_record(&record, seq);
+}
+
+/**
+ * Flushes and closes the open files, and unmounts the SD card. Write errors
+ * are reported but do not stop the unmount, as the card may be gone.
+ */
+static void release_sdcard() {
+    IArg sd_mutex_key;
+    int ret;
+
     sd_mutex_key = GateMutex_enter(sdMutex);
-    // Open the configuration file on the SD card.
-    input_config_file = fopen(configuration_filename, "r");
-    if (!input_config_file) {
-        // Don't fail to boot, but warn user.
-        cli_log("No configuration file found, cannot set radar offset\n");
-        System_printf(
-            "Warning: no configuration file found, cannot set radar offset\n");
-        GateMutex_leave(sdMutex, sd_mutex_key);
+    // Close every file, even after one fails
+    ret = data_day_close(false);
+    if (writer_close(&rollup_writer) < 0) {
+        ret = -1;
+    }
+    if (writer_close(&log_writer) < 0) {
+        ret = -1;
+    }
+    if (writer_close(&trace_writer) < 0) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        System_printf("SD card write error on unmount\n");
+    }
+    SDFatFS_close(sdfatfsHandle);
+    sdfatfsHandle = NULL;
+    GateMutex_leave(sdMutex, sd_mutex_key);
+}
+
+/**
+ * Schedules the next attempt to mount the SD card. The delay starts at
+ * MOUNT_RETRY_MIN and doubles after each failed attempt, up to
+ * MOUNT_RETRY_MAX.
+ */
+static void schedule_mount_retry() {
+    if (mount_retry_delay == 0) {
+        mount_retry_delay = MOUNT_RETRY_MIN;
+    } else if (mount_retry_delay < MOUNT_RETRY_MAX / 2) {
+        mount_retry_delay *= 2;
+    } else {
+        mount_retry_delay = MOUNT_RETRY_MAX;
+    }
+    mount_retry_tick = Clock_getTicks() + mount_retry_delay;
+}
+
+/**
+ * Attempts to mount the SD card, moving held samples to it on success, or
+ * scheduling the next attempt on failure.
+ */
+static void retry_mount() {
+    if (mount_sdcard() < 0) {
+        schedule_mount_retry();
+        cli_log("SD card not available, next mount attempt in %lu s\n",
+                (unsigned long)(mount_retry_delay / 1000));
         return;
     }
-    output_config_file = fopen(temp_config_file, "w+");
-    if (!output_config_file) {
-        // "w" does not assume file exists, so this error is likely bigger
-        System_abort("Cannot write output config file");
+    mount_retry_delay = 0;
+    write_failures = 0;
+    cli_log("SD Card mounted\n");
+    drain_backlog();
+}
+
+/**
+ * Counts a failed write to the SD card. After SD_FAILURE_LIMIT failures in a
+ * row the card is treated as removed: it is unmounted, and the storage task
+ * remounts it with backoff.
+ * @return true if the card was unmounted
+ */
+static bool note_write_failure() {
+    if (++write_failures < SD_FAILURE_LIMIT) {
+        return false;
     }
-    // Read the configuration file data.
-    while (1) {
-        if (fgets(file_buffer, sizeof(file_buffer), input_config_file) ==
-            NULL) {
-            // Check if we reached the end of the file or had an error.
-            if (ferror(input_config_file)) {
-                System_abort("Error while reading configuration file\n");
-            } else if (feof(input_config_file)) {
-                System_printf("Configuration file copy complete\n");
-                break; // Exit loop
-            } else {
-                System_printf("Unknown error while reading config file\n");
-            }
+    write_failures = 0;
+    cli_log("SD card keeps failing, remounting it\n");
+    release_sdcard();
+    schedule_mount_retry();
+    return true;
+}
+
+/**
+ * Keeps a sample that cannot be written to the SD card yet. While a remount
+ * is being retried, samples are held in RAM, so a loose card contact does not
+ * wear the flash. They move to the flash ring, which survives a reset, when
+ * the RAM buffer fills, once retries reach MOUNT_RETRY_MAX, or when no
+ * remount is pending (the card was unmounted on purpose, or it is mounted
+ * but failing).
+ * @param record: sample to keep
+ * @param seq: sequence number of the sample in the pending ring, or 0
+ */
+static void hold_record(DataRecord *record, uint32_t seq) {
+    if (mount_retry_delay == 0 || mount_retry_delay >= MOUNT_RETRY_MAX) {
+        spill_held_records();
+        save_to_flash(record, seq);
+        return;
+    }
+    if (held_count == HELD_RECORDS) {
+        spill_held_records();
+    }
+    held_records[held_count].record = *record;
+    held_records[held_count].seq = seq;
+    held_count++;
+}
+
+/**
+ * Moves the samples held in RAM to the flash ring, oldest first
+ */
+static void spill_held_records() {
+    unsigned int i;
+
+    for (i = 0; i < held_count; i++) {
+        save_to_flash(&held_records[i].record, held_records[i].seq);
+    }
+    held_count = 0;
+}
+
+/**
+ * Moves the samples kept while the SD card was unavailable to the card,
+ * oldest first: those lost from the data file with a failed flush, which
+ * are still in the pending ring, then those in the flash ring, then those
+ * held in RAM. Samples that could not be written stay where they were.
+ * Takes the SD card mutex.
+ * @return 0 on success, or negative value on write error
+ */
+static int drain_backlog() {
+    IArg sd_mutex_key;
+    unsigned int stored;
+    int ret = 0;
+
+    if (sd_lost_seq) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        stored = pending_replay_through(sd_lost_seq, PENDING_STORE,
+                                        restore_lost_record, &ret);
+        if (ret == 0) {
+            sd_lost_seq = 0;
         }
-        /*
-         * Here, we should parse the line we read from the configuration file.
-         * Note that lines starting with '#' (and empty lines) are ignored.
-         */
-        if (file_buffer[0] == '#' || file_buffer[0] == '\n') {
-            // Transparently write the line into the new file.
-            if (fwrite(file_buffer, strlen(file_buffer), 1,
-                       output_config_file) != 1) {
-                System_printf("Failed to write to new config file\n");
-                cli_log("Failed to write to new config file\n");
-                fclose(output_config_file);
-                fclose(input_config_file);
-                GateMutex_leave(sdMutex, sd_mutex_key);
-                return;
-            }
-            continue; // Do not parse configuration line
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        if (ret < 0) {
+            cli_log("SD card write error while storing lost samples again\n");
+            return -1;
         }
-        /*
-         * Now parse the configuration line.
-         * Lines are formatted as "key : value"
-         */
-        config_key = strtok(file_buffer, " : ");
-        // /n removes the newline from value
-        config_value = strtok(NULL, " : \n");
-        if ((!config_key) || !(config_value)) {
-            System_printf("Invalid configuration file line\n");
-            continue;
+        cli_log("Stored %u samples lost with the data file buffer again\n",
+                stored);
+    }
+    if (drain_flash_ring() < 0) {
+        return -1;
+    }
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    for (stored = 0; stored < held_count; stored++) {
+        if (store_record(&held_records[stored].record) < 0) {
+            ret = -1;
+            break;
         }
-        // Check if the key is the radar sample offset for this line
-        if (strncmp(config_key, RADAR_SAMPLE_OFFSET_KEY,
-                    strlen(RADAR_SAMPLE_OFFSET_KEY)) == 0) {
-            // Splice in new configuration value.
-            snprintf(output_buffer, sizeof(output_buffer), "%s: %.3f\n",
-                     config_key, offset);
-        } else {
-            // Simply write the same config value back to the new file
-            snprintf(output_buffer, sizeof(output_buffer), "%s : %s\n",
-                     config_key, config_value);
-        }
-        if (fwrite(output_buffer, strlen(output_buffer), 1,
-                   output_config_file) != 1) {
-            System_printf("Failed to write to new config file\n");
-            cli_log("Failed to write to new config file\n");
-            fclose(output_config_file);
-            fclose(input_config_file);
-            GateMutex_leave(sdMutex, sd_mutex_key);
-            return;
+        if (held_records[stored].seq) {
+            sd_uncommitted_seq = held_records[stored].seq;
         }
     }
-    // Close both files
-    fclose(input_config_file);
-    fclose(output_config_file);
-    // Copy output config file to overwrite input one.
-    ret = f_unlink("config.txt");
-    if (ret != FR_OK) {
-        System_printf("Could not delete old configuration file\n");
-        cli_log(
-            "Could not set radar sample offset, could not delete old config "
-            "file\n");
-        GateMutex_leave(sdMutex, sd_mutex_key);
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    if (stored > 0) {
+        memmove(held_records, &held_records[stored],
+                (held_count - stored) * sizeof(HeldRecord));
+        held_count -= stored;
+        cli_log("Moved %u held samples to SD card\n", stored);
+    }
+    if (ret < 0) {
+        cli_log("SD card write error while moving held samples\n");
+    }
+    return ret;
+}
+
+/**
+ * pending_replay_through callback, stores a sample that was lost from the
+ * data file. Samples already stored again since the last flush are skipped,
+ * and nothing more is stored after a write error.
+ * Must be called with the SD card mutex held.
+ * @param packet: lost sample
+ * @param seq: sequence number of the sample in the pending ring
+ * @param arg: int result, set negative on a write error
+ */
+static void restore_lost_record(SensorDataPacket *packet, uint32_t seq,
+                                void *arg) {
+    int *ret = arg;
+    DataRecord record;
+
+    if (*ret < 0 || seq <= sd_uncommitted_seq) {
         return;
     }
-    ret = f_rename("tmp.txt", "config.txt");
-    if (ret != FR_OK) {
-        System_printf("Could not overwrite configuration file\n");
-        cli_log("Could not set radar sample offset, could not overwrite config "
-                "file\n");
-        GateMutex_leave(sdMutex, sd_mutex_key);
+    encode_record(packet, &record);
+    if (store_record(&record) < 0) {
+        *ret = -1;
         return;
     }
+    sd_uncommitted_seq = seq;
+}
+
+/**
+ * Sets the radar offset into the configuration file, through
+ * set_config_value().
+ * @param offset: float specifying new offset
+ */
+void set_radar_offset(float offset) {
+    char value[16];
+
+    snprintf(value, sizeof(value), "%.3f", offset);
+    if (set_config_value(config_key(CONFIG_RADAR_SAMPLE_OFFSET), value) == 0) {
+        cli_log("Successfully saved radar offset to sd card\n");
+    }
+}
+
+/**
+ * Sets a configuration value, both in program_config and in config.txt.
+ * The file is updated atomically: the new contents are written in full to
+ * config.new before it replaces config.txt, and recover_config_file()
+ * finishes an interrupted replacement at the next boot. The binary snapshot
+ * is rewritten to match.
+ * @param key: configuration file key, as in config.txt
+ * @param value: new value, as it would appear in config.txt
+ * @return 0 on success, -1 if the key is unknown or the value is invalid, or
+ *  -2 if the value was applied but could not be saved to the card
+ */
+int set_config_value(const char *key, const char *value) {
+    IArg sd_mutex_key;
+    int ret;
+
+    // Values must survive the "key : value" line format
+    if (value[0] == '\0' || strpbrk(value, " :#\r\n") ||
+        strlen(key) + strlen(value) + sizeof(" : \n") > CONFIG_LINE_MAX) {
+        cli_log("Invalid configuration value for %s\n", key);
+        return -1;
+    }
+    ret = config_parse_entry(key, value);
+    if (ret == -1) {
+        cli_log("Unknown configuration key %s\n", key);
+        return -1;
+    } else if (ret < 0) {
+        cli_log("Invalid configuration value for %s\n", key);
+        return -1;
+    }
+    if (!sdfatfsHandle) {
+        cli_log("SD card not available, %s not saved\n", key);
+        return -2;
+    }
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    ret = rewrite_config_file(key, value);
+    if (ret == 0 && save_config_snapshot() < 0) {
+        // Boot still works from config.txt alone
+        cli_log("Warning: could not save configuration snapshot\n");
+    }
     GateMutex_leave(sdMutex, sd_mutex_key);
-    cli_log("Successfully saved radar offset to sd card\n");
+    if (ret < 0) {
+        cli_log("Could not save %s to configuration file\n", key);
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * Writes config.new as a copy of config.txt with one key set to a new value,
+ * then moves it over config.txt. Comments and other lines are copied as they
+ * are. If the key is not in config.txt, it is added at the end.
+ * Must be called with the SD card mutex held.
+ * @param key: configuration key to set
+ * @param value: value to set
+ * @return 0 on success, or negative value on error
+ */
+static int rewrite_config_file(const char *key, const char *value) {
+    FILE *input_config_file, *output_config_file;
+    char file_buffer[CONFIG_LINE_MAX], parse_buffer[CONFIG_LINE_MAX];
+    char *config_key;
+    bool found = false;
+    int ret = 0;
+
+    // A missing config.txt is created holding only this key
+    input_config_file = sd_fopen(configuration_filename, "r");
+    output_config_file = sd_fopen(new_configuration_filename, "w");
+    if (!output_config_file) {
+        if (input_config_file) {
+            sd_fclose(input_config_file);
+        }
+        return -1;
+    }
+    while (input_config_file &&
+           fgets(file_buffer, sizeof(file_buffer), input_config_file)) {
+        config_key = NULL;
+        if (file_buffer[0] != '#' && file_buffer[0] != '\n') {
+            strcpy(parse_buffer, file_buffer);
+            config_key = strtok(parse_buffer, " :\r\n");
+        }
+        if (config_key && strcmp(config_key, key) == 0) {
+            // Replace the key's line, dropping any repeats of it
+            if (!found && sd_fprintf(output_config_file, "%s : %s\n", key,
+                                     value) < 0) {
+                ret = -1;
+            }
+            found = true;
+        } else if (sd_fputs(file_buffer, output_config_file) == EOF) {
+            ret = -1;
+        }
+    }
+    if (input_config_file) {
+        if (ferror(input_config_file)) {
+            ret = -1;
+        }
+        sd_fclose(input_config_file);
+    }
+    if (!found &&
+        sd_fprintf(output_config_file, "%s : %s\n", key, value) < 0) {
+        ret = -1;
+    }
+    if (sd_fclose(output_config_file) != 0) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        f_unlink(config_new_path);
+        return -1;
+    }
+    return replace_config_file();
+}
+
+/**
+ * Moves a completely written config.new over config.txt. FatFs cannot rename
+ * over an existing file, so config.txt is first moved to config.old.
+ * Must be called with the SD card mutex held.
+ * @return 0 on success, or negative value on error
+ */
+static int replace_config_file() {
+    FRESULT fr;
+
+    f_unlink(config_old_path);
+    fr = f_rename(config_path, config_old_path);
+    if (fr != FR_OK && fr != FR_NO_FILE) {
+        return -1;
+    }
+    if (f_rename(config_new_path, config_path) != FR_OK) {
+        return -1;
+    }
+    f_unlink(config_old_path);
+    return 0;
+}
+
+/**
+ * Finishes a configuration file replacement cut short by a power loss.
+ * config.new is only renamed once it is complete, so if config.txt is
+ * missing, config.new (or else config.old) holds the configuration. If
+ * config.txt exists, any config.new is a partial write and is deleted.
+ * Must be called with the SD card mutex held.
+ */
+static void recover_config_file() {
+    FILINFO info;
+
+    if (f_stat(config_path, &info) == FR_OK) {
+        f_unlink(config_new_path);
+        f_unlink(config_old_path);
+    } else if (f_rename(config_new_path, config_path) == FR_OK ||
+               f_rename(config_old_path, config_path) == FR_OK) {
+        cli_log("Recovered configuration file after interrupted update\n");
+        f_unlink(config_old_path);
+    }
+}
+
+/**
+ * Loads program_config from the binary snapshot, if the snapshot is intact
+ * and was made from the current config.txt and built in defaults.
+ * Must be called with the SD card mutex held.
+ * @param text_info: file information of config.txt
+ * @return 0 if program_config was loaded, or negative value if config.txt
+ *  must be parsed instead
+ */
+static int load_config_snapshot(const FILINFO *text_info) {
+    ConfigSnapshot snapshot;
+    FIL file;
+    FRESULT fr;
+    UINT bytes_read;
+
+    if (sd_open(&file, config_snapshot_path, FA_READ) != FR_OK) {
+        return -1;
+    }
+    fr = f_read(&file, &snapshot, sizeof(snapshot), &bytes_read);
+    sd_close(&file);
+    if (fr != FR_OK || bytes_read != sizeof(snapshot) ||
+        memcmp(snapshot.magic, CONFIG_SNAPSHOT_MAGIC,
+               sizeof(snapshot.magic)) != 0 ||
+        snapshot.version != CONFIG_SNAPSHOT_VERSION ||
+        snapshot.config_size != CONFIG_SERIALIZED_SIZE ||
+        snapshot.schema_id != config_schema_id() ||
+        snapshot.crc != crc32(&snapshot, offsetof(ConfigSnapshot, crc))) {
+        return -1;
+    }
+    if (snapshot.text_size != text_info->fsize ||
+        snapshot.text_time != FAT_TIMESTAMP(text_info) ||
+        snapshot.defaults_crc != config_defaults_crc) {
+        return -1; // config.txt or the firmware changed
+    }
+    return config_deserialize(&program_config, snapshot.config);
+}
+
+/**
+ * Saves program_config to the binary snapshot, tagged with the size and time
+ * of config.txt. Must be called right after config.txt is parsed or written.
+ * Must be called with the SD card mutex held.
+ * @return 0 on success, or negative value on error
+ */
+static int save_config_snapshot() {
+    ConfigSnapshot snapshot;
+    FILINFO info;
+    FIL file;
+    FRESULT fr;
+    UINT bytes_written;
+
+    if (f_stat(config_path, &info) != FR_OK) {
+        return -1;
+    }
+    memset(&snapshot, 0, sizeof(snapshot));
+    memcpy(snapshot.magic, CONFIG_SNAPSHOT_MAGIC, sizeof(snapshot.magic));
+    snapshot.version = CONFIG_SNAPSHOT_VERSION;
+    snapshot.config_size = CONFIG_SERIALIZED_SIZE;
+    snapshot.schema_id = config_schema_id();
+    snapshot.text_size = info.fsize;
+    snapshot.text_time = FAT_TIMESTAMP(&info);
+    snapshot.defaults_crc = config_defaults_crc;
+    config_serialize(&program_config, snapshot.config);
+    snapshot.crc = crc32(&snapshot, offsetof(ConfigSnapshot, crc));
+    // A torn snapshot fails its CRC, and config.txt is parsed instead
+    fr = sd_open(&file, config_snapshot_path, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK) {
+        return -1;
+    }
+    fr = sd_write(&file, &snapshot, sizeof(snapshot), &bytes_written);
+    if (fr == FR_OK && bytes_written != sizeof(snapshot)) {
+        fr = FR_DENIED; // Disk is full
+    }
+    if (sd_close(&file) != FR_OK && fr == FR_OK) {
+        fr = FR_DISK_ERR;
+    }
+    return fr == FR_OK ? 0 : -1;
 }
 
 /**
- * Reads the program configuration from config.txt,
- * and populates the configuration structure.
+ * Reads the program configuration and populates the configuration
+ * structure. Unless config.txt changed since it was last parsed, the binary
+ * snapshot of the parsed configuration is loaded instead, which takes a
+ * single small read.
+ * @param use_snapshot: false to always parse config.txt
  */
-void read_configuration() {
+void read_configuration(bool use_snapshot) {
     FILE *config_file;
-    char file_buffer[80], *config_key, *config_value;
+    FILINFO info;
+    IArg sd_mutex_key;
+    uint32_t start_ticks = Clock_getTicks();
+    char file_buffer[CONFIG_LINE_MAX], *config_key, *config_value;
     if (!sdfatfsHandle) {
         // Warn user
         System_printf(
             "Warning: SD card not available, cannot read configuration\n");
         return;
     }
-    // Open the configuration file on the SD card.
-    config_file = fopen(configuration_filename, "r");
-    if (!config_file) {
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    recover_config_file();
+    if (f_stat(config_path, &info) != FR_OK) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
         // Don't fail to boot, but warn user.
         cli_log("Warning: no configuration file found, using default values\n");
         System_printf(
             "Warning: no configuration file found, using default values\n");
         return;
     }
+    if (use_snapshot && load_config_snapshot(&info) == 0) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        System_printf("Configuration snapshot loaded in %lu ms\n",
+                      (unsigned long)(Clock_getTicks() - start_ticks));
+        return;
+    }
+    // Open the configuration file on the SD card.
+    config_file = sd_fopen(configuration_filename, "r");
+    if (!config_file) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        cli_log("Warning: could not open configuration file, using default "
+                "values\n");
+        return;
+    }
     // Read the configuration file data.
     while (1) {
         if (fgets(file_buffer, sizeof(file_buffer), config_file) == NULL) {
@@ -427,168 +1174,2377 @@ void read_configuration() {
          * Now parse the configuration line.
          * Lines are formatted as "key : value"
          */
-        config_key = strtok(file_buffer, " : ");
-        // /n removes the newline from value
-        config_value = strtok(NULL, " : \n");
+        config_key = strtok(file_buffer, " :\r\n");
+        // \r\n removes the line ending from value
+        config_value = strtok(NULL, " :\r\n");
         if ((!config_key) || !(config_value)) {
             System_printf("Invalid configuration file line\n");
             continue;
         }
         System_printf("Config: %s = %s\n", config_key, config_value);
-        parse_config_entry(config_key, config_value);
+        if (config_parse_entry(config_key, config_value) == -2) {
+            // Field keeps its previous value
+            cli_log("Invalid configuration value for %s: %s\n", config_key,
+                    config_value);
+        }
     }
-    fclose(config_file);
-}
+    sd_fclose(config_file);
+    if (save_config_snapshot() < 0) {
+        cli_log("Warning: could not save configuration snapshot\n");
+    }
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    System_printf("Configuration file parsed in %lu ms\n",
+                  (unsigned long)(Clock_getTicks() - start_ticks));
+}
+
+/**
+ * This function posts an event to the storage thread so that it will attempt
+ * to mount the SD card
+ */
+void request_sd_mount() { Event_post(storageEventHandle, EVT_SDCARD_MOUNT); }
+
+/**
+ * This function mounts the SD card, and opens the log files for writing.
+ * No attempt is made to reread the configuration file.
+ * @return 0 on success, or negative value if the card could not be mounted
+ */
+int mount_sdcard() {
+    FRESULT fr;
+    IArg sd_mutex_key;
+    uint32_t day;
+    sdfatfsHandle = SDFatFS_open(CONFIG_SD_0, DRIVE_NUM);
+    if (sdfatfsHandle == NULL) {
+        System_printf("Warning: could not open the SD card\n");
+        return -1;
+    }
+    // Get SD card mutex
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    /*
+     * Make sure the data directory exists. Daily data files are opened when
+     * the first sample of each day is stored.
+     */
+    fr = f_mkdir(data_dirname);
+    switch (fr) {
+    case FR_OK:
+        System_printf("Created sensor data directory\n");
+        break;
+    case FR_EXIST:
+        break;
+    case FR_NOT_READY:
+        // This error occurs when the system has no SD card. Warn user.
+        System_printf("Warning: no SD card detected\n");
+        SDFatFS_close(sdfatfsHandle);
+        sdfatfsHandle = NULL;
+        break;
+    default:
+        // A card with bad contacts or a damaged file system, try again later
+        System_printf("Warning: SD card error %d\n", (int)fr);
+        SDFatFS_close(sdfatfsHandle);
+        sdfatfsHandle = NULL;
+    }
+    if (sdfatfsHandle) {
+        // Open log file
+        if (writer_open(&log_writer, log_filename) != FR_OK) {
+            // Don't fail to boot, but warn user.
+            cli_log("Warning: could not locate log file\n");
+            System_printf("Warning: could not locate log file\n");
+        }
+        // Open trace file, starting it with a header if it is new
+        if (writer_open(&trace_writer, trace_filename) != FR_OK ||
+            (f_size(&(trace_writer.file)) == 0 &&
+             writer_write(&trace_writer, &TRACE_HEADER,
+                          sizeof(TRACE_HEADER)) < 0)) {
+            cli_log("Warning: could not open trace file\n");
+        }
+        /*
+         * Carry on from the newest day: pick up its rollup periods left open
+         * by the last reset, and bring its compressed file up to date. Older
+         * days are over, so they are compacted if they were not already.
+         */
+        day = newest_data_day();
+        if (day != NO_DAY) {
+            rollup_rebuild(day);
+            compact_stale_days(day);
+            if (data_day_open(day) < 0) {
+                cli_log("Warning: could not open data file for day\n");
+            }
+        }
+    }
+    // Leave SD card mutex
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    return sdfatfsHandle ? 0 : -1;
+}
+
+/**
+ * Creates a new sensor data file holding only the file header, and reserves
+ * a contiguous extent for it so appends do not need to allocate clusters.
+ * Must be called with the SD card mutex held.
+ * @param filename: name of data file to create
+ * @return FR_OK on success, or FatFs error code
+ */
+static FRESULT create_data_file(const char *filename) {
+    FIL file;
+    FRESULT fr;
+    UINT bytes_written;
+
+    fr = sd_open(&file, filename, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK) {
+        return fr;
+    }
+    // f_expand only works while the file is still empty
+    if (DATA_FILE_EXTENT && f_expand(&file, DATA_FILE_EXTENT, 1) != FR_OK) {
+        // Not fatal, the file is grown as it fills instead
+        cli_log("Warning: no contiguous space for sensor data file\n");
+    }
+    fr = sd_write(&file, &FILE_HEADER, sizeof(FILE_HEADER), &bytes_written);
+    if (fr == FR_OK && bytes_written != sizeof(FILE_HEADER)) {
+        fr = FR_DENIED; // Disk is full
+    }
+    if (sd_close(&file) != FR_OK && fr == FR_OK) {
+        fr = FR_DISK_ERR;
+    }
+    return fr;
+}
+
+/**
+ * Opens the data file, index file and compressed block file for a day,
+ * closing the previously open day. A data file with a header this firmware
+ * does not write is moved aside and replaced. If the day was already
+ * compacted, its data file is first restored from the compressed file.
+ * Must be called with the SD card mutex held.
+ * @param day: day to open files for, in days since the unix epoch
+ * @return 0 on success, or negative value on error
+ */
+static int data_day_open(uint32_t day) {
+    char filename[DAY_FILENAME_LEN], old_filename[DAY_FILENAME_LEN];
+    int ret;
+
+    // A late sample for an earlier day leaves the open day's data file
+    ret = data_day_close(open_day != NO_DAY && day > open_day);
+    if (ret < 0) {
+        cli_log("SD card write error while closing data file\n");
+    }
+    if (ret == -2) {
+        // Samples lost from the closed file must be stored again first
+        return -1;
+    }
+    day_filename(day, "bin", filename);
+    ret = data_file_open(filename);
+    if (ret == -2) {
+        // Don't append records in a format the file wasn't created with
+        day_filename(day, "old", old_filename);
+        cli_log("Warning: unknown data file format, moving it to %s\n",
+                old_filename);
+        f_unlink(old_filename);
+        if (f_rename(filename, old_filename) != FR_OK) {
+            return -1;
+        }
+        ret = -3;
+    }
+    if (ret == -3) {
+        // Samples of a compacted day go back in the data file first
+        if (journal_restore(day) < 0) {
+            return -1;
+        }
+        ret = data_file_open(filename);
+    }
+    if (ret == -3) {
+        // No data file for this day yet
+        if (create_data_file(filename) != FR_OK) {
+            return -1;
+        }
+        ret = data_file_open(filename);
+    }
+    if (ret != 0) {
+        return -1;
+    }
+    day_filename(day, "idx", filename);
+    if (writer_open(&index_writer, filename) != FR_OK) {
+        // Samples are still stored, queries of this day just scan more
+        cli_log("Warning: could not open data index file %s\n", filename);
+    }
+    if (block_file_open_day(day) < 0) {
+        // The data file then stays the day's stored copy
+        cli_log("Warning: could not open compressed data file for day\n");
+    }
+    open_day = day;
+    return 0;
+}
+
+/**
+ * Closes the files of the open day, every one even after one fails. Once a
+ * day is over, its compressed block file holds every sample, so the day is
+ * compacted: its data file and index are deleted, and the block file becomes
+ * the only stored copy. A day whose block file missed samples, because a
+ * write failed, keeps its data file.
+ * Must be called with the SD card mutex held.
+ * @param compact: is the day over
+ * @return 0 on success, -1 on a write error, or -2 if samples stored since
+ *  the last commit were lost with the data file, see data_writer_close()
+ */
+static int data_day_close(bool compact) {
+    char filename[DAY_FILENAME_LEN];
+    bool whole = block_file_is_open;
+    int ret = 0;
+
+    if (data_writer_close() < 0) {
+        ret = sd_lost_seq ? -2 : -1;
+        whole = false;
+    }
+    if (writer_close(&index_writer) < 0 && ret == 0) {
+        ret = -1;
+    }
+    if (block_file_close() < 0) {
+        whole = false;
+        if (ret == 0) {
+            ret = -1;
+        }
+    }
+    if (compact && open_day != NO_DAY) {
+        day_filename(open_day, "bin", filename);
+        if (!whole) {
+            cli_log("Keeping %s, compressed data file is incomplete\n",
+                    filename);
+        } else if (f_unlink(filename) == FR_OK) {
+            day_filename(open_day, "idx", filename);
+            f_unlink(filename);
+        }
+    }
+    open_day = NO_DAY;
+    return ret;
+}
+
+/**
+ * Closes the data file writer. If the final flush fails, the samples stored
+ * since the last commit are cut off when the file is opened again, so the
+ * newest of them is noted in sd_lost_seq for drain_backlog() to store them
+ * again from the pending ring.
+ * Must be called with the SD card mutex held.
+ * @return 0 on success, or negative value on write error
+ */
+static int data_writer_close() {
+    int ret;
+
+    ret = writer_close(&data_writer);
+    if (ret < 0 && sd_uncommitted_seq > sd_lost_seq) {
+        sd_lost_seq = sd_uncommitted_seq;
+    }
+    // The writer's buffer is gone, so are the samples it held
+    sd_uncommitted_seq = 0;
+    return ret;
+}
+
+/**
+ * Stores a record in the data file for its day, rolling over to a new file
+ * when the day changes. Every INDEX_STRIDE records of a file, the timestamp
+ * and file offset of the record are added to the day's index file. The
+ * index, compressed block and rollups are only updated once the record is in
+ * the data file, so a failed store that is retried is not counted twice.
+ * Must be called with the SD card mutex held.
+ * @param record: record to store
+ * @return 0 on success, or negative value on error
+ */
+static int store_record(DataRecord *record) {
+    uint32_t day = record->timestamp / SECONDS_PER_DAY;
+
+    if (day != open_day && data_day_open(day) < 0) {
+        return -1;
+    }
+    if (journal_write(record) < 0) {
+        return -1;
+    }
+    if (block_store(record) < 0) {
+        cli_log("Compressed data write error, keeping data file of day\n");
+    }
+    if (rollup_add(record, true) < 0) {
+        cli_log("Rollup write error\n");
+    }
+    return 0;
+}
+
+/**
+ * Appends a record to the open data file. Every INDEX_STRIDE records of a
+ * file, the timestamp and file offset of the record are added to the day's
+ * index file.
+ * Must be called with the SD card mutex held.
+ * @param record: record to append, its crc is set
+ * @return 0 on success, or negative value on write error
+ */
+static int journal_write(DataRecord *record) {
+    IndexEntry entry;
+
+    // Offset the record will be written at
+    entry.offset = f_tell(&(data_writer.file)) + data_writer.len;
+    record->crc = record_crc(record);
+    if (writer_write(&data_writer, record, sizeof(DataRecord)) < 0) {
+        return -1;
+    }
+    last_sample_time = record->timestamp;
+    uncommitted_records++;
+    if (((entry.offset - sizeof(DataFileHeader)) / sizeof(DataRecord)) %
+            INDEX_STRIDE ==
+        0) {
+        entry.timestamp = record->timestamp;
+        if (index_writer.open &&
+            writer_write(&index_writer, &entry, sizeof(entry)) < 0) {
+            cli_log("Data index write error\n");
+            writer_close(&index_writer);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads the samples of the open data file, oldest first, to count them, and
+ * optionally to add those after the first skip samples to the block being
+ * built.
+ * Must be called with the SD card mutex held, with nothing buffered in the
+ * data file writer.
+ * @param skip: number of samples to pass over before adding them to the
+ *  block
+ * @param encode: add the samples after skip to the block
+ * @param count: set to the number of samples in the data file
+ * @return 0 on success, or negative value on a file system error
+ */
+static int journal_read(uint32_t skip, bool encode, uint32_t *count) {
+    DataRecord records[QUERY_CHUNK_RECORDS];
+    FIL *file = &(data_writer.file);
+    uint32_t pos, len, data_end = f_tell(file);
+    UINT bytes_read;
+    unsigned int i;
+    int ret = 0;
+
+    *count = 0;
+    for (pos = sizeof(DataFileHeader); pos < data_end; pos += len) {
+        len = (data_end - pos) < sizeof(records) ? data_end - pos
+                                                 : sizeof(records);
+        if (f_lseek(file, pos) != FR_OK ||
+            f_read(file, records, len, &bytes_read) != FR_OK ||
+            bytes_read != len) {
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < len / sizeof(DataRecord); i++) {
+            if (!record_valid(&records[i])) {
+                continue;
+            }
+            if (encode && *count >= skip) {
+                block_store(&records[i]);
+            }
+            (*count)++;
+        }
+        Watchdog_clear(watchdogHandle);
+    }
+    // Appending carries on from the end of the file
+    if (f_lseek(file, data_end) != FR_OK) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * Writes the samples of a compacted day back to a new data file, when more
+ * samples arrive for the day, such as after a clock step. The file is built
+ * under a temporary name and renamed once complete, so a reset part way
+ * through leaves the day compacted.
+ * Must be called with the SD card mutex held, with no day open.
+ * @param day: day to restore, in days since the unix epoch
+ * @return 0 on success or if the day has no compressed file, or negative
+ *  value on error
+ */
+static int journal_restore(uint32_t day) {
+    uint8_t block[GORILLA_BLOCK_SIZE];
+    const GorillaBlockHeader *header = (const GorillaBlockHeader *)block;
+    char block_name[DAY_FILENAME_LEN], temp_name[DAY_FILENAME_LEN],
+        data_name[DAY_FILENAME_LEN];
+    GorillaDecoder decoder;
+    DataRecord record;
+    FIL file;
+    FRESULT fr;
+    UINT bytes_read;
+    uint32_t count = 0;
+    int ret = 0;
+
+    day_filename(day, "gts", block_name);
+    fr = sd_open(&file, block_name, FA_READ);
+    if (fr == FR_NO_FILE) {
+        return 0;
+    } else if (fr != FR_OK) {
+        return -1;
+    }
+    // Offsets in an index left behind would not match the new file
+    day_filename(day, "idx", data_name);
+    f_unlink(data_name);
+    day_filename(day, "new", temp_name);
+    f_unlink(temp_name);
+    if (create_data_file(temp_name) != FR_OK ||
+        data_file_open(temp_name) != 0) {
+        sd_close(&file);
+        return -1;
+    }
+    while (ret == 0 &&
+           (fr = f_read(&file, block, sizeof(block), &bytes_read)) == FR_OK &&
+           bytes_read == sizeof(block)) {
+        if (gorilla_decoder_init(&decoder, block) < 0) {
+            continue; // Damaged blocks were skipped by queries too
+        }
+        record.sensor_id = header->sensor_id;
+        while (gorilla_next(&decoder, &record.timestamp, &record.distance)) {
+            if (journal_write(&record) < 0) {
+                ret = -1;
+                break;
+            }
+            count++;
+        }
+        Watchdog_clear(watchdogHandle);
+    }
+    if (fr != FR_OK) {
+        ret = -1;
+    }
+    sd_close(&file);
+    if (writer_close(&data_writer) < 0) {
+        ret = -1;
+    }
+    day_filename(day, "bin", data_name);
+    if (ret == 0 && f_rename(temp_name, data_name) != FR_OK) {
+        ret = -1;
+    }
+    if (ret < 0) {
+        f_unlink(temp_name);
+        return -1;
+    }
+    cli_log("Restored %lu samples to %s\n", (unsigned long)count, data_name);
+    return 0;
+}
+
+/**
+ * Computes the check value of a DataRecord or CommitRecord
+ * @param record: record to check, of either type
+ * @return low 16 bits of the CRC-32 of the fields before the crc field
+ */
+static uint16_t record_crc(const void *record) {
+    return (uint16_t)crc32(record, offsetof(DataRecord, crc));
+}
+
+/**
+ * Checks if a data file slot holds an intact sample record
+ * @param record: record read from a data file
+ * @return true for a sample record with a matching CRC, false for a damaged
+ *  record or a CommitRecord
+ */
+static bool record_valid(const DataRecord *record) {
+    return record->timestamp != COMMIT_MARKER &&
+           record->crc == record_crc(record);
+}
+
+/**
+ * Opens the compressed block file for a day, "data/YYMMDD.gts", and brings it
+ * in line with the open data file. Blocks are not synced as they are written,
+ * so after a power loss the file may miss blocks, end in a torn one, or hold
+ * samples the data file dropped with an uncommitted tail. The file is cut
+ * after the last intact block covered by the data file, and the data file's
+ * samples after it are encoded again.
+ * Must be called with the SD card mutex held, with the day's data file open.
+ * @param day: day to open the file for, in days since the unix epoch
+ * @return 0 on success, or negative value on error
+ */
+static int block_file_open_day(uint32_t day) {
+    uint8_t block[GORILLA_BLOCK_SIZE];
+    char filename[DAY_FILENAME_LEN];
+    GorillaDecoder decoder;
+    uint32_t journal_count, block_count = 0;
+    FSIZE_t pos = 0;
+    UINT bytes_read;
+
+    if (journal_read(0, false, &journal_count) < 0) {
+        return -1;
+    }
+    day_filename(day, "gts", filename);
+    if (sd_open(&block_file, filename,
+                FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) {
+        return -1;
+    }
+    while (pos + GORILLA_BLOCK_SIZE <= f_size(&block_file)) {
+        if (f_read(&block_file, block, sizeof(block), &bytes_read) != FR_OK ||
+            bytes_read != sizeof(block)) {
+            sd_close(&block_file);
+            return -1;
+        }
+        if (gorilla_decoder_init(&decoder, block) < 0 ||
+            block_count + decoder.count > journal_count) {
+            break;
+        }
+        block_count += decoder.count;
+        pos += GORILLA_BLOCK_SIZE;
+    }
+    if ((pos != f_size(&block_file) &&
+         (f_lseek(&block_file, pos) != FR_OK ||
+          f_truncate(&block_file) != FR_OK)) ||
+        f_lseek(&block_file, pos) != FR_OK) {
+        sd_close(&block_file);
+        return -1;
+    }
+    block_file_is_open = true;
+    gorilla_init(&block_encoder, (uint16_t)program_config.synthetic_id);
+    if (block_count < journal_count) {
+        if (journal_read(block_count, true, &journal_count) < 0) {
+            block_file_close();
+            return -1;
+        }
+        cli_log("Encoded %lu samples again to %s\n",
+                (unsigned long)(journal_count - block_count), filename);
+    }
+    return 0;
+}
+
+/**
+ * Writes out the block being built, even if it is not full, and closes the
+ * compressed block file. Does nothing if the file is not open.
+ * Must be called with the SD card mutex held.
+ * @return 0 on success, or negative value on write error
+ */
+static int block_file_close() {
+    int ret;
+
+    if (!block_file_is_open) {
+        return 0;
+    }
+    ret = block_write();
+    if (!block_file_is_open) {
+        // Closed by a failed write
+        return ret;
+    }
+    block_file_is_open = false;
+    if (sd_close(&block_file) != FR_OK) {
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * Adds a record to the block being built, writing the block out to the
+ * compressed block file once it is full.
+ * Must be called with the SD card mutex held.
+ * @param record: record to add
+ * @return 0 on success, or negative value on write error
+ */
+static int block_store(DataRecord *record) {
+    int ret = 0;
+
+    if (!block_file_is_open) {
+        return 0;
+    }
+    if (gorilla_count(&block_encoder) == 0) {
+        gorilla_init(&block_encoder, record->sensor_id);
+    }
+    if (!gorilla_append(&block_encoder, record->timestamp, record->distance)) {
+        ret = block_write();
+        gorilla_append(&block_encoder, record->timestamp, record->distance);
+    }
+    return ret;
+}
+
+/**
+ * Writes the block being built to the compressed block file as one sector,
+ * and starts a new block. The block is not synced: the data file is synced
+ * with every commit, and block_file_open_day() encodes its samples again
+ * after a power loss. On a write error the block file is closed, so it stays
+ * a gapless run of the day's samples, and the day keeps its data file.
+ * Must be called with the SD card mutex held.
+ * @return 0 on success, or negative value on write error
+ */
+static int block_write() {
+    UINT bytes_written;
+    int ret = 0;
+
+    if (gorilla_count(&block_encoder) == 0) {
+        return 0;
+    }
+    gorilla_seal(block_encoder.block);
+    if (sd_write(&block_file, block_encoder.block, GORILLA_BLOCK_SIZE,
+                &bytes_written) != FR_OK ||
+        bytes_written != GORILLA_BLOCK_SIZE) {
+        block_file_is_open = false;
+        sd_close(&block_file);
+        ret = -1;
+    } else {
+        storage_stats.sector_writes++;
+    }
+    gorilla_init(&block_encoder, (uint16_t)program_config.synthetic_id);
+    return ret;
+}
+
+/**
+ * Builds the name of a data directory file for a day, in the form
+ * "data/YYMMDD.ext".
+ * @param day: day in days since the unix epoch
+ * @param ext: file extension, without the dot, at most 3 characters
+ * @param output: buffer of at least DAY_FILENAME_LEN bytes
+ */
+static void day_filename(uint32_t day, const char *ext, char *output) {
+    int year, month, mday;
+
+    civil_from_days(day, &year, &month, &mday);
+    // Every field is bounded to its width, so the name always fits
+    snprintf(output, DAY_FILENAME_LEN, "%s/%02u%02u%02u.%.3s", data_dirname,
+             (unsigned int)year % 100, (unsigned int)month % 100,
+             (unsigned int)mday % 100, ext);
+}
+
+/**
+ * Converts a day count to a calendar date. Done with integer math, so the
+ * result does not depend on the C library's time epoch.
+ * @param day: days since the unix epoch
+ * @param year: set to calendar year
+ * @param month: set to month, 1-12
+ * @param mday: set to day of the month, 1-31
+ */
+static void civil_from_days(uint32_t day, int *year, int *month, int *mday) {
+    // Shift the epoch to 0000-03-01, so leap days fall at the end of a year
+    uint32_t z = day + 719468;
+    uint32_t era = z / 146097;
+    uint32_t doe = z - era * 146097;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+
+    *mday = doy - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = yoe + era * 400 + (*month <= 2);
+}
+
+/**
+ * Converts a calendar date to a day count. Inverse of civil_from_days.
+ * @param year: calendar year, 1970 or later
+ * @param month: month, 1-12
+ * @param mday: day of the month, 1-31
+ * @return days since the unix epoch
+ */
+static uint32_t days_from_civil(int year, int month, int mday) {
+    uint32_t y = year - (month <= 2);
+    uint32_t era = y / 400;
+    uint32_t yoe = y - era * 400;
+    uint32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 +
+                   mday - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/**
+ * Parses a UTC time given as "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM:SS"
+ * @param str: string to parse
+ * @param timestamp: set to the unix timestamp of str
+ * @return 0 on success, or negative value if str is not a valid time
+ */
+int storage_parse_time(const char *str, uint32_t *timestamp) {
+    int year, month, mday, hour = 0, min = 0, sec = 0, fields;
+
+    fields = sscanf(str, "%d-%d-%dT%d:%d:%d", &year, &month, &mday, &hour,
+                    &min, &sec);
+    if ((fields != 3 && fields != 6) || year < 1970 || month < 1 ||
+        month > 12 || mday < 1 || mday > 31 || hour < 0 || hour > 23 ||
+        min < 0 || min > 59 || sec < 0 || sec > 59) {
+        return -1;
+    }
+    *timestamp = days_from_civil(year, month, mday) * SECONDS_PER_DAY +
+                 hour * 3600 + min * 60 + sec;
+    return 0;
+}
+
+/**
+ * Formats a unix timestamp as a UTC "YYYY-MM-DDTHH:MM:SS" string
+ * @param timestamp: unix timestamp to format
+ * @param output: output buffer
+ * @param len: length of output buffer
+ */
+void storage_format_time(uint32_t timestamp, char *output, int len) {
+    int year, month, mday;
+    uint32_t secs = timestamp % SECONDS_PER_DAY;
+
+    civil_from_days(timestamp / SECONDS_PER_DAY, &year, &month, &mday);
+    snprintf(output, len, "%04d-%02d-%02dT%02d:%02d:%02d", year, month, mday,
+             (int)(secs / 3600), (int)((secs / 60) % 60), (int)(secs % 60));
+}
+
+/**
+ * Finds where to start reading a day's data file for records at or after a
+ * time, using the day's sparse index file.
+ * Must be called with the SD card mutex held.
+ * @param day: day of the data file, in days since the unix epoch
+ * @param start: unix timestamp to look for
+ * @param data_end: end of valid records in the data file
+ * @return file offset of the latest indexed record at or before start, or the
+ *  first record of the file if there is none
+ */
+static uint32_t index_lookup(uint32_t day, uint32_t start, uint32_t data_end) {
+    IndexEntry entries[SECTOR_SIZE / sizeof(IndexEntry)];
+    char filename[DAY_FILENAME_LEN];
+    uint32_t offset = sizeof(DataFileHeader);
+    FIL file;
+    UINT bytes_read;
+    unsigned int i;
+
+    day_filename(day, "idx", filename);
+    if (sd_open(&file, filename, FA_READ) != FR_OK) {
+        return offset;
+    }
+    while (f_read(&file, entries, sizeof(entries), &bytes_read) == FR_OK &&
+           bytes_read >= sizeof(IndexEntry)) {
+        for (i = 0; i < bytes_read / sizeof(IndexEntry); i++) {
+            if (entries[i].timestamp > start) {
+                sd_close(&file);
+                return offset;
+            }
+            if (entries[i].offset < data_end) {
+                offset = entries[i].offset;
+            }
+        }
+    }
+    sd_close(&file);
+    return offset;
+}
+
+/**
+ * Reads stored sensor records in a time range. Each day is read from its
+ * compressed block file, or from its data file while the day keeps one
+ * without a whole block file. The SD card is only locked while each chunk of
+ * records is read, so sampling continues during long queries.
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of records passed to callback, or negative value on error
+ */
+int storage_query(uint32_t start, uint32_t end,
+                  bool (*callback)(DataRecord *record, void *arg), void *arg) {
+    char filename[DAY_FILENAME_LEN];
+    FILINFO info;
+    IArg sd_mutex_key;
+    uint32_t day;
+    int ret, count = 0;
+    bool done = false, blocks;
+
+    if (end <= start) {
+        return 0;
+    }
+    for (day = start / SECONDS_PER_DAY;
+         day <= (end - 1) / SECONDS_PER_DAY && !done; day++) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        if (!sdfatfsHandle) {
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return -1;
+        }
+        if (day == open_day) {
+            blocks = block_file_is_open;
+        } else {
+            // Compacted days have no data file left
+            day_filename(day, "bin", filename);
+            blocks = f_stat(filename, &info) != FR_OK;
+        }
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        ret = blocks ? query_day_blocks(day, start, end, callback, arg, &done)
+                     : query_day_raw(day, start, end, callback, arg, &done);
+        if (ret < 0) {
+            return -1;
+        }
+        count += ret;
+    }
+    return count;
+}
+
+/**
+ * Reads one day's records in a time range from its data file, seeking with
+ * its index file.
+ * @param day: day to read, in days since the unix epoch
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @param done: set once callback stops the query
+ * @return number of records passed to callback, or negative value on error
+ */
+static int query_day_raw(uint32_t day, uint32_t start, uint32_t end,
+                         bool (*callback)(DataRecord *record, void *arg),
+                         void *arg, bool *done) {
+    DataRecord records[QUERY_CHUNK_RECORDS];
+    char filename[DAY_FILENAME_LEN];
+    IArg sd_mutex_key;
+    FIL file, *fp;
+    FSIZE_t write_pos;
+    UINT bytes_read;
+    uint32_t pos, data_end;
+    unsigned int i;
+    int count = 0;
+    bool ok;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    if (!sdfatfsHandle) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        return -1;
+    }
+    if (day == open_day) {
+        /*
+         * The day being written is read through the writer's own file
+         * object, restoring its position after each read. Flush first so
+         * buffered records and index entries are on the card.
+         */
+        if (writer_flush(&data_writer) < 0 ||
+            writer_flush(&index_writer) < 0) {
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return -1;
+        }
+        fp = &(data_writer.file);
+        data_end = f_tell(fp);
+    } else {
+        fp = &file;
+        day_filename(day, "bin", filename);
+        if (sd_open(fp, filename, FA_READ) != FR_OK) {
+            // No samples stored this day
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return 0;
+        }
+        if (read_data_header(fp, &data_end) < 0) {
+            sd_close(fp);
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return 0;
+        }
+    }
+    pos = index_lookup(day, start, data_end);
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    while (pos < data_end && !*done) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        // The day's file is closed if the card was unmounted or it rolled
+        ok = sdfatfsHandle && (fp == &file || day == open_day);
+        if (ok) {
+            write_pos = f_tell(fp);
+            ok = f_lseek(fp, pos) == FR_OK &&
+                 f_read(fp, records,
+                        (data_end - pos) < sizeof(records) ? data_end - pos
+                                                           : sizeof(records),
+                        &bytes_read) == FR_OK &&
+                 bytes_read >= sizeof(DataRecord);
+            if (fp != &file && f_lseek(fp, write_pos) != FR_OK) {
+                ok = false;
+            }
+        }
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        if (!ok) {
+            break;
+        }
+        pos += bytes_read;
+        for (i = 0; i < bytes_read / sizeof(DataRecord) && !*done; i++) {
+            // Time steps from RTC syncs can leave records out of order
+            if (record_valid(&records[i]) && records[i].timestamp >= start &&
+                records[i].timestamp < end) {
+                count++;
+                *done = !callback(&records[i], arg);
+            }
+        }
+        Watchdog_clear(watchdogHandle);
+    }
+    if (fp == &file) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        sd_close(&file);
+        GateMutex_leave(sdMutex, sd_mutex_key);
+    }
+    return count;
+}
+
+/**
+ * Adds a record to every rollup tier. A tier's current period is written to
+ * its file when the record falls in a different period, so each tier costs
+ * the same small amount of RAM however many samples arrive.
+ * Must be called with the SD card mutex held.
+ * @param record: record to add
+ * @param emit: write out periods the record ends, false to drop them, for
+ *  samples whose periods were written before
+ * @return 0 on success, or negative value on write error
+ */
+static int rollup_add(DataRecord *record, bool emit) {
+    RollupState *state;
+    uint32_t start;
+    int tier, ret = 0;
+
+    for (tier = 0; tier < ROLLUP_TIERS; tier++) {
+        state = &rollups[tier];
+        start = record->timestamp - record->timestamp % state->period;
+        if (state->current.count && state->current.start != start) {
+            if (emit && rollup_emit((RollupTier)tier) < 0) {
+                ret = -1;
+            }
+            state->current.count = 0;
+        }
+        if (state->current.count == 0) {
+            state->current.start = start;
+            state->current.min = record->distance;
+            state->current.max = record->distance;
+            state->sum = 0.0;
+        } else if (record->distance < state->current.min) {
+            state->current.min = record->distance;
+        } else if (record->distance > state->current.max) {
+            state->current.max = record->distance;
+        }
+        state->sum += record->distance;
+        state->current.count++;
+    }
+    return ret;
+}
+
+/**
+ * Writes the current period of a rollup tier to the tier's file.
+ * Must be called with the SD card mutex held.
+ * @param tier: tier to write
+ * @return 0 on success, or negative value on write error
+ */
+static int rollup_emit(RollupTier tier) {
+    RollupState *state = &rollups[tier];
+    char filename[DAY_FILENAME_LEN];
+    uint32_t day = state->current.start / SECONDS_PER_DAY;
+
+    state->current.mean = (float)(state->sum / state->current.count);
+    rollup_filename(tier, day, filename);
+    if (tier != ROLLUP_MINUTE) {
+        return append_file(filename, &state->current, sizeof(RollupRecord));
+    }
+    if (!rollup_writer.open || rollup_day != day) {
+        if (writer_close(&rollup_writer) < 0) {
+            cli_log("SD card write error while closing rollup file\n");
+        }
+        if (writer_open(&rollup_writer, filename) != FR_OK) {
+            return -1;
+        }
+        rollup_day = day;
+    }
+    return writer_write(&rollup_writer, &state->current, sizeof(RollupRecord));
+}
+
+/**
+ * Rebuilds the period each rollup tier was accumulating before the last
+ * reset, from the newest data file. Periods are only written out when a
+ * sample from the next period arrives, so without this the first rollups
+ * written after a boot would only cover the samples taken since the boot.
+ * Does nothing if the tiers already hold samples, as after a remount.
+ * Must be called with the SD card mutex held, before the day is opened.
+ * @param day: day of the newest data file, which holds the periods still
+ *  open
+ */
+static void rollup_rebuild(uint32_t day) {
+    DataRecord records[QUERY_CHUNK_RECORDS];
+    char filename[DAY_FILENAME_LEN];
+    FIL file;
+    UINT bytes_read;
+    uint32_t pos, data_end, len;
+    unsigned int i, count = 0;
+    int tier;
+
+    for (tier = 0; tier < ROLLUP_TIERS; tier++) {
+        if (rollups[tier].current.count) {
+            return;
+        }
+    }
+    day_filename(day, "bin", filename);
+    if (sd_open(&file, filename, FA_READ) != FR_OK) {
+        return;
+    }
+    if (read_data_header(&file, &data_end) == 0) {
+        // Every period but the last of each tier is dropped as it ends
+        for (pos = sizeof(DataFileHeader); pos < data_end; pos += len) {
+            len = (data_end - pos) < sizeof(records) ? data_end - pos
+                                                     : sizeof(records);
+            if (f_read(&file, records, len, &bytes_read) != FR_OK ||
+                bytes_read != len) {
+                break;
+            }
+            for (i = 0; i < len / sizeof(DataRecord); i++) {
+                if (record_valid(&records[i])) {
+                    rollup_add(&records[i], false);
+                    count++;
+                }
+            }
+            Watchdog_clear(watchdogHandle);
+        }
+    }
+    sd_close(&file);
+    if (count) {
+        cli_log("Rollups rebuilt from %u samples in %s\n", count, filename);
+    }
+}
+
+/**
+ * Finds the newest day with a data file. The data file of a day is deleted
+ * once the day is over, so this is the day the last run was writing.
+ * Must be called with the SD card mutex held.
+ * @return day in days since the unix epoch, or NO_DAY if there is no data
+ *  file
+ */
+static uint32_t newest_data_day() {
+    DIR dir;
+    FILINFO info;
+    uint32_t day = NO_DAY, name_day;
+
+    if (f_opendir(&dir, data_dirname) != FR_OK) {
+        return NO_DAY;
+    }
+    while (f_readdir(&dir, &info) == FR_OK && info.fname[0] != '\0') {
+        name_day = data_file_day(info.fname);
+        if (name_day != NO_DAY && (day == NO_DAY || name_day > day)) {
+            day = name_day;
+        }
+    }
+    f_closedir(&dir);
+    return day;
+}
+
+/**
+ * Compacts the days before the newest data file whose data files were left
+ * behind, as happens when a write fails while the day is closed. Only the
+ * STALE_SCAN_DAYS days before the newest are checked, so mounting a card
+ * with a long history stays quick.
+ * Must be called with the SD card mutex held, with no day open.
+ * @param newest: day of the newest data file
+ */
+static void compact_stale_days(uint32_t newest) {
+    char filename[DAY_FILENAME_LEN];
+    FILINFO info;
+    uint32_t day;
+
+    for (day = newest - 1; day + STALE_SCAN_DAYS >= newest && day < newest;
+         day--) {
+        day_filename(day, "bin", filename);
+        if (f_stat(filename, &info) != FR_OK) {
+            continue;
+        }
+        // Opening the day brings its compressed file up to date
+        if (data_day_open(day) < 0 || data_day_close(true) < 0) {
+            cli_log("Warning: could not compact %s\n", filename);
+        }
+        Watchdog_clear(watchdogHandle);
+    }
+}
+
+/**
+ * Gets the day a data file holds samples for from its name
+ * @param name: name of a file in the data directory
+ * @return day in days since the unix epoch, or NO_DAY if name is not the
+ *  name of a data file
+ */
+static uint32_t data_file_day(const char *name) {
+    int year, month, mday, end = 0;
+
+    // Extensions are upper case without long file name support
+    if (sscanf(name, "%2d%2d%2d.%*[Bb]%*[Ii]%*[Nn]%n", &year, &month, &mday,
+               &end) != 3 ||
+        end != 10 || name[end] != '\0' || month < 1 || month > 12 ||
+        mday < 1 || mday > 31) {
+        return NO_DAY;
+    }
+    return days_from_civil(2000 + year, month, mday);
+}
+
+/**
+ * Builds the name of the file holding a rollup tier's records for a day
+ * @param tier: rollup tier
+ * @param day: day in days since the unix epoch, ignored for day rollups
+ * @param output: buffer of at least DAY_FILENAME_LEN bytes
+ */
+static void rollup_filename(RollupTier tier, uint32_t day, char *output) {
+    if (tier == ROLLUP_DAY) {
+        strcpy(output, day_rollup_filename);
+    } else {
+        day_filename(day, rollups[tier].ext, output);
+    }
+}
+
+/**
+ * Appends data to a file with a single open, write and close, for files
+ * written too rarely to keep open.
+ * Must be called with the SD card mutex held.
+ * @param filename: file to append to, created if it does not exist
+ * @param data: data to append
+ * @param len: length of data
+ * @return 0 on success, or negative value on error
+ */
+static int append_file(const char *filename, const void *data,
+                       unsigned int len) {
+    FIL file;
+    FRESULT fr;
+    UINT bytes_written;
+
+    fr = sd_open(&file, filename, FA_WRITE | FA_OPEN_APPEND);
+    if (fr != FR_OK) {
+        return -1;
+    }
+    fr = sd_write(&file, data, len, &bytes_written);
+    if (fr == FR_OK && bytes_written != len) {
+        fr = FR_DENIED; // Disk is full
+    }
+    if (sd_close(&file) != FR_OK && fr == FR_OK) {
+        fr = FR_DISK_ERR;
+    }
+    storage_stats.partial_writes++;
+    storage_stats.syncs++;
+    return fr == FR_OK ? 0 : -1;
+}
+
+/**
+ * Keeps a record in the internal flash ring while it cannot be stored on the
+ * SD card. If flash fails too, the record is printed to the CLI so it is not
+ * lost silently. Flash survives a power loss, so the record is released from
+ * the pending ring once it is written.
+ * @param record: record to keep
+ * @param seq: sequence number of the record in the pending ring, or 0
+ */
+static void save_to_flash(DataRecord *record, uint32_t seq) {
+    if (flashring_append(record) < 0) {
+        cli_log("Flash write error, sample lost: %lu, %.3f\n",
+                (unsigned long)record->timestamp, record->distance);
+        return;
+    }
+    pending_done(seq, PENDING_STORE);
+}
+
+/**
+ * Moves the records kept in the internal flash ring to the SD card, oldest
+ * first. Flash is only erased once its records are flushed to the card, so
+ * a failure leaves the remaining records in flash for the next attempt.
+ * Takes the SD card mutex.
+ * @return 0 on success, or negative value on write error
+ */
+static int drain_flash_ring() {
+    // Drops already reported by an earlier drain
+    static uint32_t reported_drops = 0;
+    IArg sd_mutex_key;
+    uint32_t dropped = flashring_dropped() - reported_drops;
+    int count;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    count = flashring_drain(flash_ring_store, flash_ring_sync, NULL);
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    if (count < 0) {
+        cli_log("SD card write error while moving samples from flash\n");
+    } else if (count > 0) {
+        cli_log("Moved %d samples from flash to SD card\n", count);
+    }
+    if (dropped) {
+        cli_log("Warning: %lu samples dropped as flash was full\n",
+                (unsigned long)dropped);
+        reported_drops += dropped;
+    }
+    return count < 0 ? -1 : 0;
+}
+
+/**
+ * flashring_drain callback, stores one record kept in flash.
+ * Must be called with the SD card mutex held.
+ * @param record: DataRecord read from flash
+ * @param arg: unused
+ * @return 0 on success, or negative value on error
+ */
+static int flash_ring_store(const void *record, void *arg) {
+    DataRecord data;
+
+    // Flash records are not necessarily aligned for DataRecord
+    memcpy(&data, record, sizeof(data));
+    return store_record(&data);
+}
+
+/**
+ * flashring_drain callback, flushes the records stored so far to the SD card
+ * before their flash sector is erased.
+ * Must be called with the SD card mutex held.
+ * @param arg: unused
+ * @return 0 on success, or negative value on error
+ */
+static int flash_ring_sync(void *arg) {
+    // Draining a full ring takes a while
+    Watchdog_clear(watchdogHandle);
+    if (writer_flush(&data_writer) < 0 || writer_flush(&index_writer) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the rollups of a tier for the periods starting in a time range. Only
+ * the tier's own files are read, never the raw data. The period still being
+ * accumulated is passed to callback last, if it starts in the range.
+ * @param tier: rollup tier to read
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each rollup in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of rollups passed to callback, or negative value on error
+ */
+int storage_rollup_query(RollupTier tier, uint32_t start, uint32_t end,
+                         bool (*callback)(RollupRecord *rollup, void *arg),
+                         void *arg) {
+    RollupRecord rollups_read[ROLLUP_CHUNK_RECORDS], current;
+    char filename[DAY_FILENAME_LEN];
+    IArg sd_mutex_key;
+    FIL file;
+    UINT bytes_read;
+    uint32_t day, last_day;
+    unsigned int i;
+    int count = 0;
+    bool done = false, opened, ok;
+
+    if (end <= start || tier >= ROLLUP_TIERS) {
+        return 0;
+    }
+    // Day rollups are all in one file
+    day = tier == ROLLUP_DAY ? 0 : start / SECONDS_PER_DAY;
+    last_day = tier == ROLLUP_DAY ? 0 : (end - 1) / SECONDS_PER_DAY;
+    for (; day <= last_day && !done; day++) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        if (!sdfatfsHandle) {
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return -1;
+        }
+        if (tier == ROLLUP_MINUTE && day == rollup_day &&
+            writer_close(&rollup_writer) < 0) {
+            // Reopened by the next minute rollup
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return -1;
+        }
+        rollup_filename(tier, day, filename);
+        // A missing file means no samples that day
+        opened = sd_open(&file, filename, FA_READ) == FR_OK;
+        ok = opened;
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        while (ok && !done) {
+            sd_mutex_key = GateMutex_enter(sdMutex);
+            ok = sdfatfsHandle &&
+                 f_read(&file, rollups_read, sizeof(rollups_read),
+                        &bytes_read) == FR_OK &&
+                 bytes_read >= sizeof(RollupRecord);
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            for (i = 0; ok && i < bytes_read / sizeof(RollupRecord) && !done;
+                 i++) {
+                if (rollups_read[i].start >= start &&
+                    rollups_read[i].start < end) {
+                    count++;
+                    done = !callback(&rollups_read[i], arg);
+                }
+            }
+            Watchdog_clear(watchdogHandle);
+        }
+        if (opened) {
+            sd_mutex_key = GateMutex_enter(sdMutex);
+            if (sdfatfsHandle) {
+                sd_close(&file);
+            }
+            GateMutex_leave(sdMutex, sd_mutex_key);
+        }
+    }
+    // The period still being accumulated
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    current = rollups[tier].current;
+    if (current.count) {
+        current.mean = (float)(rollups[tier].sum / current.count);
+    }
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    if (!done && current.count && current.start >= start &&
+        current.start < end) {
+        count++;
+        callback(&current, arg);
+    }
+    return count;
+}
+
+/**
+ * Opens a file on the SD card to be read by the export command. All buffered
+ * writes are flushed first, so the file matches what has been stored. Data
+ * files are only exported up to the end of their records, not their whole
+ * preallocated size. Only one file can be open for export at a time.
+ * @param filename: name of the file to open, relative to the card root
+ * @param size: set to the number of bytes to export
+ * @return 0 on success, or negative value on error
+ */
+int storage_export_open(const char *filename, uint32_t *size) {
+    IArg sd_mutex_key;
+    uint32_t data_end;
+    int i, ret = -1;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    if (sdfatfsHandle && !export_is_open) {
+        for (i = 0; i < sizeof(all_writers) / sizeof(all_writers[0]); i++) {
+            if (writer_flush(all_writers[i]) < 0) {
+                cli_log("SD card write error while flushing for export\n");
+            }
+        }
+        // Blocks are not synced as they are written
+        if (block_file_is_open && sd_sync(&block_file) != FR_OK) {
+            cli_log("SD card write error while flushing for export\n");
+        }
+        if (sd_open(&export_fil, filename, FA_READ) == FR_OK) {
+            *size = f_size(&export_fil);
+            if (read_data_header(&export_fil, &data_end) == 0) {
+                *size = data_end;
+            }
+            export_is_open = true;
+            ret = 0;
+        }
+    }
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    return ret;
+}
+
+/**
+ * Reads from the file opened by storage_export_open()
+ * @param offset: offset in the file to read from
+ * @param buf: buffer to read into
+ * @param len: max number of bytes to read
+ * @return number of bytes read, or negative value on error
+ */
+int storage_export_read(uint32_t offset, void *buf, unsigned int len) {
+    IArg sd_mutex_key;
+    UINT bytes_read;
+    int ret = -1;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    // The file is gone if the card was unmounted during the export
+    if (sdfatfsHandle && export_is_open &&
+        f_lseek(&export_fil, offset) == FR_OK &&
+        f_read(&export_fil, buf, len, &bytes_read) == FR_OK) {
+        ret = bytes_read;
+    }
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    return ret;
+}
+
+/**
+ * Closes the file opened by storage_export_open()
+ */
+void storage_export_close() {
+    IArg sd_mutex_key;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    if (sdfatfsHandle && export_is_open) {
+        sd_close(&export_fil);
+    }
+    export_is_open = false;
+    GateMutex_leave(sdMutex, sd_mutex_key);
+}
+
+/**
+ * Lists the files in a directory of the SD card
+ * @param dirname: directory to list, "" for the card root
+ * @param callback: called with the name and size of each file
+ * @param arg: passed to callback
+ * @return number of files listed, or negative value on error
+ */
+int storage_list_dir(const char *dirname,
+                     void (*callback)(const char *name, uint32_t size,
+                                      void *arg),
+                     void *arg) {
+    IArg sd_mutex_key;
+    DIR dir;
+    FILINFO info;
+    int count = 0;
+
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    if (!sdfatfsHandle || f_opendir(&dir, dirname) != FR_OK) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        return -1;
+    }
+    while (f_readdir(&dir, &info) == FR_OK && info.fname[0] != '\0') {
+        if (!(info.fattrib & AM_DIR)) {
+            callback(info.fname, info.fsize, arg);
+            count++;
+        }
+    }
+    f_closedir(&dir);
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    return count;
+}
+
+/**
+ * Reads stored sensor records in a time range from the compressed block
+ * files only, even for days that still keep a data file.
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of records passed to callback, or negative value on error
+ */
+int storage_query_blocks(uint32_t start, uint32_t end,
+                         bool (*callback)(DataRecord *record, void *arg),
+                         void *arg) {
+    uint32_t day;
+    int ret, count = 0;
+    bool done = false;
+
+    if (end <= start) {
+        return 0;
+    }
+    for (day = start / SECONDS_PER_DAY;
+         day <= (end - 1) / SECONDS_PER_DAY && !done; day++) {
+        ret = query_day_blocks(day, start, end, callback, arg, &done);
+        if (ret < 0) {
+            return -1;
+        }
+        count += ret;
+    }
+    return count;
+}
+
+/**
+ * Reads one day's records in a time range from its compressed block file.
+ * Blocks whose time range does not overlap the query are skipped without
+ * decoding, and the block still being built for the open day is read from
+ * RAM. The SD card is only locked while each block is read.
+ * @param day: day to read, in days since the unix epoch
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @param done: set once callback stops the query
+ * @return number of records passed to callback, or negative value on error
+ */
+static int query_day_blocks(uint32_t day, uint32_t start, uint32_t end,
+                            bool (*callback)(DataRecord *record, void *arg),
+                            void *arg, bool *done) {
+    uint8_t block[GORILLA_BLOCK_SIZE];
+    const GorillaBlockHeader *header = (const GorillaBlockHeader *)block;
+    char filename[DAY_FILENAME_LEN];
+    GorillaDecoder decoder;
+    DataRecord record;
+    IArg sd_mutex_key;
+    FIL file, *fp;
+    FSIZE_t write_pos;
+    UINT bytes_read;
+    uint32_t pos, file_end;
+    int count = 0;
+    bool ok, ram_block;
+
+    record.crc = 0;
+    sd_mutex_key = GateMutex_enter(sdMutex);
+    if (!sdfatfsHandle) {
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        return -1;
+    }
+    if (day == open_day && block_file_is_open) {
+        // Read the day being written through its own file object
+        fp = &block_file;
+        file_end = f_tell(fp);
+    } else {
+        fp = &file;
+        day_filename(day, "gts", filename);
+        if (sd_open(fp, filename, FA_READ) != FR_OK) {
+            // No samples stored this day
+            GateMutex_leave(sdMutex, sd_mutex_key);
+            return 0;
+        }
+        file_end = f_size(fp);
+    }
+    GateMutex_leave(sdMutex, sd_mutex_key);
+    // Whole blocks in the file, then the block in RAM for the open day
+    for (pos = 0; !*done; pos += GORILLA_BLOCK_SIZE) {
+        if (fp == &file && pos + GORILLA_BLOCK_SIZE > file_end) {
+            break;
+        }
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        // The day's file is closed if the card was unmounted or it rolled
+        ok = sdfatfsHandle &&
+             (fp == &file || (day == open_day && block_file_is_open));
+        if (ok && fp != &file) {
+            // Pick up blocks written since the query started
+            file_end = f_tell(fp);
+        }
+        ram_block = pos + GORILLA_BLOCK_SIZE > file_end;
+        if (ok && ram_block) {
+            memcpy(block, block_encoder.block, sizeof(block));
+            gorilla_seal(block);
+        } else if (ok) {
+            write_pos = f_tell(fp);
+            ok = f_lseek(fp, pos) == FR_OK &&
+                 f_read(fp, block, sizeof(block), &bytes_read) == FR_OK &&
+                 bytes_read == sizeof(block);
+            if (fp != &file && f_lseek(fp, write_pos) != FR_OK) {
+                ok = false;
+            }
+        }
+        GateMutex_leave(sdMutex, sd_mutex_key);
+        if (!ok) {
+            break;
+        }
+        if (gorilla_decoder_init(&decoder, block) == 0 &&
+            header->start_time < end && header->end_time >= start) {
+            record.sensor_id = header->sensor_id;
+            while (!*done && gorilla_next(&decoder, &record.timestamp,
+                                          &record.distance)) {
+                if (record.timestamp >= start && record.timestamp < end) {
+                    count++;
+                    *done = !callback(&record, arg);
+                }
+            }
+        }
+        Watchdog_clear(watchdogHandle);
+        if (ram_block) {
+            break;
+        }
+    }
+    if (fp == &file) {
+        sd_mutex_key = GateMutex_enter(sdMutex);
+        sd_close(&file);
+        GateMutex_leave(sdMutex, sd_mutex_key);
+    }
+    return count;
+}
 
 /**
- * Parses a configuration file entry
- * @param key: Configuration file key
- * @param value: Configuration value
+ * Opens a file for appending through a sector writer. The first flush is
+ * sized so that later flushes start on a sector boundary of the file.
+ * Must be called with the SD card mutex held.
+ * @param writer: sector writer to open
+ * @param filename: name of file to open, created if it does not exist
+ * @return FR_OK on success, or FatFs error code
  */
-void parse_config_entry(char *key, char *value) {
-    // Check to see if the configuration data matches any known keys
-    if (strncmp(key, HARDWARE_ID_CONFIG_KEY, strlen(HARDWARE_ID_CONFIG_KEY)) ==
-        0) {
-        // Copy in hardware ID
-        strncpy(program_config.hardware_id, value, HARDWARE_ID_LEN);
-        // Ensure null termination
-        program_config.hardware_id[HARDWARE_ID_LEN - 1] = '\0';
-    } else if (strncmp(key, SYNTHETIC_ID_CONFIG_KEY,
-                       strlen(SYNTHETIC_ID_CONFIG_KEY)) == 0) {
-        program_config.synthetic_id = atoi(value);
-    } else if (strncmp(key, RADAR_ENABLED_KEY, strlen(RADAR_ENABLED_KEY)) ==
-               0) {
-        program_config.radar_module_enabled = (strncmp(value, "true", 4) == 0);
-    } else if (strncmp(key, CAMERA_ENABLED_KEY, strlen(CAMERA_ENABLED_KEY)) ==
-               0) {
-        program_config.camera_module_enabled = (strncmp(value, "true", 4) == 0);
-    } else if (strncmp(key, NETWORK_ENABLED_KEY, strlen(NETWORK_ENABLED_KEY)) ==
-               0) {
-        program_config.network_enabled = (strncmp(value, "true", 4) == 0);
-    } else if (strncmp(key, SERVER_IP_KEY, strlen(SERVER_IP_KEY)) == 0) {
-        strncpy(program_config.server_ip, value, IPV4_ADDR_STRLEN);
-        program_config.server_ip[IPV4_ADDR_STRLEN - 1] = '\0';
-    } else if (strncmp(key, SERVER_AUTH_KEY, strlen(SERVER_AUTH_KEY)) == 0) {
-        strncpy(program_config.server_token, value, TOKEN_STRLEN);
-        program_config.server_token[TOKEN_STRLEN - 1] = '\0';
-    } else if (strncmp(key, RADAR_SAMPLE_INTERVAL_KEY,
-                       strlen(RADAR_SAMPLE_INTERVAL_KEY)) == 0) {
-        program_config.radar_sample_interval = atoi(value);
-    } else if (strncmp(key, RADAR_SAMPLE_COUNT_KEY,
-                       strlen(RADAR_SAMPLE_COUNT_KEY)) == 0) {
-        program_config.radar_sample_count = atoi(value);
-    } else if (strncmp(key, RADAR_SAMPLE_OFFSET_KEY,
-                       strlen(RADAR_SAMPLE_OFFSET_KEY)) == 0) {
-        program_config.radar_sample_offset = strtof(value, NULL);
+static FRESULT writer_open(SectorWriter *writer, const char *filename) {
+    FRESULT fr;
+
+    fr = sd_open(&(writer->file), filename, FA_WRITE | FA_OPEN_APPEND);
+    if (fr != FR_OK) {
+        writer->open = false;
+        return fr;
     }
+    writer->open = true;
+    writer->dirty = false;
+    writer->extent = 0;
+    writer->commit = false;
+    writer->len = 0;
+    writer->capacity = SECTOR_SIZE - (f_tell(&(writer->file)) % SECTOR_SIZE);
+    return FR_OK;
 }
 
 /**
- * This function posts an event to the storage thread so that it will attempt
- * to mount the SD card
+ * Buffers data to be appended to a file. Whenever the buffer reaches the next
+ * sector boundary of the file, the whole sector is written with one f_write.
+ * Must be called with the SD card mutex held.
+ * @param writer: open sector writer
+ * @param data: data to append
+ * @param len: length of data
+ * @return 0 on success, or negative value on write error
  */
-void request_sd_mount() { Event_post(storageEventHandle, EVT_SDCARD_MOUNT); }
+static int writer_write(SectorWriter *writer, const void *data,
+                        unsigned int len) {
+    const uint8_t *src = data;
+    unsigned int chunk;
+
+    if (!writer->open) {
+        return -1;
+    }
+    if (!writer->dirty) {
+        // Start the flush age timer with the first unsynced byte
+        writer->oldest = Clock_getTicks();
+        writer->dirty = true;
+    }
+    while (len) {
+        chunk = writer->capacity - writer->len;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(writer->buf + writer->len, src, chunk);
+        writer->len += chunk;
+        src += chunk;
+        len -= chunk;
+        if (writer->len == writer->capacity &&
+            writer_write_buffer(writer) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 /**
- * This function mounts the SD card, and opens the data file for read and write.
- * No attempt is made to reread the configuration file.
+ * Writes the buffered data of a sector writer to its file. The next buffer
+ * is sized to end on the following sector boundary.
+ * Must be called with the SD card mutex held.
+ * @param writer: open sector writer
+ * @return 0 on success, or negative value on write error
+ */
+static int writer_write_buffer(SectorWriter *writer) {
+    UINT bytes_written;
+
+    if (writer->len == 0) {
+        return 0;
+    }
+    if (writer->extent && f_tell(&(writer->file)) + writer->len >
+                              f_size(&(writer->file)) &&
+        writer_reserve(writer) < 0) {
+        return -1;
+    }
+    if (sd_write(&(writer->file), writer->buf, writer->len, &bytes_written) !=
+            FR_OK ||
+        bytes_written != writer->len) {
+        return -1;
+    }
+    if (writer->len == SECTOR_SIZE) {
+        storage_stats.sector_writes++;
+    } else {
+        storage_stats.partial_writes++;
+    }
+    writer->len = 0;
+    writer->capacity = SECTOR_SIZE - (f_tell(&(writer->file)) % SECTOR_SIZE);
+    return 0;
+}
+
+/**
+ * Writes any buffered data of a sector writer to its file, and syncs the file
+ * so the data survives a power loss.
+ * Must be called with the SD card mutex held.
+ * @param writer: open sector writer
+ * @return 0 on success, or negative value on write error
+ */
+static int writer_flush(SectorWriter *writer) {
+    if (!writer->open || !writer->dirty) {
+        return 0;
+    }
+    if ((writer->commit && writer_commit(writer) < 0) ||
+        writer_write_buffer(writer) < 0 ||
+        (writer->extent && writer_update_end(writer) < 0) ||
+        sd_sync(&(writer->file)) != FR_OK) {
+        return -1;
+    }
+    storage_stats.syncs++;
+    writer->dirty = false;
+    if (writer == &data_writer && sd_uncommitted_seq) {
+        // Samples in the data file are safe now, stop retaining them
+        pending_done_through(sd_uncommitted_seq, PENDING_STORE);
+        sd_uncommitted_seq = 0;
+    }
+    return 0;
+}
+
+/**
+ * Grows a preallocated file by the writer's extent. Seeking past the end of a
+ * file in write mode makes FatFs allocate the whole cluster chain at once, so
+ * the FAT is only updated once per extent rather than once per cluster.
+ * Must be called with the SD card mutex held.
+ * @param writer: open sector writer with a nonzero extent
+ * @return 0 on success, or negative value on error
+ */
+static int writer_reserve(SectorWriter *writer) {
+    FIL *file = &(writer->file);
+    FSIZE_t pos = f_tell(file);
+
+    if (f_lseek(file, f_size(file) + writer->extent) != FR_OK) {
+        return -1;
+    }
+    if (f_lseek(file, pos) != FR_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Records the current write position of a preallocated file as the end of
+ * valid data in its header.
+ * Must be called with the SD card mutex held.
+ * @param writer: open sector writer with a nonzero extent
+ * @return 0 on success, or negative value on error
+ */
+static int writer_update_end(SectorWriter *writer) {
+    FIL *file = &(writer->file);
+    uint32_t data_end = f_tell(file);
+    UINT bytes_written;
+
+    if (f_lseek(file, offsetof(DataFileHeader, data_end)) != FR_OK ||
+        sd_write(file, &data_end, sizeof(data_end), &bytes_written) != FR_OK ||
+        bytes_written != sizeof(data_end) ||
+        f_lseek(file, data_end) != FR_OK) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends a CommitRecord to a data file writer, covering every sample stored
+ * since the last one. Called as the writer is flushed, so the record is synced
+ * together with the samples it covers.
+ * Must be called with the SD card mutex held.
+ * @param writer: open data file writer
+ * @return 0 on success, or negative value on write error
+ */
+static int writer_commit(SectorWriter *writer) {
+    CommitRecord commit;
+
+    commit.marker = COMMIT_MARKER;
+    commit.last_timestamp = last_sample_time;
+    commit.records = uncommitted_records;
+    commit.crc = record_crc(&commit);
+    if (writer_write(writer, &commit, sizeof(commit)) < 0) {
+        return -1;
+    }
+    uncommitted_records = 0;
+    return 0;
+}
+
+/**
+ * Flushes a sector writer, then closes its file.
+ * Must be called with the SD card mutex held.
+ * @param writer: sector writer to close
+ * @return 0 on success, or negative value on write error
+ */
+static int writer_close(SectorWriter *writer) {
+    int ret;
+
+    if (!writer->open) {
+        return 0;
+    }
+    ret = writer_flush(writer);
+    if (sd_close(&(writer->file)) != FR_OK) {
+        ret = -1;
+    }
+    writer->open = false;
+    return ret;
+}
+
+/**
+ * Opens a sensor data file for appending through the data file writer.
+ * Appending continues from the end of valid data recorded in the file header,
+ * rather than the end of the file, as the file is preallocated. Records after
+ * the last CommitRecord are dropped, as a power loss may have torn them.
+ * Must be called with the SD card mutex held.
+ * @param filename: name of data file to open
+ * @return 0 on success, -1 on a file system error, -2 if the file header
+ *  does not match the format this firmware writes, or -3 if the file does not
+ *  exist
  */
-void mount_sdcard() {
+static int data_file_open(const char *filename) {
+    FIL *file = &(data_writer.file);
     FRESULT fr;
-    FILINFO fno;
-    IArg sd_mutex_key;
-    unsigned int bytesWritten;
-    char filename_buf[32];
-    // Print the filename into the full output string we need to open files
-    snprintf(filename_buf, sizeof(filename_buf), "fat:" STR(DRIVE_NUM) ":%s",
-             sensor_data_filename);
-    sdfatfsHandle = SDFatFS_open(CONFIG_SD_0, DRIVE_NUM);
-    if (sdfatfsHandle == NULL) {
-        System_abort("Could not open the SD Card\n");
+    uint32_t data_end;
+    int ret;
+
+    fr = sd_open(file, filename, FA_READ | FA_WRITE);
+    if (fr == FR_NO_FILE) {
+        return -3;
+    } else if (fr != FR_OK) {
+        return -1;
     }
-    // Get SD card mutex
-    sd_mutex_key = GateMutex_enter(sdMutex);
+    ret = read_data_header(file, &data_end);
+    if (ret < 0) {
+        sd_close(file);
+        return ret;
+    }
+    if (recover_data_end(file, &data_end) < 0 ||
+        f_lseek(file, data_end) != FR_OK) {
+        sd_close(file);
+        return -1;
+    }
+    data_writer.open = true;
+    data_writer.dirty = false;
+    data_writer.extent = DATA_FILE_EXTENT;
+    data_writer.commit = true;
+    uncommitted_records = 0;
+    data_writer.len = 0;
+    data_writer.capacity = SECTOR_SIZE - (data_end % SECTOR_SIZE);
+    return 0;
+}
+
+/**
+ * Reads and checks the header of an open data file.
+ * Must be called with the SD card mutex held.
+ * @param file: data file, positioned at the start of the file
+ * @param data_end: set to the end of valid records in the file
+ * @return 0 on success, -1 on a file system error, or -2 if the file header
+ *  does not match the format this firmware writes
+ */
+static int read_data_header(FIL *file, uint32_t *data_end) {
+    DataFileHeader header;
+    UINT bytes_read;
+
+    if (f_read(file, &header, sizeof(header), &bytes_read) != FR_OK) {
+        return -1;
+    }
+    if (bytes_read != sizeof(header) ||
+        memcmp(header.magic, FILE_HEADER.magic, sizeof(header.magic)) != 0 ||
+        header.version != DATA_FILE_VERSION ||
+        header.record_size != sizeof(DataRecord)) {
+        return -2;
+    }
+    // Only trust whole records inside the file
+    *data_end = DATA_FILE_EXTENT ? header.data_end : f_size(file);
+    if (*data_end < sizeof(header) || *data_end > f_size(file)) {
+        *data_end = sizeof(header);
+    }
+    *data_end -= (*data_end - sizeof(header)) % sizeof(DataRecord);
+    return 0;
+}
+
+/**
+ * Cuts a data file's valid data back to its last intact CommitRecord.
+ * data_end only moves when the file is synced, right after a CommitRecord is
+ * written, so the commit is normally the last record before data_end. If
+ * power was lost while the last sector was rewritten, earlier commits are
+ * searched for, reading back from the end. At most RECOVERY_SCAN_RECORDS
+ * records are read; data before them was synced long ago and is kept.
+ * Must be called with the SD card mutex held.
+ * @param file: open data file
+ * @param data_end: end of valid records from the file header, set to the end
+ *  of the last commit
+ * @return 0 on success, or negative value on a file system error
+ */
+static int recover_data_end(FIL *file, uint32_t *data_end) {
+    DataRecord records[QUERY_CHUNK_RECORDS];
+    const CommitRecord *commit;
+    uint32_t pos = *data_end, limit, len;
+    UINT bytes_read;
+    int i;
+
+    limit = sizeof(DataFileHeader);
+    if ((pos - limit) / sizeof(DataRecord) > RECOVERY_SCAN_RECORDS) {
+        limit = pos - RECOVERY_SCAN_RECORDS * sizeof(DataRecord);
+    }
+    while (pos > limit) {
+        len = (pos - limit) < sizeof(records) ? pos - limit : sizeof(records);
+        if (f_lseek(file, pos - len) != FR_OK ||
+            f_read(file, records, len, &bytes_read) != FR_OK ||
+            bytes_read != len) {
+            return -1;
+        }
+        for (i = len / sizeof(DataRecord) - 1; i >= 0; i--) {
+            commit = (const CommitRecord *)&records[i];
+            if (commit->marker == COMMIT_MARKER &&
+                commit->crc == record_crc(commit)) {
+                pos -= len - (i + 1) * sizeof(DataRecord);
+                if (pos != *data_end) {
+                    cli_log("Data file recovered, dropped %lu bytes after "
+                            "last commit\n",
+                            (unsigned long)(*data_end - pos));
+                }
+                *data_end = pos;
+                return 0;
+            }
+        }
+        pos -= len;
+    }
+    if (limit != *data_end) {
+        // Damaged records are skipped when read, thanks to their CRC
+        cli_log("Warning: no intact commit at data file end, keeping all "
+                "records\n");
+    }
+    return 0;
+}
+
+/**
+ * Packs a sensor data packet into a data file record
+ * @param packet: sensor data packet to encode
+ * @param record: record to fill
+ */
+static void encode_record(SensorDataPacket *packet, DataRecord *record) {
+    record->timestamp = (uint32_t)packet->timestamp;
+    record->distance = packet->distance;
+    record->sensor_id = (uint16_t)program_config.synthetic_id;
+    record->crc = 0; // Set when the record is stored
+}
+
+/**
+ * Formats a sensor data packet as a CSV line, the way the data file was
+ * written before the binary format. Only used by the storage benchmark.
+ * @param packet: sensor data packet to format
+ * @param output: buffer to write the line into
+ * @param len: length of output buffer
+ * @return number of characters written
+ */
+static int format_csv_record(SensorDataPacket *packet, char *output,
+                             int len) {
+    struct tm *timeinfo;
     /*
-     * Check if data file exists.
-     * TODO: It may be possible to avoid this check, and simply open the file in
-     * "append" mode
+     * Convert the timestamp to a human readable value.
+     * We are using ISO 8601 timestamps,
+     * and the timezone is UTC (+00)
      */
-    fr = f_stat(sensor_data_filename, &fno);
-    switch (fr) {
-    case FR_OK: // File exists
-        System_printf("Found sensor data file, size: %lu\n", fno.fsize);
-        data_file = fopen(filename_buf, "a");
-        if (!data_file) {
-            System_abort("Could not open sensor data file\n");
-        }
-        break;
-    case FR_NO_FILE:
-        System_printf("No sensor data file, making new file\n");
-        data_file = fopen(filename_buf, "w+");
-        if (!data_file) {
-            System_abort("Could not open sensor data file\n");
-        }
-        // Write headers to new data file (exclude the null byte)
-        bytesWritten =
-            fwrite(FILE_HEADER, sizeof(FILE_HEADER) - 1, 1, data_file);
-        if (!bytesWritten) {
-            System_abort("SD card write error\n");
+    timeinfo = localtime(&(packet->timestamp));
+    return snprintf(output, len, "20%d-%02d-%02dT%02d:%02d:%02d, %f\n",
+                    timeinfo->tm_year - 100, timeinfo->tm_mon,
+                    timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min,
+                    timeinfo->tm_sec, packet->distance);
+}
+
+/**
+ * Benchmarks the per record CPU cost and size on disk of the binary data file
+ * format against CSV formatting, and prints the results to the CLI.
+ * Only the encoding is timed, as the SD card write cost depends on the card.
+ * @param records: number of records to encode with each format
+ */
+void storage_benchmark(int records) {
+    SensorDataPacket packet;
+    DataRecord record;
+    StorageStats stats;
+    volatile uint32_t sink = 0; // Keeps encoded output from being optimized out
+    uint32_t start, csv_cycles, bin_cycles, mclk_mhz;
+    unsigned long csv_bytes = 0;
+    char linebuf[64];
+    int i;
+
+    if (records <= 0) {
+        return;
+    }
+    cyclecount_enable();
+    mclk_mhz = MAP_CS_getMCLK() / 1000000;
+    packet.timestamp = time(NULL);
+    packet.distance = 1.234f;
+    // Time the CSV path
+    start = cyclecount_read();
+    for (i = 0; i < records; i++) {
+        csv_bytes += format_csv_record(&packet, linebuf, sizeof(linebuf));
+        sink += linebuf[0];
+        packet.timestamp++;
+        packet.distance += 0.001f;
+    }
+    csv_cycles = cyclecount_read() - start;
+    // Time the binary path
+    start = cyclecount_read();
+    for (i = 0; i < records; i++) {
+        encode_record(&packet, &record);
+        sink += record.timestamp;
+        packet.timestamp++;
+        packet.distance += 0.001f;
+    }
+    bin_cycles = cyclecount_read() - start;
+    cli_write("Encoded %d records per format at %lu MHz\n", records,
+              (unsigned long)mclk_mhz);
+    cli_write("CSV: %lu cycles/record, %lu bytes/record\n",
+              (unsigned long)(csv_cycles / records), csv_bytes / records);
+    cli_write("Binary: %lu cycles/record, %u bytes/record\n",
+              (unsigned long)(bin_cycles / records),
+              (unsigned int)sizeof(DataRecord));
+    storage_get_stats(&stats);
+    cli_write("SD writes since boot: %lu whole sector, %lu partial, "
+              "%lu syncs\n",
+              (unsigned long)stats.sector_writes,
+              (unsigned long)stats.partial_writes,
+              (unsigned long)stats.syncs);
+    cli_write("Log lines dropped since boot: %lu\n",
+              (unsigned long)log_overflow_count());
+    Watchdog_clear(watchdogHandle);
+}
+
+/**
+ * Reads the storage write counters
+ * @param stats: structure to copy the counters into
+ */
+void storage_get_stats(StorageStats *stats) {
+    UInt key;
+    /*
+     * Called from other tasks, which must not wait behind SD card I/O
+     * holding the SD mutex. The copy is a few hundred bytes, and
+     * sd_record() updates the histograms with interrupts disabled too.
+     */
+    key = Hwi_disable();
+    memcpy(stats, &storage_stats, sizeof(StorageStats));
+    Hwi_restore(key);
+}
+
+/**
+ * Finds a percentile of an SD latency histogram
+ * @param stats: histogram to read
+ * @param percent: percentile to find, 1 to 100
+ * @return upper bound in ms of the bucket holding the percentile (the
+ *  slowest call for the last bucket), or 0 if there were no calls
+ */
+uint32_t storage_latency_percentile(const SdLatencyStats *stats,
+                                    unsigned int percent) {
+    uint32_t target, seen = 0;
+    unsigned int i;
+
+    if (stats->count == 0) {
+        return 0;
+    }
+    // Smallest number of calls that covers the percentile, rounded up
+    target = (uint32_t)(((uint64_t)stats->count * percent + 99) / 100);
+    for (i = 0; i < SD_LATENCY_BUCKETS - 1; i++) {
+        seen += stats->buckets[i];
+        if (seen >= target) {
+            return 1UL << i;
         }
-        break;
-    case FR_NOT_READY:
-        // This error occurs when the system has no SD card. Warn user.
-        System_printf("Warning: no SD card detected, data storage will not "
-                      "function\n");
-        cli_log(
-            "Warning: without an SD card, data storage will not function\n");
-        SDFatFS_close(sdfatfsHandle);
-        sdfatfsHandle = NULL;
-        break;
-    default:
-        System_abort("SD card error occurred\n");
     }
-    // Open log file
-    log_file = fopen(log_filename, "a");
-    if (!log_file) {
-        // Don't fail to boot, but warn user.
-        cli_log("Warning: could not locate log file\n");
-        System_printf("Warning: could not locate log file\n");
+    return stats->max_ms;
+}
+
+/**
+ * f_open, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static FRESULT sd_open(FIL *file, const TCHAR *path, BYTE mode) {
+    uint32_t start = Clock_getTicks();
+    FRESULT fr = f_open(file, path, mode);
+
+    // A missing file is an answer from the card, not an error
+    sd_record(SD_OP_OPEN, start, fr == FR_OK || fr == FR_NO_FILE);
+    return fr;
+}
+
+/**
+ * f_write, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static FRESULT sd_write(FIL *file, const void *data, UINT len, UINT *written) {
+    uint32_t start = Clock_getTicks();
+    FRESULT fr = f_write(file, data, len, written);
+
+    storage_stats.bytes_written += *written;
+    // A short write means the card is full
+    sd_record(SD_OP_WRITE, start, fr == FR_OK && *written == len);
+    return fr;
+}
+
+/**
+ * f_sync, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static FRESULT sd_sync(FIL *file) {
+    uint32_t start = Clock_getTicks();
+    FRESULT fr = f_sync(file);
+
+    sd_record(SD_OP_SYNC, start, fr == FR_OK);
+    return fr;
+}
+
+/**
+ * f_close, timed and counted in the SD card statistics. Closing a file
+ * opened for writing flushes its cached data to the card.
+ * Must be called with the SD card mutex held.
+ */
+static FRESULT sd_close(FIL *file) {
+    uint32_t start = Clock_getTicks();
+    FRESULT fr = f_close(file);
+
+    sd_record(SD_OP_CLOSE, start, fr == FR_OK);
+    return fr;
+}
+
+/**
+ * fopen, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static FILE *sd_fopen(const char *path, const char *mode) {
+    uint32_t start = Clock_getTicks();
+    FILE *file = fopen(path, mode);
+
+    // stdio gives no reason, a failed read open is taken as a missing file
+    sd_record(SD_OP_OPEN, start, file != NULL || mode[0] == 'r');
+    return file;
+}
+
+/**
+ * fputs, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static int sd_fputs(const char *str, FILE *file) {
+    uint32_t start = Clock_getTicks();
+    int ret = fputs(str, file);
+
+    if (ret != EOF) {
+        storage_stats.bytes_written += strlen(str);
+    }
+    sd_record(SD_OP_WRITE, start, ret != EOF);
+    return ret;
+}
+
+/**
+ * fprintf, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static int sd_fprintf(FILE *file, const char *format, ...) {
+    uint32_t start = Clock_getTicks();
+    va_list args;
+    int ret;
+
+    va_start(args, format);
+    ret = vfprintf(file, format, args);
+    va_end(args);
+    if (ret > 0) {
+        storage_stats.bytes_written += ret;
+    }
+    sd_record(SD_OP_WRITE, start, ret >= 0);
+    return ret;
+}
+
+/**
+ * fclose, timed and counted in the SD card statistics.
+ * Must be called with the SD card mutex held.
+ */
+static int sd_fclose(FILE *file) {
+    uint32_t start = Clock_getTicks();
+    int ret = fclose(file);
+
+    sd_record(SD_OP_CLOSE, start, ret == 0);
+    return ret;
+}
+
+/**
+ * Adds one SD card operation to its latency histogram. Every
+ * LATENCY_WINDOW_WRITES writes, the p99 write latency of the window is
+ * checked against StorageLatencyAlarm, so a card slowing down with wear is
+ * reported before it starts failing. The counters are updated with
+ * interrupts disabled, so storage_get_stats() never copies a half updated
+ * histogram.
+ * Must be called with the SD card mutex held.
+ * @param op: operation that was made
+ * @param start: clock tick the operation started at
+ * @param ok: did the operation succeed
+ */
+static void sd_record(SdOp op, uint32_t start, bool ok) {
+    SdLatencyStats *stats = &storage_stats.latency[op];
+    uint32_t elapsed = Clock_getTicks() - start;
+    unsigned int bucket = 0;
+    uint32_t window_p99_ms;
+    bool alarm;
+    UInt key;
+
+    // Bucket i > 0 holds latencies of 2^(i - 1) to 2^i - 1 ms
+    while (bucket < SD_LATENCY_BUCKETS - 1 && (elapsed >> bucket) != 0) {
+        bucket++;
+    }
+    key = Hwi_disable();
+    stats->count++;
+    stats->buckets[bucket]++;
+    if (!ok) {
+        stats->errors++;
+    }
+    if (elapsed > stats->max_ms) {
+        stats->max_ms = elapsed;
+    }
+    Hwi_restore(key);
+    if (op != SD_OP_WRITE) {
+        return;
+    }
+    latency_window.count++;
+    latency_window.buckets[bucket]++;
+    if (elapsed > latency_window.max_ms) {
+        latency_window.max_ms = elapsed;
+    }
+    if (latency_window.count < LATENCY_WINDOW_WRITES) {
+        return;
+    }
+    window_p99_ms = storage_latency_percentile(&latency_window, 99);
+    memset(&latency_window, 0, sizeof(latency_window));
+    alarm = program_config.storage_latency_alarm > 0 &&
+            window_p99_ms > (uint32_t)program_config.storage_latency_alarm;
+    key = Hwi_disable();
+    storage_stats.window_p99_ms = window_p99_ms;
+    storage_stats.latency_alarm = alarm;
+    if (alarm) {
+        storage_stats.latency_alarms++;
+    }
+    Hwi_restore(key);
+    if (alarm) {
+        cli_log("Warning: SD card p99 write latency (<%lu ms) is over the %d "
+                "ms limit, consider replacing the card\n",
+                (unsigned long)storage_stats.window_p99_ms,
+                program_config.storage_latency_alarm);
     }
-    // Leave SD card mutex
-    GateMutex_leave(sdMutex, sd_mutex_key);
 }
 
 /**
- * Logs data onto the SD card. Logs asynchronously.
+ * Logs data onto the SD card. Logs asynchronously: the string is copied into
+ * the log ring with a timestamp, and written to the SD card by the storage
+ * task. Never blocks, and is safe to call from any task. If the ring is full
+ * the line is dropped and counted.
  * @param logstr: string to log
  */
 void log_sdcard(const char *logstr) {
-    IArg sd_mutex_key;
-    int num_printed;
-    char output_buf[LOG_LINE_MAX];
     struct timespec ts;
-    if (log_file && sdfatfsHandle) {
-        // Get current timestamp
-        clock_gettime(CLOCK_REALTIME, &ts);
-        // Print timestamp and log string into buffer
-        num_printed = snprintf(output_buf, sizeof(output_buf), "[%d]: %s",
-                               (int)ts.tv_sec, logstr);
-        // Get SD card mutex
-        sd_mutex_key = GateMutex_enter(sdMutex);
-        Watchdog_clear(watchdogHandle);
-        if (fwrite(output_buf, num_printed, 1, log_file) != 1) {
-            fclose(log_file);
-            log_file = NULL;
-            // Drop mutex, otherwise we'll get deadlock
-            GateMutex_leave(sdMutex, sd_mutex_key);
-            cli_log("Logfile SD card error\n");
+    uint8_t header[LOG_RECORD_HEADER];
+    uint32_t timestamp;
+    unsigned int len;
+    if (!log_writer.open || !sdfatfsHandle) {
+        return;
+    }
+    len = strlen(logstr);
+    if (len > LOG_LINE_MAX) {
+        len = LOG_LINE_MAX;
+    }
+    // Get current timestamp
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timestamp = ts.tv_sec;
+    memcpy(header, &timestamp, sizeof(timestamp));
+    header[sizeof(timestamp)] = len;
+    if (ring_put(&log_ring, header, sizeof(header), logstr, len)) {
+        // Notify storage thread about log data
+        Event_post(storageEventHandle, EVT_LOG_DATA_AVAIL);
+    }
+}
+
+/**
+ * Logs a trace record onto the SD card in binary form. The format string is
+ * not formatted on the device: only its ID and the argument words are stored,
+ * and tools/trace_decode.py expands them on a PC. Never blocks. Use the
+ * TRACE() macro in trace.h rather than calling this directly.
+ * @param fmt_id: ID of the format string, its address in the trace section
+ * @param args: argument words for the format string
+ * @param nargs: number of argument words, at most TRACE_MAX_ARGS
+ */
+void log_trace(uint32_t fmt_id, const uint32_t *args, unsigned int nargs) {
+    struct timespec ts;
+    uint8_t header[TRACE_RECORD_HEADER];
+    uint32_t timestamp;
+    if (!trace_writer.open || !sdfatfsHandle) {
+        return;
+    }
+    if (nargs > TRACE_MAX_ARGS) {
+        nargs = TRACE_MAX_ARGS;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    timestamp = ts.tv_sec;
+    memcpy(header, &timestamp, sizeof(timestamp));
+    memcpy(header + sizeof(timestamp), &fmt_id, sizeof(fmt_id));
+    header[sizeof(timestamp) + sizeof(fmt_id)] = nargs;
+    if (ring_put(&trace_ring, header, sizeof(header), args,
+                 nargs * sizeof(uint32_t))) {
+        Event_post(storageEventHandle, EVT_LOG_DATA_AVAIL);
+    }
+}
+
+/**
+ * Adds a record to a byte ring. The record is dropped and counted if the ring
+ * does not have space for it. Safe to call from any task or interrupt.
+ * @param ring: ring to add record to
+ * @param header: record header
+ * @param header_len: length of record header
+ * @param data: record data, following the header
+ * @param len: length of record data
+ * @return true if the record was added, false if it was dropped
+ */
+static bool ring_put(ByteRing *ring, const void *header,
+                     unsigned int header_len, const void *data,
+                     unsigned int len) {
+    UInt key;
+    /*
+     * Rings are shared by every task logging, so the space check and copy
+     * run with interrupts disabled. This is a copy of a few hundred bytes at
+     * most, and unlike the SD mutex can never wait on SD card I/O.
+     */
+    key = Hwi_disable();
+    if (ring->size - (ring->head - ring->tail) < header_len + len) {
+        ring->overflows++;
+        Hwi_restore(key);
+        return false;
+    }
+    ring_copy_in(ring, ring->head, header, header_len);
+    ring_copy_in(ring, ring->head + header_len, data, len);
+    ring->head += header_len + len;
+    Hwi_restore(key);
+    return true;
+}
+
+/**
+ * Copies data into a byte ring, wrapping at the end of the ring.
+ * Must be called with interrupts disabled.
+ * @param ring: ring to copy into
+ * @param pos: free running ring index to copy to
+ * @param data: data to copy
+ * @param len: length of data
+ */
+static void ring_copy_in(ByteRing *ring, uint32_t pos, const void *data,
+                         unsigned int len) {
+    unsigned int offset = pos & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(ring->buf + offset, data, first);
+    memcpy(ring->buf, (const uint8_t *)data + first, len - first);
+}
+
+/**
+ * Copies data out of a byte ring, wrapping at the end of the ring.
+ * @param ring: ring to copy from
+ * @param pos: free running ring index to copy from
+ * @param data: buffer to copy into
+ * @param len: length of data
+ */
+static void ring_copy_out(ByteRing *ring, uint32_t pos, void *data,
+                          unsigned int len) {
+    unsigned int offset = pos & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(data, ring->buf + offset, first);
+    memcpy((uint8_t *)data + first, ring->buf, len - first);
+}
+
+/**
+ * Writes every record in the log ring to the log file. Only the storage task
+ * consumes the ring, so records are read without disabling interrupts.
+ * Must be called with the SD card mutex held.
+ */
+static void drain_log_ring() {
+    static uint32_t reported_overflows = 0;
+    char line[LOG_LINE_MAX + 16];
+    uint8_t header[LOG_RECORD_HEADER];
+    uint32_t timestamp, overflows;
+    int num_printed;
+    unsigned int len;
+
+    while (log_ring.tail != log_ring.head) {
+        ring_copy_out(&log_ring, log_ring.tail, header, sizeof(header));
+        memcpy(&timestamp, header, sizeof(timestamp));
+        len = header[sizeof(timestamp)];
+        num_printed = snprintf(line, sizeof(line), "[%d]: ", (int)timestamp);
+        ring_copy_out(&log_ring, log_ring.tail + sizeof(header),
+                      line + num_printed, len);
+        // Release the space before writing, so loggers can reuse it
+        log_ring.tail += sizeof(header) + len;
+        if (writer_write(&log_writer, line, num_printed + len) < 0) {
+            System_printf("Logfile SD card error\n");
+            writer_close(&log_writer);
+            log_ring.tail = log_ring.head; // Drop the rest of the ring
+            return;
+        }
+    }
+    overflows = log_ring.overflows;
+    if (overflows != reported_overflows) {
+        num_printed = snprintf(line, sizeof(line),
+                               "%lu log lines dropped, log ring full\n",
+                               (unsigned long)(overflows - reported_overflows));
+        reported_overflows = overflows;
+        writer_write(&log_writer, line, num_printed);
+    }
+}
+
+/**
+ * Writes every record in the trace ring to the trace file, unchanged.
+ * Must be called with the SD card mutex held.
+ */
+static void drain_trace_ring() {
+    uint8_t record[TRACE_RECORD_HEADER + TRACE_MAX_ARGS * sizeof(uint32_t)];
+    unsigned int len;
+
+    while (trace_ring.tail != trace_ring.head) {
+        ring_copy_out(&trace_ring, trace_ring.tail, record,
+                      TRACE_RECORD_HEADER);
+        len = TRACE_RECORD_HEADER +
+              record[TRACE_RECORD_HEADER - 1] * sizeof(uint32_t);
+        ring_copy_out(&trace_ring, trace_ring.tail, record, len);
+        trace_ring.tail += len;
+        if (writer_write(&trace_writer, record, len) < 0) {
+            System_printf("Trace file SD card error\n");
+            writer_close(&trace_writer);
+            trace_ring.tail = trace_ring.head;
             return;
         }
-        // Leave SD card mutex
-        GateMutex_leave(sdMutex, sd_mutex_key);
     }
 }
 
+/**
+ * Reads the number of log lines and trace records dropped because the log or
+ * trace ring was full
+ * @return number of dropped log lines and trace records since boot
+ */
+uint32_t log_overflow_count() {
+    return log_ring.overflows + trace_ring.overflows;
+}
+
 /**
  * Unmount the SD card, so it can be removed from the system.
  */
@@ -608,6 +3564,8 @@ void store_sensor_data(SensorDataPacket *packet) {
     queue_elem =
         &queue_elements[queue_idx & (MAX_QUEUE_ELEM - 1)]; // quicker modulo
     memcpy(&(queue_elem->packet), packet, sizeof(SensorDataPacket));
+    // Retain the sample until it is stored, in case the device resets
+    queue_elem->seq = pending_add(packet, PENDING_STORE);
     // Use the atomic enqueuing operation
     Queue_enqueue(sensorDataQueue, &(queue_elem->elem));
     GateMutex_leave(queueMutex, mutex_key);
@@ -617,27 +3575,29 @@ void store_sensor_data(SensorDataPacket *packet) {
 }
 
 /**
- * forces all open files to write to the attached disk
+ * Writes buffered file data to the attached disk, for files whose oldest
+ * unsynced data is older than the configured flush age. Whole sectors are
+ * written as soon as they fill, so this only handles partial sectors.
  */
 void sync_to_disk() {
     IArg sd_mutex_key;
+    uint32_t now;
+    int i;
     if (!sdfatfsHandle) {
         return; // No sd card present
     }
     // Get SD card mutex
     sd_mutex_key = GateMutex_enter(sdMutex);
-    // Force files to flush to OS using fflush
-    if (fflush(data_file)) {
-        System_printf("SD Card write error!\n");
-        System_flush();
-        GateMutex_leave(sdMutex, sd_mutex_key);
-        return;
-    }
-    if (fflush(log_file)) {
-        System_printf("SD card write error\n");
-        System_flush();
-        GateMutex_leave(sdMutex, sd_mutex_key);
-        return;
+    now = Clock_getTicks();
+    for (i = 0; i < sizeof(all_writers) / sizeof(all_writers[0]); i++) {
+        if (all_writers[i]->dirty &&
+            (now - all_writers[i]->oldest) >=
+                (uint32_t)program_config.storage_flush_age &&
+            writer_flush(all_writers[i]) < 0) {
+            System_printf("SD Card write error!\n");
+            System_flush();
+            break;
+        }
     }
     // Drop SD card mutex
     GateMutex_leave(sdMutex, sd_mutex_key);
@@ -19,6 +19,126 @@
 #define STORAGE_TASK_STACK_MEM 4096 /**< size of the task stack */
 #define STORAGE_TASK_PRIORITY 1     /**< priority of task */
 
+/**
+ * Sensor data file format. Samples are stored compressed in one block file
+ * per UTC day, data/YYMMDD.gts (see gorilla.h). The day being written also
+ * keeps a data file, data/YYMMDD.bin, as its power loss journal, which is
+ * deleted once the day is over. The file starts with a DataFileHeader, followed
+ * by fixed size DataRecord entries appended in the order samples arrive.
+ * Each time the file is synced, a CommitRecord is appended in a record slot.
+ * The file is preallocated, so only data before the header's data_end
+ * offset is valid. All fields are little endian. tools/decode_distdata.py
+ * converts a data file to CSV.
+ */
+#define DATA_FILE_MAGIC "FDAT" /**< magic bytes at start of data file */
+#define DATA_FILE_VERSION 3    /**< current data file format version */
+/** First field of a CommitRecord, never a sample timestamp */
+#define COMMIT_MARKER UINT32_MAX
+
+/** Header written once at the start of the sensor data file */
+typedef struct {
+    char magic[4];        /**< DATA_FILE_MAGIC, not null terminated */
+    uint16_t version;     /**< DATA_FILE_VERSION the file was created with */
+    uint16_t record_size; /**< size of each DataRecord in bytes */
+    uint32_t data_end;    /**< file offset of the end of valid records */
+    uint32_t reserved;    /**< reserved, written as zero */
+} DataFileHeader;
+
+/** One sensor sample, as stored in the sensor data file */
+typedef struct {
+    uint32_t timestamp; /**< UTC unix timestamp of the sample */
+    float distance;     /**< distance read from sensor in meters */
+    uint16_t sensor_id; /**< synthetic ID of the device that took the sample */
+    uint16_t crc;       /**< low 16 bits of the CRC-32 of the fields above */
+} DataRecord;
+
+/**
+ * Commit record, marking that every record before it was synced to the card.
+ * Takes the place of a DataRecord in the data file.
+ */
+typedef struct {
+    uint32_t marker;         /**< COMMIT_MARKER */
+    uint32_t last_timestamp; /**< timestamp of the last sample before it */
+    uint16_t records;        /**< samples since the previous commit */
+    uint16_t crc;            /**< low 16 bits of the CRC-32 of the fields
+                                  above */
+} CommitRecord;
+
+/**
+ * Rollup tiers kept by the storage task. Minute and hour rollups are stored
+ * per day in "data/YYMMDD.r1m" and "data/YYMMDD.r1h", and day rollups in
+ * "data/days.r1d". The files hold RollupRecords, in the order their periods
+ * ended.
+ */
+typedef enum {
+    ROLLUP_MINUTE, /**< one record per minute */
+    ROLLUP_HOUR,   /**< one record per hour */
+    ROLLUP_DAY,    /**< one record per UTC day */
+    ROLLUP_TIERS   /**< number of rollup tiers */
+} RollupTier;
+
+/** Summary of the samples in one rollup period */
+typedef struct {
+    uint32_t start; /**< UTC unix timestamp of the start of the period */
+    uint32_t count; /**< number of samples in the period */
+    float min;      /**< minimum distance in meters */
+    float max;      /**< maximum distance in meters */
+    float mean;     /**< mean distance in meters */
+} RollupRecord;
+
+/**
+ * Binary trace file format. The file starts with a TraceFileHeader, followed
+ * by variable length records: a 4 byte timestamp, the 4 byte format ID, a
+ * 1 byte argument count, then that many 4 byte argument words. Records are
+ * unaligned and little endian. tools/trace_decode.py expands the file to text
+ * using the format table extracted from the firmware image.
+ */
+#define TRACE_FILE_MAGIC "FTRC" /**< magic bytes at start of trace file */
+#define TRACE_FILE_VERSION 1    /**< current trace file format version */
+#define TRACE_MAX_ARGS 6        /**< max argument words in a trace record */
+
+/** Header written once at the start of the trace file */
+typedef struct {
+    char magic[4];     /**< TRACE_FILE_MAGIC, not null terminated */
+    uint16_t version;  /**< TRACE_FILE_VERSION the file was created with */
+    uint16_t reserved; /**< reserved, written as zero */
+} TraceFileHeader;
+
+/** SD card operations whose latency is tracked */
+typedef enum {
+    SD_OP_OPEN,  /**< f_open and fopen */
+    SD_OP_WRITE, /**< f_write and stdio writes */
+    SD_OP_SYNC,  /**< f_sync */
+    SD_OP_CLOSE, /**< f_close and fclose */
+    SD_OP_COUNT  /**< number of tracked operations */
+} SdOp;
+
+/**
+ * Buckets of each SD latency histogram. Bucket 0 counts operations under
+ * 1 ms, bucket i > 0 those under 2^i ms, and the last one all slower ones.
+ */
+#define SD_LATENCY_BUCKETS 12
+
+/** Latency histogram and counters of one SD card operation */
+typedef struct {
+    uint32_t count;                       /**< calls since boot */
+    uint32_t errors;                      /**< calls that failed */
+    uint32_t max_ms;                      /**< slowest call */
+    uint32_t buckets[SD_LATENCY_BUCKETS]; /**< calls per latency bucket */
+} SdLatencyStats;
+
+/** SD card I/O counters, used for benchmarking and card health */
+typedef struct {
+    uint32_t sector_writes;  /**< f_write calls of one whole, aligned sector */
+    uint32_t partial_writes; /**< f_write calls of a partial sector */
+    uint32_t syncs;          /**< f_sync calls */
+    uint32_t bytes_written;  /**< bytes written with f_write and stdio */
+    SdLatencyStats latency[SD_OP_COUNT]; /**< per operation latency */
+    uint32_t window_p99_ms;  /**< p99 f_write latency of the last window */
+    uint32_t latency_alarms; /**< windows over StorageLatencyAlarm */
+    bool latency_alarm;      /**< was the last window over the limit */
+} StorageStats;
+
 /**
  * This function should perform any initialization required for the storage
  * module to function, including initializing peripherals like SPI.
@@ -40,11 +160,32 @@ void storage_run(UArg arg0, UArg arg1);
 void store_sensor_data(SensorDataPacket *packet);
 
 /**
- * Logs data onto the SD card. Logs asynchronously.
+ * Logs data onto the SD card. Logs asynchronously: the string is copied into
+ * the log ring with a timestamp, and written to the SD card by the storage
+ * task. Never blocks, and is safe to call from any task. If the ring is full
+ * the line is dropped and counted.
  * @param logstr: string to log
  */
 void log_sdcard(const char *logstr);
 
+/**
+ * Logs a trace record onto the SD card in binary form. The format string is
+ * not formatted on the device: only its ID and the argument words are stored,
+ * and tools/trace_decode.py expands them on a PC. Never blocks. Use the
+ * TRACE() macro in trace.h rather than calling this directly.
+ * @param fmt_id: ID of the format string, its address in the trace section
+ * @param args: argument words for the format string
+ * @param nargs: number of argument words, at most TRACE_MAX_ARGS
+ */
+void log_trace(uint32_t fmt_id, const uint32_t *args, unsigned int nargs);
+
+/**
+ * Reads the number of log lines and trace records dropped because the log or
+ * trace ring was full
+ * @return number of dropped log lines and trace records since boot
+ */
+uint32_t log_overflow_count();
+
 /**
  * Unmount the SD card, so it can be removed from the system.
  */
@@ -57,24 +198,162 @@ void unmount_sdcard();
 void request_sd_mount();
 
 /**
- * Reads the program configuration from config.txt,
- * and populates the configuration structure.
+ * Reads the program configuration and populates the configuration
+ * structure. Unless config.txt changed since it was last parsed, the binary
+ * snapshot of the parsed configuration is loaded instead, which takes a
+ * single small read.
+ * @param use_snapshot: false to always parse config.txt
+ */
+void read_configuration(bool use_snapshot);
+
+/**
+ * Sets a configuration value, both in program_config and in config.txt.
+ * The file is updated atomically: the new contents are written in full to
+ * config.new before it replaces config.txt, and recover_config_file()
+ * finishes an interrupted replacement at the next boot. The binary snapshot
+ * is rewritten to match.
+ * @param key: configuration file key, as in config.txt
+ * @param value: new value, as it would appear in config.txt
+ * @return 0 on success, -1 if the key is unknown or the value cannot be
+ *  stored, or -2 if the value was applied but could not be saved to the card
  */
-void read_configuration();
+int set_config_value(const char *key, const char *value);
 
 /**
- * forces all open files to write to the attached disk
+ * Writes buffered file data to the attached disk, for files whose oldest
+ * unsynced data is older than the configured flush age. Whole sectors are
+ * written as soon as they fill, so this only handles partial sectors.
  */
 void sync_to_disk();
 
 /**
- * Sets the radar offset into the configuration file.
- * The strategy used here is to copy the current configuration file to
- * a new file line by line, and splice in the new offset when required. Once
- * the new config file is created, copy it over the old one.
- * This method would also work to set other configuration values.
+ * Sets the radar offset into the configuration file, through
+ * set_config_value().
  * @param offset: float specifying new offset
  */
 void set_radar_offset(float offset);
 
+/**
+ * Benchmarks the per record CPU cost and size on disk of the binary data file
+ * format against CSV formatting, and prints the results to the CLI.
+ * @param records: number of records to encode with each format
+ */
+void storage_benchmark(int records);
+
+/**
+ * Reads stored sensor records in a time range, by opening only the files of
+ * the days in the range. Days are read from their compressed block files,
+ * and from their data files only while a day keeps one without a whole block
+ * file. The SD card is only locked while each chunk of records is read, so
+ * sampling continues during long queries.
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of records passed to callback, or negative value on error
+ */
+int storage_query(uint32_t start, uint32_t end,
+                  bool (*callback)(DataRecord *record, void *arg), void *arg);
+
+/**
+ * Reads stored sensor records in a time range from the compressed block
+ * files only, skipping blocks outside the range by their headers. Records are
+ * decoded one at a time, so no more than one block is held in memory.
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each record in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of records passed to callback, or negative value on error
+ */
+int storage_query_blocks(uint32_t start, uint32_t end,
+                         bool (*callback)(DataRecord *record, void *arg),
+                         void *arg);
+
+/**
+ * Parses a UTC time given as "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM:SS"
+ * @param str: string to parse
+ * @param timestamp: set to the unix timestamp of str
+ * @return 0 on success, or negative value if str is not a valid time
+ */
+int storage_parse_time(const char *str, uint32_t *timestamp);
+
+/**
+ * Formats a unix timestamp as a UTC "YYYY-MM-DDTHH:MM:SS" string
+ * @param timestamp: unix timestamp to format
+ * @param output: output buffer
+ * @param len: length of output buffer
+ */
+void storage_format_time(uint32_t timestamp, char *output, int len);
+
+/**
+ * Reads the rollups of a tier for the periods starting in a time range. Only
+ * the tier's own files are read, never the raw data. The period still being
+ * accumulated is passed to callback last, if it starts in the range.
+ * @param tier: rollup tier to read
+ * @param start: unix timestamp of the start of the range (inclusive)
+ * @param end: unix timestamp of the end of the range (exclusive)
+ * @param callback: called for each rollup in the range, in file order.
+ *  Return false to stop the query.
+ * @param arg: passed to callback
+ * @return number of rollups passed to callback, or negative value on error
+ */
+int storage_rollup_query(RollupTier tier, uint32_t start, uint32_t end,
+                         bool (*callback)(RollupRecord *rollup, void *arg),
+                         void *arg);
+
+/**
+ * Opens a file on the SD card to be read by the export command. All buffered
+ * writes are flushed first, so the file matches what has been stored. Data
+ * files are only exported up to the end of their records.
+ * @param filename: name of the file to open, relative to the card root
+ * @param size: set to the number of bytes to export
+ * @return 0 on success, or negative value on error
+ */
+int storage_export_open(const char *filename, uint32_t *size);
+
+/**
+ * Reads from the file opened by storage_export_open()
+ * @param offset: offset in the file to read from
+ * @param buf: buffer to read into
+ * @param len: max number of bytes to read
+ * @return number of bytes read, or negative value on error
+ */
+int storage_export_read(uint32_t offset, void *buf, unsigned int len);
+
+/**
+ * Closes the file opened by storage_export_open()
+ */
+void storage_export_close();
+
+/**
+ * Lists the files in a directory of the SD card
+ * @param dirname: directory to list, "" for the card root
+ * @param callback: called with the name and size of each file. Called with
+ *  the SD card locked, so it must not access the card.
+ * @param arg: passed to callback
+ * @return number of files listed, or negative value on error
+ */
+int storage_list_dir(const char *dirname,
+                     void (*callback)(const char *name, uint32_t size,
+                                      void *arg),
+                     void *arg);
+
+/**
+ * Reads the storage write counters
+ * @param stats: structure to copy the counters into
+ */
+void storage_get_stats(StorageStats *stats);
+
+/**
+ * Finds a percentile of an SD latency histogram
+ * @param stats: histogram to read
+ * @param percent: percentile to find, 1 to 100
+ * @return upper bound in ms of the bucket holding the percentile (the
+ *  slowest call for the last bucket), or 0 if there were no calls
+ */
+uint32_t storage_latency_percentile(const SdLatencyStats *stats,
+                                    unsigned int percent);
+
 #endif /* STORAGE_H_ */
@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+"""
+Converts a binary sensor data file (distdata.bin) from the SD card to CSV.
+
+The file format is defined in storage.h: a 16 byte header, followed by fixed
+size little endian records. Version 2 files are preallocated, so only records
+before the data_end offset in the header are decoded. Version 3 records end
+with a CRC instead of flags, and commit records are mixed in with the
+samples; commit records and samples with a bad CRC are skipped.
+
+Usage: decode_distdata.py distdata.bin [output.csv]
+"""
+
+import csv
+import struct
+import sys
+import zlib
+from datetime import datetime, timezone
+
+HEADER = struct.Struct("<4sHHI4x")
+RECORD = struct.Struct("<IfHH")
+MAGIC = b"FDAT"
+SUPPORTED_VERSIONS = (1, 2, 3)
+COMMIT_MARKER = 0xFFFFFFFF
+
+
+def decode(data_file, out):
+    header = data_file.read(HEADER.size)
+    if len(header) != HEADER.size:
+        raise ValueError("file is too short to hold a header")
+    magic, version, record_size, data_end = HEADER.unpack(header)
+    if magic != MAGIC:
+        raise ValueError("not a sensor data file (bad magic %r)" % magic)
+    if version not in SUPPORTED_VERSIONS:
+        raise ValueError("unsupported data file version %d" % version)
+    if record_size != RECORD.size:
+        raise ValueError("unexpected record size %d" % record_size)
+    # Version 1 files have no preallocation, all data up to EOF is valid
+    remaining = data_end - HEADER.size if version >= 2 else None
+    writer = csv.writer(out)
+    writer.writerow(["Timestamp", "Distance", "Sensor", "Flags"])
+    count = damaged = 0
+    while remaining is None or remaining >= RECORD.size:
+        raw = data_file.read(RECORD.size)
+        if len(raw) < RECORD.size:
+            if raw:
+                print("warning: ignoring %d trailing bytes" % len(raw),
+                      file=sys.stderr)
+            break
+        if remaining is not None:
+            remaining -= RECORD.size
+        timestamp, distance, sensor, flags = RECORD.unpack(raw)
+        if version >= 3:
+            if zlib.crc32(raw[:-2]) & 0xFFFF != flags:
+                damaged += 1
+                continue
+            if timestamp == COMMIT_MARKER:
+                continue
+            flags = 0  # Version 3 has no flags, the field is the CRC
+        iso = datetime.fromtimestamp(timestamp, timezone.utc)
+        writer.writerow([iso.strftime("%Y-%m-%dT%H:%M:%S"),
+                         "%.3f" % distance, sensor, flags])
+        count += 1
+    if damaged:
+        print("warning: skipped %d damaged records" % damaged,
+              file=sys.stderr)
+    return count
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    with open(sys.argv[1], "rb") as data_file:
+        if len(sys.argv) == 3:
+            with open(sys.argv[2], "w", newline="") as out:
+                count = decode(data_file, out)
+        else:
+            count = decode(data_file, sys.stdout)
+    print("decoded %d records" % count, file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""
+Decodes compressed sensor data block files (data/YYMMDD.gts) written by the
+storage task. See gorilla.h and gorilla.c for the block format.
+
+Usage:
+  decode_gts.py YYMMDD.gts [more.gts ...]
+      Prints every sample as "timestamp, distance" CSV lines, and a summary
+      of each file to stderr.
+"""
+
+import struct
+import sys
+import zlib
+
+BLOCK_SIZE = 512
+HEADER = struct.Struct("<HHIIHH")
+MAGIC = 0x4347     # blocks ending in a CRC-32
+MAGIC_V1 = 0x4247  # older blocks without a CRC
+CRC_SIZE = 4
+
+
+class BitReader:
+    """Reads a block's bit stream, most significant bit first."""
+
+    def __init__(self, payload):
+        self.value = int.from_bytes(payload, "big")
+        self.length = len(payload) * 8
+        self.pos = 0
+
+    def read(self, bits):
+        self.pos += bits
+        if self.pos > self.length:
+            raise ValueError("read past end of block")
+        return (self.value >> (self.length - self.pos)) & ((1 << bits) - 1)
+
+
+def signed(value, bits):
+    """Sign extends a two's complement value."""
+    return value - (1 << bits) if value & (1 << (bits - 1)) else value
+
+
+def decode_block(block):
+    """Yields (timestamp, distance) for each sample of a block."""
+    magic, count, _, _, _, payload_bits = HEADER.unpack_from(block)
+    if magic == MAGIC:
+        end = BLOCK_SIZE - CRC_SIZE
+        crc, = struct.unpack_from("<I", block, end)
+        if zlib.crc32(block[:end]) != crc:
+            raise ValueError("bad block CRC")
+    elif magic == MAGIC_V1:
+        end = BLOCK_SIZE
+    else:
+        raise ValueError("bad block header")
+    if payload_bits > (end - HEADER.size) * 8:
+        raise ValueError("bad block header")
+    reader = BitReader(block[HEADER.size:end])
+    if count == 0:
+        return
+    timestamp = reader.read(32)
+    value = reader.read(32)
+    delta = 0
+    leading = trailing = 0
+    yield timestamp, struct.unpack("<f", struct.pack("<I", value))[0]
+    for _ in range(count - 1):
+        prefix = 0
+        while prefix < 4 and reader.read(1):
+            prefix += 1
+        if prefix == 1:
+            dod = signed(reader.read(7), 7)
+        elif prefix == 2:
+            dod = signed(reader.read(9), 9)
+        elif prefix == 3:
+            dod = signed(reader.read(12), 12)
+        elif prefix == 4:
+            dod = signed(reader.read(32), 32)
+        else:
+            dod = 0
+        delta += dod
+        timestamp = (timestamp + delta) & 0xFFFFFFFF
+        if reader.read(1):
+            if reader.read(1):
+                leading = reader.read(5)
+                trailing = 32 - leading - (reader.read(5) + 1)
+            value ^= reader.read(32 - leading - trailing) << trailing
+        yield timestamp, struct.unpack("<f", struct.pack("<I", value))[0]
+
+
+def decode_file(path):
+    """Prints the samples of a block file, returns (blocks, samples)."""
+    with open(path, "rb") as gts:
+        data = gts.read()
+    blocks = samples = 0
+    for offset in range(0, len(data) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        try:
+            for timestamp, distance in decode_block(
+                    data[offset:offset + BLOCK_SIZE]):
+                print("%d, %.3f" % (timestamp, distance))
+                samples += 1
+        except ValueError as err:
+            print("warning: %s: block at offset %d: %s" % (path, offset, err),
+                  file=sys.stderr)
+            continue
+        blocks += 1
+    if len(data) % BLOCK_SIZE:
+        print("warning: %s: partial block at end of file" % path,
+              file=sys.stderr)
+    return blocks, samples
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    for path in sys.argv[1:]:
+        blocks, samples = decode_file(path)
+        size = blocks * BLOCK_SIZE
+        print("%s: %d blocks, %d samples, %.2f bytes/sample" %
+              (path, blocks, samples, size / samples if samples else 0),
+              file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
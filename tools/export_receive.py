@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""
+Downloads files from a station's SD card over the CLI UART, using the
+"export" CLI command. See export.h for the protocol. Partial downloads are
+resumed from where they stopped, so rerunning the script only fetches data
+added since the last run.
+
+Usage:
+  export_receive.py PORT OUTDIR [DIR ...]
+      Downloads every file in each SD card directory DIR ("" for the card
+      root; default: the root and "data") into OUTDIR. Needs pyserial.
+"""
+
+import os
+import re
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+BAUDRATE = 115200
+SYNC = b"\x7e\xa5"
+FRAME_HEADER = struct.Struct("<BHI")  # type, payload length, offset
+PAYLOAD_MAX = 256
+FRAME_TIMEOUT = 5.0   # seconds without a frame before giving up a file
+COMMAND_TIMEOUT = 10.0
+ATTEMPTS = 3          # tries to start each file transfer
+DIR_ENTRY = re.compile(r"^(\S+) (\d+)$")
+DATA_FILE_MAGIC = b"FDAT"
+
+
+class FrameReader:
+    """Splits the byte stream from the device into valid frames."""
+
+    def __init__(self, port):
+        self.port = port
+        self.buf = b""
+
+    def read(self, timeout):
+        """Returns (type, offset, payload) of the next frame, or None."""
+        deadline = time.monotonic() + timeout
+        while True:
+            start = self.buf.find(SYNC)
+            if start < 0:
+                # Keep a trailing first sync byte, it may start a frame
+                self.buf = self.buf[-1:] if self.buf.endswith(SYNC[:1]) else b""
+            else:
+                self.buf = self.buf[start:]
+                frame = self.parse()
+                if frame is not None:
+                    return frame
+            if time.monotonic() > deadline:
+                return None
+            self.buf += self.port.read(max(1, self.port.in_waiting))
+
+    def parse(self):
+        """Takes one frame from the start of buf, or returns None."""
+        if len(self.buf) < 2 + FRAME_HEADER.size:
+            return None
+        ftype, length, offset = FRAME_HEADER.unpack_from(self.buf, 2)
+        if length > PAYLOAD_MAX:
+            self.buf = self.buf[1:]  # Not a real frame start
+            return None
+        end = 2 + FRAME_HEADER.size + length
+        if len(self.buf) < end + 4:
+            return None
+        crc, = struct.unpack_from("<I", self.buf, end)
+        if zlib.crc32(self.buf[2:end]) != crc:
+            self.buf = self.buf[1:]
+            return None
+        payload = self.buf[2 + FRAME_HEADER.size:end]
+        self.buf = self.buf[end + 4:]
+        return chr(ftype), offset, payload
+
+
+def send_frame(port, ftype, offset):
+    """Sends a frame without payload to the device."""
+    body = FRAME_HEADER.pack(ord(ftype), 0, offset)
+    port.write(SYNC + body + struct.pack("<I", zlib.crc32(body)))
+
+
+def command(port, line):
+    """Runs a CLI command, returns its output lines and success."""
+    port.reset_input_buffer()
+    port.write(line.encode() + b"\n")
+    lines = []
+    text = b""
+    deadline = time.monotonic() + COMMAND_TIMEOUT
+    while time.monotonic() < deadline:
+        text += port.read(max(1, port.in_waiting))
+        while b"\n" in text:
+            raw, text = text.split(b"\n", 1)
+            out = raw.replace(b"\0", b"").decode("ascii", "replace").strip()
+            out = out[3:] if out.startswith("-> ") else out
+            if out == "Done":
+                return lines, True
+            if out == "Execution failed":
+                return lines, False
+            lines.append(out)
+    return lines, False
+
+
+def wait_for_prompt(port):
+    """Reads until the CLI prints the result of the last command."""
+    text = b""
+    deadline = time.monotonic() + COMMAND_TIMEOUT
+    while time.monotonic() < deadline:
+        text += port.read(max(1, port.in_waiting))
+        if b"Done" in text or b"Execution failed" in text:
+            return b"Done" in text
+    return False
+
+
+def start_transfer(port, name, offset):
+    """
+    Starts sending a file. Returns the frame reader and the header frame, or
+    None for the header if the device did not answer with one.
+    """
+    for _ in range(ATTEMPTS):
+        port.reset_input_buffer()
+        port.write(("export get %s %d\n" % (name, offset)).encode())
+        reader = FrameReader(port)
+        frame = reader.read(FRAME_TIMEOUT)
+        if frame is not None and frame[0] in "HX":
+            return reader, frame
+        # Header frame was lost, stop the transfer and ask again
+        send_frame(port, "C", offset)
+        wait_for_prompt(port)
+    return None, None
+
+
+def receive_file(port, name, path):
+    """Downloads one file, resuming a partial download at path."""
+    offset = os.path.getsize(path) if os.path.exists(path) else 0
+    reader, frame = start_transfer(port, name, offset)
+    if frame is None:
+        print("%s: no response" % name, file=sys.stderr)
+        return False
+    ftype, start, payload = frame
+    if ftype == "X":
+        wait_for_prompt(port)
+        if payload == b"offset past end" and offset:
+            # File on the card is shorter than our copy, fetch it again
+            os.remove(path)
+            return receive_file(port, name, path)
+        print("%s: device error: %s" % (name, payload.decode()),
+              file=sys.stderr)
+        return False
+    size, = struct.unpack_from("<I", payload)
+    expected = start
+    last_nak = None
+    began = time.monotonic()
+    with open(path, "r+b" if offset else "wb") as out:
+        out.seek(start)
+        out.truncate()
+        while True:
+            frame = reader.read(FRAME_TIMEOUT)
+            if frame is None:
+                print("%s: timed out at %d of %d bytes" % (name, expected,
+                                                           size),
+                      file=sys.stderr)
+                send_frame(port, "C", expected)
+                wait_for_prompt(port)
+                return False
+            ftype, foffset, payload = frame
+            if ftype == "D":
+                if foffset == expected:
+                    out.write(payload)
+                    expected += len(payload)
+                    send_frame(port, "A", expected)
+                elif foffset > expected and last_nak != expected:
+                    # A frame was lost, ask once for a resend from the gap
+                    send_frame(port, "A", expected)
+                    last_nak = expected
+            elif ftype == "E":
+                send_frame(port, "A", expected)
+                if expected == size:
+                    break
+            elif ftype == "X":
+                print("%s: device error: %s" % (name, payload.decode()),
+                      file=sys.stderr)
+                wait_for_prompt(port)
+                return False
+    fix_data_end(path)
+    elapsed = time.monotonic() - began
+    print("%s: %d bytes (%d new) in %.1f s" % (name, size, size - start,
+                                                elapsed), file=sys.stderr)
+    return wait_for_prompt(port)
+
+
+def fix_data_end(path):
+    """
+    Data files are exported up to their last record, but their header was
+    sent when fewer records may have been stored. Point the header's data end
+    at the end of the downloaded copy.
+    """
+    with open(path, "r+b") as data:
+        header = data.read(16)
+        if len(header) == 16 and header[:4] == DATA_FILE_MAGIC and \
+                struct.unpack_from("<H", header, 4)[0] >= 2:
+            data.seek(8)
+            data.write(struct.pack("<I", os.path.getsize(path)))
+
+
+def main():
+    if len(sys.argv) < 3:
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    port = serial.Serial(sys.argv[1], BAUDRATE, timeout=0.05)
+    outdir = sys.argv[2]
+    dirs = sys.argv[3:] or ["", "data"]
+    ok = True
+    for directory in dirs:
+        lines, success = command(port, ("export list %s" % directory).strip())
+        if not success:
+            print("could not list '%s'" % directory, file=sys.stderr)
+            ok = False
+            continue
+        os.makedirs(os.path.join(outdir, directory), exist_ok=True)
+        for line in lines:
+            match = DIR_ENTRY.match(line)
+            if not match:
+                continue
+            name = match.group(1)
+            remote = "%s/%s" % (directory, name) if directory else name
+            ok &= receive_file(port, remote,
+                               os.path.join(outdir, directory, name))
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
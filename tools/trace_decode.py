@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+Expands binary trace files (trace.bin) written by TRACE() call sites built
+with TRACE_DEFERRED. See trace.h and storage.h for the formats.
+
+Usage:
+  trace_decode.py extract firmware.out table.trace
+      Writes the format table held in the .trace_fmt section of a firmware
+      image. The gcc build runs this after linking.
+  trace_decode.py decode table.trace trace.bin
+      Prints the trace file as text, one "[timestamp]: message" per record.
+"""
+
+import json
+import re
+import struct
+import sys
+
+HEADER = struct.Struct("<4sHH")
+RECORD_HEADER = struct.Struct("<IIB")
+MAGIC = b"FTRC"
+SUPPORTED_VERSIONS = (1,)
+SECTION = ".trace_fmt"
+
+# printf conversion: flags, width, precision, length modifier, conversion
+CONVERSION = re.compile(r"%([-+ #0]*)(\d*)(\.\d+)?(hh|h|ll|l|z|t)?([diuxXcfFeEgGsp%])")
+
+
+def read_section(elf_path, name):
+    """Returns (address, contents) of a section in a 32 bit ELF file."""
+    with open(elf_path, "rb") as elf:
+        data = elf.read()
+    if data[:4] != b"\x7fELF" or data[4] != 1:
+        raise ValueError("%s is not a 32 bit ELF file" % elf_path)
+    endian = "<" if data[5] == 1 else ">"
+    shoff, = struct.unpack_from(endian + "I", data, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", data, 0x2E)
+    section = struct.Struct(endian + "IIIIIIIIII")
+
+    def header(index):
+        return section.unpack_from(data, shoff + index * shentsize)
+
+    strtab = header(shstrndx)
+    for index in range(shnum):
+        sh_name, _, _, sh_addr, sh_offset, sh_size = header(index)[:6]
+        start = strtab[4] + sh_name
+        if data[start:data.index(b"\0", start)].decode() == name:
+            return sh_addr, data[sh_offset:sh_offset + sh_size]
+    return 0, b""
+
+
+def extract(elf_path, table_path):
+    """Builds a format ID to format string table from a firmware image."""
+    address, contents = read_section(elf_path, SECTION)
+    table = {}
+    offset = 0
+    while offset < len(contents):
+        if contents[offset] == 0:
+            offset += 1  # Padding between strings
+            continue
+        end = contents.index(b"\0", offset)
+        table[address + offset] = contents[offset:end].decode("ascii",
+                                                              "replace")
+        offset = end + 1
+    with open(table_path, "w") as out:
+        json.dump({"%d" % k: v for k, v in table.items()}, out, indent=1)
+    print("extracted %d trace formats" % len(table), file=sys.stderr)
+
+
+def expand(fmt, args):
+    """Formats raw argument words with a C printf style format string."""
+    words = iter(args)
+
+    def convert(match):
+        flags, width, precision, _, conv = match.groups()
+        if conv == "%":
+            return "%"
+        word = next(words, 0)
+        if conv in "di":
+            value = struct.unpack("<i", struct.pack("<I", word))[0]
+        elif conv in "fFeEgG":
+            value = struct.unpack("<f", struct.pack("<I", word))[0]
+        elif conv in "sp":
+            return "<0x%08x>" % word  # Only the pointer was logged
+        elif conv == "u":
+            conv = "d"
+            value = word
+        else:
+            value = word
+        return ("%" + flags + width + (precision or "") + conv) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode(table_path, trace_path):
+    """Prints a binary trace file as text."""
+    with open(table_path) as table_file:
+        table = {int(k): v for k, v in json.load(table_file).items()}
+    with open(trace_path, "rb") as trace:
+        data = trace.read()
+    if len(data) < HEADER.size:
+        raise ValueError("file is too short to hold a header")
+    magic, version, _ = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError("not a trace file (bad magic %r)" % magic)
+    if version not in SUPPORTED_VERSIONS:
+        raise ValueError("unsupported trace file version %d" % version)
+    offset = HEADER.size
+    count = 0
+    while offset + RECORD_HEADER.size <= len(data):
+        timestamp, fmt_id, nargs = RECORD_HEADER.unpack_from(data, offset)
+        offset += RECORD_HEADER.size
+        if offset + 4 * nargs > len(data):
+            print("warning: truncated record at end of file", file=sys.stderr)
+            break
+        args = struct.unpack_from("<%dI" % nargs, data, offset)
+        offset += 4 * nargs
+        fmt = table.get(fmt_id)
+        if fmt is None:
+            text = "<unknown format 0x%08x> %s\n" % (fmt_id, list(args))
+        else:
+            text = expand(fmt, args)
+        sys.stdout.write("[%d]: %s" % (timestamp, text))
+        count += 1
+    print("decoded %d records" % count, file=sys.stderr)
+
+
+def main():
+    if len(sys.argv) != 4 or sys.argv[1] not in ("extract", "decode"):
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    if sys.argv[1] == "extract":
+        extract(sys.argv[2], sys.argv[3])
+    else:
+        decode(sys.argv[2], sys.argv[3])
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
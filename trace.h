@@ -0,0 +1,72 @@
+/**
+ * @file trace.h
+ * Trace logging macros. With TRACE_DEFERRED defined at build time, TRACE()
+ * call sites do no formatting on the device: the format string is placed in
+ * the .trace_fmt section (which is not loaded onto the device), and only its
+ * address and the argument words are queued for the SD card trace file.
+ * tools/trace_decode.py expands the trace file on a PC, using the format
+ * table extracted from the firmware image at build time.
+ * Without TRACE_DEFERRED, TRACE() is a plain cli_log() call.
+ *
+ * Arguments must fit in 32 bits. Wrap float arguments in TRACE_FLOAT(), and
+ * do not use %s, as only the string pointer would be logged.
+ *
+ * Created on: Oct 18, 2026
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cli.h"
+#include "storage.h"
+
+#ifdef TRACE_DEFERRED
+
+/**
+ * Logs a trace record. Takes a printf style format string literal, followed
+ * by at most TRACE_MAX_ARGS arguments.
+ */
+#define TRACE(...) TRACE_(__VA_ARGS__, 0)
+/**
+ * Implementation of TRACE. The extra 0 argument appended by TRACE keeps the
+ * argument array valid when a format string has no arguments, and is not
+ * logged.
+ */
+#define TRACE_(fmt, ...)                                                       \
+    do {                                                                       \
+        static const char trace_fmt_[]                                         \
+            __attribute__((section(".trace_fmt"))) = fmt;                      \
+        const uint32_t trace_args_[] = {__VA_ARGS__};                          \
+        log_trace((uint32_t)(uintptr_t)trace_fmt_, trace_args_,                \
+                  sizeof(trace_args_) / sizeof(uint32_t) - 1);                 \
+    } while (0)
+/** Passes a float argument to TRACE as its raw bits */
+#define TRACE_FLOAT(x) trace_float_bits(x)
+
+/**
+ * Reinterprets a float as a 32 bit word, so it can be logged unformatted
+ * @param value: float to convert
+ * @return bits of value
+ */
+static inline uint32_t trace_float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+#else
+
+/**
+ * Logs a trace record. Takes a printf style format string literal, followed
+ * by at most TRACE_MAX_ARGS arguments.
+ */
+#define TRACE(...) cli_log(__VA_ARGS__)
+/** Passes a float argument to TRACE */
+#define TRACE_FLOAT(x) (x)
+
+#endif /* TRACE_DEFERRED */
+
+#endif /* TRACE_H_ */
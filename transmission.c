@@ -14,6 +14,7 @@
 /* BIOS module headers */
 #include <ti/sysbios/BIOS.h>
 #include <ti/sysbios/gates/GateMutex.h>
+#include <ti/sysbios/knl/Clock.h>
 #include <ti/sysbios/knl/Event.h>
 #include <ti/sysbios/knl/Queue.h>
 #include <ti/sysbios/knl/Task.h>
@@ -31,12 +32,23 @@
 
 #include "cli.h"
 #include "common.h"
+#include "crc32.h"
+#include "pending.h"
 #include "sim7000.h"
+#include "storage.h"
 #include "ti_drivers_config.h"
+#include "trace.h"
+/** Event that opens a modem power-on window to run pending jobs */
+#define EVT_MODEM_WINDOW Event_Id_00
+
 ///@{
-/** Events that can trigger action in the main transmission module */
-#define EVT_TX_DATA_AVAIL Event_Id_00 /**< new radar data is available */
-#define EVT_UPDATE_CLK Event_Id_03    /**< request to update clock */
+/**
+ * Modem jobs. Each job is one bit in the pending job mask. Jobs are collected
+ * until an urgent job opens a modem window, then every pending job runs in
+ * that window over one data session.
+ */
+#define JOB_UPLOAD 0x01   /**< upload queued sensor data */
+#define JOB_TIMESYNC 0x02 /**< sync the RTC with network time */
 ///@}
 
 /** fallback timestamp in ms  (if NTP does not work) */
@@ -44,27 +56,164 @@
 
 #define APN "hologram" /**< APN to use for network */
 
-/** must be a power of 2, max elements in transmission queue */
+/** max elements shared between the live and backlog transmission queues */
 #define MAX_QUEUE_ELEM 32
 /** how many times to attempt to send packet */
 #define TRANSMISSION_ATTEMPTS 2
+/**
+ * Per-session budget for draining the backlog queue. Once live samples are
+ * sent, backlog samples are sent until either budget is exhausted. Anything
+ * left over waits for the next modem session.
+ */
+#define BACKLOG_TIME_BUDGET 60000  /**< ms spent sending backlog per session */
+#define BACKLOG_BYTE_BUDGET 4096   /**< body bytes of backlog per session */
+/** ms between uploads of the SD card health summary */
+#define SD_REPORT_INTERVAL 3600000
+///@{
+/**
+ * Upload retry delay in ms. Data left after a window opens another window
+ * after UPLOAD_RETRY_MIN. Each failed window doubles the delay, up to
+ * UPLOAD_RETRY_MAX, and a successful one resets it.
+ */
+#define UPLOAD_RETRY_MIN 60000
+#define UPLOAD_RETRY_MAX 3600000
+///@}
 
 static bool transmission_init_done = false;
 static SIM7000_Config sim_config;
 
+/**
+ * Summary of samples the reporting filter did not upload since the previous
+ * uploaded sample. Sent to the backend along with the next uploaded sample.
+ */
+typedef struct SuppressedSummary {
+    unsigned int count; /**< number of samples suppressed */
+    float min;          /**< smallest suppressed distance */
+    float max;          /**< largest suppressed distance */
+} SuppressedSummary;
+
 /**
  * Queue element to be placed in FIFO queue for transmission to web backend.
  */
 typedef struct SensorDataQueueElem {
     Queue_Elem elem;
     SensorDataPacket packet;
+    SuppressedSummary suppressed; /**< samples skipped before this one */
+    uint32_t seq; /**< sequence number in the pending ring */
 } SensorDataQueueElem;
 
 static SensorDataQueueElem queue_elements[MAX_QUEUE_ELEM];
 static GateMutex_Handle queueMutex;
 static Event_Handle transmissionEventHandle;
-static Queue_Handle sensorDataQueue;
+/** Unused queue elements */
+static Queue_Handle freeQueue;
+/** Samples that have not been attempted yet. Always sent first. */
+static Queue_Handle liveQueue;
+/** Samples that failed to send, drained within the session budget */
+static Queue_Handle backlogQueue;
+/** Number of samples dropped because the queues were full */
+static unsigned int dropped_samples = 0;
+/**
+ * Reporting filter state. A sample is only queued when it moved more than
+ * the configured deadband from the last value the backend acknowledged, or
+ * when the heartbeat period elapsed since the last queued sample.
+ * Protected by queueMutex.
+ */
+static bool have_acked_sample = false;
+static float last_acked_distance;
+static bool have_reported_sample = false;
+static time_t last_report_time;
+static SuppressedSummary suppressed;
+/** Jobs waiting for the next modem window. Protected by queueMutex */
+static uint32_t pending_jobs = 0;
+/** One shot clock opening a window to retry uploads */
+static Clock_Handle retryClock;
+/** Delay before the next upload retry, only used by the transmission task */
+static UInt32 retry_delay = UPLOAD_RETRY_MIN;
+/**
+ * SD card health reporting state, only used by the transmission task. The
+ * summary is attached to the first upload after SD_REPORT_INTERVAL, or
+ * after a new latency alarm.
+ */
+static bool sd_reported = false;
+static uint32_t last_sd_report;
+static uint32_t reported_latency_alarms = 0;
+/**
+ * Hourly rollup reporting state, only used by the transmission task. The
+ * rollup of the last complete hour is read from the SD card once per hour,
+ * and attached to the first upload that gets through after that.
+ */
+static RollupRecord hour_rollup;
+static bool hour_rollup_pending = false;
+static uint32_t rollup_checked_hour = 0;
+
 static void update_rtc();
+static void run_upload_job();
+static void schedule_job(uint32_t job, bool urgent);
+static void schedule_upload_retry(bool failed);
+static void retry_clock_handle(UArg arg);
+static SensorDataQueueElem *next_tx_elem(bool *is_live, uint32_t session_start,
+                                         int backlog_bytes);
+static int post_sensor_packet(SensorDataQueueElem *elem);
+static int format_sensor_json(SensorDataQueueElem *elem,
+                              const StorageStats *sd_stats,
+                              const RollupRecord *rollup, char *output,
+                              int len);
+static void check_hour_rollup();
+static bool copy_rollup(RollupRecord *rollup, void *arg);
+static int post_json(char *body, int body_len);
+static bool recover_staged_batches();
+static void stage_backlog();
+static bool post_staged_batches(uint32_t session_start, int *backlog_bytes);
+static bool should_report(SensorDataPacket *packet);
+static void replay_sample(SensorDataPacket *packet, uint32_t seq, void *arg);
+
+/**
+ * A job the transmission task can run while the modem is powered on.
+ * Jobs run in table order, so latency sensitive jobs go first.
+ */
+typedef struct ModemJob {
+    uint32_t id;      /**< job bit in the pending job mask */
+    void (*run)();    /**< function running the job */
+} ModemJob;
+
+static const ModemJob modem_jobs[] = {
+    {JOB_UPLOAD, run_upload_job},
+    {JOB_TIMESYNC, update_rtc},
+};
+
+/** Authorization header value, built once the task starts */
+static char http_token[6 + TOKEN_STRLEN];
+/**
+ * Response buffer for HTTP requests. Only the response code is used, so
+ * longer responses are truncated.
+ */
+static char http_response[64];
+
+/**
+ * Modem staging. When a modem window cannot reach the backend, backlog
+ * samples are packed into JSON array batches and written to the SIM7000's
+ * flash file system, freeing their queue elements. Staged batches are posted
+ * (one HTTP request per batch) in later windows.
+ *
+ * The batch numbers are only kept in RAM, so after a reset they are found
+ * again by probing the batch files in the first modem window. Batches are
+ * written and deleted in ring order, and one number is always left free, so
+ * the oldest batch is the first one after a missing file.
+ */
+/** Max size of one staged batch (the SIM's HTTP body limit is 1024) */
+#define STAGE_BATCH_MAX 512
+/** Number of batch file names, one more than the batches kept at a time */
+#define STAGE_MAX_FILES 64
+/** Staged batch file name format, numbered from 0 to STAGE_MAX_FILES - 1 */
+#define STAGE_FILENAME "batch%02u.jsn"
+/** Buffer used to build and read back staged batches */
+static char stage_buffer[STAGE_BATCH_MAX];
+static unsigned int stage_head = 0; /**< number of oldest staged batch */
+static unsigned int stage_tail = 0; /**< number of next batch to write */
+/** Staged batches left from before the last reset have been found */
+static bool stage_recovered = false;
+
 
 /**
  * This function should perform any initialization required for the transmission
@@ -73,6 +222,9 @@ static void update_rtc();
  * This code assumes that the connected device to the UART is a SIM7000A LTE
  */
 void transmission_init() {
+    Clock_Params clockParams;
+    unsigned int replayed;
+    int i;
     /*
      * start the botletics module, and verify it responds to AT commands.
      */
@@ -86,19 +238,41 @@ void transmission_init() {
     if (!transmissionEventHandle) {
         System_abort("Could not create storage event handle\n");
     }
-    sensorDataQueue = Queue_create(NULL, NULL);
-    if (!sensorDataQueue) {
+    freeQueue = Queue_create(NULL, NULL);
+    liveQueue = Queue_create(NULL, NULL);
+    backlogQueue = Queue_create(NULL, NULL);
+    if (!freeQueue || !liveQueue || !backlogQueue) {
         System_abort("Could not create sensor data queue\n");
     }
+    // All queue elements start out unused
+    for (i = 0; i < MAX_QUEUE_ELEM; i++) {
+        Queue_enqueue(freeQueue, &(queue_elements[i].elem));
+    }
     queueMutex = GateMutex_create(NULL, NULL);
     if (!queueMutex) {
         System_abort("Failed to create queue mutex\n");
     }
+    // Started when an upload has to be retried
+    Clock_Params_init(&clockParams);
+    clockParams.period = 0;
+    clockParams.startFlag = false;
+    retryClock = Clock_create(retry_clock_handle, UPLOAD_RETRY_MIN,
+                              &clockParams, NULL);
+    if (!retryClock) {
+        System_abort("Could not create upload retry clock\n");
+    }
     if (!SIM7000_open(&sim_config)) {
         System_abort("Could not open SIM UART\n");
     }
     // Also configure D2 indicator LED as low output
     GPIO_setConfig(CONFIG_D2_LED, GPIO_CFG_OUTPUT | GPIO_CFG_OUT_LOW);
+    // Send samples that were not uploaded when the device last reset
+    replayed = pending_replay(PENDING_UPLOAD, replay_sample, NULL);
+    if (replayed) {
+        System_printf("Recovered %u unsent samples queued before reset\n",
+                      replayed);
+        schedule_job(JOB_UPLOAD, true);
+    }
     transmission_init_done = true;
     System_printf("Transmission init done\n");
 }
@@ -127,17 +301,9 @@ bool find_sim() {
  * @param arg1: Unused
  */
 void transmission_run(UArg arg0, UArg arg1) {
-    HTTPConnectionRequest request;
-    HTTPHeader headers[2];
-    SensorDataQueueElem *elem;
-    UInt events;
-    int attempts_remaining;
-    int return_val;
-    struct tm *time_management; // name pending
     IArg mutex_key;
-    char http_post_data[128];
-    char http_token[6 + TOKEN_STRLEN];
-    char response[512];
+    uint32_t jobs;
+    int i;
 
     if (!transmission_init_done)
         return;
@@ -148,102 +314,50 @@ void transmission_run(UArg arg0, UArg arg1) {
              program_config.server_token);
     // Event loop
     while (1) {
-        events =
-            Event_pend(transmissionEventHandle, Event_Id_NONE,
-                       EVT_TX_DATA_AVAIL | EVT_UPDATE_CLK, BIOS_WAIT_FOREVER);
+        Event_pend(transmissionEventHandle, Event_Id_NONE, EVT_MODEM_WINDOW,
+                   BIOS_WAIT_FOREVER);
+        // Take every pending job, urgent or not, for this window
+        mutex_key = GateMutex_enter(queueMutex);
+        jobs = pending_jobs;
+        pending_jobs = 0;
+        GateMutex_leave(queueMutex, mutex_key);
+        if (!jobs) {
+            continue;
+        }
         /*
-         * All transmission events require the SIM to be running, so boot it
-         * if one occurred.
+         * All modem jobs require the SIM to be running, so boot it once for
+         * the whole window.
          */
         if (!SIM7000_running(&sim_config)) {
             if (!SIM7000_poweron(&sim_config)) {
                 cli_log("SIM module failed to boot for transmission\n");
-                continue; // No point in trying to handle events
-            }
-        }
-        if (events & EVT_TX_DATA_AVAIL) {
-            // While storage has data to be TX'd available, TX data
-            while (1) {
-                // Get Queue mutex
-                mutex_key = GateMutex_enter(queueMutex);
-                if (Queue_empty(sensorDataQueue)) {
-                    GateMutex_leave(queueMutex, mutex_key);
-                    break; // Exit
+                if (jobs & JOB_TIMESYNC) {
+                    update_rtc(); // Sets the fallback timestamp
                 }
-                // pop element from queue
-                elem = Queue_dequeue(sensorDataQueue);
-                GateMutex_leave(queueMutex, mutex_key);
-                time_management = localtime(
-                    &(elem->packet.timestamp)); // Put unix time into tm struct
-                snprintf(http_post_data, sizeof(http_post_data),
-                         "{\"distance\": %.3f, \"timestamp\": "
-                         "\"20%d-%02d-%02dT%02d:%02d:%02d\", \"sensor\": %d}",
-                         elem->packet.distance, time_management->tm_year - 100,
-                         time_management->tm_mon, time_management->tm_mday,
-                         time_management->tm_hour, time_management->tm_min,
-                         time_management->tm_sec, program_config.synthetic_id);
-                /*
-                 * TODO: if having weird errors, add a mutex to protect
-                 * program_config
-                 */
-                request.endpoint = program_config.server_ip;
-                request.port = 80;
-                request.path = "/api/sensor-data/";
-                request.body = (uint8_t *)http_post_data;
-                request.body_len = strlen(http_post_data);
-                request.response = (uint8_t *)response;
-                request.response_code = 0;
-                request.response_len = sizeof(response);
-                headers[0].key = "Content-Type";
-                headers[0].value = "application/json";
-                headers[1].key = "Authorization";
-                headers[1].value = http_token;
-                request.headers = headers;
-                request.header_count = 2;
-
-                attempts_remaining = TRANSMISSION_ATTEMPTS;
-                while (attempts_remaining > 0) {
-                    // Set D2 Led high to indicate a transmission is being
-                    // attempted
-                    GPIO_write(CONFIG_D2_LED, CONFIG_GPIO_LED_ON);
-                    return_val = SIM7000_http_post(&sim_config, &request);
-                    // Set D2 Led high to indicate a transmission is over
-                    GPIO_write(CONFIG_D2_LED, CONFIG_GPIO_LED_OFF);
-                    if (return_val < 0) {
-                        // had error
-                        System_printf("Error while transmitting to backend\n");
-                        System_flush();
-                        cli_log("Error while transmitting to backend, HTTP "
-                                "code %d\n",
-                                request.response_code);
-                        attempts_remaining--;
-                    } else {
-                        System_printf("Succeeded, data response len was %d "
-                                      "with HTTP response code %d\n",
-                                      return_val, request.response_code);
-                        System_flush();
-                        if (request.response_code == 201) {
-                            // Request succeeded on backend. Exit loop.
-                            break;
-                        }
-                    }
-                }
-                cli_log("Completed SIM transmission with return val %d and "
-                        "HTTP response code %d\n",
-                        return_val, request.response_code);
-                if (attempts_remaining == 0) {
-                    cli_log("Failed to send data to backend, will retry when "
-                            "more is available\n");
-                    break;
+                // Retry any other work in the next window
+                schedule_job(jobs & ~JOB_TIMESYNC, false);
+                if (jobs & JOB_UPLOAD) {
+                    schedule_upload_retry(true);
                 }
+                continue;
             }
         }
-        if (events & EVT_UPDATE_CLK) {
-            // Update clock from event trigger
-            update_rtc();
+        /*
+         * Open one data session shared by every job. If it fails, jobs still
+         * run and fall back to their own one-shot network setup.
+         */
+        if (!SIM7000_session_open(&sim_config)) {
+            cli_log("Could not open SIM data session\n");
         }
+        for (i = 0; i < sizeof(modem_jobs) / sizeof(modem_jobs[0]); i++) {
+            if (jobs & modem_jobs[i].id) {
+                Watchdog_clear(watchdogHandle);
+                modem_jobs[i].run();
+            }
+        }
+        SIM7000_session_close(&sim_config);
         /*
-         * This is the end of the loop. We should power down the SIM now.
+         * This is the end of the window. We should power down the SIM now.
          */
         if (!SIM7000_poweroff(&sim_config)) {
             cli_log("SIM did not power off, in unknown state\n");
@@ -252,33 +366,644 @@ void transmission_run(UArg arg0, UArg arg1) {
 }
 
 /**
- * Transmits sensor data to the backend
+ * Sends queued sensor data. Live samples are always sent first, and are
+ * checked again before every backlog sample so a new reading never waits
+ * behind the backlog. Backlog samples are only sent while the session budget
+ * allows. Anything left over is deferred to the next modem window.
+ */
+static void run_upload_job() {
+    SensorDataQueueElem *elem;
+    IArg mutex_key;
+    bool is_live, data_remaining, link_failed = false;
+    uint32_t session_start;
+    int backlog_bytes, return_val;
+
+    session_start = Clock_getTicks();
+    backlog_bytes = 0;
+    while ((elem = next_tx_elem(&is_live, session_start, backlog_bytes)) !=
+           NULL) {
+        return_val = post_sensor_packet(elem);
+        mutex_key = GateMutex_enter(queueMutex);
+        if (return_val < 0) {
+            /*
+             * Keep the sample for a later session. Failed live samples are
+             * newer than anything in the backlog, so they go to the tail.
+             * Failed backlog samples keep their place at the head.
+             */
+            if (is_live) {
+                Queue_enqueue(backlogQueue, &(elem->elem));
+            } else {
+                Queue_putHead(backlogQueue, &(elem->elem));
+            }
+            GateMutex_leave(queueMutex, mutex_key);
+            cli_log("Failed to send data to backend, will retry when "
+                    "more is available\n");
+            link_failed = true;
+            break;
+        }
+        if (is_live || !have_acked_sample) {
+            // Deadband is measured against the newest acked value
+            last_acked_distance = elem->packet.distance;
+            have_acked_sample = true;
+        }
+        pending_done(elem->seq, PENDING_UPLOAD);
+        Queue_enqueue(freeQueue, &(elem->elem));
+        GateMutex_leave(queueMutex, mutex_key);
+        if (!is_live) {
+            backlog_bytes += return_val;
+        }
+    }
+    if (program_config.modem_staging_enabled &&
+        (stage_recovered || recover_staged_batches())) {
+        if (link_failed) {
+            // Move the backlog out of RAM until the link is back
+            stage_backlog();
+        } else {
+            link_failed = !post_staged_batches(session_start, &backlog_bytes);
+        }
+    }
+    mutex_key = GateMutex_enter(queueMutex);
+    data_remaining = !Queue_empty(liveQueue) || !Queue_empty(backlogQueue) ||
+                     (stage_head != stage_tail && !link_failed);
+    GateMutex_leave(queueMutex, mutex_key);
+    if (data_remaining) {
+        schedule_job(JOB_UPLOAD, false);
+        schedule_upload_retry(link_failed);
+    } else {
+        Clock_stop(retryClock);
+        retry_delay = UPLOAD_RETRY_MIN;
+    }
+}
+
+/**
+ * Arms the retry clock, so data left after a window is sent without waiting
+ * for a new sample to open the next one. The reporting filter can hold new
+ * samples back for up to the heartbeat period.
+ * @param failed: true if the window failed, which doubles the retry delay.
+ *  Otherwise data was left over by the session budget, and the delay is reset.
+ */
+static void schedule_upload_retry(bool failed) {
+    if (!failed) {
+        retry_delay = UPLOAD_RETRY_MIN;
+    }
+    Clock_stop(retryClock);
+    Clock_setTimeout(retryClock, retry_delay);
+    Clock_start(retryClock);
+    if (failed) {
+        retry_delay = retry_delay * 2 < UPLOAD_RETRY_MAX ? retry_delay * 2
+                                                         : UPLOAD_RETRY_MAX;
+    }
+}
+
+/**
+ * Retry clock handler, opens a modem window for the upload job that was
+ * left pending. Runs in Swi context, so it only posts the window event.
+ * @param arg: unused
+ */
+static void retry_clock_handle(UArg arg) {
+    Event_post(transmissionEventHandle, EVT_MODEM_WINDOW);
+}
+
+/**
+ * Finds the batches staged on the SIM7000's file system before the last
+ * reset, by checking which batch files exist
+ * @return true if the staged batches are known, false if the SIM did not
+ *  answer (staging then waits for a later window)
+ */
+static bool recover_staged_batches() {
+    bool present[STAGE_MAX_FILES];
+    char filename[16];
+    unsigned int i, count = 0, run;
+    int size;
+
+    for (i = 0; i < STAGE_MAX_FILES; i++) {
+        Watchdog_clear(watchdogHandle);
+        snprintf(filename, sizeof(filename), STAGE_FILENAME, i);
+        size = SIM7000_fs_size(&sim_config, filename);
+        if (size < 0 && size != SIM7000_FS_NOFILE) {
+            cli_log("Could not check staged batches on SIM\n");
+            return false;
+        }
+        present[i] = size >= 0;
+        count += present[i];
+    }
+    stage_head = 0;
+    stage_tail = 0;
+    if (count) {
+        // The oldest batch is the first one after a free number
+        for (i = 0; i < STAGE_MAX_FILES; i++) {
+            if (present[i] && !present[(i + STAGE_MAX_FILES - 1) %
+                                       STAGE_MAX_FILES]) {
+                break;
+            }
+        }
+        stage_head = i % STAGE_MAX_FILES;
+        for (run = 0; run < count && present[(stage_head + run) %
+                                             STAGE_MAX_FILES];
+             run++) {
+        }
+        stage_tail = stage_head + run;
+        if (run != count) {
+            cli_log("%u staged batches are out of order, skipping them\n",
+                    count - run);
+        }
+        cli_log("Found %u staged batches on SIM\n", run);
+    }
+    stage_recovered = true;
+    return true;
+}
+
+/**
+ * Packs backlog samples into JSON array batches, and writes each batch to the
+ * SIM7000's file system. Samples are only released from the backlog once
+ * their batch is written. The queue mutex is not held while the SIM writes
+ * the file, as tasks queueing new samples would wait on it.
+ */
+static void stage_backlog() {
+    SensorDataQueueElem *elem, *batch[MAX_QUEUE_ELEM];
+    char filename[16];
+    IArg mutex_key;
+    int count, batch_len, elem_len, sep, ret;
+
+    // Leave one batch number free, see recover_staged_batches()
+    while ((stage_tail - stage_head) < STAGE_MAX_FILES - 1) {
+        // Fill one batch with as many backlog samples as fit
+        count = 0;
+        batch_len = 1;
+        stage_buffer[0] = '[';
+        mutex_key = GateMutex_enter(queueMutex);
+        while (!Queue_empty(backlogQueue)) {
+            elem = Queue_head(backlogQueue);
+            sep = count ? 1 : 0;
+            // Leave room for the separator and the closing bracket
+            elem_len = format_sensor_json(
+                elem, NULL, NULL, stage_buffer + batch_len + sep,
+                sizeof(stage_buffer) - batch_len - sep - 1);
+            if (elem_len < 0) {
+                break; // Batch is full
+            }
+            if (sep) {
+                stage_buffer[batch_len] = ',';
+            }
+            batch_len += sep + elem_len;
+            batch[count++] = Queue_dequeue(backlogQueue);
+        }
+        GateMutex_leave(queueMutex, mutex_key);
+        if (count == 0) {
+            return; // Backlog is empty
+        }
+        stage_buffer[batch_len++] = ']';
+        snprintf(filename, sizeof(filename), STAGE_FILENAME,
+                 stage_tail % STAGE_MAX_FILES);
+        ret = SIM7000_fs_write(&sim_config, filename, (uint8_t *)stage_buffer,
+                               batch_len, false);
+        mutex_key = GateMutex_enter(queueMutex);
+        if (ret < 0) {
+            // Put the samples back in their original order
+            while (count--) {
+                Queue_putHead(backlogQueue, &(batch[count]->elem));
+            }
+            GateMutex_leave(queueMutex, mutex_key);
+            cli_log("Could not stage backlog on SIM file system\n");
+            return;
+        }
+        // Staged batches survive a reset on the SIM7000, and are found again
+        while (count--) {
+            pending_done(batch[count]->seq, PENDING_UPLOAD);
+            Queue_enqueue(freeQueue, &(batch[count]->elem));
+        }
+        GateMutex_leave(queueMutex, mutex_key);
+        stage_tail++;
+    }
+}
+
+/**
+ * Posts batches staged on the SIM7000's file system, oldest first, while the
+ * session backlog budget allows. Each batch is deleted once it is accepted.
+ * Batches the SIM could not read or delete are kept for the next window.
+ * @param session_start: clock tick the modem session started at
+ * @param backlog_bytes: number of backlog body bytes sent this session,
+ *  updated with the size of each posted batch
+ * @return false if a batch could not be posted, true otherwise
+ */
+static bool post_staged_batches(uint32_t session_start, int *backlog_bytes) {
+    char filename[16];
+    int batch_len;
+
+    while (stage_head != stage_tail &&
+           (Clock_getTicks() - session_start) < BACKLOG_TIME_BUDGET &&
+           *backlog_bytes < BACKLOG_BYTE_BUDGET) {
+        snprintf(filename, sizeof(filename), STAGE_FILENAME,
+                 stage_head % STAGE_MAX_FILES);
+        batch_len = SIM7000_fs_read(&sim_config, filename,
+                                    (uint8_t *)stage_buffer,
+                                    sizeof(stage_buffer));
+        if (batch_len > 0) {
+            if (post_json(stage_buffer, batch_len) < 0) {
+                return false;
+            }
+            *backlog_bytes += batch_len;
+        } else if (batch_len == SIM7000_FS_NOFILE || batch_len == 0) {
+            // Only skip batches the SIM confirms are gone or empty
+            cli_log("Staged batch %s is missing, skipping it\n", filename);
+        } else {
+            cli_log("Could not read staged batch %s\n", filename);
+            return false;
+        }
+        /*
+         * A batch left behind would be posted again after a reset, so it is
+         * kept as the oldest until it can be deleted. Posting it twice is
+         * better than losing track of the ring.
+         */
+        if (batch_len != SIM7000_FS_NOFILE &&
+            !SIM7000_fs_delete(&sim_config, filename)) {
+            cli_log("Could not delete staged batch %s\n", filename);
+            return false;
+        }
+        stage_head++;
+    }
+    return true;
+}
+
+/**
+ * Adds a job to the pending job mask. Urgent jobs open a modem window right
+ * away. Other jobs wait for the next window opened by an urgent job.
+ * @param job: job bits to schedule
+ * @param urgent: should a modem window be opened now
+ */
+static void schedule_job(uint32_t job, bool urgent) {
+    IArg mutex_key;
+    if (!job) {
+        return;
+    }
+    mutex_key = GateMutex_enter(queueMutex);
+    pending_jobs |= job;
+    GateMutex_leave(queueMutex, mutex_key);
+    if (urgent) {
+        Event_post(transmissionEventHandle, EVT_MODEM_WINDOW);
+    }
+}
+
+/**
+ * Selects the next queue element to transmit. Live samples are always
+ * selected first. Backlog samples are only selected if the session budget
+ * has not been used up.
+ * @param is_live: set to true if the returned element came from the live queue
+ * @param session_start: clock tick the modem session started at
+ * @param backlog_bytes: number of backlog body bytes sent this session
+ * @return queue element to send, or NULL if nothing should be sent
+ */
+static SensorDataQueueElem *next_tx_elem(bool *is_live, uint32_t session_start,
+                                         int backlog_bytes) {
+    SensorDataQueueElem *elem = NULL;
+    IArg mutex_key;
+    mutex_key = GateMutex_enter(queueMutex);
+    if (!Queue_empty(liveQueue)) {
+        elem = Queue_dequeue(liveQueue);
+        *is_live = true;
+    } else if (!Queue_empty(backlogQueue) &&
+               (Clock_getTicks() - session_start) < BACKLOG_TIME_BUDGET &&
+               backlog_bytes < BACKLOG_BYTE_BUDGET) {
+        elem = Queue_dequeue(backlogQueue);
+        *is_live = false;
+    }
+    GateMutex_leave(queueMutex, mutex_key);
+    return elem;
+}
+
+/**
+ * Formats a sensor data packet as a JSON object
+ * @param elem: queue element holding the sensor data packet
+ * @param sd_stats: SD card counters to attach as a health summary, or NULL
+ * @param rollup: hourly rollup to attach, or NULL
+ * @param output: buffer to write the JSON object into
+ * @param len: length of the output buffer
+ * @return number of characters written, or negative value if it did not fit
+ */
+static int format_sensor_json(SensorDataQueueElem *elem,
+                              const StorageStats *sd_stats,
+                              const RollupRecord *rollup, char *output,
+                              int len) {
+    const SdLatencyStats *writes;
+    char timestr[24];
+    unsigned long errors = 0;
+    int i;
+    SensorDataPacket *packet = &(elem->packet);
+    struct tm *time_management; // name pending
+    int num_printed;
+
+    time_management =
+        localtime(&(packet->timestamp)); // Put unix time into tm struct
+    num_printed = snprintf(
+        output, len,
+        "{\"distance\": %.3f, \"timestamp\": "
+        "\"20%d-%02d-%02dT%02d:%02d:%02d\", \"sensor\": %d",
+        packet->distance, time_management->tm_year - 100,
+        time_management->tm_mon, time_management->tm_mday,
+        time_management->tm_hour, time_management->tm_min,
+        time_management->tm_sec, program_config.synthetic_id);
+    if (elem->suppressed.count && num_printed < len) {
+        // Tell the backend what the reporting filter held back
+        num_printed += snprintf(
+            output + num_printed, len - num_printed,
+            ", \"suppressed\": {\"count\": %u, \"min\": %.3f, "
+            "\"max\": %.3f}",
+            elem->suppressed.count, elem->suppressed.min,
+            elem->suppressed.max);
+    }
+    if (sd_stats && num_printed < len) {
+        // Lets the backend flag cards that are wearing out
+        writes = &(sd_stats->latency[SD_OP_WRITE]);
+        for (i = 0; i < SD_OP_COUNT; i++) {
+            errors += sd_stats->latency[i].errors;
+        }
+        num_printed += snprintf(
+            output + num_printed, len - num_printed,
+            ", \"sd\": {\"writes\": %lu, \"errors\": %lu, \"kb\": %lu, "
+            "\"p99_ms\": %lu, \"max_ms\": %lu, \"alarm\": %s}",
+            (unsigned long)writes->count, errors,
+            (unsigned long)(sd_stats->bytes_written / 1024),
+            (unsigned long)sd_stats->window_p99_ms,
+            (unsigned long)writes->max_ms,
+            sd_stats->latency_alarm ? "true" : "false");
+    }
+    if (rollup && num_printed < len) {
+        // Summary of the last hour, including samples the filter held back
+        storage_format_time(rollup->start, timestr, sizeof(timestr));
+        num_printed += snprintf(
+            output + num_printed, len - num_printed,
+            ", \"hour\": {\"start\": \"%s\", \"count\": %lu, "
+            "\"min\": %.3f, \"max\": %.3f, \"mean\": %.3f}",
+            timestr, (unsigned long)rollup->count, rollup->min, rollup->max,
+            rollup->mean);
+    }
+    if (num_printed < len) {
+        num_printed += snprintf(output + num_printed, len - num_printed, "}");
+    }
+    return (num_printed < len) ? num_printed : -1;
+}
+
+/**
+ * Formats a sensor data packet as JSON, and posts it to the backend. The SD
+ * card health summary and the last hour's rollup are attached when due.
+ * @param elem: queue element holding the sensor data packet to send
+ * @return number of body bytes sent on success, or negative value on failure
+ */
+static int post_sensor_packet(SensorDataQueueElem *elem) {
+    char http_post_data[448];
+    StorageStats sd_stats;
+    bool sd_report;
+    int body_len, ret;
+
+    storage_get_stats(&sd_stats);
+    sd_report = !sd_reported ||
+                Clock_getTicks() - last_sd_report >= SD_REPORT_INTERVAL ||
+                sd_stats.latency_alarms != reported_latency_alarms;
+    check_hour_rollup();
+    body_len = format_sensor_json(elem, sd_report ? &sd_stats : NULL,
+                                  hour_rollup_pending ? &hour_rollup : NULL,
+                                  http_post_data, sizeof(http_post_data));
+    if (body_len < 0) {
+        return -1;
+    }
+    ret = post_json(http_post_data, body_len);
+    if (ret >= 0 && sd_report) {
+        sd_reported = true;
+        last_sd_report = Clock_getTicks();
+        reported_latency_alarms = sd_stats.latency_alarms;
+    }
+    if (ret >= 0) {
+        hour_rollup_pending = false;
+    }
+    return ret;
+}
+
+/**
+ * Reads the rollup of the last complete hour from the storage task, once
+ * per hour. Uploads are filtered, so the rollup tells the backend about
+ * every sample of the hour, as the CLI summary command does.
+ */
+static void check_hour_rollup() {
+    struct timespec ts;
+    uint32_t hour;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hour = (uint32_t)ts.tv_sec - (uint32_t)ts.tv_sec % 3600;
+    if (hour == rollup_checked_hour) {
+        return;
+    }
+    hour_rollup.count = 0;
+    ret = storage_rollup_query(ROLLUP_HOUR, hour - 3600, hour, copy_rollup,
+                               &hour_rollup);
+    if (ret < 0) {
+        // SD card is unavailable, try again at the next upload
+        return;
+    }
+    rollup_checked_hour = hour;
+    if (ret > 0 && hour_rollup.count) {
+        hour_rollup_pending = true;
+    }
+}
+
+/**
+ * Rollup query callback, copies the rollup
+ * @param rollup: rollup in the queried range
+ * @param arg: RollupRecord to copy it to
+ * @return false, as only one rollup is needed
+ */
+static bool copy_rollup(RollupRecord *rollup, void *arg) {
+    memcpy(arg, rollup, sizeof(RollupRecord));
+    return false;
+}
+
+/**
+ * Posts a JSON body to the backend's sensor data endpoint
+ * @param body: JSON body to send
+ * @param body_len: length of the body
+ * @return number of body bytes sent on success, or negative value on failure
+ */
+static int post_json(char *body, int body_len) {
+    HTTPConnectionRequest request;
+    HTTPHeader headers[3];
+    char body_crc[9];
+    int attempts_remaining;
+    int return_val;
+
+    /*
+     * TODO: if having weird errors, add a mutex to protect
+     * program_config
+     */
+    request.endpoint = program_config.server_ip;
+    request.port = 80;
+    request.path = "/api/sensor-data/";
+    request.body = (uint8_t *)body;
+    request.body_len = body_len;
+    request.response = (uint8_t *)http_response;
+    request.response_code = 0;
+    request.response_len = sizeof(http_response);
+    headers[0].key = "Content-Type";
+    headers[0].value = "application/json";
+    headers[1].key = "Authorization";
+    headers[1].value = http_token;
+    // Lets the backend reject bodies damaged between here and the server
+    snprintf(body_crc, sizeof(body_crc), "%08lx",
+             (unsigned long)crc32(body, body_len));
+    headers[2].key = "X-Payload-CRC32";
+    headers[2].value = body_crc;
+    request.headers = headers;
+    request.header_count = 3;
+
+    attempts_remaining = TRANSMISSION_ATTEMPTS;
+    while (attempts_remaining > 0) {
+        // Set D2 Led high to indicate a transmission is being
+        // attempted
+        GPIO_write(CONFIG_D2_LED, CONFIG_GPIO_LED_ON);
+        return_val = SIM7000_http_post(&sim_config, &request);
+        // Set D2 Led high to indicate a transmission is over
+        GPIO_write(CONFIG_D2_LED, CONFIG_GPIO_LED_OFF);
+        if (return_val < 0) {
+            // had error
+            System_printf("Error while transmitting to backend\n");
+            System_flush();
+            TRACE("Error while transmitting to backend, HTTP "
+                  "code %d\n",
+                  request.response_code);
+            attempts_remaining--;
+        } else {
+            System_printf("Succeeded, data response len was %d "
+                          "with HTTP response code %d\n",
+                          return_val, request.response_code);
+            System_flush();
+            if (request.response_code == 201) {
+                // Request succeeded on backend. Exit loop.
+                break;
+            }
+            attempts_remaining--;
+        }
+    }
+    TRACE("Completed SIM transmission with return val %d and "
+          "HTTP response code %d\n",
+          return_val, request.response_code);
+    if (attempts_remaining == 0) {
+        return -1;
+    }
+    return body_len;
+}
+
+/**
+ * Reporting filter. Decides if a sample should be uploaded, and records it in
+ * the suppressed sample summary if not. Must be called with queueMutex held.
+ * @param packet: sample to check
+ * @return true if the sample should be uploaded
+ */
+static bool should_report(SensorDataPacket *packet) {
+    float delta;
+    long long elapsed_ms;
+    if (program_config.report_deadband <= 0 || !have_acked_sample ||
+        !have_reported_sample) {
+        return true; // Filter disabled, or nothing to compare against
+    }
+    delta = packet->distance - last_acked_distance;
+    if (delta > program_config.report_deadband ||
+        delta < -program_config.report_deadband) {
+        return true;
+    }
+    elapsed_ms = (long long)(packet->timestamp - last_report_time) * 1000LL;
+    if (elapsed_ms < 0 || elapsed_ms >= program_config.report_heartbeat) {
+        // Heartbeat elapsed (or the RTC was moved backwards)
+        return true;
+    }
+    // Sample is redundant. Add it to the summary.
+    if (suppressed.count == 0 || packet->distance < suppressed.min) {
+        suppressed.min = packet->distance;
+    }
+    if (suppressed.count == 0 || packet->distance > suppressed.max) {
+        suppressed.max = packet->distance;
+    }
+    suppressed.count++;
+    return false;
+}
+
+/**
+ * Transmits sensor data to the backend. The sample is passed through the
+ * reporting filter, then placed in the live queue. If no queue elements are
+ * free, the oldest backlog sample is dropped to make room.
  * @param packet Data packet to send
  */
 void transmit_sensor_data(SensorDataPacket *packet) {
+    SensorDataQueueElem *queue_elem;
+    IArg mutex_key;
+    bool dropped = false;
     if (!program_config.network_enabled || !transmission_init_done) {
         return; // Can't transmit, network not enabled
     }
     Watchdog_clear(watchdogHandle);
-    static int queue_idx = 0;
-    SensorDataQueueElem *queue_elem;
-    IArg mutex_key;
     // Enter the queue mutex
     mutex_key = GateMutex_enter(queueMutex);
-    // Get the queue element to add.
-    queue_elem =
-        &queue_elements[queue_idx & (MAX_QUEUE_ELEM - 1)]; // quicker modulo
+    if (!should_report(packet)) {
+        GateMutex_leave(queueMutex, mutex_key);
+        return;
+    }
+    // Get a free queue element, reclaiming the oldest sample if needed
+    if (!Queue_empty(freeQueue)) {
+        queue_elem = Queue_dequeue(freeQueue);
+    } else if (!Queue_empty(backlogQueue)) {
+        queue_elem = Queue_dequeue(backlogQueue);
+        dropped = true;
+    } else {
+        queue_elem = Queue_dequeue(liveQueue);
+        dropped = true;
+    }
+    if (dropped) {
+        pending_done(queue_elem->seq, PENDING_UPLOAD);
+    }
     memcpy(&(queue_elem->packet), packet, sizeof(SensorDataPacket));
+    // Retain the sample until it is sent, in case the device resets
+    queue_elem->seq = pending_add(packet, PENDING_UPLOAD);
+    // Attach the summary of samples suppressed since the last report
+    queue_elem->suppressed = suppressed;
+    suppressed.count = 0;
+    last_report_time = packet->timestamp;
+    have_reported_sample = true;
     // Use the atomic enqueuing operation
-    Queue_enqueue(sensorDataQueue, &(queue_elem->elem));
+    Queue_enqueue(liveQueue, &(queue_elem->elem));
     GateMutex_leave(queueMutex, mutex_key);
-    queue_idx++;
-    // Notify storage thread about sensor data
-    Event_post(transmissionEventHandle, EVT_TX_DATA_AVAIL);
+    if (dropped) {
+        dropped_samples++;
+        TRACE("Transmission queue full, dropped oldest sample (%u total)\n",
+              dropped_samples);
+    }
+    // New data is urgent, open a modem window for it
+    schedule_job(JOB_UPLOAD, true);
 }
 
 /**
- * Requests for the transmission task to update the RTC
+ * pending_replay callback, queues a sample retained across a reset. Replayed
+ * samples already passed the reporting filter, and go to the backlog as they
+ * are older than any new sample. Samples that do not fit are dropped.
+ * @param packet: retained sample
+ * @param seq: sequence number of the sample in the pending ring
+ * @param arg: unused
+ */
+static void replay_sample(SensorDataPacket *packet, uint32_t seq, void *arg) {
+    SensorDataQueueElem *queue_elem;
+
+    if (Queue_empty(freeQueue)) {
+        dropped_samples++;
+        pending_done(seq, PENDING_UPLOAD);
+        return;
+    }
+    queue_elem = Queue_dequeue(freeQueue);
+    memcpy(&(queue_elem->packet), packet, sizeof(SensorDataPacket));
+    queue_elem->suppressed.count = 0;
+    queue_elem->seq = seq;
+    Queue_enqueue(backlogQueue, &(queue_elem->elem));
+}
+
+/**
+ * Requests for the transmission task to update the RTC. The update is urgent,
+ * and opens a modem window right away.
  */
 void request_rtc_update() {
     struct timespec ts;
@@ -295,42 +1020,36 @@ void request_rtc_update() {
         ts.tv_sec = FALLBACK_TIMESTAMP;
         clock_settime(CLOCK_REALTIME, &ts);
     } else {
-        Event_post(transmissionEventHandle, EVT_UPDATE_CLK);
+        schedule_job(JOB_TIMESYNC, true);
     }
 }
 
+/**
+ * Schedules a routine RTC update. The update is deferred until the next
+ * modem window, so it does not cost a modem power cycle of its own.
+ */
+void schedule_rtc_update() {
+    if (!program_config.network_enabled || !transmission_init_done) {
+        return; // RTC was set directly at boot, nothing to sync with
+    }
+    schedule_job(JOB_TIMESYNC, false);
+}
+
 /**
  * This function updates the real time clock with a timestamp from a remote
- * server.
+ * server. It runs as a modem job, so the SIM is already powered on.
  */
 static void update_rtc() {
     struct timespec ts;
-    bool sim_powermanage = false;
-    bool sim_booted = false;
     if (program_config.network_enabled && transmission_init_done) {
-        // Attempt to boot the SIM
-        sim_booted = SIM7000_running(&sim_config);
-        if (!sim_booted) {
-            /*
-             * Assume that we should manage the power state of the sim, by
-             * booting it up and turning it off in this function
-             */
-            sim_powermanage = true;
-            sim_booted = SIM7000_poweron(&sim_config);
-        }
-        if (sim_booted) {
-            if (SIM7000_ntp_time(&sim_config, &ts) >= 0) {
-                // Everything worked, shut down the SIM and set the time
-                if (sim_powermanage && !SIM7000_poweroff(&sim_config)) {
-                    System_printf("SIM failed to shutdown, in unknown state\n");
-                }
-                clock_settime(CLOCK_REALTIME, &ts);
-                cli_log("network time sync completed\n");
-                return;
-            }
+        if (SIM7000_running(&sim_config) &&
+            SIM7000_ntp_time(&sim_config, &ts) >= 0) {
+            // Everything worked, set the time
+            clock_settime(CLOCK_REALTIME, &ts);
+            cli_log("network time sync completed\n");
+            return;
         }
-        // We failed to boot the SIM, warn the user
-        System_printf("Failed to start SIM7000\n");
+        // We failed to get the time, warn the user
         System_printf("Failed to set timestamp from SIM module\n"
                       "Using fallback timestamp\n");
         System_flush();
@@ -40,10 +40,17 @@ void transmission_run(UArg arg0, UArg arg1);
 bool find_sim();
 
 /**
- * Requests for the transmission task to update the RTC
+ * Requests for the transmission task to update the RTC. The update is urgent,
+ * and opens a modem window right away.
  */
 void request_rtc_update();
 
+/**
+ * Schedules a routine RTC update. The update is deferred until the next
+ * modem window, so it does not cost a modem power cycle of its own.
+ */
+void schedule_rtc_update();
+
 /**
  * Transmits sensor data to the backend
  * @param packet Data packet to send